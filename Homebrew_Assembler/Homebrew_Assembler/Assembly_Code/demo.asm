@@ -14,6 +14,4 @@
 
 	mov b, a
 	tba
-	mov Y, a
-
-	sta $0a
+	mov a, Y
@@ -0,0 +1,140 @@
+#include "BranchRelaxer.h"
+#include <algorithm>
+#include <cstdlib>
+
+BranchRelaxer::BranchRelaxer()
+{
+	_sites.clear();
+	_deltas.clear();
+	_tree.clear();
+	_regionStart.clear();
+	_byAddress.clear();
+	_branchAt.clear();
+	_branches.clear();
+}
+
+// Sites have to be added in the order they were emitted. newLength is the size the site has after any other rewrites.
+void BranchRelaxer::AddSite(long long address, int length, int newLength, int region)
+{
+	int s = _sites.size();
+	bool sameRegion = s > 0 && _sites[s - 1].region == region;
+
+	_sites.push_back({ address, length, region });
+	_deltas.push_back(newLength - length);
+	_regionStart.push_back(sameRegion ? _regionStart[s - 1] : s);
+	_branchAt.push_back(-1);
+}
+
+// Every branch starts out in its short form
+void BranchRelaxer::AddBranch(int site, int shortLength, long long target)
+{
+	_branchAt[site] = _branches.size();
+	_branches.push_back({ site, shortLength, target, false });
+	_deltas[site] = shortLength - _sites[site].length;
+}
+
+void BranchRelaxer::AddDelta(int site, long long delta)
+{
+	_deltas[site] += delta;
+	for (int i = site + 1; i < _tree.size(); i += i & -i)
+		_tree[i] += delta;
+}
+
+// Total size change of the sites before site
+long long BranchRelaxer::Prefix(int site)
+{
+	long long sum = 0;
+	for (int i = site; i > 0; i -= i & -i)
+		sum += _tree[i];
+
+	return sum;
+}
+
+// How far a site has moved: the size changes before it in its region
+long long BranchRelaxer::Shift(int site)
+{
+	return Prefix(site) - Prefix(_regionStart[site]);
+}
+
+// Where an address of the original program is now. It moves with the last site in front of it.
+long long BranchRelaxer::MapAddress(long long address)
+{
+	auto after = lower_bound(_byAddress.begin(), _byAddress.end(), address, [this](int s, long long a) { return _sites[s].address < a; });
+	if (after == _byAddress.begin())
+		return address;
+
+	int s = *(after - 1);
+	return address + Prefix(s + 1) - Prefix(_regionStart[s]);
+}
+
+// Widens the branches whose targets are out of reach of their short form, until every branch fits. Widening only ever
+// makes code longer, so a branch that is checked again after a widening inside its span is the only one that can stop
+// fitting, and those lie within reach bytes of it. fits(branch, pc, target) says whether a branch fits in its short form.
+// Returns the number of worklist steps.
+long long BranchRelaxer::Relax(long long reach, const function<bool(int, long long, long long)>& fits)
+{
+	int n = _sites.size();
+
+	// The tree is built in one pass: each node adds itself to its parent
+	_tree.assign(n + 1, 0);
+	for (int i = 1; i <= n; i++)
+	{
+		_tree[i] += _deltas[i - 1];
+		if (i + (i & -i) <= n)
+			_tree[i + (i & -i)] += _tree[i];
+	}
+
+	_byAddress.resize(n);
+	for (int s = 0; s < n; s++)
+		_byAddress[s] = s;
+
+	stable_sort(_byAddress.begin(), _byAddress.end(), [this](int x, int y) { return _sites[x].address < _sites[y].address; });
+
+	// Branches are checked in program order the first time round
+	vector<int> worklist;
+	vector<bool> queued(_branches.size(), true);
+	for (int b = _branches.size() - 1; b >= 0; b--)
+		worklist.push_back(b);
+
+	long long steps = 0;
+	while (!worklist.empty())
+	{
+		int b = worklist.back();
+		worklist.pop_back();
+		queued[b] = false;
+		steps++;
+
+		RelaxBranch& branch = _branches[b];
+		int site = branch.site;
+		long long shift = Shift(site);
+		long long pc = _sites[site].address + shift;
+
+		if (branch.widened || fits(b, pc, MapAddress(branch.target)))
+			continue;
+
+		branch.widened = true;
+		AddDelta(site, _sites[site].length - branch.shortLength);
+
+		// Walk out from the widened branch in both directions while still in reach, keeping track of the shift as we go
+		for (int dir = -1; dir <= 1; dir += 2)
+		{
+			long long siteShift = shift;
+
+			for (int s = site + dir; s >= 0 && s < n && _regionStart[s] == _regionStart[site]; s += dir)
+			{
+				siteShift += dir < 0 ? -_deltas[s] : _deltas[s - 1];
+				if (llabs(_sites[s].address + siteShift - pc) > reach)
+					break;
+
+				int other = _branchAt[s];
+				if (other >= 0 && !_branches[other].widened && !queued[other])
+				{
+					queued[other] = true;
+					worklist.push_back(other);
+				}
+			}
+		}
+	}
+
+	return steps;
+}
\ No newline at end of file
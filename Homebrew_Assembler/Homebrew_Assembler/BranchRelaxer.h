@@ -0,0 +1,49 @@
+#pragma once
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+// An instruction of the program in the order it was emitted. Its address moves by the size changes of the instructions
+// before it in the same region (the code between two .org or .align lines).
+struct RelaxSite
+{
+	long long address;
+	int length;
+	int region;
+};
+
+// A jump that can use a shorter form while its target is in reach
+struct RelaxBranch
+{
+	int site;
+	int shortLength;
+	long long target;	// address of the target before relaxation
+	bool widened;
+};
+
+class BranchRelaxer
+{
+public:
+	BranchRelaxer();
+
+	void AddSite(long long address, int length, int newLength, int region);
+	void AddBranch(int site, int shortLength, long long target);
+	int NumBranches() { return _branches.size(); }
+	bool IsShort(int b) { return !_branches[b].widened; }
+	long long Relax(long long reach, const function<bool(int, long long, long long)>& fits);
+
+private:
+	void AddDelta(int site, long long delta);
+	long long Prefix(int site);
+	long long Shift(int site);
+	long long MapAddress(long long address);
+
+	vector<RelaxSite> _sites;
+	vector<long long> _deltas;		// change in size of each site
+	vector<long long> _tree;		// Fenwick tree over _deltas, so a shift is a log(n) sum
+	vector<int> _regionStart;		// first site of each site's region
+	vector<int> _byAddress;			// sites sorted by address
+	vector<int> _branchAt;			// branch at each site, or -1
+	vector<RelaxBranch> _branches;
+};
\ No newline at end of file
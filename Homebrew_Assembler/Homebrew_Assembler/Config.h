@@ -10,6 +10,9 @@ constexpr const char* BIN_KEY = "%";
 constexpr const char* HEX_KEY = "$";
 constexpr const char* DEC_KEY = "";
 
+// Symbol that stands for the address of the current line inside an expression (when it isn't a number prefix)
+constexpr const char* CURRENT_ADDRESS_KEY = "$";
+
 // Define strings for origin and export directives (do not incude DIRECTIVE_KEYS defined above...
 // this will be added automatically)
 constexpr const char* ARCH_STR = "arch";
@@ -19,9 +22,98 @@ constexpr const char* ORIGIN_STR = "org";
 constexpr const char* EXPORT_STR = "export";
 constexpr const char* BYTE_STR = "byte";
 constexpr const char* ASCII_STR = "ascii";
+constexpr const char* LIST_STR = "list";
+constexpr const char* SYMBOLS_STR = "symbols";
+constexpr const char* FILL_STR = "fill";
+constexpr const char* ALIGN_STR = "align";
+constexpr const char* INCBIN_STR = "incbin";
+constexpr const char* SIMULATE_STR = "simulate";
+constexpr const char* EXPECT_STR = "expect";
+constexpr const char* ASSERT_STR = "assert";
+constexpr const char* PROFILE_STR = "profile";
+constexpr const char* BUDGET_STR = "budget";
+constexpr const char* OPTIMIZE_STR = "optimize";
+constexpr const char* ENTRY_STR = "entry";
+constexpr const char* BANK_STR = "bank";
+constexpr const char* SEGMENT_STR = "segment";
+constexpr const char* SECTION_STR = "section";
+constexpr const char* ENDS_STR = "ends";
+constexpr const char* MACRO_STR = "macro";
+constexpr const char* ENDM_STR = "endm";
+constexpr const char* IF_STR = "if";
+constexpr const char* IFDEF_STR = "ifdef";
+constexpr const char* IFNDEF_STR = "ifndef";
+constexpr const char* ELIF_STR = "elif";
+constexpr const char* ELSE_STR = "else";
+constexpr const char* ENDIF_STR = "endif";
+constexpr const char* REPT_STR = "rept";
+constexpr const char* ENDR_STR = "endr";
 constexpr const char* REGISTER_STR = "register";
 constexpr const char* CONTROL_STR = "control";
 constexpr const char* CONTROL_ALIAS_STR = "control_alias";
+constexpr const char* CONTROL_FIELD_STR = "control_field";
+constexpr const char* CONTROL_GROUP_STR = "control_group";
+constexpr const char* CONTROL_ACTION_STR = "control_action";
 constexpr const char* OPCODE_STR = "opcode";
 constexpr const char* OPCODE_ALIAS_STR = "opcode_alias";
-constexpr const char* CONTROL_ROM_STR = "controlROM";
\ No newline at end of file
+constexpr const char* PEEPHOLE_STR = "peephole";
+constexpr const char* RELAX_STR = "relax";
+constexpr const char* VENEER_STR = "veneer";
+constexpr const char* CONTROL_ROM_STR = "controlROM";
+constexpr const char* CONTROL_ROM_LAYOUT_STR = "controlROM_layout";
+constexpr const char* LAYOUT_DIRECT_STR = "direct";
+constexpr const char* LAYOUT_PACKED_STR = "packed";
+constexpr const char* LAYOUT_INDEXED_STR = "indexed";
+
+// What a control line can do in the simulator (control_action Name action [register])
+constexpr const char* ACTION_ASSERT_STR = "assert";
+constexpr const char* ACTION_LOAD_STR = "load";
+constexpr const char* ACTION_FETCH_STR = "fetch";
+constexpr const char* ACTION_JUMP_STR = "jump";
+constexpr const char* ACTION_OUT_STR = "out";
+constexpr const char* ACTION_HALT_STR = "halt";
+constexpr const char* CONST_REGISTER_STR = "const";
+
+// Words of the .expect/.assert directive (.expect reg a == $48 after [start] within 1000 cycles)
+constexpr const char* EXPECT_REG_STR = "reg";
+constexpr const char* EXPECT_MEM_STR = "mem";
+constexpr const char* EXPECT_AFTER_STR = "after";
+constexpr const char* EXPECT_WITHIN_STR = "within";
+constexpr const char* EXPECT_CYCLES_STR = "cycles";
+
+// Words of a peephole rule (peephole Name mov a, #x ; mov a, #x => mov a, #x)
+constexpr const char* PEEPHOLE_ARROW_STR = "=>";
+constexpr const char* PEEPHOLE_SEPARATOR_STR = ";";
+constexpr const char* PEEPHOLE_CAPTURE_KEY = "#";
+
+// Capture a veneer's replacement can use for the bank of the label it calls (veneer Name call #t => mov b, #bank ; jmp #t)
+constexpr const char* VENEER_BANK_CAPTURE = "#bank";
+
+// Prefix of the labels .optimize puts at the start of a pooled data block, for the blocks that share its bytes
+constexpr const char* POOL_ANCHOR_STR = "__pool.";
+
+constexpr const char* ENCODE_STR = "encode";
+constexpr const char* OPCODE_CYCLES_STR = "cycles";
+constexpr const char* RELATIVE_STR = "rel";
+
+// Smallest program ROM file that is written (bank 0 is padded up to it; bigger programs write all of their bytes)
+constexpr int PROGRAM_ROM_SIZE = 32768;
+
+// Number of similar opcodes listed when an instruction doesn't match any opcode
+constexpr int MAX_MATCH_CANDIDATES = 4;
+
+// Cycles the simulator runs for when .simulate doesn't say
+constexpr long long DEFAULT_SIMULATION_CYCLES = 1000000;
+
+// Lines of the hot spot table printed after a profiled simulation (the .prof file has all of them)
+constexpr int PROFILE_HOT_SPOTS = 10;
+
+// Seconds a test program may run for before the test runner gives up on it
+constexpr double DEFAULT_TEST_TIMEOUT = 10.0;
+
+// Limit on how deeply macros may expand other macros (this also catches a macro that expands itself)
+constexpr int MAX_MACRO_DEPTH = 32;
+
+// Times the program is assembled again when a relaxed jump turns out to be out of reach after all (each time, those jumps
+// go back to their long form)
+constexpr int MAX_RELAX_ATTEMPTS = 8;
\ No newline at end of file
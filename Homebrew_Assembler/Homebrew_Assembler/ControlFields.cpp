@@ -0,0 +1,241 @@
+#include "ControlFields.h"
+
+ControlFields::ControlFields()
+{
+	_fields.clear();
+	_groups.clear();
+	_controlLines.clear();
+	_patterns.clear();
+	_termNames.clear();
+	_termValues.clear();
+	_termFields.clear();
+}
+
+int ControlFields::Find(const string& name)
+{
+	for (int f = 0; f < _fields.size(); f++)
+	{
+		if (_fields[f].name == name)
+			return f;
+	}
+
+	return -1;
+}
+
+// Declares a field covering bits high down to low. Fields can't share bits with each other.
+bool ControlFields::AddField(const string& name, int high, int low, string& error)
+{
+	if (low < 0 || high < low || high > 63)
+	{
+		error = "bit range must be within bits 63 to 0";
+		return false;
+	}
+
+	if (_fields.size() >= MAX_FIELDS)
+	{
+		error = "no more than " + to_string(MAX_FIELDS) + " fields can be declared";
+		return false;
+	}
+
+	if (Find(name) >= 0)
+	{
+		error = "field is already defined";
+		return false;
+	}
+
+	ControlField field;
+	field.name = name;
+	field.low = low;
+	field.width = high - low + 1;
+	field.mask = (field.width == 64 ? ~0ULL : (1ULL << field.width) - 1) << low;
+
+	for (const ControlField& other : _fields)
+	{
+		if (other.mask & field.mask)
+		{
+			error = "bits overlap field \"" + other.name + "\"";
+			return false;
+		}
+	}
+
+	_fields.push_back(field);
+	return true;
+}
+
+// Declares fields that mustn't be driven by the same pattern (e.g. two units that both want the bus)
+bool ControlFields::AddGroup(const vector<string>& fields, string& error)
+{
+	unsigned long long group = 0;
+
+	for (const string& name : fields)
+	{
+		int f = Find(name);
+		if (f < 0)
+		{
+			error = "\"" + name + "\" is not a control field";
+			return false;
+		}
+
+		group |= 1ULL << f;
+	}
+
+	_groups.push_back(group);
+	return true;
+}
+
+// Control lines are only sorted into fields when the patterns are validated, so fields can be declared before or after them
+void ControlFields::AddControlLine(unsigned long long value)
+{
+	_controlLines.push_back(value);
+}
+
+void ControlFields::AddPattern(const string& name, const string& file, int line, unsigned long long value, const vector<string>& termNames, const vector<unsigned long long>& termValues)
+{
+	_patterns.push_back({ name, file, line, value, (int)_termValues.size(), (int)termValues.size() });
+	_termNames.insert(_termNames.end(), termNames.begin(), termNames.end());
+	_termValues.insert(_termValues.end(), termValues.begin(), termValues.end());
+}
+
+// Checks every pattern at once. The work is done a field (or group) at a time over flat arrays of 64-bit words with no
+// branches in the inner loops, so the compiler can vectorize them; only patterns with a problem are looked at one by one.
+void ControlFields::Validate(vector<ControlConflict>& conflicts)
+{
+	int numTerms = _termValues.size();
+	int numPatterns = _patterns.size();
+
+	// The fields each control line (term) drives
+	_termFields.assign(numTerms, 0);
+	for (int f = 0; f < _fields.size(); f++)
+	{
+		const unsigned long long mask = _fields[f].mask;
+		const unsigned long long bit = 1ULL << f;
+		const unsigned long long* values = _termValues.data();
+		unsigned long long* fields = _termFields.data();
+
+		for (int t = 0; t < numTerms; t++)
+			fields[t] |= (0 - (unsigned long long)((values[t] & mask) != 0)) & bit;
+	}
+
+	// A field is driven more than once if a second term touches it
+	vector<unsigned long long> driven(numPatterns, 0);
+	vector<unsigned long long> multiple(numPatterns, 0);
+
+	for (int p = 0; p < numPatterns; p++)
+	{
+		unsigned long long seen = 0;
+		unsigned long long again = 0;
+		const unsigned long long* fields = _termFields.data() + _patterns[p].firstTerm;
+
+		for (int t = 0; t < _patterns[p].numTerms; t++)
+		{
+			again |= seen & fields[t];
+			seen |= fields[t];
+		}
+
+		driven[p] = seen;
+		multiple[p] = again;
+	}
+
+	// More than one field of an exclusive group being driven (x & (x - 1) is non-zero when x has two or more bits set)
+	vector<unsigned long long> exclusive(numPatterns, 0);
+	for (int g = 0; g < _groups.size(); g++)
+	{
+		const unsigned long long group = _groups[g];
+
+		for (int p = 0; p < numPatterns; p++)
+		{
+			unsigned long long x = driven[p] & group;
+			exclusive[p] |= (0 - (unsigned long long)((x & (x - 1)) != 0)) & x;
+		}
+	}
+
+	// The values each field is allowed to take are the control lines that lie inside it
+	for (ControlField& field : _fields)
+	{
+		field.values.clear();
+		for (unsigned long long line : _controlLines)
+		{
+			if (!(line & ~field.mask))
+				field.values.insert((line & field.mask) >> field.low);
+		}
+	}
+
+	for (int p = 0; p < numPatterns; p++)
+	{
+		for (int f = 0; f < _fields.size(); f++)
+		{
+			unsigned long long bit = 1ULL << f;
+
+			if (multiple[p] & bit)
+				conflicts.push_back({ ControlConflictType::MultipleDrivers, p, f, -1 });
+
+			if ((exclusive[p] & bit) && !(exclusive[p] & (bit - 1)))
+			{
+				// Reported once per pattern, naming the first two fields of the group that are driven
+				int other = f + 1;
+				while (!(exclusive[p] & (1ULL << other)))
+					other++;
+
+				conflicts.push_back({ ControlConflictType::ExclusiveFields, p, f, other });
+			}
+
+			// Zero means the field isn't driven, which is always allowed
+			unsigned long long value = (_patterns[p].value & _fields[f].mask) >> _fields[f].low;
+			if (value && !(multiple[p] & bit) && !_fields[f].values.empty() && !_fields[f].values.count(value))
+				conflicts.push_back({ ControlConflictType::UnknownValue, p, f, -1 });
+		}
+	}
+}
+
+// The bits that have to be compared to tell whether a control line is active: its declared field or, for lines outside of
+// any field, every bit of the control lines that share bits with it (e.g. all four bits of a register select)
+unsigned long long ControlFields::GetFieldMask(unsigned long long line)
+{
+	for (const ControlField& field : _fields)
+	{
+		if (line && !(line & ~field.mask))
+			return field.mask;
+	}
+
+	unsigned long long mask = line;
+	bool grown = true;
+
+	while (grown)
+	{
+		grown = false;
+		for (unsigned long long other : _controlLines)
+		{
+			if ((other & mask) && (other | mask) != mask)
+			{
+				mask |= other;
+				grown = true;
+			}
+		}
+	}
+
+	return mask;
+}
+
+string ControlFields::Describe(const ControlConflict& conflict)
+{
+	const ControlPattern& pattern = _patterns[conflict.pattern];
+	const ControlField& field = _fields[conflict.field];
+
+	if (conflict.type == ControlConflictType::MultipleDrivers)
+	{
+		// Name the control lines that drive the field
+		string lines;
+		for (int t = pattern.firstTerm; t < pattern.firstTerm + pattern.numTerms; t++)
+		{
+			if (_termFields[t] & (1ULL << conflict.field))
+				lines += (lines.empty() ? "" : ", ") + _termNames[t];
+		}
+
+		return "Control pattern of " + pattern.name + " drives field \"" + field.name + "\" more than once (" + lines + ")";
+	}
+
+	if (conflict.type == ControlConflictType::ExclusiveFields)
+		return "Control pattern of " + pattern.name + " drives both \"" + field.name + "\" and \"" + _fields[conflict.otherField].name + "\", which are mutually exclusive";
+
+	return "Control pattern of " + pattern.name + " sets field \"" + field.name + "\" to " + to_string((pattern.value & field.mask) >> field.low) + ", which isn't the value of any of its control lines";
+}
\ No newline at end of file
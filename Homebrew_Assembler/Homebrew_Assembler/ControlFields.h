@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+using namespace std;
+
+// A range of control word bits that together select one thing, e.g. which register drives the data bus. Its values are
+// the control lines that lie entirely inside it.
+struct ControlField
+{
+	string name;
+	int low;
+	int width;
+	unsigned long long mask;
+	unordered_set<unsigned long long> values;	// shifted down to bit 0
+};
+
+// A control pattern (of an opcode or control alias) and the control lines it was built from
+struct ControlPattern
+{
+	string name;
+	string file;
+	int line;
+	unsigned long long value;
+	int firstTerm;
+	int numTerms;
+};
+
+enum class ControlConflictType { MultipleDrivers, ExclusiveFields, UnknownValue };
+
+struct ControlConflict
+{
+	ControlConflictType type;
+	int pattern;
+	int field;
+	int otherField;		// second field of an exclusive group conflict
+};
+
+class ControlFields
+{
+public:
+	ControlFields();
+
+	bool AddField(const string& name, int high, int low, string& error);
+	bool AddGroup(const vector<string>& fields, string& error);
+	void AddControlLine(unsigned long long value);
+	void AddPattern(const string& name, const string& file, int line, unsigned long long value, const vector<string>& termNames, const vector<unsigned long long>& termValues);
+	int NumFields() { return _fields.size(); }
+	int NumPatterns() { return _patterns.size(); }
+	const ControlPattern& GetPattern(int p) { return _patterns[p]; }
+	unsigned long long GetFieldMask(unsigned long long line);
+	void Validate(vector<ControlConflict>& conflicts);
+	string Describe(const ControlConflict& conflict);
+
+	// Fields are tracked as bits of a 64-bit set, which is also the widest control word
+	static constexpr int MAX_FIELDS = 64;
+
+private:
+	int Find(const string& name);
+
+	vector<ControlField> _fields;
+	vector<unsigned long long> _groups;			// set of fields in each mutually exclusive group
+	vector<unsigned long long> _controlLines;
+	vector<ControlPattern> _patterns;
+	vector<string> _termNames;
+	vector<unsigned long long> _termValues;
+	vector<unsigned long long> _termFields;		// filled in by Validate()
+};
\ No newline at end of file
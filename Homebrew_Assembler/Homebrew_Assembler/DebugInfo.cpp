@@ -0,0 +1,261 @@
+#include "DebugInfo.h"
+#include <algorithm>
+#include <climits>
+
+DebugInfo::DebugInfo()
+{
+	_symbols.clear();
+	_symbolIndex.clear();
+	_uses.clear();
+	_sections.clear();
+}
+
+int DebugInfo::InternSymbol(const string& name)
+{
+	auto found = _symbolIndex.find(name);
+	if (found != _symbolIndex.end())
+		return found->second;
+
+	int symbol = _symbols.size();
+	_symbols.push_back(name);
+	_symbolIndex[name] = symbol;
+	return symbol;
+}
+
+void DebugInfo::AddUse(const string& symbol, int fileId, int line)
+{
+	_uses.push_back({ InternSymbol(symbol), fileId, line });
+}
+
+// The symbol's number in the uses, or -1 if it wasn't used
+int DebugInfo::FindSymbol(const string& name)
+{
+	auto found = _symbolIndex.find(name);
+	return found == _symbolIndex.end() ? -1 : found->second;
+}
+
+// For a file's lines that are assembled again, which note their uses once more
+void DebugInfo::RemoveUses(int fileId, const unordered_set<int>& lines)
+{
+	_uses.erase(remove_if(_uses.begin(), _uses.end(), [&](const SymbolUse& use) { return use.fileId == fileId && lines.count(use.line) > 0; }), _uses.end());
+}
+
+void DebugInfo::AddSection(const string& name, int bank, int start, int size)
+{
+	if (size > 0)
+		_sections.push_back({ name, bank, start, size });
+}
+
+// Only the file name is printed, not the whole path
+static const char* BaseName(const string& path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return path.c_str() + (slash == string::npos ? 0 : slash + 1);
+}
+
+static bool Before(int bankA, int addressA, int bankB, int addressB)
+{
+	return bankA != bankB ? bankA < bankB : addressA < addressB;
+}
+
+// The records, labels and sections are each sorted by bank and address once, and then walked together: each label's
+// size is the bytes of the records up to the next label, and the rows of the line table are written as the records are
+// passed.
+bool DebugInfo::Write(const string& symbolFile, const string& xrefFile, const string& lineFile, ROMData& rom, LabelDictionary& labels, const unordered_map<string, pair<int, int>>& symbolLines)
+{
+	FILE* symbols = fopen(symbolFile.c_str(), "w");
+	FILE* xref = fopen(xrefFile.c_str(), "w");
+	FILE* lines = fopen(lineFile.c_str(), "wb");
+
+	if (!symbols || !xref || !lines)
+	{
+		printf("!!! CRITICAL ERROR: Cannot open file %s for writing the symbols !!!\n", !symbols ? symbolFile.c_str() : !xref ? xrefFile.c_str() : lineFile.c_str());
+		if (symbols) fclose(symbols);
+		if (xref) fclose(xref);
+		if (lines) fclose(lines);
+		return false;
+	}
+
+	const vector<ListingRecord>& records = rom.GetListing();
+	const vector<string>& files = rom.GetSourceFiles();
+
+	vector<int> order(records.size());
+	for (int i = 0; i < order.size(); i++)
+		order[i] = i;
+	stable_sort(order.begin(), order.end(), [&](int a, int b) { return Before(records[a].bank, records[a].address, records[b].bank, records[b].address); });
+
+	vector<ListingLabel> sorted = rom.GetLabels();
+	stable_sort(sorted.begin(), sorted.end(), [](const ListingLabel& a, const ListingLabel& b) { return Before(a.bank, a.address, b.bank, b.address); });
+	sort(_sections.begin(), _sections.end(), [](const SymbolSection& a, const SymbolSection& b) { return Before(a.bank, a.start, b.bank, b.start); });
+
+	// Everything before the rows is known up front, so it is written first
+	vector<uint32_t> nameOffsets;
+	uint32_t stringsSize = 0;
+	for (const string& file : files)
+	{
+		nameOffsets.push_back(stringsSize);
+		stringsSize += file.size() + 1;
+	}
+
+	LineTableHeader header;
+	header.magic = LINE_TABLE_MAGIC;
+	header.version = LINE_TABLE_VERSION;
+	header.numFiles = files.size();
+	header.numRows = order.size();
+	header.filesOffset = sizeof(LineTableHeader);
+	header.stringsOffset = header.filesOffset + header.numFiles * sizeof(uint32_t);
+	header.rowsOffset = (header.stringsOffset + stringsSize + 3) & ~3u;
+	header.byLineOffset = header.rowsOffset + header.numRows * sizeof(LineTableRow);
+
+	fwrite(&header, sizeof(header), 1, lines);
+	fwrite(nameOffsets.data(), sizeof(uint32_t), nameOffsets.size(), lines);
+	for (const string& file : files)
+		fwrite(file.c_str(), 1, file.size() + 1, lines);
+	for (uint32_t p = header.stringsOffset + stringsSize; p < header.rowsOffset; p++)
+		fputc(0, lines);
+
+	int r = 0;
+	auto writeRow = [&]()
+	{
+		const ListingRecord& record = records[order[r++]];
+		LineTableRow row = { (uint32_t)record.address, record.bank, (uint32_t)record.length, (uint32_t)record.fileId, (uint32_t)record.line + 1 };
+		fwrite(&row, sizeof(row), 1, lines);
+		return record.length;
+	};
+
+	fprintf(symbols, "; %d labels\n", (int)sorted.size());
+	fprintf(symbols, "; bank  address    size  section           name\n");
+
+	int s = 0;
+	for (int l = 0; l < sorted.size(); l++)
+	{
+		const ListingLabel& label = sorted[l];
+		int end = l + 1 < sorted.size() && sorted[l + 1].bank == label.bank ? sorted[l + 1].address : INT_MAX;
+
+		// Records in front of the first label of a bank don't belong to any label
+		while (r < order.size() && Before(records[order[r]].bank, records[order[r]].address, label.bank, label.address))
+			writeRow();
+
+		int size = 0;
+		while (r < order.size() && records[order[r]].bank == label.bank && records[order[r]].address < end)
+			size += writeRow();
+
+		while (s < _sections.size() && Before(_sections[s].bank, _sections[s].start + _sections[s].size - 1, label.bank, label.address))
+			s++;
+
+		bool inSection = s < _sections.size() && _sections[s].bank == label.bank && _sections[s].start <= label.address;
+		fprintf(symbols, "%6d  $%04X  %6d  %-16s  %s\n", label.bank, label.address, size, inSection ? _sections[s].name.c_str() : "-", label.name.c_str());
+	}
+
+	while (r < order.size())
+		writeRow();
+
+	// Row numbers in line order, for going from a line to its addresses
+	vector<uint32_t> byLine(order.size());
+	for (int i = 0; i < byLine.size(); i++)
+		byLine[i] = i;
+	stable_sort(byLine.begin(), byLine.end(), [&](uint32_t a, uint32_t b)
+	{
+		const ListingRecord& x = records[order[a]];
+		const ListingRecord& y = records[order[b]];
+		return x.fileId != y.fileId ? x.fileId < y.fileId : x.line < y.line;
+	});
+	fwrite(byLine.data(), sizeof(uint32_t), byLine.size(), lines);
+
+	WriteCrossReference(xref, rom, labels, symbolLines);
+
+	bool ok = !ferror(symbols) && !ferror(xref) && !ferror(lines);
+	fclose(symbols);
+	fclose(xref);
+	fclose(lines);
+
+	if (!ok)
+		printf("!!! CRITICAL ERROR: Writing the symbols failed !!!\n");
+
+	return ok;
+}
+
+// One line per symbol, in name order: its value, where it was defined and every line that used it. symbolLines has the
+// file id and line of each symbol (name = value) definition; labels are found in the listing.
+bool DebugInfo::WriteCrossReference(FILE* out, ROMData& rom, LabelDictionary& labels, const unordered_map<string, pair<int, int>>& symbolLines)
+{
+	const vector<string>& files = rom.GetSourceFiles();
+	const vector<ListingLabel>& defined = rom.GetLabels();
+
+	// Labels and symbols are listed even when nothing uses them
+	for (const auto& symbol : symbolLines)
+		InternSymbol(symbol.first);
+
+	vector<int> definedAt;
+	for (int l = 0; l < defined.size(); l++)
+	{
+		int symbol = InternSymbol(defined[l].name);
+		if (symbol >= definedAt.size())
+			definedAt.resize(symbol + 1, -1);
+		definedAt[symbol] = l;
+	}
+	definedAt.resize(_symbols.size(), -1);
+
+	vector<int> names(_symbols.size());
+	vector<int> rank(_symbols.size());
+	for (int i = 0; i < names.size(); i++)
+		names[i] = i;
+	sort(names.begin(), names.end(), [this](int a, int b) { return _symbols[a] < _symbols[b]; });
+	for (int i = 0; i < names.size(); i++)
+		rank[names[i]] = i;
+
+	sort(_uses.begin(), _uses.end(), [&](const SymbolUse& a, const SymbolUse& b)
+	{
+		if (a.symbol != b.symbol)
+			return rank[a.symbol] < rank[b.symbol];
+		return a.fileId != b.fileId ? a.fileId < b.fileId : a.line < b.line;
+	});
+
+	fprintf(out, "; %d symbols\n", (int)names.size());
+	fprintf(out, "; symbol                   value     defined               used\n");
+
+	int u = 0;
+	for (int symbol : names)
+	{
+		long long value = 0;
+		bool known = labels.Resolve(_symbols[symbol], &value);
+
+		int first = u;
+		while (u < _uses.size() && _uses[u].symbol == symbol)
+			u++;
+
+		// Names that aren't symbols of the program (and so were reported when they were used) are left out
+		if (!known)
+			continue;
+
+		char where[64] = "-";
+		if (definedAt[symbol] >= 0)
+		{
+			const ListingLabel& label = defined[definedAt[symbol]];
+			snprintf(where, sizeof(where), "%s:%d", BaseName(files[label.fileId]), label.line + 1);
+		}
+		else
+		{
+			auto line = symbolLines.find(_symbols[symbol]);
+			if (line != symbolLines.end() && line->second.first >= 0 && line->second.first < files.size())
+				snprintf(where, sizeof(where), "%s:%d", BaseName(files[line->second.first]), line->second.second + 1);
+		}
+
+		char text[32];
+		snprintf(text, sizeof(text), value < 0 ? "%lld" : "$%04llX", value);
+		fprintf(out, "%-26s %-9s %-21s", _symbols[symbol].c_str(), text, where);
+
+		for (int k = first; k < u; k++)
+		{
+			// A line that names a symbol more than once is only listed once
+			if (k > first && _uses[k].fileId == _uses[k - 1].fileId && _uses[k].line == _uses[k - 1].line)
+				continue;
+
+			fprintf(out, " %s:%d", BaseName(files[_uses[k].fileId]), _uses[k].line + 1);
+		}
+
+		fprintf(out, "\n");
+	}
+
+	return !ferror(out);
+}
\ No newline at end of file
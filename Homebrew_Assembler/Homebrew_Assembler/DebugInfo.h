@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "ROMData.h"
+#include "LabelDictionary.h"
+
+using namespace std;
+
+// A line of the program that named a symbol
+struct SymbolUse
+{
+	int symbol;
+	int fileId;
+	int line;
+};
+
+// Where a section ended up
+struct SymbolSection
+{
+	string name;
+	int bank;
+	int start;
+	int size;
+};
+
+// The line table is laid out to be mapped and used in place: the header, the file name offsets, the names themselves
+// (each ending in a 0), the rows sorted by bank and address, and then the rows' numbers sorted by file and line. Every
+// part starts on a 4 byte boundary, and offsets are from the start of the file.
+constexpr uint32_t LINE_TABLE_MAGIC = 0x544C4248;	// "HBLT"
+constexpr uint32_t LINE_TABLE_VERSION = 1;
+
+struct LineTableHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numFiles;
+	uint32_t numRows;
+	uint32_t filesOffset;
+	uint32_t stringsOffset;
+	uint32_t rowsOffset;
+	uint32_t byLineOffset;
+};
+
+struct LineTableRow
+{
+	uint32_t address;
+	int32_t bank;
+	uint32_t length;
+	uint32_t file;
+	uint32_t line;		// counted from 1
+};
+
+// Writes what a debugger or emulator needs to know about the assembled program: a symbol map (.sym), a cross reference
+// of where each symbol is used (.xref) and the line table (.dbg). The uses are collected while the program is assembled;
+// everything else comes from the listing records, labels and the lines symbols were defined on once it is done.
+class DebugInfo
+{
+public:
+	DebugInfo();
+
+	void AddUse(const string& symbol, int fileId, int line);
+	void AddSection(const string& name, int bank, int start, int size);
+	int NumUses() { return _uses.size(); }
+	const vector<SymbolUse>& GetUses() { return _uses; }
+	int FindSymbol(const string& name);
+	void RemoveUses(int fileId, const unordered_set<int>& lines);
+	bool Write(const string& symbolFile, const string& xrefFile, const string& lineFile, ROMData& rom, LabelDictionary& labels, const unordered_map<string, pair<int, int>>& symbolLines);
+
+private:
+	int InternSymbol(const string& name);
+	bool WriteCrossReference(FILE* out, ROMData& rom, LabelDictionary& labels, const unordered_map<string, pair<int, int>>& symbolLines);
+
+	vector<string> _symbols;
+	unordered_map<string, int> _symbolIndex;
+	vector<SymbolUse> _uses;
+	vector<SymbolSection> _sections;
+};
\ No newline at end of file
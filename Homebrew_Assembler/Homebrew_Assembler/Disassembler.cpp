@@ -0,0 +1,193 @@
+#include "Disassembler.h"
+#include <algorithm>
+#include <bitset>
+
+Disassembler::Disassembler(InstructionEncoder& encoder) : _encoder(encoder)
+{
+	_opcodes.clear();
+	_candidates.clear();
+	_lines.clear();
+	_marks.clear();
+	_base = 0;
+	_instructions = 0;
+	_labels = 0;
+
+	for (int v = 0; v <= 256; v++)
+		_firstCandidate[v] = 0;
+}
+
+// An operand is a jump target if the opcode jumps and the operand is an immediate, or if it is stored relative to the
+// next instruction
+void Disassembler::AddOpcode(int entry, int layout, unsigned long long mask, unsigned long long bits, const bool* immediate, bool jumps)
+{
+	int width = 0;
+	int relative = _encoder.GetRelativeArg(layout, &width);
+
+	DisasmOpcode opcode;
+	opcode.entry = entry;
+	opcode.layout = layout;
+	opcode.length = _encoder.Size(layout);
+	opcode.mask = mask;
+	opcode.bits = bits;
+
+	for (int n = 0; n < 2; n++)
+		opcode.target[n] = immediate[n] && (jumps || n == relative);
+
+	_opcodes.push_back(opcode);
+}
+
+// An opcode goes in the list of every first byte it can start with. Opcodes that fix more bits come first, so the one
+// that matches best wins (and an opcode wins over the aliases that were added after it).
+void Disassembler::Build()
+{
+	vector<int> order(_opcodes.size());
+	for (int o = 0; o < order.size(); o++)
+		order[o] = o;
+
+	stable_sort(order.begin(), order.end(), [this](int a, int b)
+	{
+		return bitset<64>(_opcodes[a].mask).count() > bitset<64>(_opcodes[b].mask).count();
+	});
+
+	vector<vector<int>> byFirstByte(256);
+	for (int o : order)
+	{
+		int shift = 8 * (_opcodes[o].length - 1);
+		int mask = (int)((_opcodes[o].mask >> shift) & 0xFF);
+		int bits = (int)((_opcodes[o].bits >> shift) & 0xFF);
+
+		for (int v = 0; v < 256; v++)
+		{
+			if ((v & mask) == bits)
+				byFirstByte[v].push_back(o);
+		}
+	}
+
+	_candidates.clear();
+	for (int v = 0; v < 256; v++)
+	{
+		_firstCandidate[v] = _candidates.size();
+		_candidates.insert(_candidates.end(), byFirstByte[v].begin(), byFirstByte[v].end());
+	}
+	_firstCandidate[256] = _candidates.size();
+}
+
+// One pass over the image. A byte that doesn't start any opcode (or starts one that would run past the end) becomes a
+// line of data of its own.
+void Disassembler::Decode(const unsigned char* image, int length, int base)
+{
+	_base = base;
+	_instructions = 0;
+	_lines.clear();
+	_lines.reserve(length);
+	_marks.assign(length, 0);
+
+	for (int pc = 0; pc < length; )
+	{
+		DisasmLine line = { base + pc, 1, -1, { image[pc], 0 } };
+		int first = image[pc];
+
+		for (int c = _firstCandidate[first]; c < _firstCandidate[first + 1]; c++)
+		{
+			const DisasmOpcode& opcode = _opcodes[_candidates[c]];
+			if (pc + opcode.length > length)
+				continue;
+
+			unsigned long long word = 0;
+			for (int b = 0; b < opcode.length; b++)
+				word = (word << 8) | image[pc + b];
+
+			if ((word & opcode.mask) != opcode.bits)
+				continue;
+
+			line.opcode = _candidates[c];
+			line.length = opcode.length;
+			line.args[0] = line.args[1] = 0;
+			_encoder.Decode(opcode.layout, image + pc, base + pc, line.args);
+
+			for (int n = 0; n < 2; n++)
+			{
+				if (opcode.target[n] && line.args[n] >= base && line.args[n] < (long long)base + length)
+					_marks[line.args[n] - base] |= 2;
+			}
+
+			_instructions++;
+			break;
+		}
+
+		_marks[pc] |= 1;
+		_lines.push_back(line);
+		pc += line.length;
+	}
+
+	_labels = 0;
+	for (unsigned char mark : _marks)
+		_labels += mark == 3;
+}
+
+// Only addresses that something jumps to and that start a line get a label. A jump into the middle of an instruction
+// keeps its number.
+bool Disassembler::IsLabel(long long address)
+{
+	return address >= _base && address < (long long)_base + _marks.size() && _marks[address - _base] == 3;
+}
+
+string Disassembler::Operand(const DisasmOpcode& opcode, int n, long long value)
+{
+	char text[32];
+
+	if (opcode.target[n] && IsLabel(value))
+		snprintf(text, sizeof(text), "L_%04llX", value);
+	else if (value < 0)
+		snprintf(text, sizeof(text), "%lld", value);
+	else
+		snprintf(text, sizeof(text), "$%02llX", value);
+
+	return text;
+}
+
+// The source is written so that it assembles back to the same image: the architecture, the origin, and then one line per
+// instruction, with the bytes that aren't instructions in .byte lines of up to 8
+void Disassembler::Write(FILE* out, OpcodeDictionary& opcodes, const string& architecture, const string& source)
+{
+	fprintf(out, "; Disassembly of %s\n", source.c_str());
+	fprintf(out, ".arch \"%s\"\n", architecture.c_str());
+
+	if (_base != 0)
+		fprintf(out, ".org $%04X\n", _base);
+
+	for (int l = 0; l < _lines.size(); )
+	{
+		const DisasmLine& line = _lines[l];
+
+		if (IsLabel(line.address))
+			fprintf(out, "[L_%04X]:\n", line.address);
+
+		if (line.opcode < 0)
+		{
+			fprintf(out, "\t.byte");
+			int n = 0;
+			do
+			{
+				fprintf(out, "%s$%02llX", n == 0 ? " " : ", ", _lines[l].args[0]);
+				l++;
+				n++;
+			} while (n < 8 && l < _lines.size() && _lines[l].opcode < 0 && !IsLabel(_lines[l].address));
+
+			fprintf(out, "\n");
+			continue;
+		}
+
+		const DisasmOpcode& opcode = _opcodes[line.opcode];
+		string text = "\t" + opcodes.GetMnemonic(opcode.entry);
+
+		for (int n = 0; n < opcodes.GetNumArgs(opcode.entry) && n < 2; n++)
+		{
+			text += n == 0 ? " " : ", ";
+			text += opcodes.GetArgType(opcode.entry, n) == ArgType::Register ? opcodes.GetArgString(opcode.entry, n) : Operand(opcode, n, line.args[n]);
+		}
+
+		fprintf(out, "%s\n", text.c_str());
+		l++;
+	}
+}
\ No newline at end of file
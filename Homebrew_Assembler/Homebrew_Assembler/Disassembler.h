@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "InstructionEncoder.h"
+#include "OpcodeDictionary.h"
+
+using namespace std;
+
+// An opcode as the disassembler sees it: the bits that every instruction it encodes has (the opcode, constants and
+// register operands), and which of its operands are addresses that code jumps to
+struct DisasmOpcode
+{
+	int entry;
+	int layout;
+	int length;
+	unsigned long long mask;
+	unsigned long long bits;
+	bool target[2];
+};
+
+// One line of the disassembly: an instruction, or a byte that isn't one (opcode -1)
+struct DisasmLine
+{
+	int address;
+	int length;
+	int opcode;
+	long long args[2];
+};
+
+// Turns a ROM image back into source for the same architecture. Opcodes are indexed by the value of their first byte,
+// so decoding an instruction is a table lookup and a compare of its fixed bits (more than one compare only when
+// opcodes share a first byte and differ further on).
+class Disassembler
+{
+public:
+	Disassembler(InstructionEncoder& encoder);
+
+	void AddOpcode(int entry, int layout, unsigned long long mask, unsigned long long bits, const bool* immediate, bool jumps);
+	void Build();
+	void Decode(const unsigned char* image, int length, int base);
+	void Write(FILE* out, OpcodeDictionary& opcodes, const string& architecture, const string& source);
+	int NumInstructions() { return _instructions; }
+	int NumDataBytes() { return _lines.size() - _instructions; }
+	int NumLabels() { return _labels; }
+
+private:
+	bool IsLabel(long long address);
+	string Operand(const DisasmOpcode& opcode, int n, long long value);
+
+	InstructionEncoder& _encoder;
+	vector<DisasmOpcode> _opcodes;
+	vector<int> _candidates;		// opcodes that can start with each first byte, the most specific first, back to back
+	int _firstCandidate[257];
+	vector<DisasmLine> _lines;
+	vector<unsigned char> _marks;	// for each byte of the image: 1 if an instruction starts there, 2 if one also jumps there
+	int _base;
+	int _instructions;
+	int _labels;
+};
\ No newline at end of file
@@ -0,0 +1,441 @@
+#include "Expression.h"
+#include "Config.h"
+#include <cstring>
+#include <cctype>
+
+ExpressionPool::ExpressionPool()
+{
+	_text = "";
+	_pos = 0;
+	_lexType = LexType::End;
+	_lexValue = 0;
+	_depth = 0;
+	_maxDepth = 0;
+
+	_code.clear();
+	_first.clear();
+	_count.clear();
+	_constants.clear();
+	_symbolNames.clear();
+	_symbolIndex.clear();
+}
+
+// Compiles the expression into the pool and returns its id, or -1 (with error set) if it is malformed
+int ExpressionPool::Compile(const string& text, string& error)
+{
+	_text = text.c_str();
+	_pos = 0;
+	_error = "";
+	_depth = 0;
+	_maxDepth = 0;
+
+	int first = _code.size();
+
+	Next();
+	bool ok = ParseBinary(1);
+
+	if (ok && _lexType != LexType::End)
+	{
+		_error = "unexpected '" + _lexText + "'";
+		ok = false;
+	}
+
+	if (ok && _maxDepth > MAX_EXPRESSION_DEPTH)
+	{
+		_error = "expression is nested too deeply";
+		ok = false;
+	}
+
+	if (!ok)
+	{
+		_code.resize(first);
+		error = _error;
+		return -1;
+	}
+
+	_first.push_back(first);
+	_count.push_back(_code.size() - first);
+
+	return _first.size() - 1;
+}
+
+ExprResult ExpressionPool::Evaluate(int id, long long pc, const function<bool(int, long long*)>& resolve, long long* value, int* unresolvedSymbol)
+{
+	long long stack[MAX_EXPRESSION_DEPTH];
+	int top = -1;
+
+	const ExprInstr* code = &_code[_first[id]];
+	const ExprInstr* end = code + _count[id];
+
+	for (; code < end; code++)
+	{
+		long long a, b;
+
+		switch (code->op)
+		{
+		case ExprOp::PushConst:
+			stack[++top] = _constants[code->operand];
+			continue;
+		case ExprOp::PushSymbol:
+			if (!resolve(code->operand, &a))
+			{
+				if (unresolvedSymbol)
+					*unresolvedSymbol = code->operand;
+
+				return ExprResult::Unresolved;
+			}
+			stack[++top] = a;
+			continue;
+		case ExprOp::PushPC:
+			stack[++top] = pc;
+			continue;
+		case ExprOp::Negate:		stack[top] = -stack[top];					continue;
+		case ExprOp::Complement:	stack[top] = ~stack[top];					continue;
+		case ExprOp::LogicalNot:	stack[top] = !stack[top];					continue;
+		case ExprOp::LowByte:		stack[top] = stack[top] & 0xFF;				continue;
+		case ExprOp::HighByte:		stack[top] = (stack[top] >> 8) & 0xFF;		continue;
+		default:
+			break;
+		}
+
+		// Everything else is a binary operator
+		b = stack[top--];
+		a = stack[top];
+
+		switch (code->op)
+		{
+		case ExprOp::Multiply:		a = a * b;	break;
+		case ExprOp::Divide:
+			if (b == 0)
+				return ExprResult::DivideByZero;
+			a = a / b;
+			break;
+		case ExprOp::Add:			a = a + b;	break;
+		case ExprOp::Subtract:		a = a - b;	break;
+		case ExprOp::ShiftLeft:		a = (b < 0 || b > 63) ? 0 : (long long)((unsigned long long)a << b);	break;
+		case ExprOp::ShiftRight:	a = (b < 0 || b > 63) ? 0 : (long long)((unsigned long long)a >> b);	break;
+		case ExprOp::Less:			a = a < b;	break;
+		case ExprOp::Greater:		a = a > b;	break;
+		case ExprOp::LessEqual:		a = a <= b;	break;
+		case ExprOp::GreaterEqual:	a = a >= b;	break;
+		case ExprOp::Equal:			a = a == b;	break;
+		case ExprOp::NotEqual:		a = a != b;	break;
+		case ExprOp::BitAnd:		a = a & b;	break;
+		case ExprOp::BitXor:		a = a ^ b;	break;
+		case ExprOp::BitOr:			a = a | b;	break;
+		case ExprOp::LogicalAnd:	a = a && b;	break;
+		case ExprOp::LogicalOr:		a = a || b;	break;
+		default:
+			break;
+		}
+
+		stack[top] = a;
+	}
+
+	*value = stack[top];
+	return ExprResult::Ok;
+}
+
+bool ExpressionPool::IsConstant(int id)
+{
+	for (int i = _first[id]; i < _first[id] + _count[id]; i++)
+	{
+		if (_code[i].op == ExprOp::PushSymbol || _code[i].op == ExprOp::PushPC)
+			return false;
+	}
+
+	return true;
+}
+
+bool ExpressionPool::UsesPC(int id)
+{
+	for (int i = _first[id]; i < _first[id] + _count[id]; i++)
+	{
+		if (_code[i].op == ExprOp::PushPC)
+			return true;
+	}
+
+	return false;
+}
+
+void ExpressionPool::GetSymbols(int id, vector<int>& symbols)
+{
+	for (int i = _first[id]; i < _first[id] + _count[id]; i++)
+	{
+		if (_code[i].op == ExprOp::PushSymbol)
+			symbols.push_back(_code[i].operand);
+	}
+}
+
+// Reads the next lexeme of the expression being compiled
+void ExpressionPool::Next()
+{
+	while (_text[_pos] == ' ' || _text[_pos] == '\t')
+		_pos++;
+
+	char c = _text[_pos];
+	_lexText = "";
+
+	if (c == '\0')
+	{
+		_lexType = LexType::End;
+		return;
+	}
+
+	// Numbers, which may carry one of the radix prefixes, or the current address
+	int base = 0;
+	size_t start = _pos;
+
+	if (*HEX_KEY && c == *HEX_KEY && isxdigit((unsigned char)_text[_pos + 1]))
+	{
+		base = 16;
+		start++;
+	}
+	else if (*BIN_KEY && c == *BIN_KEY && (_text[_pos + 1] == '0' || _text[_pos + 1] == '1'))
+	{
+		base = 2;
+		start++;
+	}
+	else if (*DEC_KEY && c == *DEC_KEY && isdigit((unsigned char)_text[_pos + 1]))
+	{
+		base = 10;
+		start++;
+	}
+	else if (c == *CURRENT_ADDRESS_KEY)
+	{
+		_lexType = LexType::PC;
+		_lexText = c;
+		_pos++;
+		return;
+	}
+	else if (isdigit((unsigned char)c))
+		base = !*DEC_KEY ? 10 : !*HEX_KEY ? 16 : 2;
+
+	if (base)
+	{
+		size_t end = start;
+		while (isalnum((unsigned char)_text[end]) || _text[end] == '_')
+			end++;
+
+		_lexText = string(_text + _pos, end - _pos);
+		_lexValue = 0;
+		_pos = end;
+
+		for (size_t i = start; i < end; i++)
+		{
+			int digit = isdigit((unsigned char)_text[i]) ? _text[i] - '0' : isalpha((unsigned char)_text[i]) ? tolower(_text[i]) - 'a' + 10 : 99;
+
+			if (digit >= base)
+			{
+				_lexType = LexType::Invalid;
+				return;
+			}
+
+			_lexValue = _lexValue * base + digit;
+		}
+
+		_lexType = LexType::Number;
+		return;
+	}
+
+	if (isalpha((unsigned char)c) || c == '_')
+	{
+		size_t end = _pos;
+		while (isalnum((unsigned char)_text[end]) || _text[end] == '_' || _text[end] == '.')
+			end++;
+
+		_lexText = string(_text + _pos, end - _pos);
+		_lexType = LexType::Identifier;
+		_pos = end;
+		return;
+	}
+
+	if (c == '(' || c == '{')
+	{
+		_lexType = LexType::Open;
+		_lexText = c;
+		_pos++;
+		return;
+	}
+
+	if (c == ')' || c == '}')
+	{
+		_lexType = LexType::Close;
+		_lexText = c;
+		_pos++;
+		return;
+	}
+
+	static const char* twoCharOps[] = { "<<", ">>", "<=", ">=", "==", "!=", "&&", "||" };
+	for (const char* op : twoCharOps)
+	{
+		if (c == op[0] && _text[_pos + 1] == op[1])
+		{
+			_lexType = LexType::Operator;
+			_lexText = op;
+			_pos += 2;
+			return;
+		}
+	}
+
+	if (strchr("+-*/&|^~!<>", c))
+	{
+		_lexType = LexType::Operator;
+		_lexText = c;
+		_pos++;
+		return;
+	}
+
+	_lexType = LexType::Invalid;
+	_lexText = c;
+	_pos++;
+}
+
+// Precedence climbing over the binary operators; operands are handled by ParseUnary
+bool ExpressionPool::ParseBinary(int minPrecedence)
+{
+	if (!ParseUnary())
+		return false;
+
+	ExprOp op;
+	int precedence;
+
+	while (_lexType == LexType::Operator && (precedence = Precedence(_lexText, &op)) >= minPrecedence)
+	{
+		Next();
+
+		if (!ParseBinary(precedence + 1))
+			return false;
+
+		Emit(op, 0);
+	}
+
+	return true;
+}
+
+bool ExpressionPool::ParseUnary()
+{
+	switch (_lexType)
+	{
+	case LexType::Number:
+		_constants.push_back(_lexValue);
+		Emit(ExprOp::PushConst, _constants.size() - 1);
+		Next();
+		return true;
+
+	case LexType::Identifier:
+		Emit(ExprOp::PushSymbol, InternSymbol(_lexText));
+		Next();
+		return true;
+
+	case LexType::PC:
+		Emit(ExprOp::PushPC, 0);
+		Next();
+		return true;
+
+	case LexType::Open:
+		Next();
+		if (!ParseBinary(1))
+			return false;
+
+		if (_lexType != LexType::Close)
+		{
+			_error = "missing closing parenthesis";
+			return false;
+		}
+
+		Next();
+		return true;
+
+	case LexType::Operator:
+	{
+		// '<' and '>' in front of an operand select its low and high byte
+		string op = _lexText;
+		ExprOp unary;
+
+		if (op == "-")		unary = ExprOp::Negate;
+		else if (op == "~")	unary = ExprOp::Complement;
+		else if (op == "!")	unary = ExprOp::LogicalNot;
+		else if (op == "<")	unary = ExprOp::LowByte;
+		else if (op == ">")	unary = ExprOp::HighByte;
+		else if (op == "+")	unary = ExprOp::Add;
+		else
+		{
+			_error = "unexpected '" + op + "'";
+			return false;
+		}
+
+		Next();
+		if (!ParseUnary())
+			return false;
+
+		if (unary != ExprOp::Add)
+			Emit(unary, 0);
+
+		return true;
+	}
+
+	case LexType::End:
+		_error = "missing operand";
+		return false;
+
+	default:
+		_error = "unexpected '" + _lexText + "'";
+		return false;
+	}
+}
+
+int ExpressionPool::Precedence(const string& op, ExprOp* result)
+{
+	static const struct { const char* text; ExprOp op; int precedence; } table[] =
+	{
+		{ "*", ExprOp::Multiply, 10 },		{ "/", ExprOp::Divide, 10 },
+		{ "+", ExprOp::Add, 9 },			{ "-", ExprOp::Subtract, 9 },
+		{ "<<", ExprOp::ShiftLeft, 8 },		{ ">>", ExprOp::ShiftRight, 8 },
+		{ "<", ExprOp::Less, 7 },			{ ">", ExprOp::Greater, 7 },
+		{ "<=", ExprOp::LessEqual, 7 },		{ ">=", ExprOp::GreaterEqual, 7 },
+		{ "==", ExprOp::Equal, 6 },			{ "!=", ExprOp::NotEqual, 6 },
+		{ "&", ExprOp::BitAnd, 5 },
+		{ "^", ExprOp::BitXor, 4 },
+		{ "|", ExprOp::BitOr, 3 },
+		{ "&&", ExprOp::LogicalAnd, 2 },
+		{ "||", ExprOp::LogicalOr, 1 },
+	};
+
+	for (const auto& entry : table)
+	{
+		if (op == entry.text)
+		{
+			*result = entry.op;
+			return entry.precedence;
+		}
+	}
+
+	return 0;
+}
+
+int ExpressionPool::InternSymbol(const string& name)
+{
+	auto found = _symbolIndex.find(name);
+	if (found != _symbolIndex.end())
+		return found->second;
+
+	_symbolNames.push_back(name);
+	_symbolIndex[name] = _symbolNames.size() - 1;
+
+	return _symbolNames.size() - 1;
+}
+
+void ExpressionPool::Emit(ExprOp op, int operand)
+{
+	_code.push_back({ op, operand });
+
+	// Track how deep the value stack gets so evaluation can use a fixed-size stack
+	if (op == ExprOp::PushConst || op == ExprOp::PushSymbol || op == ExprOp::PushPC)
+		_depth++;
+	else if (op >= ExprOp::Multiply)
+		_depth--;
+
+	if (_depth > _maxDepth)
+		_maxDepth = _depth;
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+using namespace std;
+
+// Expressions are compiled into a small postfix bytecode that is evaluated with a value stack. All compiled
+// expressions live back to back in one pool, and symbols are referred to by an id into the pool's name table
+// so that evaluating an expression never has to deal with strings (the resolver can cache by id).
+enum class ExprOp : unsigned char
+{
+	PushConst, PushSymbol, PushPC,
+	Negate, Complement, LogicalNot, LowByte, HighByte,
+	Multiply, Divide, Add, Subtract, ShiftLeft, ShiftRight,
+	Less, Greater, LessEqual, GreaterEqual, Equal, NotEqual,
+	BitAnd, BitXor, BitOr, LogicalAnd, LogicalOr
+};
+
+enum class ExprResult { Ok, Unresolved, DivideByZero };
+
+// Deepest value stack an expression may need while it is evaluated
+constexpr int MAX_EXPRESSION_DEPTH = 64;
+
+struct ExprInstr
+{
+	ExprOp op;
+	int operand;	// constant index (PushConst) or symbol id (PushSymbol)
+};
+
+class ExpressionPool
+{
+public:
+	ExpressionPool();
+
+	int Compile(const string& text, string& error);
+	ExprResult Evaluate(int id, long long pc, const function<bool(int, long long*)>& resolve, long long* value, int* unresolvedSymbol);
+	bool IsConstant(int id);
+	bool UsesPC(int id);
+	int NumSymbols() { return _symbolNames.size(); }
+	const string& GetSymbolName(int symbol) { return _symbolNames[symbol]; }
+	void GetSymbols(int id, vector<int>& symbols);
+
+private:
+	enum class LexType { End, Number, Identifier, PC, Operator, Open, Close, Invalid };
+
+	void Next();
+	bool ParseBinary(int minPrecedence);
+	bool ParseUnary();
+	int Precedence(const string& op, ExprOp* result);
+	int InternSymbol(const string& name);
+	void Emit(ExprOp op, int operand);
+
+	// Compiler state
+	const char* _text;
+	size_t _pos;
+	LexType _lexType;
+	string _lexText;
+	long long _lexValue;
+	string _error;
+	int _depth;
+	int _maxDepth;
+
+	vector<ExprInstr> _code;
+	vector<int> _first;
+	vector<int> _count;
+	vector<long long> _constants;
+	vector<string> _symbolNames;
+	unordered_map<string, int> _symbolIndex;
+};
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include "FreeSpace.h"
+#include <climits>
+
+FreeSpace::FreeSpace()
+{
+	_byStart.clear();
+	_bySize.clear();
+}
+
+// Ranges must not overlap the ones that are already free
+void FreeSpace::Add(long long start, long long end)
+{
+	if (end <= start)
+		return;
+
+	_byStart[start] = end;
+	_bySize.insert({ end - start, start });
+}
+
+void FreeSpace::Remove(long long start)
+{
+	auto range = _byStart.find(start);
+	_bySize.erase({ range->second - range->first, start });
+	_byStart.erase(range);
+}
+
+// The first address of a free range where a block can start: aligned, and (with a page size) not running over the end
+// of a page
+bool FreeSpace::Fit(long long start, long long end, long long size, long long alignment, long long page, long long* address)
+{
+	long long at = (start + alignment - 1) / alignment * alignment;
+
+	while (at + size <= end)
+	{
+		if (page <= 0 || at / page == (at + size - 1) / page)
+		{
+			*address = at;
+			return true;
+		}
+
+		// Start again at the next page
+		at = (at / page + 1) * page;
+		at = (at + alignment - 1) / alignment * alignment;
+	}
+
+	return false;
+}
+
+// Best fit: the block goes into the shortest free range it fits in, and what is left on either side of it stays free.
+// Returns false if it doesn't fit anywhere.
+bool FreeSpace::Allocate(long long size, long long alignment, long long page, long long* address)
+{
+	if (size <= 0 || (page > 0 && size > page))
+		return false;
+
+	for (auto range = _bySize.lower_bound({ size, LLONG_MIN }); range != _bySize.end(); range++)
+	{
+		long long start = range->second;
+		long long end = start + range->first;
+
+		if (!Fit(start, end, size, alignment, page, address))
+			continue;
+
+		Remove(start);
+		Add(start, *address);
+		Add(*address + size, end);
+		return true;
+	}
+
+	return false;
+}
\ No newline at end of file
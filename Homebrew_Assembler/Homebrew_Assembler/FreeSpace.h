@@ -0,0 +1,24 @@
+#pragma once
+#include <map>
+#include <set>
+
+using namespace std;
+
+// The free ranges of an address space, kept both by start address and by length, so the smallest range that a block
+// fits in can be found in log(n) steps and the rest of it handed back
+class FreeSpace
+{
+public:
+	FreeSpace();
+
+	void Add(long long start, long long end);
+	bool Allocate(long long size, long long alignment, long long page, long long* address);
+	int NumRanges() { return _byStart.size(); }
+
+private:
+	bool Fit(long long start, long long end, long long size, long long alignment, long long page, long long* address);
+	void Remove(long long start);
+
+	map<long long, long long> _byStart;		// start of each free range, and its end (one past the last address)
+	set<pair<long long, long long>> _bySize;	// length and start of each free range
+};
\ No newline at end of file
@@ -1,13 +1,142 @@
 #include "Parser.h"
+#include "LanguageServer.h"
+#include <thread>
+
+// Assembles every file given after --test and runs their .expect/.assert checks on the simulator, spread over the cores.
+// Files are assembled one after the other (the parser isn't thread-safe) and nothing is written to disk but the report.
+static int RunTests(int argc, char** argv)
+{
+	int jobs = max(1, (int)thread::hardware_concurrency());
+	double timeout = DEFAULT_TEST_TIMEOUT;
+	const char* junitFile = NULL;
+	const char* profileFile = NULL;
+	vector<const char*> files;
+
+	for (int a = 2; a < argc; a++)
+	{
+		if (!strcmp(argv[a], "--jobs") && a + 1 < argc)
+			jobs = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--timeout") && a + 1 < argc)
+			timeout = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--junit") && a + 1 < argc)
+			junitFile = argv[++a];
+		else if (!strcmp(argv[a], "--profile") && a + 1 < argc)
+			profileFile = argv[++a];
+		else
+			files.push_back(argv[a]);
+	}
+
+	if (files.empty())
+	{
+		printf("ERROR! : Expected: --test [--jobs n] [--timeout seconds] [--junit report.xml] [--profile stacks.folded] files...\n");
+		return 1;
+	}
+
+	TestRunner runner;
+	for (const char* file : files)
+	{
+		printf("Assembling %s\n", file);
+
+		Parser parser = Parser();
+		parser.SetParseMode(ParseMode::Assembler);
+		parser.SetOutMode(OutMode::Brief);
+		parser.SetTestMode(true);
+		parser.Parse(file);
+
+		TestCase test;
+		test.name = file;
+		if (parser.BuildTest(test))
+			runner.AddTest(test);
+		else
+			runner.AddBrokenTest(file, "the program could not be assembled");
+	}
+
+	if (profileFile != NULL)
+		runner.EnableProfiling();
+
+	runner.Run(jobs, timeout);
+	int failed = runner.PrintSummary();
+
+	if (junitFile != NULL)
+	{
+		FILE* out = fopen(junitFile, "w");
+		if (out == NULL)
+		{
+			printf("ERROR! : Unable to write %s\n", junitFile);
+			return 1;
+		}
+
+		runner.WriteJUnit(out);
+		fclose(out);
+	}
+
+	if (profileFile != NULL)
+	{
+		FILE* out = fopen(profileFile, "w");
+		if (out == NULL)
+		{
+			printf("ERROR! : Unable to write %s\n", profileFile);
+			return 1;
+		}
+
+		runner.WriteProfile(out);
+		fclose(out);
+	}
+
+	return failed > 0 ? 1 : 0;
+}
+
+// Disassembles a ROM image with the opcodes of an architecture file. The address of the first byte of the image can be
+// given in decimal, or in hex with a $ or 0x in front.
+static int RunDisassembler(int argc, char** argv)
+{
+	int base = 0;
+	const char* outFile = NULL;
+	vector<const char*> files;
+
+	for (int a = 2; a < argc; a++)
+	{
+		if (!strcmp(argv[a], "--org") && a + 1 < argc)
+		{
+			const char* text = argv[++a];
+			base = (int)(*text == '$' ? strtol(text + 1, NULL, 16) : strtol(text, NULL, 0));
+		}
+		else if (!strcmp(argv[a], "--out") && a + 1 < argc)
+			outFile = argv[++a];
+		else
+			files.push_back(argv[a]);
+	}
+
+	if (files.size() != 2)
+	{
+		printf("ERROR! : Expected: --disasm architecture rom.bin [--org address] [--out file.asm]\n");
+		return 1;
+	}
+
+	Parser parser = Parser();
+	parser.SetParseMode(ParseMode::Assembler);
+	parser.SetOutMode(OutMode::Brief);
+	return parser.Disassemble(files[0], files[1], base, outFile) ? 0 : 1;
+}
 
 int main(int argc, char** argv)
 {
 	// Create the parser object
 	Parser parser = Parser();
 
+	// The language server talks to the editor over stdout, so nothing else may be printed before it starts
+	if (argc > 1 && !strcmp(argv[1], "--server"))
+		return LanguageServer().Run();
+
 	// Print a welcome message
 	printf("\n\nWelcome to the Homebrew CPU Assembler - v1.0!\n\n");
 
+	if (argc > 1 && !strcmp(argv[1], "--test"))
+		return RunTests(argc, argv);
+
+	if (argc > 1 && !strcmp(argv[1], "--disasm"))
+		return RunDisassembler(argc, argv);
+
 	// Currently limited to two input arguments, though this will probably change soon
 	if (argc > 2)
 	{
@@ -28,7 +157,7 @@ int main(int argc, char** argv)
 		else
 		{
 			// Otherwise, use the file provided by the user
-			char* filename = argv[1];
+			filename = argv[1];
 			printf("File %s\n", filename);
 		}
 
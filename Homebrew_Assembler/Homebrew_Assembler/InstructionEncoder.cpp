@@ -0,0 +1,260 @@
+#include "InstructionEncoder.h"
+
+InstructionEncoder::InstructionEncoder()
+{
+	_steps.clear();
+	_firstStep.clear();
+	_numSteps.clear();
+	_bytes.clear();
+	_index.clear();
+}
+
+// Compiles a list of fields (most significant first) into a layout and returns its id, or -1 with error set
+int InstructionEncoder::AddLayout(const vector<EncodeField>& fields, string& error)
+{
+	int totalBits = 0;
+	string key;
+
+	for (int f = 0; f < fields.size(); f++)
+	{
+		const EncodeField& field = fields[f];
+
+		if (field.width <= 0 || field.width > 32)
+		{
+			error = "field widths must be between 1 and 32 bits";
+			return -1;
+		}
+
+		totalBits += field.width;
+		key += to_string((int)field.source) + ":" + to_string(field.width) + (field.bigEndian ? "b" : "l") + (field.relative ? "r" : "") + "=" + to_string(field.constant) + ";";
+	}
+
+	if (totalBits == 0 || totalBits % 8 != 0 || totalBits > MAX_BITS)
+	{
+		error = "instruction layout must add up to a whole number of bytes (at most " + to_string(MAX_BITS) + " bits), not " + to_string(totalBits);
+		return -1;
+	}
+
+	auto found = _index.find(key);
+	if (found != _index.end())
+		return found->second;
+
+	_firstStep.push_back(_steps.size());
+	_numSteps.push_back(fields.size());
+	_bytes.push_back(totalBits / 8);
+
+	int bit = totalBits;
+	for (int f = 0; f < fields.size(); f++)
+	{
+		const EncodeField& field = fields[f];
+		bit -= field.width;
+
+		EncodeStep step;
+		step.source = field.source;
+		step.shift = (unsigned char)bit;
+		step.width = (unsigned char)field.width;
+		step.swapBytes = !field.bigEndian && field.width > 8 && field.width % 8 == 0 ? field.width / 8 : 0;
+		step.relative = field.relative;
+		step.mask = field.width == 64 ? ~0ULL : (1ULL << field.width) - 1;
+		step.constant = field.constant;
+		_steps.push_back(step);
+	}
+
+	_index[key] = _bytes.size() - 1;
+	return _bytes.size() - 1;
+}
+
+// Writes the encoded instruction to out (Size(layout) bytes). When checkRange is false (some of the values are still
+// placeholders for a forward reference) values that don't fit are truncated without complaint.
+bool InstructionEncoder::Encode(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned char* out, string& error)
+{
+	// The common shapes get a packer with the byte count known at compile time
+	switch (_bytes[layout])
+	{
+	case 1:		return Pack<1>(layout, opcode, args, pc, checkRange, out, error);
+	case 2:		return Pack<2>(layout, opcode, args, pc, checkRange, out, error);
+	case 3:		return Pack<3>(layout, opcode, args, pc, checkRange, out, error);
+	default:	return PackAny(layout, opcode, args, pc, checkRange, out, error);
+	}
+}
+
+// The instruction word with only the bits that are the same every time the opcode is used: the opcode, constants and
+// register operands. Fields of the operands marked as immediate are left at zero.
+unsigned long long InstructionEncoder::FixedBits(int layout, long long opcode, const long long* args, const bool* immediate)
+{
+	const EncodeStep* step = &_steps[_firstStep[layout]];
+	const EncodeStep* end = step + _numSteps[layout];
+	unsigned long long result = 0;
+
+	for (; step < end; step++)
+	{
+		long long value;
+		switch (step->source)
+		{
+		case FieldSource::Opcode:	value = opcode;								break;
+		case FieldSource::Arg0:		value = immediate[0] ? 0 : args[0];			break;
+		case FieldSource::Arg1:		value = immediate[1] ? 0 : args[1];			break;
+		default:					value = step->constant;						break;
+		}
+
+		result |= ((unsigned long long)value & step->mask) << step->shift;
+	}
+
+	return result;
+}
+
+// The bits that FixedBits() decides: those of every field but the immediate operands
+unsigned long long InstructionEncoder::FixedMask(int layout, const bool* immediate)
+{
+	const EncodeStep* step = &_steps[_firstStep[layout]];
+	const EncodeStep* end = step + _numSteps[layout];
+	unsigned long long result = 0;
+
+	for (; step < end; step++)
+	{
+		if ((step->source == FieldSource::Arg0 && immediate[0]) || (step->source == FieldSource::Arg1 && immediate[1]))
+			continue;
+
+		result |= step->mask << step->shift;
+	}
+
+	return result;
+}
+
+// The reverse of Encode(): reads the operands back out of an encoded instruction. Relative fields are turned back into
+// the address they point to.
+void InstructionEncoder::Decode(int layout, const unsigned char* in, int pc, long long* args)
+{
+	const EncodeStep* step = &_steps[_firstStep[layout]];
+	const EncodeStep* end = step + _numSteps[layout];
+	int bytes = _bytes[layout];
+
+	unsigned long long word = 0;
+	for (int b = 0; b < bytes; b++)
+		word = (word << 8) | in[b];
+
+	for (; step < end; step++)
+	{
+		if (step->source != FieldSource::Arg0 && step->source != FieldSource::Arg1)
+			continue;
+
+		unsigned long long bits = (word >> step->shift) & step->mask;
+
+		if (step->swapBytes)
+		{
+			unsigned long long swapped = 0;
+			for (int b = 0; b < step->swapBytes; b++)
+				swapped |= ((bits >> (8 * b)) & 0xFF) << (8 * (step->swapBytes - 1 - b));
+
+			bits = swapped;
+		}
+
+		long long value = (long long)bits;
+		if (step->relative)
+		{
+			// Offsets are signed
+			if (step->width < 64 && (bits >> (step->width - 1)) & 1)
+				value -= 1LL << step->width;
+
+			value += pc + bytes;
+		}
+
+		args[step->source == FieldSource::Arg0 ? 0 : 1] = value;
+	}
+}
+
+// The operand (0 or 1) that a layout stores relative to the next instruction, and its width in bits. Returns -1 if it
+// doesn't have one.
+int InstructionEncoder::GetRelativeArg(int layout, int* width)
+{
+	const EncodeStep* step = &_steps[_firstStep[layout]];
+	const EncodeStep* end = step + _numSteps[layout];
+
+	for (; step < end; step++)
+	{
+		if (step->relative && (step->source == FieldSource::Arg0 || step->source == FieldSource::Arg1))
+		{
+			*width = step->width;
+			return step->source == FieldSource::Arg0 ? 0 : 1;
+		}
+	}
+
+	return -1;
+}
+
+template <int Bytes>
+bool InstructionEncoder::Pack(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned char* out, string& error)
+{
+	unsigned long long word;
+	if (!Fill(layout, opcode, args, pc, checkRange, &word, error))
+		return false;
+
+	for (int b = 0; b < Bytes; b++)
+		out[b] = (unsigned char)(word >> (8 * (Bytes - 1 - b)));
+
+	return true;
+}
+
+bool InstructionEncoder::PackAny(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned char* out, string& error)
+{
+	unsigned long long word;
+	if (!Fill(layout, opcode, args, pc, checkRange, &word, error))
+		return false;
+
+	int bytes = _bytes[layout];
+	for (int b = 0; b < bytes; b++)
+		out[b] = (unsigned char)(word >> (8 * (bytes - 1 - b)));
+
+	return true;
+}
+
+bool InstructionEncoder::Fill(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned long long* word, string& error)
+{
+	const EncodeStep* step = &_steps[_firstStep[layout]];
+	const EncodeStep* end = step + _numSteps[layout];
+	unsigned long long result = 0;
+
+	for (; step < end; step++)
+	{
+		long long value;
+		switch (step->source)
+		{
+		case FieldSource::Opcode:	value = opcode;				break;
+		case FieldSource::Arg0:		value = args[0];			break;
+		case FieldSource::Arg1:		value = args[1];			break;
+		default:					value = step->constant;		break;
+		}
+
+		if (step->relative)
+			value -= pc + _bytes[layout];
+
+		if (checkRange)
+		{
+			// Relative offsets have to fit as signed values, everything else may be given either signed or unsigned
+			long long low = -(1LL << (step->width - 1));
+			long long high = step->relative ? (1LL << (step->width - 1)) - 1 : (long long)step->mask;
+
+			if (value < low || value > high)
+			{
+				error = (step->relative ? "offset " : "value ") + to_string(value) + " does not fit in " + to_string(step->width) + " bits";
+				return false;
+			}
+		}
+
+		unsigned long long bits = (unsigned long long)value & step->mask;
+
+		if (step->swapBytes)
+		{
+			unsigned long long swapped = 0;
+			for (int b = 0; b < step->swapBytes; b++)
+				swapped |= ((bits >> (8 * b)) & 0xFF) << (8 * (step->swapBytes - 1 - b));
+
+			bits = swapped;
+		}
+
+		result |= bits << step->shift;
+	}
+
+	*word = result;
+	return true;
+}
\ No newline at end of file
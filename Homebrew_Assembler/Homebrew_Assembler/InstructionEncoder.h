@@ -0,0 +1,61 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+// Where the bits of a field come from
+enum class FieldSource : unsigned char { Opcode, Arg0, Arg1, Constant };
+
+// One bit field of an instruction layout, as written in the architecture file
+struct EncodeField
+{
+	FieldSource source;
+	int width;			// in bits
+	bool bigEndian;		// byte order of fields that are a whole number of bytes wide (others are stored as is)
+	bool relative;		// value is stored relative to the address of the next instruction
+	long long constant;
+};
+
+// A compiled field: everything needed to drop a value into the instruction word with a shift and a mask
+struct EncodeStep
+{
+	FieldSource source;
+	unsigned char shift;
+	unsigned char width;
+	unsigned char swapBytes;	// number of bytes to reverse (0 if the field is stored as is)
+	bool relative;
+	unsigned long long mask;
+	long long constant;
+};
+
+class InstructionEncoder
+{
+public:
+	InstructionEncoder();
+
+	int AddLayout(const vector<EncodeField>& fields, string& error);
+	int NumLayouts() { return _bytes.size(); }
+	int Size(int layout) { return _bytes[layout]; }
+	bool Encode(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned char* out, string& error);
+	unsigned long long FixedBits(int layout, long long opcode, const long long* args, const bool* immediate);
+	unsigned long long FixedMask(int layout, const bool* immediate);
+	void Decode(int layout, const unsigned char* in, int pc, long long* args);
+	int GetRelativeArg(int layout, int* width);
+
+	static constexpr int MAX_BITS = 64;
+
+private:
+	template <int Bytes> bool Pack(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned char* out, string& error);
+	bool PackAny(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned char* out, string& error);
+	bool Fill(int layout, long long opcode, const long long* args, int pc, bool checkRange, unsigned long long* word, string& error);
+
+	// Layouts are stored back to back as runs of steps. Identical layouts are only compiled once, since most opcodes of
+	// an architecture share the same handful of shapes.
+	vector<EncodeStep> _steps;
+	vector<int> _firstStep;
+	vector<int> _numSteps;
+	vector<int> _bytes;
+	unordered_map<string, int> _index;
+};
\ No newline at end of file
@@ -0,0 +1,310 @@
+#include "JsonValue.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+
+// Messages nest a few levels deep at most, so anything deeper than this is treated as broken
+static const int MAX_JSON_DEPTH = 64;
+
+JsonValue::JsonValue()
+{
+	type = JsonType::Null;
+	boolean = false;
+	number = 0;
+	text.clear();
+	items.clear();
+	members.clear();
+}
+
+bool JsonValue::Parse(const string& text, JsonValue& value)
+{
+	const char* p = text.c_str();
+	value = JsonValue();
+
+	if (!ParseValue(p, value, 0))
+		return false;
+
+	while (isspace((unsigned char)*p))
+		p++;
+
+	return *p == 0;
+}
+
+const JsonValue& JsonValue::operator[](const char* key) const
+{
+	static const JsonValue none;
+
+	for (const auto& member : members)
+	{
+		if (member.first == key)
+			return member.second;
+	}
+
+	return none;
+}
+
+const JsonValue& JsonValue::operator[](int i) const
+{
+	static const JsonValue none;
+	return i >= 0 && i < items.size() ? items[i] : none;
+}
+
+string JsonValue::Quote(const string& text)
+{
+	string quoted = "\"";
+
+	for (unsigned char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			quoted += '\\';
+			quoted += c;
+		}
+		else if (c == '\n')
+			quoted += "\\n";
+		else if (c == '\r')
+			quoted += "\\r";
+		else if (c == '\t')
+			quoted += "\\t";
+		else if (c < 0x20)
+		{
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			quoted += escape;
+		}
+		else
+			quoted += c;
+	}
+
+	return quoted + "\"";
+}
+
+string JsonValue::Write() const
+{
+	switch (type)
+	{
+	case JsonType::Bool:
+		return boolean ? "true" : "false";
+
+	case JsonType::Number:
+	{
+		char digits[32];
+		if (number == floor(number) && fabs(number) < 1e15)
+			snprintf(digits, sizeof(digits), "%lld", (long long)number);
+		else
+			snprintf(digits, sizeof(digits), "%.17g", number);
+		return digits;
+	}
+
+	case JsonType::String:
+		return Quote(text);
+
+	case JsonType::Array:
+	{
+		string out = "[";
+		for (int i = 0; i < items.size(); i++)
+			out += (i > 0 ? "," : "") + items[i].Write();
+		return out + "]";
+	}
+
+	case JsonType::Object:
+	{
+		string out = "{";
+		for (int i = 0; i < members.size(); i++)
+			out += (i > 0 ? "," : "") + Quote(members[i].first) + ":" + members[i].second.Write();
+		return out + "}";
+	}
+
+	default:
+		return "null";
+	}
+}
+
+// Reads a string that starts at the opening quote. \u escapes are written out as UTF-8.
+bool JsonValue::ParseString(const char*& p, string& text)
+{
+	text.clear();
+	p++;
+
+	while (*p != '"')
+	{
+		if (*p == 0)
+			return false;
+
+		if (*p != '\\')
+		{
+			text += *p++;
+			continue;
+		}
+
+		p++;
+		switch (*p)
+		{
+		case '"': case '\\': case '/': text += *p; break;
+		case 'b': text += '\b'; break;
+		case 'f': text += '\f'; break;
+		case 'n': text += '\n'; break;
+		case 'r': text += '\r'; break;
+		case 't': text += '\t'; break;
+		case 'u':
+		{
+			char hex[5] = { 0 };
+			for (int i = 0; i < 4; i++)
+			{
+				if (!isxdigit((unsigned char)p[i + 1]))
+					return false;
+				hex[i] = p[i + 1];
+			}
+
+			unsigned int code = strtoul(hex, NULL, 16);
+			p += 4;
+
+			// The second half of a surrogate pair follows as another \u escape
+			if (code >= 0xD800 && code < 0xDC00 && p[1] == '\\' && p[2] == 'u')
+			{
+				for (int i = 0; i < 4; i++)
+				{
+					if (!isxdigit((unsigned char)p[i + 3]))
+						return false;
+					hex[i] = p[i + 3];
+				}
+
+				unsigned int low = strtoul(hex, NULL, 16);
+				if (low >= 0xDC00 && low < 0xE000)
+				{
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					p += 6;
+				}
+			}
+
+			if (code < 0x80)
+				text += (char)code;
+			else if (code < 0x800)
+			{
+				text += (char)(0xC0 | code >> 6);
+				text += (char)(0x80 | (code & 0x3F));
+			}
+			else if (code < 0x10000)
+			{
+				text += (char)(0xE0 | code >> 12);
+				text += (char)(0x80 | (code >> 6 & 0x3F));
+				text += (char)(0x80 | (code & 0x3F));
+			}
+			else
+			{
+				text += (char)(0xF0 | code >> 18);
+				text += (char)(0x80 | (code >> 12 & 0x3F));
+				text += (char)(0x80 | (code >> 6 & 0x3F));
+				text += (char)(0x80 | (code & 0x3F));
+			}
+			break;
+		}
+		default:
+			return false;
+		}
+
+		p++;
+	}
+
+	p++;
+	return true;
+}
+
+bool JsonValue::ParseValue(const char*& p, JsonValue& value, int depth)
+{
+	if (depth > MAX_JSON_DEPTH)
+		return false;
+
+	while (isspace((unsigned char)*p))
+		p++;
+
+	if (*p == '"')
+	{
+		value.type = JsonType::String;
+		return ParseString(p, value.text);
+	}
+
+	if (*p == '{' || *p == '[')
+	{
+		bool object = *p == '{';
+		char close = object ? '}' : ']';
+		value.type = object ? JsonType::Object : JsonType::Array;
+		p++;
+
+		while (isspace((unsigned char)*p))
+			p++;
+
+		if (*p == close)
+		{
+			p++;
+			return true;
+		}
+
+		while (true)
+		{
+			JsonValue item;
+
+			if (object)
+			{
+				string key;
+				while (isspace((unsigned char)*p))
+					p++;
+
+				if (*p != '"' || !ParseString(p, key))
+					return false;
+
+				while (isspace((unsigned char)*p))
+					p++;
+
+				if (*p++ != ':' || !ParseValue(p, item, depth + 1))
+					return false;
+
+				value.members.push_back({ key, item });
+			}
+			else
+			{
+				if (!ParseValue(p, item, depth + 1))
+					return false;
+
+				value.items.push_back(item);
+			}
+
+			while (isspace((unsigned char)*p))
+				p++;
+
+			if (*p == close)
+			{
+				p++;
+				return true;
+			}
+
+			if (*p++ != ',')
+				return false;
+		}
+	}
+
+	if (!strncmp(p, "true", 4) || !strncmp(p, "false", 5))
+	{
+		value.type = JsonType::Bool;
+		value.boolean = *p == 't';
+		p += value.boolean ? 4 : 5;
+		return true;
+	}
+
+	if (!strncmp(p, "null", 4))
+	{
+		p += 4;
+		return true;
+	}
+
+	char* end = NULL;
+	value.number = strtod(p, &end);
+	if (end == p)
+		return false;
+
+	value.type = JsonType::Number;
+	p = end;
+	return true;
+}
\ No newline at end of file
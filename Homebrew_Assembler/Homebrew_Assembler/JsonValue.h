@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum class JsonType { Null, Bool, Number, String, Array, Object };
+
+// Just enough JSON for the language server's messages. Objects keep their members in the order they were read, and a
+// member or item that isn't there reads as null.
+class JsonValue
+{
+public:
+	JsonValue();
+
+	static bool Parse(const string& text, JsonValue& value);
+	static string Quote(const string& text);
+
+	const JsonValue& operator[](const char* key) const;
+	const JsonValue& operator[](int i) const;
+	bool IsNull() const { return type == JsonType::Null; }
+	int Size() const { return items.size(); }
+	int AsInt() const { return type == JsonType::Number ? (int)number : 0; }
+	const string& AsString() const { return text; }
+	string Write() const;
+
+	JsonType type;
+	bool boolean;
+	double number;
+	string text;
+	vector<JsonValue> items;
+	vector<pair<string, JsonValue>> members;
+
+private:
+	static bool ParseValue(const char*& p, JsonValue& value, int depth);
+	static bool ParseString(const char*& p, string& text);
+};
\ No newline at end of file
@@ -4,9 +4,14 @@ LabelDictionary::LabelDictionary()
 {
 	currLabel = "";
 	currValue = 0;
+	_evaluations = 0;
 
 	_labels.clear();
 	_values.clear();
+	_exprs.clear();
+	_exprPCs.clear();
+	_states.clear();
+	_index.clear();
 }
 
 int LabelDictionary::NumLabels()
@@ -16,51 +21,165 @@ int LabelDictionary::NumLabels()
 
 void LabelDictionary::AddCurrentEntry()
 {
-	_labels.push_back(currLabel);
-	_values.push_back(currValue);
+	Add(currLabel, currValue);
 }
 
-void LabelDictionary::Add(const string& newLabel, int newVal)
+void LabelDictionary::Add(const string& newLabel, long long newVal)
 {
 	_labels.push_back(newLabel);
 	_values.push_back(newVal);
+	_exprs.push_back(-1);
+	_exprPCs.push_back(0);
+	_states.push_back(0);
+
+	// The first definition of a name is the one that is found (as it always has been)
+	_index.emplace(newLabel, _labels.size() - 1);
 
 	currLabel = newLabel;
 	currValue = newVal;
 }
 
+bool LabelDictionary::AddExpression(const string& newLabel, const string& expression, int pc, string& error)
+{
+	int expr = _expressions.Compile(expression, error);
+	if (expr < 0)
+		return false;
+
+	Add(newLabel, 0);
+
+	// Constant expressions don't need to wait for anything
+	int i = _labels.size() - 1;
+	_exprs[i] = expr;
+	_exprPCs[i] = pc;
+	_states[i] = 1;
+
+	if (_expressions.IsConstant(expr))
+		Evaluate(i);
+
+	currValue = _values[i];
+	return true;
+}
+
 bool LabelDictionary::GetLabel(const char* c)
 {
-	for (int i = 0; i < _labels.size(); i++)
-	{
-		const char* lbl = _labels[i].c_str();
+	int i = Find(c);
+	if (i < 0)
+		return false;
 
-		if (!strcmp(c, lbl))
-		{
-			currLabel = lbl;
-			currValue = _values[i];
+	if (_states[i] == 1)
+		Evaluate(i);
 
-			return true;
-		}
-	}
+	currLabel = _labels[i];
+	currValue = _values[i];
 
-	return false;
+	return true;
 }
 
 int LabelDictionary::GetLabelValue(const char* c)
 {
-	for (int i = 0; i < _labels.size(); i++)
+	long long value;
+	if (!Resolve(c, &value))
+		return -1;
+
+	return (int)value;
+}
+
+// Returns false if the name isn't defined or its definition can't be evaluated (yet)
+bool LabelDictionary::Resolve(const string& name, long long* value)
+{
+	int i = Find(name);
+	if (i < 0)
+		return false;
+
+	if (_states[i] != 0 && !Evaluate(i))
+		return false;
+
+	*value = _values[i];
+	return true;
+}
+
+int LabelDictionary::Find(const string& name)
+{
+	auto found = _index.find(name);
+	if (found == _index.end())
+		return -1;
+
+	return found->second;
+}
+
+bool LabelDictionary::Evaluate(int i)
+{
+	if (_states[i] == 2)
+		return false;
+
+	_states[i] = 2;
+	_evaluations++;
+
+	long long value;
+	ExprResult result = _expressions.Evaluate(_exprs[i], _exprPCs[i],
+		[this](int symbol, long long* v) { return Resolve(_expressions.GetSymbolName(symbol), v); }, &value, nullptr);
+
+	if (result != ExprResult::Ok)
 	{
-		const char* lbl = _labels[i].c_str();
+		// Leave it pending, a later definition may let it resolve
+		_states[i] = 1;
+		return false;
+	}
+
+	_values[i] = value;
+	_states[i] = 0;
 
-		if (!strcmp(c, lbl))
+	return true;
+}
+
+// Explains why a name can't be resolved: path is filled with the chain of definitions that leads to the problem, ending in
+// either a name that isn't defined or a name that is already on the path (a definition that depends on itself). Returns
+// false if every name the definition uses can be resolved.
+bool LabelDictionary::FindUnresolved(const string& name, vector<string>& path)
+{
+	path.push_back(name);
+
+	int i = Find(name);
+	if (i < 0)
+		return true;
+
+	if (_states[i] != 0)
+	{
+		for (int k = 0; k + 1 < path.size(); k++)
 		{
-			//currLabel = lbl;
-			//currValue = _values[i];
+			if (path[k] == name)
+				return true;
+		}
+
+		vector<int> symbols;
+		_expressions.GetSymbols(_exprs[i], symbols);
 
-			return _values[i];
+		for (int symbol : symbols)
+		{
+			if (FindUnresolved(_expressions.GetSymbolName(symbol), path))
+				return true;
 		}
 	}
 
-	return -1;
+	path.pop_back();
+	return false;
+}
+
+// For the language server: the labels from first up to end that lie past address move by delta, as does the current address
+// of the definitions made there, and every definition is worked out again when it is next needed
+void LabelDictionary::Shift(int first, int end, long long address, int delta)
+{
+	for (int i = first; i < end; i++)
+	{
+		if (_exprs[i] < 0 && _values[i] > address)
+			_values[i] += delta;
+		else if (_exprs[i] >= 0 && _exprPCs[i] > address)
+			_exprPCs[i] += delta;
+	}
+
+	for (int i = 0; i < _labels.size(); i++)
+	{
+		if (_exprs[i] >= 0)
+			_states[i] = 1;
+	}
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include "Expression.h"
 
 using namespace std;
 
@@ -11,14 +13,33 @@ public:
 	
 	int NumLabels();
 	void AddCurrentEntry();
-	void Add(const string& newLabel, int newVal);
+	void Add(const string& newLabel, long long newVal);
+	bool AddExpression(const string& newLabel, const string& expression, int pc, string& error);
 	bool GetLabel(const char* c);
 	int GetLabelValue(const char* c);
+	bool Resolve(const string& name, long long* value);
+	bool IsDefined(const string& name) { return Find(name) >= 0; }
+	bool FindUnresolved(const string& name, vector<string>& path);
+	void Shift(int first, int end, long long address, int delta);
+	int NumEvaluations() { return _evaluations; }
 
 	string currLabel;
 	int currValue;
 
 private:
+	int Find(const string& name);
+	bool Evaluate(int i);
+
 	vector<string> _labels;
-	vector<int> _values;
+	vector<long long> _values;		// 64 bits wide so the same class can hold control words
+
+	// Labels defined by an expression are evaluated the first time they are needed and then memoized.
+	// _states is 0 once the value is known, 1 while it still has to be evaluated and 2 while it is being
+	// evaluated (seeing that again means the definition depends on itself).
+	vector<int> _exprs;
+	vector<int> _exprPCs;
+	vector<char> _states;
+	ExpressionPool _expressions;
+	unordered_map<string, int> _index;
+	int _evaluations;
 };
\ No newline at end of file
@@ -0,0 +1,632 @@
+#include "LanguageServer.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+// LSP error code for a request the server doesn't know
+static const int METHOD_NOT_FOUND = -32601;
+
+// The parser prints its errors, so while it runs stdout goes to a temporary file instead of the editor
+static int DuplicateFd(int fd)
+{
+#ifdef _WIN32
+	return _dup(fd);
+#else
+	return dup(fd);
+#endif
+}
+
+static void RedirectFd(int from, int to)
+{
+#ifdef _WIN32
+	_dup2(from, to);
+#else
+	dup2(from, to);
+#endif
+}
+
+static long SeekFd(int fd, long offset, int origin)
+{
+#ifdef _WIN32
+	return _lseek(fd, offset, origin);
+#else
+	return (long)lseek(fd, offset, origin);
+#endif
+}
+
+static int ReadFd(int fd, char* data, int length)
+{
+#ifdef _WIN32
+	return _read(fd, data, length);
+#else
+	return (int)read(fd, data, length);
+#endif
+}
+
+LanguageServer::LanguageServer()
+{
+	_in = stdin;
+	_out = NULL;
+	_capture = NULL;
+	_documents.clear();
+	_sources.clear();
+	_programs.clear();
+	_shutdown = false;
+	_assemblies = 0;
+	_patches = 0;
+}
+
+LanguageServer::~LanguageServer()
+{
+	if (_out != NULL)
+		fclose(_out);
+	if (_capture != NULL)
+		fclose(_capture);
+}
+
+int LanguageServer::Run()
+{
+	fflush(stdout);
+
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_out = _fdopen(DuplicateFd(_fileno(stdout)), "wb");
+#else
+	_out = fdopen(DuplicateFd(fileno(stdout)), "wb");
+#endif
+
+	_capture = tmpfile();
+	if (_out == NULL || _capture == NULL)
+		return 1;
+
+	RedirectFd(fileno(_capture), fileno(stdout));
+
+	string body;
+	while (ReadMessage(body))
+	{
+		JsonValue message;
+		if (!JsonValue::Parse(body, message))
+			continue;
+
+		int exitCode = 0;
+		if (!Handle(message, &exitCode))
+			return exitCode;
+	}
+
+	return _shutdown ? 0 : 1;
+}
+
+// Headers end with an empty line. Only Content-Length matters.
+bool LanguageServer::ReadMessage(string& body)
+{
+	char header[256];
+	int length = -1;
+
+	while (fgets(header, sizeof(header), _in) != NULL)
+	{
+		if (!strncmp(header, "\r\n", 2) || header[0] == '\n')
+		{
+			if (length < 0)
+				continue;
+
+			body.resize(length);
+			return fread(&body[0], 1, length, _in) == (size_t)length;
+		}
+
+		if (!strncmp(header, "Content-Length:", 15))
+			length = atoi(header + 15);
+	}
+
+	return false;
+}
+
+void LanguageServer::Send(const string& body)
+{
+	fprintf(_out, "Content-Length: %d\r\n\r\n", (int)body.size());
+	fwrite(body.data(), 1, body.size(), _out);
+	fflush(_out);
+}
+
+void LanguageServer::Reply(const JsonValue& id, const string& result)
+{
+	Send("{\"jsonrpc\":\"2.0\",\"id\":" + id.Write() + ",\"result\":" + result + "}");
+}
+
+void LanguageServer::ReplyError(const JsonValue& id, int code, const string& message)
+{
+	Send("{\"jsonrpc\":\"2.0\",\"id\":" + id.Write() + ",\"error\":{\"code\":" + to_string(code) + ",\"message\":" + JsonValue::Quote(message) + "}}");
+}
+
+// Returns false once the editor asks the server to exit
+bool LanguageServer::Handle(const JsonValue& message, int* exitCode)
+{
+	const string& method = message["method"].AsString();
+	const JsonValue& id = message["id"];
+	const JsonValue& params = message["params"];
+
+	if (method == "initialize")
+	{
+		Reply(id, "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},\"hoverProvider\":true,\"definitionProvider\":true},"
+			"\"serverInfo\":{\"name\":\"Homebrew Assembler\",\"version\":\"1.0\"}}");
+	}
+	else if (method == "textDocument/didOpen")
+		OpenDocument(params);
+	else if (method == "textDocument/didChange")
+		ChangeDocument(params);
+	else if (method == "textDocument/didClose")
+		CloseDocument(params);
+	else if (method == "textDocument/hover")
+		Reply(id, Hover(params));
+	else if (method == "textDocument/definition")
+		Reply(id, Definition(params));
+	else if (method == "homebrew/symbol")
+		Reply(id, QuerySymbol(params));
+	else if (method == "homebrew/stats")
+		Reply(id, "{\"assemblies\":" + to_string(_assemblies) + ",\"patches\":" + to_string(_patches) + "}");
+	else if (method == "shutdown")
+	{
+		_shutdown = true;
+		Reply(id, "null");
+	}
+	else if (method == "exit")
+	{
+		*exitCode = _shutdown ? 0 : 1;
+		return false;
+	}
+	else if (!id.IsNull())
+		ReplyError(id, METHOD_NOT_FOUND, "Unknown method " + method);
+
+	return true;
+}
+
+void LanguageServer::OpenDocument(const JsonValue& params)
+{
+	const JsonValue& document = params["textDocument"];
+	string path = UriToPath(document["uri"].AsString());
+
+	ServerDocument& open = _documents[path];
+	open.uri = document["uri"].AsString();
+	SplitLines(document["text"].AsString(), open.lines);
+	open.changed = true;
+
+	Assemble(path);
+}
+
+// Edits come as ranges of the old text and what replaces them, applied one after the other. Only an edit that stays
+// within one line can be patched in; the line is assembled on its own once all of them have been applied.
+void LanguageServer::ChangeDocument(const JsonValue& params)
+{
+	string path = UriToPath(params["textDocument"]["uri"].AsString());
+	auto found = _documents.find(path);
+	if (found == _documents.end())
+		return;
+
+	ServerDocument& document = found->second;
+	const JsonValue& changes = params["contentChanges"];
+	int patchLine = -1;
+	bool patchable = true;
+
+	for (int c = 0; c < changes.Size(); c++)
+	{
+		const JsonValue& change = changes[c];
+		const JsonValue& range = change["range"];
+
+		if (range.IsNull())
+		{
+			SplitLines(change["text"].AsString(), document.lines);
+			patchable = false;
+			continue;
+		}
+
+		int last = document.lines.size() - 1;
+		int startLine = min(max(range["start"]["line"].AsInt(), 0), last);
+		int endLine = min(max(range["end"]["line"].AsInt(), startLine), last);
+		string& start = document.lines[startLine];
+		string& end = document.lines[endLine];
+		size_t startChar = min((size_t)max(range["start"]["character"].AsInt(), 0), start.size());
+		size_t endChar = min((size_t)max(range["end"]["character"].AsInt(), 0), end.size());
+
+		vector<string> inserted;
+		SplitLines(start.substr(0, startChar) + change["text"].AsString() + end.substr(endChar), inserted);
+
+		// Most edits stay within a line, and moving every line after it would cost more than the rest of the edit
+		if (startLine == endLine && inserted.size() == 1)
+			document.lines[startLine].swap(inserted[0]);
+		else
+		{
+			document.lines.erase(document.lines.begin() + startLine, document.lines.begin() + endLine + 1);
+			document.lines.insert(document.lines.begin() + startLine, inserted.begin(), inserted.end());
+		}
+
+		if (startLine != endLine || inserted.size() != 1 || (patchLine >= 0 && patchLine != startLine))
+			patchable = false;
+
+		patchLine = startLine;
+	}
+
+	document.changed = true;
+
+	if (patchable && patchLine >= 0 && PatchLine(path, patchLine))
+		return;
+
+	Assemble(path);
+}
+
+void LanguageServer::CloseDocument(const JsonValue& params)
+{
+	string path = UriToPath(params["textDocument"]["uri"].AsString());
+
+	// The editor keeps showing the diagnostics of a closed document unless they are cleared
+	auto program = _programs.find(path);
+	if (program != _programs.end() && program->second.published)
+		PublishDiagnostics(path, {});
+
+	_programs.erase(path);
+	_documents.erase(path);
+	_sources.erase(path);
+}
+
+// The parser says which lines and names the patch changed, so only those entries of the index are brought up to date, and
+// the diagnostics stay the way they were (there weren't any, or the program couldn't be patched)
+bool LanguageServer::PatchLine(const string& path, int line)
+{
+	auto found = _programs.find(path);
+	if (found == _programs.end() || found->second.fileId < 0)
+		return false;
+
+	ServerProgram& program = found->second;
+
+	BeginCapture();
+	bool patched = program.parser->PatchLine(path, line, _documents[path].lines);
+	EndCapture();
+
+	if (!patched)
+		return false;
+
+	program.parser->UpdateIndex(program.index);
+	_patches++;
+	return true;
+}
+
+void LanguageServer::Assemble(const string& path)
+{
+	// The parser reads the open documents as the editor has them
+	for (auto& document : _documents)
+	{
+		if (!document.second.changed)
+			continue;
+
+		string& text = _sources[document.first];
+		text.clear();
+		for (const string& line : document.second.lines)
+			text += line + "\n";
+
+		document.second.changed = false;
+	}
+
+	ServerProgram& program = _programs[path];
+	program.parser = make_unique<Parser>();
+	program.parser->SetParseMode(ParseMode::Assembler);
+	program.parser->SetOutMode(OutMode::Brief);
+	program.parser->SetTestMode(true);
+	program.parser->SetSources(&_sources);
+
+	BeginCapture();
+	program.parser->Parse(path.c_str());
+	program.parser->BuildIndex(program.index);
+	string output = EndCapture();
+
+	auto file = find(program.index.files.begin(), program.index.files.end(), path);
+	program.fileId = file != program.index.files.end() ? file - program.index.files.begin() : -1;
+	_assemblies++;
+
+	vector<ServerDiagnostic> diagnostics;
+	ReadDiagnostics(output, diagnostics);
+	PublishDiagnostics(path, diagnostics);
+}
+
+// A document only gets diagnostics of its own program. Errors in the files it reads (the architecture, or an included
+// file) are shown on its first line, with the file and line they are on.
+void LanguageServer::PublishDiagnostics(const string& path, const vector<ServerDiagnostic>& diagnostics)
+{
+	string list;
+
+	for (const ServerDiagnostic& diagnostic : diagnostics)
+	{
+		bool here = diagnostic.file == path;
+		int line = here ? max(diagnostic.line, 0) : 0;
+		string message = diagnostic.message;
+		if (!here && !diagnostic.file.empty())
+			message = diagnostic.file + (diagnostic.line >= 0 ? " (line " + to_string(diagnostic.line + 1) + ")" : "") + ": " + message;
+
+
+		list += (list.empty() ? "" : ",") + string("{\"range\":{\"start\":{\"line\":") + to_string(line) + ",\"character\":0},\"end\":{\"line\":" + to_string(line) +
+			",\"character\":" + to_string(here && line < _documents[path].lines.size() ? _documents[path].lines[line].size() : 0) + "}},\"severity\":1,\"source\":\"hba\",\"message\":" +
+			JsonValue::Quote(message) + "}";
+	}
+
+	Send("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":" + JsonValue::Quote(_documents[path].uri) + ",\"diagnostics\":[" + list + "]}}");
+
+	auto program = _programs.find(path);
+	if (program != _programs.end())
+		program->second.published = !diagnostics.empty();
+}
+
+string LanguageServer::Hover(const JsonValue& params)
+{
+	string path;
+	ServerProgram* program = FindProgram(params, path);
+	if (program == NULL)
+		return "null";
+
+	int line = params["position"]["line"].AsInt();
+	string word = WordAt(path, line, params["position"]["character"].AsInt());
+	char text[256];
+
+	// A label or symbol shows its value, anywhere else the line shows what it assembled to
+	auto symbol = program->index.symbols.find(word);
+	if (symbol != program->index.symbols.end())
+	{
+		const IndexedSymbol& s = symbol->second;
+
+		if (!s.known)
+			snprintf(text, sizeof(text), "**%s** (symbol): value unknown", word.c_str());
+		else if (s.label)
+			snprintf(text, sizeof(text), "**%s** (label) = $%04llX, bank %d", word.c_str(), s.value, s.bank);
+		else
+			snprintf(text, sizeof(text), "**%s** (symbol) = %lld ($%llX)", word.c_str(), s.value, s.value);
+	}
+	else
+	{
+		auto bytes = program->index.lines.find(SourceIndex::LineKey(program->fileId, line));
+		if (program->fileId < 0 || bytes == program->index.lines.end())
+			return "null";
+
+		const IndexedLine& l = bytes->second;
+		int length = snprintf(text, sizeof(text), "`$%04X:", l.address);
+		for (int b = 0; b < l.bytes.size() && b < 32; b++)
+			length += snprintf(text + length, sizeof(text) - length, " %02X", l.bytes[b]);
+
+		snprintf(text + length, sizeof(text) - length, "%s` (%d bytes)", l.bytes.size() > 32 ? " ..." : "", (int)l.bytes.size());
+	}
+
+	return string("{\"contents\":{\"kind\":\"markdown\",\"value\":") + JsonValue::Quote(text) + "}}";
+}
+
+string LanguageServer::Definition(const JsonValue& params)
+{
+	string path;
+	ServerProgram* program = FindProgram(params, path);
+	if (program == NULL)
+		return "null";
+
+	string word = WordAt(path, params["position"]["line"].AsInt(), params["position"]["character"].AsInt());
+	auto symbol = program->index.symbols.find(word);
+	if (symbol == program->index.symbols.end() || symbol->second.fileId < 0)
+		return "null";
+
+	return Location(*program, symbol->second.fileId, symbol->second.line);
+}
+
+// homebrew/symbol: { textDocument, name } -> the symbol's value and where it was defined, or null
+string LanguageServer::QuerySymbol(const JsonValue& params)
+{
+	string path;
+	ServerProgram* program = FindProgram(params, path);
+	if (program == NULL)
+		return "null";
+
+	const string& name = params["name"].AsString();
+	auto symbol = program->index.symbols.find(name);
+	if (symbol == program->index.symbols.end())
+		return "null";
+
+	const IndexedSymbol& s = symbol->second;
+	return "{\"name\":" + JsonValue::Quote(name) + ",\"value\":" + (s.known ? to_string(s.value) : "null") + ",\"label\":" + (s.label ? "true" : "false") +
+		",\"bank\":" + to_string(s.bank) + ",\"location\":" + (s.fileId >= 0 ? Location(*program, s.fileId, s.line) : "null") + "}";
+}
+
+ServerProgram* LanguageServer::FindProgram(const JsonValue& params, string& path)
+{
+	path = UriToPath(params["textDocument"]["uri"].AsString());
+	auto found = _programs.find(path);
+	return found != _programs.end() ? &found->second : NULL;
+}
+
+// Labels and symbols are made of letters, digits, '_' and '.'
+string LanguageServer::WordAt(const string& path, int line, int character)
+{
+	const vector<string>& lines = _documents[path].lines;
+	if (line < 0 || line >= lines.size())
+		return "";
+
+	const string& text = lines[line];
+	auto isWord = [&](int i) { return i >= 0 && i < text.size() && (isalnum((unsigned char)text[i]) || text[i] == '_' || text[i] == '.'); };
+
+	int start = min(max(character, 0), (int)text.size());
+	int end = start;
+
+	// The cursor can be just after the word
+	if (!isWord(start) && isWord(start - 1))
+		start--, end--;
+
+	while (isWord(start - 1))
+		start--;
+	while (isWord(end))
+		end++;
+
+	return text.substr(start, end - start);
+}
+
+string LanguageServer::Location(ServerProgram& program, int fileId, int line)
+{
+	const string& file = program.index.files[fileId];
+	auto open = _documents.find(file);
+	string uri = open != _documents.end() ? open->second.uri : PathToUri(file);
+
+	return "{\"uri\":" + JsonValue::Quote(uri) + ",\"range\":{\"start\":{\"line\":" + to_string(line) + ",\"character\":0},\"end\":{\"line\":" + to_string(line) + ",\"character\":0}}}";
+}
+
+void LanguageServer::BeginCapture()
+{
+	fflush(stdout);
+	SeekFd(fileno(stdout), 0, SEEK_SET);
+}
+
+// What was printed since BeginCapture(). The file is written over from the start each time.
+string LanguageServer::EndCapture()
+{
+	fflush(stdout);
+
+	int fd = fileno(stdout);
+	long length = SeekFd(fd, 0, SEEK_CUR);
+	string output(max(length, 0L), 0);
+
+	SeekFd(fd, 0, SEEK_SET);
+	for (long done = 0; done < length; )
+	{
+		int chunk = ReadFd(fd, &output[done], (int)(length - done));
+		if (chunk <= 0)
+		{
+			output.resize(done);
+			break;
+		}
+
+		done += chunk;
+	}
+
+	SeekFd(fd, 0, SEEK_SET);
+	return output;
+}
+
+// Errors look like
+//   !!! CRITICAL ERROR in Line #12 of "file" !!!
+//     -> What went wrong! Parsing cannot continue until fixed
+// maybe followed by more indented lines. A program assembled twice can print the same error twice.
+void LanguageServer::ReadDiagnostics(const string& output, vector<ServerDiagnostic>& diagnostics)
+{
+	const char* prefix = "!!! CRITICAL ERROR in ";
+	const char* suffix = " Parsing cannot continue until fixed";
+	vector<string> lines;
+	SplitLines(output, lines);
+
+	diagnostics.clear();
+	for (int l = 0; l < lines.size(); l++)
+	{
+		const string& text = lines[l];
+		ServerDiagnostic diagnostic = { "", -1, "" };
+
+		if (!text.compare(0, strlen(prefix), prefix))
+		{
+			size_t quote = text.find('"');
+			size_t close = text.rfind('"');
+			if (quote == string::npos || close == quote)
+				continue;
+
+			diagnostic.file = text.substr(quote + 1, close - quote - 1);
+			if (!text.compare(strlen(prefix), 6, "Line #"))
+				diagnostic.line = atoi(text.c_str() + strlen(prefix) + 6) - 1;
+
+			for (; l + 1 < lines.size() && !lines[l + 1].compare(0, 2, "  ") && !lines[l + 1].empty(); l++)
+			{
+				string part = lines[l + 1];
+				part.erase(0, part.find_first_not_of(" ->"));
+
+				size_t end = part.find(suffix);
+				if (end != string::npos)
+					part.erase(end > 0 && part[end - 1] == '!' ? end - 1 : end);
+
+				diagnostic.message += (diagnostic.message.empty() ? "" : "\n") + part;
+			}
+		}
+		else if (text == "Unable to open file!" || !text.compare(0, 15, "ROM not written"))
+			diagnostic.message = text;
+		else
+			continue;
+
+		bool seen = false;
+		for (const ServerDiagnostic& d : diagnostics)
+			seen = seen || (d.file == diagnostic.file && d.line == diagnostic.line && d.message == diagnostic.message);
+
+		if (!seen)
+			diagnostics.push_back(diagnostic);
+	}
+}
+
+// The editor counts lines from 0, with one more line than there are line breaks
+void LanguageServer::SplitLines(const string& text, vector<string>& lines)
+{
+	lines.clear();
+
+	size_t start = 0;
+	while (true)
+	{
+		size_t end = text.find('\n', start);
+		string line = text.substr(start, end == string::npos ? string::npos : end - start);
+
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		lines.push_back(line);
+		if (end == string::npos)
+			break;
+
+		start = end + 1;
+	}
+}
+
+// file:///C:/dir/x.asm is C:/dir/x.asm on Windows and file:///dir/x.asm is /dir/x.asm elsewhere, with %xx escapes decoded
+string LanguageServer::UriToPath(const string& uri)
+{
+	string path = uri.compare(0, 7, "file://") ? uri : uri.substr(7);
+
+#ifdef _WIN32
+	if (path.size() > 2 && path[0] == '/' && path[2] == ':')
+		path.erase(0, 1);
+#endif
+
+	string decoded;
+	for (size_t i = 0; i < path.size(); i++)
+	{
+		if (path[i] == '%' && i + 2 < path.size() && isxdigit((unsigned char)path[i + 1]) && isxdigit((unsigned char)path[i + 2]))
+		{
+			decoded += (char)strtol(path.substr(i + 1, 2).c_str(), NULL, 16);
+			i += 2;
+		}
+		else
+			decoded += path[i];
+	}
+
+	return decoded;
+}
+
+string LanguageServer::PathToUri(const string& path)
+{
+	string uri = "file://";
+	if (!path.empty() && path[0] != '/')
+		uri += '/';
+
+	for (unsigned char c : path)
+	{
+		if (isalnum(c) || strchr("/-_.~:", c))
+			uri += c;
+		else if (c == '\\')
+			uri += '/';
+		else
+		{
+			char escape[4];
+			snprintf(escape, sizeof(escape), "%%%02X", c);
+			uri += escape;
+		}
+	}
+
+	return uri;
+}
\ No newline at end of file
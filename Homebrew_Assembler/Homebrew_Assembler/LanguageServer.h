@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "JsonValue.h"
+#include "Parser.h"
+
+using namespace std;
+
+// A document the editor has open, as the editor has it
+struct ServerDocument
+{
+	string uri;
+	vector<string> lines;
+	bool changed;		// the lines differ from the text the parser was last given
+};
+
+// The last assembly of an open document, kept to answer queries from and to patch edited lines into
+struct ServerProgram
+{
+	unique_ptr<Parser> parser;
+	SourceIndex index;
+	int fileId;			// the document's id in the index, or -1
+	bool published;		// the document was last sent some diagnostics
+};
+
+// An error the assembler printed
+struct ServerDiagnostic
+{
+	string file;
+	int line;			// counted from 0
+	string message;
+};
+
+// Language server for editors: JSON-RPC messages with Content-Length headers over stdin and stdout. Every open document
+// is assembled in memory as a program of its own, and hover, go to definition and the symbol query are answered from the
+// labels, symbols and bytes its last assembly indexed. An edit within one line of an instruction is assembled on its own
+// and patched in, along with the lines it moves when its length changes (see Parser::PatchLine()); any other edit
+// assembles the document again. The errors the parser prints are caught and sent as diagnostics.
+class LanguageServer
+{
+public:
+	LanguageServer();
+	~LanguageServer();
+
+	int Run();
+
+private:
+	bool ReadMessage(string& body);
+	void Send(const string& body);
+	void Reply(const JsonValue& id, const string& result);
+	void ReplyError(const JsonValue& id, int code, const string& message);
+	bool Handle(const JsonValue& message, int* exitCode);
+	void OpenDocument(const JsonValue& params);
+	void ChangeDocument(const JsonValue& params);
+	void CloseDocument(const JsonValue& params);
+	bool PatchLine(const string& path, int line);
+	void Assemble(const string& path);
+	void PublishDiagnostics(const string& path, const vector<ServerDiagnostic>& diagnostics);
+	string Hover(const JsonValue& params);
+	string Definition(const JsonValue& params);
+	string QuerySymbol(const JsonValue& params);
+	ServerProgram* FindProgram(const JsonValue& params, string& path);
+	string WordAt(const string& path, int line, int character);
+	string Location(ServerProgram& program, int fileId, int line);
+	void BeginCapture();
+	string EndCapture();
+
+	static void ReadDiagnostics(const string& output, vector<ServerDiagnostic>& diagnostics);
+	static void SplitLines(const string& text, vector<string>& lines);
+	static string UriToPath(const string& uri);
+	static string PathToUri(const string& path);
+
+	FILE* _in;
+	FILE* _out;				// the real stdout, which only ever gets messages
+	FILE* _capture;			// stdout points here while the parser runs
+	unordered_map<string, ServerDocument> _documents;	// by path
+	unordered_map<string, string> _sources;				// text of each open document for the parser, by path
+	unordered_map<string, ServerProgram> _programs;		// by path
+	bool _shutdown;
+	int _assemblies;
+	int _patches;
+};
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "MacroDictionary.h"
+#include "Config.h"
+#include <cstring>
+
+MacroDictionary::MacroDictionary()
+{
+	_recording = -1;
+
+	_names.clear();
+	_firstParams.clear();
+	_paramCounts.clear();
+	_firstLines.clear();
+	_lineCounts.clear();
+	_firstLocals.clear();
+	_localCounts.clear();
+	_paramNames.clear();
+	_paramDefaults.clear();
+	_paramHasDefault.clear();
+	_localNames.clear();
+	_lines.clear();
+	_tokens.clear();
+}
+
+int MacroDictionary::NumMacros()
+{
+	return _names.size();
+}
+
+int MacroDictionary::NumNamedMacros()
+{
+	// .rept blocks are stored as macros without a name
+	int count = 0;
+	for (int i = 0; i < _names.size(); i++)
+		count += !_names[i].empty();
+
+	return count;
+}
+
+int MacroDictionary::BeginMacro(const string& name)
+{
+	_names.push_back(name);
+	_firstParams.push_back(_paramNames.size());
+	_paramCounts.push_back(0);
+	_firstLines.push_back(_lines.size());
+	_lineCounts.push_back(0);
+	_firstLocals.push_back(_localNames.size());
+	_localCounts.push_back(0);
+
+	_recording = _names.size() - 1;
+	return _recording;
+}
+
+void MacroDictionary::AddParameter(const string& name, const string& defaultValue, bool hasDefault)
+{
+	_paramNames.push_back(name);
+	_paramDefaults.push_back(defaultValue);
+	_paramHasDefault.push_back(hasDefault);
+	_paramCounts[_recording]++;
+}
+
+void MacroDictionary::AddLine(int lineType, char** tokens, const int* groups, int numTokens, const MacroSource& source)
+{
+	MacroLine line;
+	line.lineType = lineType;
+	line.firstToken = _tokens.size();
+	line.numTokens = numTokens;
+	line.source = source;
+	_lines.push_back(line);
+	_lineCounts[_recording]++;
+
+	// Tokens are stored as literals for now...they are classified once the whole body is known (a local label
+	// can be referenced before the line that defines it)
+	for (int i = 0; i < numTokens; i++)
+	{
+		MacroToken t;
+		t.type = MacroTokenType::Literal;
+		t.index = -1;
+		t.text = tokens[i];
+		t.group = groups[i];
+		_tokens.push_back(t);
+	}
+}
+
+void MacroDictionary::EndMacro()
+{
+	if (_recording < 0)
+		return;
+
+	ClassifyTokens(_recording);
+	_recording = -1;
+}
+
+int MacroDictionary::GetMacro(const char* name)
+{
+	// Later definitions win, so search from the back
+	for (int m = (int)_names.size() - 1; m >= 0; m--)
+	{
+		if (m == _recording)
+			continue;
+
+		if (!strcmp(name, _names[m].c_str()))
+			return m;
+	}
+
+	return -1;
+}
+
+void MacroDictionary::ClassifyTokens(int m)
+{
+	int firstLine = _firstLines[m];
+	int lastLine = firstLine + _lineCounts[m];
+
+	// Collect the labels defined inside the body...these are local to each expansion
+	for (int l = firstLine; l < lastLine; l++)
+	{
+		MacroToken& t = _tokens[_lines[l].firstToken];
+		if (_lines[l].numTokens > 0 && t.text.size() > 0 && t.text[0] == LABEL_KEYS[0])
+		{
+			size_t start = t.text.find_first_not_of(LABEL_KEYS);
+			size_t end = t.text.find_first_of(LABEL_KEYS, start);
+			if (start == string::npos)
+				continue;
+
+			_localNames.push_back(t.text.substr(start, end == string::npos ? string::npos : end - start));
+			_localCounts[m]++;
+		}
+	}
+
+	for (int l = firstLine; l < lastLine; l++)
+	{
+		for (int i = 0; i < _lines[l].numTokens; i++)
+		{
+			MacroToken& t = _tokens[_lines[l].firstToken + i];
+
+			// Parameters can be written either as "name" or "\name". They can also be the value half of a named
+			// argument (key=name) when one macro passes its parameter on to another.
+			const char* text = t.text.c_str();
+			const char* eq = strchr(text, '=');
+			size_t prefix = 0;
+			if (eq != NULL && eq != text)
+			{
+				prefix = eq + 1 - text;
+				text = eq + 1;
+			}
+
+			if (*text == '\\')
+				text++;
+
+			for (int p = 0; p < _paramCounts[m]; p++)
+			{
+				if (!strcmp(text, _paramNames[_firstParams[m] + p].c_str()))
+				{
+					t.type = MacroTokenType::Parameter;
+					t.index = p;
+					t.text = t.text.substr(0, prefix);
+					break;
+				}
+			}
+
+			if (t.type != MacroTokenType::Literal)
+				continue;
+
+			for (int n = 0; n < _localCounts[m]; n++)
+			{
+				const string& local = _localNames[_firstLocals[m] + n];
+
+				if (i == 0 && t.text[0] == LABEL_KEYS[0] && t.text.compare(1, local.size(), local) == 0 && t.text.size() > local.size() + 1 &&
+					strchr(LABEL_KEYS, t.text[local.size() + 1]))
+				{
+					t.type = MacroTokenType::LocalLabelDef;
+					t.index = n;
+					break;
+				}
+
+				if (t.text == local)
+				{
+					t.type = MacroTokenType::LocalLabelRef;
+					t.index = n;
+					break;
+				}
+			}
+		}
+	}
+}
+
+bool MacroDictionary::BindArguments(int m, const vector<string>& args, vector<string>& bound, string& error)
+{
+	int numParams = _paramCounts[m];
+	int firstParam = _firstParams[m];
+
+	bound.assign(numParams, "");
+	vector<bool> set(numParams, false);
+
+	int positional = 0;
+	for (int a = 0; a < args.size(); a++)
+	{
+		// Named arguments look like name=value
+		size_t eq = args[a].find('=');
+		int named = -1;
+		if (eq != string::npos && eq > 0)
+		{
+			for (int p = 0; p < numParams; p++)
+			{
+				if (args[a].compare(0, eq, _paramNames[firstParam + p]) == 0 && _paramNames[firstParam + p].size() == eq)
+				{
+					named = p;
+					break;
+				}
+			}
+		}
+
+		if (named != -1)
+		{
+			bound[named] = args[a].substr(eq + 1);
+			set[named] = true;
+			continue;
+		}
+
+		// Positional arguments fill whichever parameters have not been named yet, in order
+		while (positional < numParams && set[positional])
+			positional++;
+
+		if (positional >= numParams)
+		{
+			error = "too many arguments";
+			return false;
+		}
+
+		bound[positional] = args[a];
+		set[positional] = true;
+	}
+
+	for (int p = 0; p < numParams; p++)
+	{
+		if (!set[p])
+		{
+			if (!_paramHasDefault[firstParam + p])
+			{
+				error = "missing argument \"" + _paramNames[firstParam + p] + "\"";
+				return false;
+			}
+
+			bound[p] = _paramDefaults[firstParam + p];
+		}
+	}
+
+	return true;
+}
+
+void MacroDictionary::AppendToken(int m, int t, const vector<string>& bound, int expansionId, vector<char>& buffer)
+{
+	const MacroToken& token = _tokens[t];
+	const string* local = token.type == MacroTokenType::LocalLabelDef || token.type == MacroTokenType::LocalLabelRef ? &_localNames[_firstLocals[m] + token.index] : NULL;
+	string suffix = local != NULL ? "__" + to_string(expansionId) : "";
+
+	switch (token.type)
+	{
+	case MacroTokenType::Literal:
+		buffer.insert(buffer.end(), token.text.begin(), token.text.end());
+		break;
+
+	case MacroTokenType::Parameter:
+		buffer.insert(buffer.end(), token.text.begin(), token.text.end());
+		buffer.insert(buffer.end(), bound[token.index].begin(), bound[token.index].end());
+		break;
+
+	case MacroTokenType::LocalLabelDef:
+		// [name]: becomes [name__N]:
+		buffer.push_back(LABEL_KEYS[0]);
+		buffer.insert(buffer.end(), local->begin(), local->end());
+		buffer.insert(buffer.end(), suffix.begin(), suffix.end());
+		buffer.insert(buffer.end(), token.text.begin() + local->size() + 1, token.text.end());
+		break;
+
+	case MacroTokenType::LocalLabelRef:
+		buffer.insert(buffer.end(), local->begin(), local->end());
+		buffer.insert(buffer.end(), suffix.begin(), suffix.end());
+		break;
+	}
+
+	buffer.push_back(0);
+}
\ No newline at end of file
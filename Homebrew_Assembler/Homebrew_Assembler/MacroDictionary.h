@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Macro bodies are tokenized once, when the macro is defined. Each token is classified up front so that expanding
+// the macro only has to drop the arguments (or a uniquified local label) into the right slots.
+enum class MacroTokenType { Literal, Parameter, LocalLabelDef, LocalLabelRef };
+
+struct MacroToken
+{
+	MacroTokenType type;
+	int index;		// parameter or local label index (unused for literals)
+	string text;	// literal text, or the "name=" prefix of a named argument that passes a parameter along
+	int group;		// operand (comma separated group) of the line the token belongs to
+};
+
+// Where a recorded line came from, so the bytes a .rept block emits can be listed under the line that produced them
+struct MacroSource
+{
+	int fileId;
+	int line;
+	int colStart;
+	int colEnd;
+};
+
+struct MacroLine
+{
+	int lineType;	// Parser LineType of the line, classified when the macro was defined
+	int firstToken;
+	int numTokens;
+	MacroSource source;
+};
+
+class MacroDictionary
+{
+public:
+	MacroDictionary();
+
+	int NumMacros();
+	int NumNamedMacros();
+	bool IsRecording() { return _recording >= 0; }
+	int BeginMacro(const string& name);
+	void AddParameter(const string& name, const string& defaultValue, bool hasDefault);
+	void AddLine(int lineType, char** tokens, const int* groups, int numTokens, const MacroSource& source);
+	void EndMacro();
+	int GetMacro(const char* name);
+	const string& GetName(int m) { return _names[m]; }
+
+	// Argument binding and expansion
+	bool BindArguments(int m, const vector<string>& args, vector<string>& bound, string& error);
+	int NumLines(int m) { return _lineCounts[m]; }
+	const MacroLine& GetLine(int m, int l) { return _lines[_firstLines[m] + l]; }
+	void AppendToken(int m, int t, const vector<string>& bound, int expansionId, vector<char>& buffer);
+	int GetTokenGroup(int t) { return _tokens[t].group; }
+
+private:
+	void ClassifyTokens(int m);
+
+	int _recording;
+
+	vector<string> _names;
+	vector<int> _firstParams;
+	vector<int> _paramCounts;
+	vector<int> _firstLines;
+	vector<int> _lineCounts;
+	vector<int> _firstLocals;
+	vector<int> _localCounts;
+
+	vector<string> _paramNames;
+	vector<string> _paramDefaults;
+	vector<bool> _paramHasDefault;
+	vector<string> _localNames;
+	vector<MacroLine> _lines;
+	vector<MacroToken> _tokens;
+};
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+	_data = NULL;
+	_size = 0;
+	_isOpen = false;
+	_fileHandle = NULL;
+	_mapHandle = NULL;
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char* filename)
+{
+	Close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	_fileHandle = file;
+	_size = (size_t)fileSize.QuadPart;
+	_isOpen = true;
+
+	// Zero-length files cannot be mapped, but they are still valid (empty) files
+	if (_size == 0)
+		return true;
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL)
+	{
+		Close();
+		return false;
+	}
+
+	_mapHandle = mapping;
+	_data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (_data == NULL)
+	{
+		Close();
+		return false;
+	}
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	_size = (size_t)st.st_size;
+	_isOpen = true;
+
+	if (_size > 0)
+	{
+		void* p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			close(fd);
+			_size = 0;
+			_isOpen = false;
+			return false;
+		}
+
+		_data = (const unsigned char*)p;
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+#endif
+
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (_data != NULL)
+		UnmapViewOfFile(_data);
+	if (_mapHandle != NULL)
+		CloseHandle((HANDLE)_mapHandle);
+	if (_fileHandle != NULL)
+		CloseHandle((HANDLE)_fileHandle);
+#else
+	if (_data != NULL)
+		munmap((void*)_data, _size);
+#endif
+
+	_data = NULL;
+	_size = 0;
+	_isOpen = false;
+	_fileHandle = NULL;
+	_mapHandle = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+
+// Read-only view of a file on disk. The contents are memory-mapped so that large source or binary asset files
+// can be read without copying them through a stream first.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char* filename);
+	void Close();
+	bool IsOpen() { return _isOpen; }
+	const unsigned char* Data() { return _data; }
+	size_t Size() { return _size; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char* _data;
+	size_t _size;
+	bool _isOpen;
+	void* _fileHandle;
+	void* _mapHandle;
+};
\ No newline at end of file
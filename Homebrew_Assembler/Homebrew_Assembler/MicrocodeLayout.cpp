@@ -0,0 +1,91 @@
+#include "MicrocodeLayout.h"
+#include <map>
+
+MicrocodeLayout::MicrocodeLayout()
+{
+	_wordBits = 0;
+	_keptBits.clear();
+	_sources.clear();
+	_constantMask = 0;
+	_onesMask = 0;
+	_distinct.clear();
+	_indices.clear();
+}
+
+// Looks at the control words that are actually used. Each bit is turned into its column (its value in every word, as a
+// bit string), so that constant bits are the all-zero and all-one columns and duplicate bits are equal columns.
+void MicrocodeLayout::Analyze(const vector<unsigned long long>& words, int wordBits)
+{
+	*this = MicrocodeLayout();
+	_wordBits = wordBits;
+	_sources.assign(wordBits, -1);
+
+	int numWords = words.size();
+	int columnWords = (numWords + 63) / 64;
+	map<vector<unsigned long long>, int> columns;
+
+	for (int bit = 0; bit < wordBits; bit++)
+	{
+		vector<unsigned long long> column(columnWords, 0);
+		int ones = 0;
+
+		for (int w = 0; w < numWords; w++)
+		{
+			unsigned long long set = (words[w] >> bit) & 1;
+			column[w >> 6] |= set << (w & 63);
+			ones += (int)set;
+		}
+
+		if (ones == 0 || ones == numWords)
+		{
+			_constantMask |= 1ULL << bit;
+			if (ones > 0)
+				_onesMask |= 1ULL << bit;
+			continue;
+		}
+
+		auto found = columns.emplace(column, _keptBits.size());
+		if (found.second)
+			_keptBits.push_back(bit);
+
+		_sources[bit] = found.first->second;
+	}
+
+	// The empty word comes first, so that addresses of the index ROM that no opcode uses select it
+	_distinct.push_back(0);
+	_indices[0] = 0;
+
+	for (unsigned long long word : words)
+	{
+		unsigned long long packed = Pack(word);
+		if (_indices.emplace(packed, _distinct.size()).second)
+			_distinct.push_back(packed);
+	}
+}
+
+unsigned long long MicrocodeLayout::Pack(unsigned long long word)
+{
+	unsigned long long packed = 0;
+
+	for (int k = 0; k < _keptBits.size(); k++)
+		packed |= ((word >> _keptBits[k]) & 1) << k;
+
+	return packed;
+}
+
+// Returns the decode ROM row of a word, or -1 if it wasn't one of the analyzed words
+int MicrocodeLayout::GetIndex(unsigned long long word)
+{
+	auto found = _indices.find(Pack(word));
+	return found != _indices.end() ? found->second : -1;
+}
+
+// Width of the index ROM, at least one bit
+int MicrocodeLayout::NumIndexBits()
+{
+	int bits = 1;
+	while ((1ULL << bits) < _distinct.size())
+		bits++;
+
+	return bits;
+}
\ No newline at end of file
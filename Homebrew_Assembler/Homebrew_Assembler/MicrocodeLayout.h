@@ -0,0 +1,40 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+enum class MicrocodeLayoutType { Direct, Packed, Indexed };
+
+// Works out how few ROM output bits the control words of an architecture need. Bits that never change are tied to a fixed
+// level instead of taking a ROM output, and bits that always equal another bit share that bit's output. What is left is
+// the packed word. The distinct packed words can also be numbered, so that a narrow index ROM (addressed by opcode) selects
+// a row of a small decode ROM that holds the packed words.
+class MicrocodeLayout
+{
+public:
+	MicrocodeLayout();
+
+	void Analyze(const vector<unsigned long long>& words, int wordBits);
+	unsigned long long Pack(unsigned long long word);
+	int GetIndex(unsigned long long word);
+
+	int GetWordBits() { return _wordBits; }
+	int NumPackedBits() { return _keptBits.size(); }
+	int NumIndexBits();
+	int NumDistinct() { return _distinct.size(); }
+	unsigned long long GetDistinct(int index) { return _distinct[index]; }
+	int GetKeptBit(int k) { return _keptBits[k]; }
+	int GetSource(int bit) { return _sources[bit]; }
+	unsigned long long GetConstantMask() { return _constantMask; }
+	unsigned long long GetOnesMask() { return _onesMask; }
+
+private:
+	int _wordBits;
+	vector<int> _keptBits;			// control word bit driven by each bit of the packed word
+	vector<int> _sources;			// packed word bit that drives each control word bit, -1 for constant bits
+	unsigned long long _constantMask;
+	unsigned long long _onesMask;	// constant bits that are always 1
+	vector<unsigned long long> _distinct;	// packed words in index order (index 0 is always the empty word)
+	unordered_map<unsigned long long, int> _indices;
+};
\ No newline at end of file
@@ -11,6 +11,10 @@ OpcodeDictionary::OpcodeDictionary()
 	currNumArgs = -1;
 	currSize = 0;
 	currControlPattern = 0;
+	currLayout = -1;
+	currMinCycles = 1;
+	currMaxCycles = 1;
+	currMatch = -1;
 
 	_mnemonics.clear();
 	_numArgs.clear();
@@ -21,6 +25,10 @@ OpcodeDictionary::OpcodeDictionary()
 	_arg1strings.clear();
 	_sizes.clear();
 	_controlPatterns.clear();
+	_layouts.clear();
+	_minCycles.clear();
+	_maxCycles.clear();
+	_patterns.clear();
 }
 
 int OpcodeDictionary::NumOpcodes()
@@ -39,9 +47,32 @@ void OpcodeDictionary::AddCurrentEntry()
 	_arg1strings.push_back(currArg1string);
 	_sizes.push_back(currSize);
 	_controlPatterns.push_back(currControlPattern);
+	_layouts.push_back(currLayout);
+	_minCycles.push_back(currMinCycles);
+	_maxCycles.push_back(currMaxCycles);
+
+	IndexLastEntry();
+}
+
+// Makes room for count entries in total, so a batch of entries (an opcode template) is added without reallocating
+void OpcodeDictionary::Reserve(int count)
+{
+	_mnemonics.reserve(count);
+	_numArgs.reserve(count);
+	_values.reserve(count);
+	_arg0types.reserve(count);
+	_arg1types.reserve(count);
+	_arg0strings.reserve(count);
+	_arg1strings.reserve(count);
+	_sizes.reserve(count);
+	_controlPatterns.reserve(count);
+	_layouts.reserve(count);
+	_minCycles.reserve(count);
+	_maxCycles.reserve(count);
+	_patterns.reserve(count);
 }
 
-void OpcodeDictionary::Add2Arg(const string& m, const string& a0, const string& a1, int s, int v, int cp)
+void OpcodeDictionary::Add2Arg(const string& m, const string& a0, const string& a1, int s, int v, long long cp)
 {
 	_mnemonics.push_back(m);
 	_numArgs.push_back(2);
@@ -52,6 +83,10 @@ void OpcodeDictionary::Add2Arg(const string& m, const string& a0, const string&
 	_values.push_back(v);
 	_sizes.push_back(s);
 	_controlPatterns.push_back(cp);
+	_layouts.push_back(currLayout);
+	_minCycles.push_back(currMinCycles);
+	_maxCycles.push_back(currMaxCycles);
+	IndexLastEntry();
 
 	currMnemonic = m;
 	currNumArgs = 2;
@@ -64,7 +99,7 @@ void OpcodeDictionary::Add2Arg(const string& m, const string& a0, const string&
 	currControlPattern = cp;
 }
 
-void OpcodeDictionary::Add2Arg(const string& m, const string& a0, int a1, int s, int v, int cp)
+void OpcodeDictionary::Add2Arg(const string& m, const string& a0, int a1, int s, int v, long long cp)
 {
 	_mnemonics.push_back(m);
 	_numArgs.push_back(2);
@@ -75,6 +110,10 @@ void OpcodeDictionary::Add2Arg(const string& m, const string& a0, int a1, int s,
 	_values.push_back(v);
 	_sizes.push_back(s);
 	_controlPatterns.push_back(cp);
+	_layouts.push_back(currLayout);
+	_minCycles.push_back(currMinCycles);
+	_maxCycles.push_back(currMaxCycles);
+	IndexLastEntry();
 
 	currMnemonic = m;
 	currNumArgs = 2;
@@ -87,7 +126,7 @@ void OpcodeDictionary::Add2Arg(const string& m, const string& a0, int a1, int s,
 	currControlPattern = cp;
 }
 
-void OpcodeDictionary::Add2Arg(const string& m, int a0, const string& a1, int s, int v, int cp)
+void OpcodeDictionary::Add2Arg(const string& m, int a0, const string& a1, int s, int v, long long cp)
 {
 	_mnemonics.push_back(m);
 	_numArgs.push_back(2);
@@ -98,6 +137,10 @@ void OpcodeDictionary::Add2Arg(const string& m, int a0, const string& a1, int s,
 	_values.push_back(v);
 	_sizes.push_back(s);
 	_controlPatterns.push_back(cp);
+	_layouts.push_back(currLayout);
+	_minCycles.push_back(currMinCycles);
+	_maxCycles.push_back(currMaxCycles);
+	IndexLastEntry();
 
 	currMnemonic = m;
 	currNumArgs = 2;
@@ -110,7 +153,7 @@ void OpcodeDictionary::Add2Arg(const string& m, int a0, const string& a1, int s,
 	currControlPattern = cp;
 }
 
-void OpcodeDictionary::Add1Arg(const string& m, const string& a0, int s, int v, int cp)
+void OpcodeDictionary::Add1Arg(const string& m, const string& a0, int s, int v, long long cp)
 {
 	_mnemonics.push_back(m);
 	_numArgs.push_back(1);
@@ -121,6 +164,10 @@ void OpcodeDictionary::Add1Arg(const string& m, const string& a0, int s, int v,
 	_values.push_back(v);
 	_sizes.push_back(s);
 	_controlPatterns.push_back(cp);
+	_layouts.push_back(currLayout);
+	_minCycles.push_back(currMinCycles);
+	_maxCycles.push_back(currMaxCycles);
+	IndexLastEntry();
 
 	currMnemonic = m;
 	currNumArgs = 1;
@@ -133,7 +180,7 @@ void OpcodeDictionary::Add1Arg(const string& m, const string& a0, int s, int v,
 	currControlPattern = cp;
 }
 
-void OpcodeDictionary::Add1Arg(const string& m, int a0, int s, int v, int cp)
+void OpcodeDictionary::Add1Arg(const string& m, int a0, int s, int v, long long cp)
 {
 	_mnemonics.push_back(m);
 	_numArgs.push_back(1);
@@ -144,6 +191,10 @@ void OpcodeDictionary::Add1Arg(const string& m, int a0, int s, int v, int cp)
 	_values.push_back(v);
 	_sizes.push_back(s);
 	_controlPatterns.push_back(cp);
+	_layouts.push_back(currLayout);
+	_minCycles.push_back(currMinCycles);
+	_maxCycles.push_back(currMaxCycles);
+	IndexLastEntry();
 
 	currMnemonic = m;
 	currNumArgs = 1;
@@ -156,7 +207,7 @@ void OpcodeDictionary::Add1Arg(const string& m, int a0, int s, int v, int cp)
 	currControlPattern = cp;
 }
 
-void OpcodeDictionary::Add0Arg(const string& m, int s, int v, int cp)
+void OpcodeDictionary::Add0Arg(const string& m, int s, int v, long long cp)
 {
 	_mnemonics.push_back(m);
 	_numArgs.push_back(0);
@@ -167,6 +218,10 @@ void OpcodeDictionary::Add0Arg(const string& m, int s, int v, int cp)
 	_values.push_back(v);
 	_sizes.push_back(s);
 	_controlPatterns.push_back(cp);
+	_layouts.push_back(currLayout);
+	_minCycles.push_back(currMinCycles);
+	_maxCycles.push_back(currMaxCycles);
+	IndexLastEntry();
 
 	currMnemonic = m;
 	currNumArgs = 1;
@@ -179,159 +234,106 @@ void OpcodeDictionary::Add0Arg(const string& m, int s, int v, int cp)
 	currControlPattern = cp;
 }
 
-bool OpcodeDictionary::Get0ArgOpcode(const string& m, int *s, int* v, int* cp)
+bool OpcodeDictionary::Get0ArgOpcode(const string& m, int *s, int* v, long long* cp)
 {
-	for (int i = 0; i < _mnemonics.size(); i++)
-	{
-		const string& mnemonic = _mnemonics[i];
-
-		if (m == mnemonic)
-		{
-			if (_numArgs[i] == 0)
-			{
-				*s = _sizes[i];
-				*v = _values[i];
-				*cp = _controlPatterns[i];
-
-				return true;
-			}
-		}
-	}
-
-	return false;
+	return GetPattern(PatternKey(m, 0, ArgType::None, "", ArgType::None, ""), s, v, cp);
 }
 
-bool OpcodeDictionary::Get1ArgOpcode(const string& m, const string& a0, int *s, int* v, int* cp)
+bool OpcodeDictionary::Get1ArgOpcode(const string& m, const string& a0, int *s, int* v, long long* cp)
 {
-	for (int i = 0; i < _mnemonics.size(); i++)
-	{
-		const string& mnemonic = _mnemonics[i];
-
-		if (m == mnemonic)
-		{
-			if (_numArgs[i] == 1 && _arg0types[i] == ArgType::Register && _arg0strings[i] == a0)
-			{
-				*s = _sizes[i];
-				*v = _values[i];
-				*cp = _controlPatterns[i];
-
-				return true;
-			}
-		}
-	}
+	return GetPattern(PatternKey(m, 1, ArgType::Register, a0, ArgType::None, ""), s, v, cp);
+}
 
-	return false;
+bool OpcodeDictionary::Get1ArgOpcode(const string& m, int, int *s, int* v, long long* cp)
+{
+	return GetPattern(PatternKey(m, 1, ArgType::Numeral, "", ArgType::None, ""), s, v, cp);
 }
 
-bool OpcodeDictionary::Get1ArgOpcode(const string& m, int a0, int *s, int* v, int* cp)
+bool OpcodeDictionary::Get2ArgOpcode(const string& m, const string& a0, const string& a1, int *s, int* v, long long* cp)
 {
-	for (int i = 0; i < _mnemonics.size(); i++)
-	{
-		const string& mnemonic = _mnemonics[i];
-
-		if (m == mnemonic)
-		{
-			if (_numArgs[i] == 1 && _arg0types[i] == ArgType::Numeral)
-			{
-				*s = _sizes[i];
-				*v = _values[i];
-				*cp = _controlPatterns[i];
-
-				return true;
-			}
-		}
-	}
+	return GetPattern(PatternKey(m, 2, ArgType::Register, a0, ArgType::Register, a1), s, v, cp);
+}
 
-	return false;
+bool OpcodeDictionary::Get2ArgOpcode(const string& m, const string& a0, int, int *s, int* v, long long* cp)
+{
+	return GetPattern(PatternKey(m, 2, ArgType::Register, a0, ArgType::Numeral, ""), s, v, cp);
 }
 
-bool OpcodeDictionary::Get2ArgOpcode(const string& m, const string& a0, const string& a1, int *s, int* v, int* cp)
+bool OpcodeDictionary::Get2ArgOpcode(const string& m, int, const string& a1, int *s, int* v, long long* cp)
 {
-	for (int i = 0; i < _mnemonics.size(); i++)
-	{
-		const string& mnemonic = _mnemonics[i];
-
-		if (m == mnemonic)
-		{
-			if (_numArgs[i] == 2 && _arg0types[i] == ArgType::Register && _arg0strings[i] == a0 &&
-				_arg1types[i] == ArgType::Register && _arg1strings[i] == a1)
-			{
-				*s = _sizes[i];
-				*v = _values[i];
-				*cp = _controlPatterns[i];
-
-				return true;
-			}
-		}
-	}
+	return GetPattern(PatternKey(m, 2, ArgType::Numeral, "", ArgType::Register, a1), s, v, cp);
+}
 
-	return false;
+// Same test as the Get*Opcode() functions, for any combination of argument types (register arguments have to match by
+// name, numeral arguments match any numeral)
+bool OpcodeDictionary::HasPattern(const string& m, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1)
+{
+	return _patterns.count(PatternKey(m, numArgs, t0, a0, t1, a1)) > 0;
 }
 
-bool OpcodeDictionary::Get2ArgOpcode(const string& m, const string& a0, int a1, int *s, int* v, int* cp)
+// The key entries are looked up by: the mnemonic, the number of arguments and the class of each of the first two
+// arguments (a register by its name, anything else by its type only)
+string OpcodeDictionary::PatternKey(const string& m, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1)
 {
-	for (int i = 0; i < _mnemonics.size(); i++)
+	string key = m + '\t' + to_string(numArgs);
+
+	for (int n = 0; n < numArgs && n < 2; n++)
 	{
-		const string& mnemonic = _mnemonics[i];
-
-		if (m == mnemonic)
-		{
-			if (_numArgs[i] == 2 && _arg0types[i] == ArgType::Register && _arg0strings[i] == a0 &&
-				_arg1types[i] == ArgType::Numeral)
-			{
-				*s = _sizes[i];
-				*v = _values[i];
-				*cp = _controlPatterns[i];
-
-				return true;
-			}
-		}
+		ArgType type = n == 0 ? t0 : t1;
+		key += '\t';
+		key += (char)('0' + (int)type);
+
+		if (type == ArgType::Register)
+			key += n == 0 ? a0 : a1;
 	}
 
-	return false;
+	return key;
 }
 
-bool OpcodeDictionary::Get2ArgOpcode(const string& m, int a0, const string& a1, int *s, int* v, int* cp)
+bool OpcodeDictionary::GetPattern(const string& key, int* s, int* v, long long* cp)
 {
-	for (int i = 0; i < _mnemonics.size(); i++)
-	{
-		const string& mnemonic = _mnemonics[i];
-
-		if (m == mnemonic)
-		{
-			if (_numArgs[i] == 2 && _arg0types[i] == ArgType::Numeral &&
-				_arg1types[i] == ArgType::Register && _arg1strings[i] == a1)
-			{
-				*s = _sizes[i];
-				*v = _values[i];
-				*cp = _controlPatterns[i];
-
-				return true;
-			}
-		}
-	}
+	auto found = _patterns.find(key);
+	if (found == _patterns.end())
+		return false;
+
+	int i = found->second;
+	*s = _sizes[i];
+	*v = _values[i];
+	*cp = _controlPatterns[i];
+	currMatch = i;
 
-	return false;
+	return true;
 }
 
-bool OpcodeDictionary::GetOpcodeValue(int v)
+// Adds the entry just pushed to the pattern index, unless an earlier entry already has its pattern
+void OpcodeDictionary::IndexLastEntry()
 {
-	for (int i = 0; i < _mnemonics.size(); i++)
+	int entry = _mnemonics.size() - 1;
+	_patterns.emplace(PatternKey(_mnemonics[entry], _numArgs[entry], _arg0types[entry], _arg0strings[entry], _arg1types[entry], _arg1strings[entry]), entry);
+}
+
+// The pattern of an entry as it would be written in the architecture file (e.g. "mov a, #")
+string OpcodeDictionary::Describe(int entry)
+{
+	string text = _mnemonics[entry];
+	for (int n = 0; n < _numArgs[entry] && n < 2; n++)
 	{
-		if (_values[i] == v)
-		{
-			return true;
-		}
+		text += n == 0 ? " " : ", ";
+		text += GetArgType(entry, n) == ArgType::Register ? GetArgString(entry, n) : "#";
 	}
 
-	return false;
+	return text;
 }
 
-bool OpcodeDictionary::IsAMnemonic(char* c)
+// Same as Describe(), for the entry that is being defined
+string OpcodeDictionary::DescribeCurrent()
 {
-	bool mnemonic = false;
-	for (int i = 0; i < _mnemonics.size(); i++)
-		mnemonic = mnemonic || !strcmp(c, _mnemonics[i].c_str());
+	string text = currMnemonic;
+	for (int n = 0; n < currNumArgs && n < 2; n++)
+	{
+		text += n == 0 ? " " : ", ";
+		text += (n == 0 ? currArg0type : currArg1type) == ArgType::Register ? (n == 0 ? currArg0string : currArg1string) : "#";
+	}
 
-	return mnemonic;
+	return text;
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
+#pragma once
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 using namespace std;
 
@@ -12,20 +14,34 @@ public:
 
 	int NumOpcodes();
 	void AddCurrentEntry();
-	void Add2Arg(const string& m, const string& a0, const string& a1, int s, int v, int cp);
-	void Add2Arg(const string& m, const string& a0, int a1, int s, int v, int cp);
-	void Add2Arg(const string& m, int a0, const string& a1, int s, int v, int cp);
-	void Add1Arg(const string& m, const string& a0, int s, int v, int cp);
-	void Add1Arg(const string& m, int a0, int s, int v, int cp);
-	void Add0Arg(const string& m, int s, int v, int cp);
-	bool Get0ArgOpcode(const string& m, int *s, int* v, int* cp);
-	bool Get1ArgOpcode(const string& m, const string& a0, int *s, int* v, int* cp);
-	bool Get1ArgOpcode(const string& m, int a0, int *s, int* v, int* cp);
-	bool Get2ArgOpcode(const string& m, const string& a0, const string& a1, int *s, int* v, int* cp);
-	bool Get2ArgOpcode(const string& m, const string& a0, int a1, int *s, int* v, int* cp);
-	bool Get2ArgOpcode(const string& m, int a0, const string& a1, int *s, int* v, int* cp);
-	bool GetOpcodeValue(int v);
-	bool IsAMnemonic(char* c);
+	void Reserve(int count);
+	void Add2Arg(const string& m, const string& a0, const string& a1, int s, int v, long long cp);
+	void Add2Arg(const string& m, const string& a0, int a1, int s, int v, long long cp);
+	void Add2Arg(const string& m, int a0, const string& a1, int s, int v, long long cp);
+	void Add1Arg(const string& m, const string& a0, int s, int v, long long cp);
+	void Add1Arg(const string& m, int a0, int s, int v, long long cp);
+	void Add0Arg(const string& m, int s, int v, long long cp);
+	bool Get0ArgOpcode(const string& m, int *s, int* v, long long* cp);
+	bool Get1ArgOpcode(const string& m, const string& a0, int *s, int* v, long long* cp);
+	bool Get1ArgOpcode(const string& m, int a0, int *s, int* v, long long* cp);
+	bool Get2ArgOpcode(const string& m, const string& a0, const string& a1, int *s, int* v, long long* cp);
+	bool Get2ArgOpcode(const string& m, const string& a0, int a1, int *s, int* v, long long* cp);
+	bool Get2ArgOpcode(const string& m, int a0, const string& a1, int *s, int* v, long long* cp);
+	bool HasPattern(const string& m, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1);
+	int GetLayout(int entry) { return _layouts[entry]; }
+	const string& GetMnemonic(int entry) { return _mnemonics[entry]; }
+	int GetNumArgs(int entry) { return _numArgs[entry]; }
+	ArgType GetArgType(int entry, int n) { return n == 0 ? _arg0types[entry] : _arg1types[entry]; }
+	const string& GetArgString(int entry, int n) { return n == 0 ? _arg0strings[entry] : _arg1strings[entry]; }
+	int GetValue(int entry) { return _values[entry]; }
+	int GetSize(int entry) { return _sizes[entry]; }
+	long long GetControlPattern(int entry) { return _controlPatterns[entry]; }
+	int GetMinCycles(int entry) { return _minCycles[entry]; }
+	int GetMaxCycles(int entry) { return _maxCycles[entry]; }
+	string Describe(int entry);
+	string DescribeCurrent();
+
+	static string PatternKey(const string& m, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1);
 
 	string currMnemonic;
 	int currValue;
@@ -37,16 +53,27 @@ public:
 	int currArg0num;
 	int currArg1num;
 	int currSize;
-	int currControlPattern;
+	long long currControlPattern;
+	int currLayout;
+	int currMinCycles;
+	int currMaxCycles;	// more than currMinCycles for an opcode that takes longer when it jumps
+	int currMatch;		// entry found by the last successful Get*Opcode() call
 
 private:
+	void IndexLastEntry();
+	bool GetPattern(const string& key, int* s, int* v, long long* cp);
+
 	vector<string> _mnemonics;
 	vector<int> _values;
 	vector<int> _numArgs;
 	vector<int> _sizes;
-	vector<int> _controlPatterns;
+	vector<long long> _controlPatterns;
+	vector<int> _layouts;
+	vector<int> _minCycles;
+	vector<int> _maxCycles;
 	vector<ArgType> _arg0types;
 	vector<ArgType> _arg1types;
 	vector<string> _arg0strings;
 	vector<string> _arg1strings;
+	unordered_map<string, int> _patterns;	// first entry of each PatternKey()
 };
\ No newline at end of file
@@ -0,0 +1,368 @@
+#include "OpcodeMatcher.h"
+#include <algorithm>
+#include <cstring>
+#include <climits>
+
+// Start of every serialized tree, followed by a version number
+static const char MATCHER_MAGIC[4] = { 'H', 'B', 'M', 'T' };
+static const int MATCHER_VERSION = 1;
+
+OpcodeMatcher::OpcodeMatcher()
+{
+	_nodes.clear();
+	_edges.clear();
+	_mnemonics.clear();
+	_registers.clear();
+	_mnemonicIds.clear();
+	_registerIds.clear();
+	_numEntries = 0;
+}
+
+// Compiles the opcode dictionary into the tree. When several entries share a pattern (opcode aliases), the first one
+// wins, as it did when the dictionary was searched in order.
+void OpcodeMatcher::Build(OpcodeDictionary& opcodes)
+{
+	_nodes.clear();
+	_edges.clear();
+	_mnemonics.clear();
+	_registers.clear();
+	_mnemonicIds.clear();
+	_registerIds.clear();
+	_numEntries = opcodes.NumOpcodes();
+
+	// One row per entry: mnemonic id, operand 0 key, operand 1 key, entry
+	vector<int> rows;
+	for (int i = 0; i < _numEntries; i++)
+	{
+		auto mnemonic = _mnemonicIds.emplace(opcodes.GetMnemonic(i), _mnemonics.size());
+		if (mnemonic.second)
+			_mnemonics.push_back(opcodes.GetMnemonic(i));
+
+		int keys[2];
+		for (int n = 0; n < 2; n++)
+		{
+			if (n < opcodes.GetNumArgs(i) && opcodes.GetArgType(i, n) == ArgType::Register)
+			{
+				auto reg = _registerIds.emplace(opcodes.GetArgString(i, n), _registers.size());
+				if (reg.second)
+					_registers.push_back(opcodes.GetArgString(i, n));
+			}
+
+			keys[n] = OperandKey(opcodes.GetNumArgs(i), n, opcodes.GetArgType(i, n), opcodes.GetArgString(i, n));
+		}
+
+		// Entries with more operands than the tree has levels can never be matched
+		if (opcodes.GetNumArgs(i) > 2)
+			continue;
+
+		rows.insert(rows.end(), { mnemonic.first->second, keys[0], keys[1], i });
+	}
+
+	// Sort the rows so that each node's children come out next to each other (stable, so the first entry of a pattern
+	// stays in front)
+	int numRows = rows.size() / 4;
+	vector<int> order(numRows);
+	for (int r = 0; r < numRows; r++)
+		order[r] = r;
+
+	stable_sort(order.begin(), order.end(), [&](int x, int y)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			if (rows[x * 4 + k] != rows[y * 4 + k])
+				return rows[x * 4 + k] < rows[y * 4 + k];
+		}
+
+		return false;
+	});
+
+	// Roots first, then the tree is filled in one level at a time. Each node remembers the range of rows below it.
+	vector<int> rowStart;
+	vector<int> rowEnd;
+
+	for (int m = 0; m < _mnemonics.size(); m++)
+	{
+		_nodes.push_back({ -1, 0, 0 });
+		rowStart.push_back(numRows);
+		rowEnd.push_back(0);
+	}
+
+	for (int r = 0; r < numRows; r++)
+	{
+		int m = rows[order[r] * 4];
+		rowStart[m] = min(rowStart[m], r);
+		rowEnd[m] = max(rowEnd[m], r + 1);
+	}
+
+	int levelStart = 0;
+	for (int level = 1; level <= 2; level++)
+	{
+		int levelEnd = _nodes.size();
+
+		for (int node = levelStart; node < levelEnd; node++)
+		{
+			_nodes[node].firstEdge = _edges.size();
+
+			for (int r = rowStart[node]; r < rowEnd[node]; r++)
+			{
+				int key = rows[order[r] * 4 + level];
+
+				if (_nodes[node].numEdges == 0 || _edges.back().key != key)
+				{
+					// Leaves (below the last operand) hold the first entry with this pattern
+					_edges.push_back({ key, (int)_nodes.size() });
+					_nodes.push_back({ level == 2 ? rows[order[r] * 4 + 3] : -1, 0, 0 });
+					_nodes[node].numEdges++;
+					rowStart.push_back(r);
+					rowEnd.push_back(r + 1);
+				}
+				else
+					rowEnd.back() = r + 1;
+			}
+		}
+
+		levelStart = levelEnd;
+	}
+}
+
+// The class of operand n: NO_OPERAND past the last operand, NUMERAL for numbers (and characters), else the register's id
+int OpcodeMatcher::OperandKey(int numArgs, int n, ArgType type, const string& text)
+{
+	if (n >= numArgs)
+		return NO_OPERAND;
+
+	if (type != ArgType::Register)
+		return NUMERAL;
+
+	auto reg = _registerIds.find(text);
+	return reg != _registerIds.end() ? reg->second : UNKNOWN_REGISTER;
+}
+
+int OpcodeMatcher::FindChild(int node, int key)
+{
+	const MatchEdge* first = _edges.data() + _nodes[node].firstEdge;
+	const MatchEdge* last = first + _nodes[node].numEdges;
+	const MatchEdge* edge = lower_bound(first, last, key, [](const MatchEdge& e, int k) { return e.key < k; });
+
+	return edge != last && edge->key == key ? edge->child : -1;
+}
+
+// Follows the operands down the tree as far as they go and returns the last node reached (-1 if the mnemonic is unknown)
+int OpcodeMatcher::Walk(const string& mnemonic, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1)
+{
+	auto m = _mnemonicIds.find(mnemonic);
+	if (m == _mnemonicIds.end())
+		return -1;
+
+	int node = m->second;
+	int keys[2] = { OperandKey(numArgs, 0, t0, a0), OperandKey(numArgs, 1, t1, a1) };
+
+	for (int n = 0; n < 2 && numArgs <= 2; n++)
+	{
+		int child = FindChild(node, keys[n]);
+		if (child < 0)
+			break;
+
+		node = child;
+	}
+
+	return node;
+}
+
+// Returns the dictionary entry for an instruction, or -1 if there isn't one
+int OpcodeMatcher::Match(const string& mnemonic, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1)
+{
+	int node = Walk(mnemonic, numArgs, t0, a0, t1, a1);
+	return node >= 0 ? _nodes[node].entry : -1;
+}
+
+// For an instruction that didn't match: the entries below the deepest node its operands reached, i.e. the patterns of
+// this mnemonic that agree with the most leading operands. A mnemonic the architecture doesn't have gets the patterns of
+// the mnemonics that are spelled most like it.
+void OpcodeMatcher::GetCandidates(const string& mnemonic, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1, int max, vector<int>& entries)
+{
+	int node = Walk(mnemonic, numArgs, t0, a0, t1, a1);
+	if (node >= 0)
+	{
+		CollectLeaves(node, max, entries);
+		return;
+	}
+
+	vector<int> distances(_mnemonics.size());
+	int closest = INT_MAX;
+	for (int m = 0; m < _mnemonics.size(); m++)
+	{
+		distances[m] = EditDistance(mnemonic, _mnemonics[m]);
+		closest = min(closest, distances[m]);
+	}
+
+	for (int m = 0; m < _mnemonics.size(); m++)
+	{
+		if (distances[m] == closest)
+			CollectLeaves(m, max, entries);
+	}
+}
+
+// Number of single character insertions, deletions and substitutions that turn a into b
+int OpcodeMatcher::EditDistance(const string& a, const string& b)
+{
+	vector<int> row(b.size() + 1);
+	for (int j = 0; j <= b.size(); j++)
+		row[j] = j;
+
+	for (int i = 1; i <= a.size(); i++)
+	{
+		int diagonal = row[0];
+		row[0] = i;
+
+		for (int j = 1; j <= b.size(); j++)
+		{
+			int above = row[j];
+			row[j] = min({ row[j] + 1, row[j - 1] + 1, diagonal + (a[i - 1] != b[j - 1]) });
+			diagonal = above;
+		}
+	}
+
+	return row[b.size()];
+}
+
+void OpcodeMatcher::CollectLeaves(int node, int max, vector<int>& entries)
+{
+	if (entries.size() >= max)
+		return;
+
+	if (_nodes[node].entry >= 0)
+		entries.push_back(_nodes[node].entry);
+
+	for (int e = 0; e < _nodes[node].numEdges; e++)
+		CollectLeaves(_edges[_nodes[node].firstEdge + e].child, max, entries);
+}
+
+// Writes the tree out as a flat block of little-endian integers and length-prefixed strings, so it can be stored
+// alongside anything else compiled from the architecture file
+void OpcodeMatcher::Serialize(vector<unsigned char>& out)
+{
+	auto putInt = [&](int v)
+	{
+		for (int b = 0; b < 4; b++)
+			out.push_back((unsigned char)((unsigned int)v >> (8 * b)));
+	};
+
+	auto putStrings = [&](const vector<string>& strings)
+	{
+		putInt(strings.size());
+		for (const string& s : strings)
+		{
+			putInt(s.size());
+			out.insert(out.end(), s.begin(), s.end());
+		}
+	};
+
+	out.insert(out.end(), MATCHER_MAGIC, MATCHER_MAGIC + 4);
+	putInt(MATCHER_VERSION);
+	putInt(_numEntries);
+	putStrings(_mnemonics);
+	putStrings(_registers);
+
+	putInt(_nodes.size());
+	for (const MatchNode& node : _nodes)
+	{
+		putInt(node.entry);
+		putInt(node.firstEdge);
+		putInt(node.numEdges);
+	}
+
+	putInt(_edges.size());
+	for (const MatchEdge& edge : _edges)
+	{
+		putInt(edge.key);
+		putInt(edge.child);
+	}
+}
+
+// Reads a tree written by Serialize(). Returns false (and leaves the tree empty) if the data is truncated or invalid.
+bool OpcodeMatcher::Deserialize(const unsigned char* data, int size)
+{
+	int pos = 0;
+	bool ok = size >= 4 && !memcmp(data, MATCHER_MAGIC, 4);
+	pos = 4;
+
+	auto getInt = [&]()
+	{
+		if (pos + 4 > size)
+		{
+			ok = false;
+			return 0;
+		}
+
+		unsigned int v = 0;
+		for (int b = 0; b < 4; b++)
+			v |= (unsigned int)data[pos++] << (8 * b);
+
+		return (int)v;
+	};
+
+	auto getStrings = [&](vector<string>& strings, unordered_map<string, int>& ids)
+	{
+		int count = getInt();
+		for (int i = 0; ok && i < count; i++)
+		{
+			int length = getInt();
+			if (length < 0 || pos + length > size)
+			{
+				ok = false;
+				break;
+			}
+
+			strings.push_back(string((const char*)data + pos, length));
+			ids[strings.back()] = i;
+			pos += length;
+		}
+	};
+
+	*this = OpcodeMatcher();
+
+	if (ok && getInt() != MATCHER_VERSION)
+		ok = false;
+
+	if (ok)
+	{
+		_numEntries = getInt();
+		getStrings(_mnemonics, _mnemonicIds);
+		getStrings(_registers, _registerIds);
+	}
+
+	int numNodes = ok ? getInt() : 0;
+	for (int i = 0; ok && i < numNodes; i++)
+	{
+		MatchNode node;
+		node.entry = getInt();
+		node.firstEdge = getInt();
+		node.numEdges = getInt();
+		_nodes.push_back(node);
+	}
+
+	int numEdges = ok ? getInt() : 0;
+	for (int i = 0; ok && i < numEdges; i++)
+	{
+		MatchEdge edge;
+		edge.key = getInt();
+		edge.child = getInt();
+		_edges.push_back(edge);
+	}
+
+	// Every edge has to stay inside the tree
+	for (int i = 0; ok && i < _nodes.size(); i++)
+		ok = _nodes[i].entry < _numEntries && _nodes[i].numEdges >= 0 && _nodes[i].firstEdge >= 0 && _nodes[i].firstEdge + _nodes[i].numEdges <= _edges.size();
+
+	for (int i = 0; ok && i < _edges.size(); i++)
+		ok = _edges[i].child > 0 && _edges[i].child < _nodes.size();
+
+	if (!ok || _nodes.size() < _mnemonics.size())
+	{
+		*this = OpcodeMatcher();
+		return false;
+	}
+
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "OpcodeDictionary.h"
+
+using namespace std;
+
+// A node of the decision tree. Inner nodes branch on the class of the next operand; leaves hold the opcode dictionary
+// entry that was selected.
+struct MatchNode
+{
+	int entry;			// -1 for inner nodes
+	int firstEdge;
+	int numEdges;
+};
+
+// Edges of a node are stored next to each other, sorted by key, so a node is searched with a binary search
+struct MatchEdge
+{
+	int key;			// operand class (NO_OPERAND, NUMERAL or a register id)
+	int child;
+};
+
+class OpcodeMatcher
+{
+public:
+	OpcodeMatcher();
+
+	void Build(OpcodeDictionary& opcodes);
+	int NumEntries() { return _numEntries; }
+	int NumNodes() { return _nodes.size(); }
+	bool IsAMnemonic(const string& mnemonic) { return _mnemonicIds.count(mnemonic) > 0; }
+	int Match(const string& mnemonic, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1);
+	void GetCandidates(const string& mnemonic, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1, int max, vector<int>& entries);
+	void Serialize(vector<unsigned char>& out);
+	bool Deserialize(const unsigned char* data, int size);
+
+	static constexpr int NO_OPERAND = -2;
+	static constexpr int NUMERAL = -1;
+	static constexpr int UNKNOWN_REGISTER = -3;		// a register that none of the opcodes use (never matches)
+
+private:
+	int OperandKey(int numArgs, int n, ArgType type, const string& text);
+	int FindChild(int node, int key);
+	int Walk(const string& mnemonic, int numArgs, ArgType t0, const string& a0, ArgType t1, const string& a1);
+	void CollectLeaves(int node, int max, vector<int>& entries);
+
+	static int EditDistance(const string& a, const string& b);
+
+	// Node m is the root for mnemonic id m. Below it come one level per operand.
+	vector<MatchNode> _nodes;
+	vector<MatchEdge> _edges;
+	vector<string> _mnemonics;
+	vector<string> _registers;
+	unordered_map<string, int> _mnemonicIds;
+	unordered_map<string, int> _registerIds;
+	int _numEntries;
+};
\ No newline at end of file
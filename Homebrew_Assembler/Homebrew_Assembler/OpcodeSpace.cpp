@@ -0,0 +1,126 @@
+#include "OpcodeSpace.h"
+#include <cmath>
+
+OpcodeSpace::OpcodeSpace()
+{
+	_sizes.clear();
+}
+
+// Architectures only use a handful of opcode sizes, so they are searched in order
+OpcodeSpaceSize* OpcodeSpace::Find(int bits)
+{
+	for (int s = 0; s < _sizes.size(); s++)
+	{
+		if (_sizes[s].bits == bits)
+			return &_sizes[s];
+	}
+
+	return nullptr;
+}
+
+// Returns the opcode dictionary entry that has claimed a slot, or -1 if it is free
+int OpcodeSpace::GetOwner(int bits, unsigned long long slot)
+{
+	OpcodeSpaceSize* size = Find(bits);
+	if (size == nullptr)
+		return -1;
+
+	if (bits <= MAX_DENSE_BITS)
+		return (size->bitmap[slot >> 6] >> (slot & 63)) & 1 ? size->owners[slot] : -1;
+
+	auto owner = size->sparseOwners.find(slot);
+	return owner != size->sparseOwners.end() ? owner->second : -1;
+}
+
+// Marks a slot as used by an entry. A slot that is already used keeps its first owner.
+void OpcodeSpace::Claim(int bits, unsigned long long slot, int entry)
+{
+	OpcodeSpaceSize* size = Find(bits);
+	if (size == nullptr)
+	{
+		OpcodeSpaceSize added;
+		added.bits = bits;
+		added.used = 0;
+
+		if (bits <= MAX_DENSE_BITS)
+		{
+			added.bitmap.assign(((1ULL << bits) + 63) / 64, 0);
+			added.owners.assign(1ULL << bits, -1);
+		}
+
+		_sizes.push_back(added);
+		size = &_sizes.back();
+	}
+
+	if (bits <= MAX_DENSE_BITS)
+	{
+		unsigned long long& word = size->bitmap[slot >> 6];
+		unsigned long long bit = 1ULL << (slot & 63);
+
+		if (!(word & bit))
+		{
+			word |= bit;
+			size->owners[slot] = entry;
+			size->used++;
+		}
+	}
+	else if (size->sparseOwners.emplace(slot, entry).second)
+		size->used++;
+}
+
+// Fraction of the slots of a size that are in use
+double OpcodeSpace::Utilization(int s)
+{
+	return _sizes[s].used / ldexp(1.0, _sizes[s].bits);
+}
+
+// Finds the longest run of unused slots. Only sizes that keep a bitmap can be searched; returns false for the others (and
+// for sizes without a free slot).
+bool OpcodeSpace::GetLargestFreeRun(int s, unsigned long long* first, unsigned long long* length)
+{
+	const OpcodeSpaceSize& size = _sizes[s];
+	if (size.bits > MAX_DENSE_BITS)
+		return false;
+
+	unsigned long long numSlots = 1ULL << size.bits;
+	unsigned long long runStart = 0;
+	*length = 0;
+
+	for (unsigned long long slot = 0; slot <= numSlots; slot++)
+	{
+		// Whole words of free (or used) slots are stepped over at once
+		if (slot < numSlots && (slot & 63) == 0 && slot + 64 <= numSlots)
+		{
+			unsigned long long word = size.bitmap[slot >> 6];
+			if (word == 0 || word == ~0ULL)
+			{
+				if (word == ~0ULL)
+				{
+					if (slot - runStart > *length)
+					{
+						*first = runStart;
+						*length = slot - runStart;
+					}
+
+					runStart = slot + 64;
+				}
+
+				slot += 63;
+				continue;
+			}
+		}
+
+		if (slot == numSlots || (size.bitmap[slot >> 6] >> (slot & 63)) & 1)
+		{
+			if (slot - runStart > *length)
+			{
+				*first = runStart;
+				*length = slot - runStart;
+			}
+
+			runStart = slot + 1;
+		}
+	}
+
+	return *length > 0;
+}
\ No newline at end of file
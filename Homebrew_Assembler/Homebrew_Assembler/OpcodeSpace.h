@@ -0,0 +1,37 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+// Occupancy of the opcode values of one opcode size. Sizes up to MAX_DENSE_BITS keep a bitmap of used slots and a table
+// of owners; larger ones only keep the owners of the slots in use.
+struct OpcodeSpaceSize
+{
+	int bits;
+	long long used;
+	vector<unsigned long long> bitmap;
+	vector<int> owners;
+	unordered_map<unsigned long long, int> sparseOwners;
+};
+
+class OpcodeSpace
+{
+public:
+	OpcodeSpace();
+
+	int GetOwner(int bits, unsigned long long slot);
+	void Claim(int bits, unsigned long long slot, int entry);
+	int NumSizes() { return _sizes.size(); }
+	int GetBits(int s) { return _sizes[s].bits; }
+	long long NumUsed(int s) { return _sizes[s].used; }
+	double Utilization(int s);
+	bool GetLargestFreeRun(int s, unsigned long long* first, unsigned long long* length);
+
+	static constexpr int MAX_DENSE_BITS = 16;
+
+private:
+	OpcodeSpaceSize* Find(int bits);
+
+	vector<OpcodeSpaceSize> _sizes;
+};
\ No newline at end of file
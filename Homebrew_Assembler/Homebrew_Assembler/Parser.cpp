@@ -1,6 +1,9 @@
 #include "Parser.h"
+#include "MappedFile.h"
 #include <string>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
 #include <iostream>
 
 /*=================================================== Parser::Parse ========================================================================
@@ -22,15 +25,30 @@ void Parser::Parse(const char* filename)
 	int linenum = 0;
 	string line;
 
-	// Open the file for input
-	ifstream inFile(filename);
-	if (inFile.is_open())
+	// Open the file for input. The language server hands over the text of the files it has open, which may not be saved.
+	bool inMemory = _sources != NULL && _sources->count(filename) > 0;
+
+	istringstream text;
+	ifstream inFile;
+	if (inMemory)
+		text.str(_sources->at(filename));
+	else
+		inFile.open(filename);
+
+	istream& in = inMemory ? (istream&)text : inFile;
+	if (inMemory || inFile.is_open())
 	{
 		// Initialize current token type
 		_currTokenType = TokenType::None;
 
+		// Listing records refer back to the source file by id rather than carrying a copy of the text
+		_currFileId = _programROM.AddSourceFile(filename);
+
+		// Error messages (and fixups) name the file that is being read
+		_currFile = filename;
+
 		// Pull in each line individually...will repeat until EOF
-		while (getline(inFile, line))
+		while (getline(in, line))
 		{
 			// Skip any lines already processed -- this is needed because this function sets linenum to zero
 			// every time it is called. We use _linePtr to save any previous line numbers in cases where 
@@ -47,9 +65,23 @@ void Parser::Parse(const char* filename)
 				continue;
 			}
 
+			// Lines inside a false conditional branch are dropped without being tokenized. Only lines starting with a
+			// directive are looked at (and only their first word), so that nested blocks and the matching
+			// .elif/.else/.endif can be found.
+			if (IsSkipping() && SkipRawLine(line.c_str()))
+			{
+				_linesSkipped++;
+				linenum++;
+				_linePtr++;
+				continue;
+			}
+
 			// Line parse object needs to be reset for every line!
 			ResetForNewLine();
 
+			// Errors (and everything that is reported later, like fixups) name the line being processed, counted from 1
+			_currLine = linenum + 1;
+
 			// Convert the line that was pulled in into an array of characters
 			const char* c_line = line.c_str();
 
@@ -61,66 +93,42 @@ void Parser::Parse(const char* filename)
 				// Tokenize the current line
 				ParseLineIntoTokens(c_line, " ,\t");
 
+				// Any bytes emitted by this line are recorded as a single listing entry
+				_programROM.BeginListingRecord(_currFileId, linenum, _lineColStart, _lineColEnd);
+
 				// If we actually have tokens...
 				if (_numTokens > 0)
 				{
-					char* label = NULL;
-					TokenType tokenType = TokenType::None;
-
-					// Loop over all of them
-					for (int i = 0; i < _numTokens; i++)
-					{
-						if (_outMode == OutMode::Verbose)
-						{
-							// Echo current token to screen
-							printf("       -> Token that is being parsed: #%d \"%s\"\n", i, _tokens[i]);
-						}
-
-						// If we are not processing the last token, store the next token.
-						// This is needed for directives whose second argument is an external file.
-						// For example, if we have a directive like .arch "homewbrew.arch"...the file we want
-						// is homebrew.arch
-						string nextToken;
-						if (i + 1 < _numTokens)
-							nextToken = _tokens[i + 1];
-
-						// Parse token i
-						retCode = ParseToken(i);
-
-						// If return code is -1 something has gone wrong
-						if (retCode == -1) printf("ERROR occurred while parsing tokens\n");
-
-						// If return code is 1, the parser has determined that we need to open and process another
-						// external file before continuing with the current one.
-						// For an example, look at demo.asm...you'll see the first line is .arch homebrew. When the
-						// ParseToken() function processes the ".arch" directive, it returns a retCode of 1 because
-						// it knows that homebrew.arch needs to be opened and processed before it can continue
-						// parsing demo.asm. Further down in demo.asm, there's also a .insert test2.asm directive,
-						// which again forces the parser to open test2.asm and process that before continuing with
-						// parsing in demo.asm. From a practical standpoint, you can picture it like the homebrew.arch
-						// and test2.asm files are copied and pasted in place of these lines. But this design was chosen
-						// to make programs more manageable. If I write a bunch of OS file management code, for example,
-						// I don't want to have to manually place that into every program that needs it. Instead, it would
-						// be much nicer to write the single line .insert OSfileManager.asm.
-						if (retCode == 1)
-						{ 
-							// Close the current file we are processing (don't worry...it will be opened again later)
-							inFile.close();
-
-							// Set a flag stating that we are processing an external file...this is mainly used to override
-							// the line skipping behavior in the while loop above. If we are opening a new file, we always
-							// want to start processing from line 0.
-							_processingExternFile = true;
-
-							// The directives that signal a new file needs to be parsed (i.e., those with return code 1)
-							// all store the filename as their second token. strtok() is used here to chop off the 
-							// quotation marks.
-							_currFile = strtok((char*)nextToken.c_str(), "\"");
-							break;
-						}
-
+					string nextFile;
+					retCode = ProcessLine(&nextFile);
+
+					// If return code is 1, the parser has determined that we need to open and process another
+					// external file before continuing with the current one.
+					// For an example, look at demo.asm...you'll see the first line is .arch homebrew. When the
+					// ParseToken() function processes the ".arch" directive, it returns a retCode of 1 because
+					// it knows that homebrew.arch needs to be opened and processed before it can continue
+					// parsing demo.asm. Further down in demo.asm, there's also a .insert test2.asm directive,
+					// which again forces the parser to open test2.asm and process that before continuing with
+					// parsing in demo.asm. From a practical standpoint, you can picture it like the homebrew.arch
+					// and test2.asm files are copied and pasted in place of these lines. But this design was chosen
+					// to make programs more manageable. If I write a bunch of OS file management code, for example,
+					// I don't want to have to manually place that into every program that needs it. Instead, it would
+					// be much nicer to write the single line .insert OSfileManager.asm.
+					if (retCode == 1)
+					{ 
+						// Stop reading the current file (don't worry...it will be opened again later)
+						in.setstate(ios::failbit);
+
+						// Set a flag stating that we are processing an external file...this is mainly used to override
+						// the line skipping behavior in the while loop above. If we are opening a new file, we always
+						// want to start processing from line 0.
+						_processingExternFile = true;
+
+						_currFile = nextFile;
 					}
 				}
+
+				_programROM.EndListingRecord();
 			}
 			else
 			{
@@ -143,9 +151,24 @@ void Parser::Parse(const char* filename)
 			printf("\nDONE!\n\n\n");
 		}
 
+		// Blocks that were opened but never closed would silently swallow the rest of the program
+		if (!_processingExternFile && retCode != 1 && (!_condStack.empty() || _macroDictionary.IsRecording()))
+		{
+			printf("\n\n!!! CRITICAL ERROR in \"%s\" !!!\n", filename);
+			if (!_condStack.empty())
+				printf("  -> %d .%s block(s) not closed with .%s! Parsing cannot continue until fixed\n", (int)_condStack.size(), IF_STR, ENDIF_STR);
+			else
+				printf("  -> .%s block not closed with .%s! Parsing cannot continue until fixed\n", _recordingRept ? REPT_STR : MACRO_STR, _recordingRept ? ENDR_STR : ENDM_STR);
+			retCode = -1;
+		}
+
 		// If retCode is 0 and we aren't processing an external file at this point, then we've finished parsing the original
 		// file and can write the program to ROM.
-		if (retCode == 0 && !_processingExternFile) 
+		if (retCode == 0 && !_processingExternFile && _architectureErrors > 0)
+		{
+			printf("\nROM not written: the architecture file has %d error(s)\n", _architectureErrors);
+		}
+		else if (retCode == 0 && !_processingExternFile) 
 		{
 			WriteProgramToROM(filename);
 		}
@@ -186,7 +209,21 @@ void Parser::Parse(const char* filename)
 		string fullFile = SplitFilename(filename_s, preferredPath, preferredExtension, false);
 		
 		// Parse this new file
+		bool loadingArchitecture = _currTokenType == TokenType::Architecture;
+		if (loadingArchitecture)
+			_parseMode = ParseMode::Architecture;
+
 		Parse(fullFile.c_str());
+
+		// All of the opcodes and control lines are known once the architecture file has been read, so the matcher can be
+		// compiled and the control patterns resolved and checked
+		if (loadingArchitecture)
+		{
+			_opcodeMatcher.Build(_opcodeDictionary);
+			ResolveControlDefinitions();
+			ValidateControlPatterns();
+			CompilePeepholeRules();
+		}
 			
 		// Since we are done parsing this new file, restore the saved line pointer so that we can continue parsing
 		// from where we left off previously.
@@ -212,999 +249,5191 @@ void Parser::WriteProgramToROM(const char* filename)
 	string preferredPath = "..\\Homebrew_Assembler\\ROM_Files\\";
 	string preferredExtension = ".bin";
 	string fullFile = SplitFilename(filename_s, preferredPath, preferredExtension, true);
-	printf("\n\nWriting ROM data to %s\n", fullFile.c_str());
 
-	// Print a list version of the interpreted program
-	_programROM.PrintList();
+	if (_currSection >= 0)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _sections[_currSection].line, _sections[_currSection].file.c_str());
+		printf("  -> Section \"%s\" has no .%s! Parsing cannot continue until fixed\n", _sections[_currSection].name.c_str(), ENDS_STR);
+		return;
+	}
 
-	// Print a hex table of the data that will be written to the ROM
-	_programROM.PrintTable();
+	// Patch the operands that referred to labels defined further down
+	if (!ResolveFixups())
+		return;
 
-	// Write the data to the ROM binary file
-	_programROM.WriteProgram((char*)fullFile.c_str(), 32768);
+	if (!ResolveEntries())
+		return;
 
-	for (int i = 0; i < _controlROMs.size(); i++)
+	// When .optimize finds something to rewrite, pool or leave out, shorter jumps apply or there are sections to place, the
+	// program is assembled again with them and that assembly is the one written
+	if (!_reassembling && (_optimizeRequested || !_relaxRules.empty() || !_sections.empty()) && Reassemble(filename))
+		return;
+
+	if (_reassembling)
 	{
-		_controlROMs[i].WriteControlROM();
+		// Sent back to be assembled with the long form of these jumps
+		if (!_relaxFailures.empty())
+			return;
+
+		if (_rewriteMismatch || _instructionIndex != _rewritePlan.size() || _dataIndex != _dataPlan.size())
+		{
+			printf("\nThe program's instructions changed between the two assemblies\n");
+			return;
+		}
+
+		if (!_testMode && !_peepholeApplications.empty())
+			PrintPeepholeReport();
+
+		if (!_testMode && _blocksPooled + _instructionsStripped > 0)
+			PrintLayoutReport();
+
+		if (!_testMode && !_sections.empty())
+			PrintSectionReport();
 	}
-}
 
-/*============================================ Parser::ParseLineIntoTokens()================================================================
-	DESCRIPTION:
-		  This function just prints a few versions of the interpreted program to the screen and writes the ROM data to a binary file.
-===========================================================================================================================================*/
-void Parser::ParseLineIntoTokens(const char* line, const char* delimiters)
-{
-	// Parse line into tokens by splitting on spaces, tabs, and commas
-	// This command actually only performs one split...hence the while loop below
-	char* tokens = strtok((char*)line, delimiters);
-	_tokens.push_back(tokens);
+	if (!EmitVeneers() || !CheckBanks() || !CheckOverlaps())
+		return;
 
-	_equalProcessed = false;
-	_lastOperation = BinaryOperation::None;
-	_ocValProcessed = false;
-	_opcodeIsAliased = false;
+	if (!CheckBudgets())
+		return;
 
-	// Skip blank lines and comments. Else, determine the line type.
-	if (tokens == NULL)
+	// The test runner only needs the program in memory
+	if (_testMode)
 	{
-		_lineType = LineType::Blank;
+		_programReady = true;
+		return;
 	}
-	else if (tokens != NULL && tokens[0] == ';')
+
+	if (!BuildControlROMs(SplitFilename(filename_s, preferredPath, ".ctl", true)))
+		return;
+
+	printf("\n\nWriting ROM data to %s\n", fullFile.c_str());
+
+	// Print a list version of the interpreted program. The listing is only built when it is asked for, since it has to
+	// go back to the source files to recover the text of each line.
+	if (_outMode == OutMode::Verbose)
+		_programROM.PrintList();
+
+	if (_listingRequested)
 	{
-		_lineType = LineType::Comment;
+		string listFile = SplitFilename(filename_s, preferredPath, ".lst", true);
+		printf("Writing listing to %s\n", listFile.c_str());
+		_programROM.WriteListing(listFile.c_str());
 	}
-	else
+
+	// The symbol map, cross reference and line table
+	if (_symbolsRequested)
 	{
-		switch (tokens[0])
-		{
-			case DIRECTIVE_KEYS[0]:
-				_lineType = LineType::Directive;
-				break;
+		for (int s = 0; s < _sections.size() && s < _sectionPlan.size(); s++)
+			_debugInfo.AddSection(_sections[s].name, _sections[s].bank, _sectionPlan[s], _sections[s].size);
 
-			case SYMBOL_KEYS[0]:
-				_lineType = LineType::Symbol;
-				break;
+		string symbolFile = SplitFilename(filename_s, preferredPath, ".sym", true);
+		printf("Writing symbols to %s\n", symbolFile.c_str());
+		_debugInfo.Write(symbolFile, SplitFilename(filename_s, preferredPath, ".xref", true), SplitFilename(filename_s, preferredPath, ".dbg", true), _programROM, _labelDictionary, _symbolLines);
+	}
 
-			case LABEL_KEYS[0]:
-				_lineType = LineType::Label;
-				break;
+	// Print a hex table of the data that will be written to the ROM
+	_programROM.PrintTable();
 
-			// Only thing left is an opcode!
-			default:
-				_lineType = LineType::OpCode;
-				break;
-		}
+	PrintStats();
 
-		// Continue splitting on the specified delimiters until none remain (i.e., NULL is returned)
-		while (tokens != NULL)
-		{
-			_numTokens++;
-			tokens = strtok(NULL, delimiters);
-			_tokens.push_back(tokens);
-		}
+	// Write the data to the ROM binary file
+	_programROM.WriteProgram((char*)fullFile.c_str(), PROGRAM_ROM_SIZE);
+
+	for (int i = 0; i < _controlROMs.size(); i++)
+	{
+		_controlROMs[i].WriteControlROM();
 	}
+
+	_programReady = true;
+
+	if (_simulationCycles > 0)
+		RunSimulation(filename_s);
+
+	if (!_expects.empty())
+		RunChecks(filename_s);
 }
 
-int Parser::ParseToken(int i)
+/*=============================================== Parser::BuildControlROMs() ================================================================
+	DESCRIPTION:
+		  Fills the control ROMs with the control pattern of every opcode, addressed by the opcode's value. The ROMs are used in
+		  the order they are declared, the first one holding the lowest bits. With a controlROM_layout line in the architecture
+		  file, the words can be packed (constant and duplicate bits dropped) or indexed (the first ROMs hold the number of a row
+		  of the following ROMs, which hold the packed words), and a report of the layouts is written next to the ROM file.
+===========================================================================================================================================*/
+bool Parser::BuildControlROMs(const string& reportFile)
 {
-	if (i >= _numTokens) return -1;
+	if (_controlROMs.empty())
+		return true;
 
-	char* directive_parse = strtok(_tokens[i], DIRECTIVE_KEYS);
-	char* symbol_parse = strtok(_tokens[i], SYMBOL_KEYS);
-	char* label_parse = strtok(_tokens[i], LABEL_KEYS);
+	int wordBits = 0;
+	for (int r = 0; r < _controlROMs.size(); r++)
+		wordBits += _controlROMs[r].GetBitWidth();
+	wordBits = min(wordBits, 64);
 
-	if (i == 0)
-	{
-		if (!strcmp(directive_parse, ARCH_STR))
-		{
-			_currTokenType = TokenType::Architecture;
-			return 1;
-		}
+	// One control word per opcode value (opcode aliases share both the value and the pattern)
+	vector<int> addresses;
+	vector<unsigned long long> words;
+	vector<vector<int>> entries;
+	unordered_map<int, int> seen;
 
-		if (!strcmp(directive_parse, INCLUDE_STR) || !strcmp(directive_parse, INSERT_STR))
+	for (int e = 0; e < _opcodeDictionary.NumOpcodes(); e++)
+	{
+		unsigned long long word = _opcodeDictionary.GetControlPattern(e);
+		if (wordBits < 64 && (word >> wordBits))
 		{
-			_currTokenType = TokenType::Include;
-			return 1;
+			printf("\n\n!!! CRITICAL ERROR: Control pattern %016llX of opcode %s doesn't fit the %d bits of the control ROMs !!!\n", word, _opcodeDictionary.Describe(e).c_str(), wordBits);
+			return false;
 		}
 
-		if (!strcmp(directive_parse, ORIGIN_STR))
+		auto found = seen.emplace(_opcodeDictionary.GetValue(e), addresses.size());
+		if (found.second)
 		{
-			_currTokenType = TokenType::Origin;
+			addresses.push_back(_opcodeDictionary.GetValue(e));
+			words.push_back(word);
+			entries.push_back(vector<int>());
 		}
 
-		if (!strcmp(directive_parse, EXPORT_STR))
-		{
-			_currTokenType = TokenType::Export;
-		}
+		entries[found.first->second].push_back(e);
+	}
 
-		if (!strcmp(directive_parse, BYTE_STR))
-		{
-			_currTokenType = TokenType::Byte;
-		}
+	MicrocodeLayout layout;
+	layout.Analyze(words, wordBits);
 
-		if (!strcmp(directive_parse, ASCII_STR))
-		{
-			_currTokenType = TokenType::Ascii;
-		}
+	// Which bits of the stored word each ROM holds: the index ROMs come first in the indexed layout, then the ROMs
+	// holding the (packed) control words
+	int indexBits = _controlLayout == MicrocodeLayoutType::Indexed ? layout.NumIndexBits() : 0;
+	int dataBits = _controlLayout == MicrocodeLayoutType::Direct ? wordBits : layout.NumPackedBits();
+	int r = 0;
 
-		if (!strcmp(_tokens[0], REGISTER_STR))
+	auto fillROMs = [&](int bits, int numRows, auto address, auto value)
+	{
+		int first = 0;
+		for (; first < bits && r < _controlROMs.size(); r++)
 		{
-			_lineType = LineType::ArchRegister;
-		}
+			ROMData& rom = _controlROMs[r];
+			unsigned long long mask = rom.GetBitWidth() >= 64 ? ~0ULL : (1ULL << rom.GetBitWidth()) - 1;
 
-		if (!strcmp(_tokens[0], CONTROL_STR))
-		{
-			_lineType = LineType::ArchControl;
-		}
+			for (int row = 0; row < numRows; row++)
+			{
+				if (address(row) < rom.GetROMsize())
+					rom.AddWord(address(row), (value(row) >> first) & mask);
+			}
 
-		if (!strcmp(_tokens[0], CONTROL_ALIAS_STR))
-		{
-			_lineType = LineType::ArchControlAlias;
-			_lastOperation = BinaryOperation::None;
+			first += rom.GetBitWidth();
 		}
 
-		if (!strcmp(_tokens[0], OPCODE_STR))
-		{
-			_lineType = LineType::ArchOpcode;			
-		}
+		return first >= bits;
+	};
 
-		if (!strcmp(_tokens[0], OPCODE_ALIAS_STR))
+	for (int a = 0; a < addresses.size(); a++)
+	{
+		if (addresses[a] >= _controlROMs[0].GetROMsize())
 		{
-			_lineType = LineType::ArchOpcode;			
-			_opcodeIsAliased = true;
+			printf("\n\n!!! CRITICAL ERROR: Opcode %s has value $%X, past the end of control ROM \"%s\" !!!\n", _opcodeDictionary.Describe(entries[a][0]).c_str(), addresses[a], _controlROMs[0].GetROMname().c_str());
+			return false;
 		}
+	}
 
-		if (!strcmp(_tokens[0], CONTROL_ROM_STR))
-		{
-			_lineType = LineType::ControlROM;
-			_controlROMindex++;
-			_controlROMs.push_back(ROMData());
-		}
+	bool fits;
+	if (indexBits > 0)
+	{
+		fits = fillROMs(indexBits, addresses.size(), [&](int a) { return addresses[a]; }, [&](int a) { return (unsigned long long)layout.GetIndex(words[a]); });
+		fits = fits && fillROMs(dataBits, layout.NumDistinct(), [&](int k) { return k; }, [&](int k) { return layout.GetDistinct(k); });
+	}
+	else if (_controlLayout == MicrocodeLayoutType::Packed)
+		fits = fillROMs(dataBits, addresses.size(), [&](int a) { return addresses[a]; }, [&](int a) { return layout.Pack(words[a]); });
+	else
+		fits = fillROMs(dataBits, addresses.size(), [&](int a) { return addresses[a]; }, [&](int a) { return words[a]; });
 
-		if (strcmp(symbol_parse, _tokens[0]))
-		{
-			_currTokenType = TokenType::Symbol;
-			_labelDictionary.currLabel = symbol_parse;
-		}
+	if (!fits)
+	{
+		printf("\n\n!!! CRITICAL ERROR: The indexed control ROM layout needs a %d-bit index and %d-bit rows, more than the %d control ROMs declared !!!\n", indexBits, dataBits, (int)_controlROMs.size());
+		return false;
+	}
 
-		if (strcmp(label_parse, _tokens[0]))
-		{
-			_currTokenType = TokenType::Label;
-			_labelDictionary.currLabel = label_parse;
-		}
+	if (_controlLayoutReport)
+	{
+		WriteMicrocodeReport(stdout, layout, addresses, words, entries);
 
-		if (_opcodeDictionary.IsAMnemonic(_tokens[0]))
+		FILE* file = fopen(reportFile.c_str(), "w");
+		if (file)
 		{
-			_currTokenType = TokenType::OpCode;
-
-			_opcodeDictionary.currMnemonic = _tokens[0];
-			_opcodeDictionary.currNumArgs = 0;
+			printf("Writing control ROM report to %s\n", reportFile.c_str());
+			WriteMicrocodeReport(file, layout, addresses, words, entries);
+			fclose(file);
 		}
 	}
 
-	int base = -1;
-	char* arg = _tokens[i];
+	return true;
+}
 
-	if (_currTokenType == TokenType::Origin && i == 1)
-	{
-		CalculateBase(1, &base, &arg);
+/*============================================= Parser::WriteMicrocodeReport() =============================================================
+	DESCRIPTION:
+		  Writes how many ROMs each control ROM layout needs, which control bits are constant or duplicated, and which
+		  control word each row of the decode ROM (in the indexed layout) stands for.
+===========================================================================================================================================*/
+void Parser::WriteMicrocodeReport(FILE* out, MicrocodeLayout& layout, const vector<int>& addresses, const vector<unsigned long long>& words, const vector<vector<int>>& entries)
+{
+	const int maxNames = 4;
+	int romBits = _controlROMs[0].GetBitWidth();
+	auto chips = [&](int bits) { return (bits + romBits - 1) / romBits; };
 
-		if (base != -1)
+	// Lists a set of bits as ranges, e.g. "0-7, 12"
+	auto ranges = [&](unsigned long long bits)
+	{
+		string text;
+		for (int b = 0; b < 64; b++)
 		{
-			int address = stoi(arg, nullptr, base);
-
-			if (_outMode == OutMode::Verbose)
-				printf("      -- Address set to: %02x\n", address);
+			if (!((bits >> b) & 1))
+				continue;
 
-			_programROM.SetCurrentAddress(address);
+			int e = b;
+			while (e < 63 && ((bits >> (e + 1)) & 1))
+				e++;
 
-			_currTokenType = TokenType::None;
+			text += (text.empty() ? "" : ", ") + to_string(b) + (e > b ? "-" + to_string(e) : "");
+			b = e;
 		}
-		else
+
+		return text.empty() ? string("none") : text;
+	};
+
+	int direct = _controlROMs.size();
+	int packed = chips(layout.NumPackedBits());
+	int indexed = chips(layout.NumIndexBits()) + packed;
+	int best = min(direct, min(packed, indexed));
+
+	fprintf(out, "\n=========================\n");
+	fprintf(out, "   CONTROL ROM LAYOUT\n");
+	fprintf(out, "=========================\n");
+	fprintf(out, "Control word:         %d bits in %d ROM(s)\n", layout.GetWordBits(), direct);
+	fprintf(out, "Opcode values:        %d (%d distinct control words)\n", (int)addresses.size(), layout.NumDistinct());
+	fprintf(out, "Always 0:             %s\n", ranges(layout.GetConstantMask() & ~layout.GetOnesMask()).c_str());
+	fprintf(out, "Always 1:             %s\n", ranges(layout.GetOnesMask()).c_str());
+	fprintf(out, "Packed width:         %d bits\n", layout.NumPackedBits());
+	fprintf(out, "Direct layout:        %d ROM(s)\n", direct);
+	fprintf(out, "Packed layout:        %d ROM(s)\n", packed);
+	fprintf(out, "Indexed layout:       %d ROM(s) (%d-bit index, %d x %d-bit decode rows)\n", indexed, layout.NumIndexBits(), layout.NumDistinct(), layout.NumPackedBits());
+	fprintf(out, "ROMs saved:           %d\n", direct - best);
+
+	fprintf(out, "\nPacked bit  Control bits\n");
+	for (int k = 0; k < layout.NumPackedBits(); k++)
+	{
+		unsigned long long driven = 0;
+		for (int b = 0; b < layout.GetWordBits(); b++)
 		{
-			printf("      -- ERROR occurred in parsing argument for ORIGIN directive\n");
+			if (layout.GetSource(b) == k)
+				driven |= 1ULL << b;
 		}
+
+		fprintf(out, "%10d  %s\n", k, ranges(driven).c_str());
 	}
 
-	if (_currTokenType == TokenType::Export && i > 0)
+	fprintf(out, "\nIndex  Packed    Control word      Opcodes\n");
+	for (int k = 0; k < layout.NumDistinct(); k++)
 	{
-		if (i == 1)
-		{
-			CalculateBase(1, &base, &arg);
-
-			if (base != -1)
-			{
-				int startAddress = stoi(arg, nullptr, base);
+		string names;
+		int numNames = 0;
+		unsigned long long word = 0;
 
-				if (_outMode == OutMode::Verbose)
-					printf("      -- Start Address set to: %02x\n", startAddress);
+		for (int a = 0; a < addresses.size(); a++)
+		{
+			if (layout.GetIndex(words[a]) != k)
+				continue;
 
-				_programROM.SetStartAddress(startAddress);
-			}
-			else
+			word = words[a];
+			for (int e : entries[a])
 			{
-				printf("      -- ERROR occurred in parsing argument for EXPORT directive\n");
+				if (numNames++ < maxNames)
+					names += (names.empty() ? "" : ", ") + _opcodeDictionary.Describe(e);
 			}
 		}
 
-		if (i == 2)
-		{
-			CalculateBase(2, &base, &arg);
-
-			if (base != -1)
-			{
-				int endAddress = stoi(arg, nullptr, base);
+		if (numNames > maxNames)
+			names += ", ...";
 
-				if (_outMode == OutMode::Verbose)
-					printf("      -- End Address set to: %02x\n", endAddress);
+		fprintf(out, "%5d  %08llX  %016llX  %s\n", k, layout.GetDistinct(k), word, numNames > 0 ? names.c_str() : "(unused opcodes)");
+	}
+}
 
-				_programROM.SetEndAddress(endAddress);
+/*================================================ Parser::BuildSimulator() =================================================================
+	DESCRIPTION:
+		  Sets up a simulation of the architecture with the assembled program loaded. The simulator is given every register, what
+		  the control lines do (from the control_action lines) and the control word of every 8-bit opcode; skipped is set to the
+		  number of opcodes that can't be simulated.
+===========================================================================================================================================*/
+bool Parser::BuildSimulator(Simulator& simulator, int* skipped)
+{
+	// Registers are added by size, in the order they were declared
+	vector<int> sizes;
+	for (auto& registerClass : _registerClasses)
+		sizes.push_back(registerClass.first);
+	sort(sizes.begin(), sizes.end());
 
-				_currTokenType = TokenType::None;
-			}
-			else
-			{
-				printf("      -- ERROR occurred in parsing argument for EXPORT directive\n");
-			}
-		}
+	for (int size : sizes)
+	{
+		for (const string& name : _registerClasses[size])
+			simulator.AddRegister(name, size);
 	}
 
-	if (_lineType == LineType::ArchRegister && i > 0)
+	for (const ControlActionDefinition& definition : _controlActions)
 	{
-		int cmdSize = stoi(_tokens[1], nullptr, 10);
+		long long value = 0;
+		int reg = definition.reg.empty() ? -1 : simulator.FindRegister(definition.reg);
 
-		// If arch file was correctly typed, anything token at this point should be the label of a new register.
-		// So, let's add it to the register dictionary. Throw an error if register has already been added. Skip
-		// parsing equal sign.
-		if (strcmp(_tokens[i], "="))
+		if (!_controlDictionary.Resolve(definition.control, &value) || value == 0 || (!definition.reg.empty() && reg < 0))
 		{
-			if (!IsNumeric(_tokens[i]) && _registerDictionary.GetLabel((char*)_tokens[i]))
-			{
-				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-				printf("  -> Register \"%s\" already defined! Parsing cannot continue until fixed\n", _tokens[i]);
-				return -1;
-			}
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", definition.line, definition.file.c_str());
+			if (!_controlDictionary.IsDefined(definition.control))
+				printf("  -> \"%s\" is not a control line! Simulation cannot continue until fixed\n", definition.control.c_str());
+			else if (value == 0)
+				printf("  -> Control line \"%s\" has no bits set, so it would always be active! Simulation cannot continue until fixed\n", definition.control.c_str());
 			else
-			{
-				// Add this register to the register dictionary
-				_registerDictionary.Add(_tokens[i], cmdSize);
-
-				if (_outMode == OutMode::Verbose)
-					printf("       -> Adding %d-bit register: \"%s\"\n", _registerDictionary.currValue, _registerDictionary.currLabel.c_str());
-			}
+				printf("  -> \"%s\" is not a register! Simulation cannot continue until fixed\n", definition.reg.c_str());
+			return false;
 		}
+
+		simulator.AddAction({ (unsigned long long)value, _controlFields.GetFieldMask(value), definition.type, reg });
 	}
 
-	if (_lineType == LineType::ArchControl && i > 0)
-	{
-		_controlDictionary.currLabel = _tokens[1];
+	// The dispatch table is indexed by the first byte of an instruction, which has to be the whole opcode (with any register
+	// operands it encodes). The first opcode with a value wins, as opcode aliases share the value and the pattern.
+	*skipped = 0;
+	bool used[256] = {};
 
-		if (i > 1)
+	for (int e = 0; e < _opcodeDictionary.NumOpcodes(); e++)
+	{
+		if (_opcodeDictionary.GetSize(e) != 8)
 		{
-			if (i >= 2)
-			{
-				if (strcmp(_tokens[i], "="))
-				{
-					int base;
-					char* arg;
-					CalculateBase(i, &base, &arg);
-
-					int val = stoi(arg, nullptr, base);
+			(*skipped)++;
+			continue;
+		}
 
-					_controlDictionary.currValue = val;
-					_controlDictionary.AddCurrentEntry();
+		long long args[2] = { 0, 0 };
+		bool immediate[2] = { true, true };
+		int constant = -1;
 
-					if (_outMode == OutMode::Verbose)
-						printf("Adding Label %s with Value %08x\n", _controlDictionary.currLabel.c_str(), _controlDictionary.currValue);
-				}
+		for (int n = 0; n < _opcodeDictionary.GetNumArgs(e) && n < 2; n++)
+		{
+			if (_opcodeDictionary.GetArgType(e, n) == ArgType::Register)
+			{
+				args[n] = _registerIds.GetLabelValue(_opcodeDictionary.GetArgString(e, n).c_str());
+				immediate[n] = false;
 			}
-		
+			else if (constant < 0)
+				constant = n;
 		}
-	}
 
-	if (_lineType == LineType::ArchControlAlias && i > 0)
-	{
-		_controlDictionary.currLabel = _tokens[1];
+		int layout = _opcodeDictionary.GetLayout(e);
+		int firstByte = (int)(_encoder.FixedBits(layout, _opcodeDictionary.GetValue(e), args, immediate) >> (8 * (_encoder.Size(layout) - 1)));
 
-		if (i > 1)
-		{
-			if (!strcmp(_tokens[i], "=") || !strcmp(_tokens[i], "{") || !strcmp(_tokens[i], "("))
-			{
-				_controlDictionary.currValue = 0;
-				_lastOperation = BinaryOperation::None;
+		if (!used[firstByte & 0xFF])
+			simulator.AddInstruction(firstByte, _opcodeDictionary.GetControlPattern(e), layout, constant, _opcodeDictionary.GetMinCycles(e), _opcodeDictionary.GetMaxCycles(e));
+		used[firstByte & 0xFF] = true;
+	}
 
-				if (_outMode == OutMode::Verbose)
-					printf("     ---> ADDING CONTROL VAL: %08x\n", _controlDictionary.currValue);
-			}
-			else if (!strcmp(_tokens[i], "|"))
-			{
-				_lastOperation = BinaryOperation::LogicalOR;
-			}
-			else if (!strcmp(_tokens[i], "&"))
-			{
-				_lastOperation = BinaryOperation::LogicalAND;
-			}
-			else if (!strcmp(_tokens[i], "}") || !strcmp(_tokens[i], ")"))
-			{
-				_controlDictionary.AddCurrentEntry();
+	// The simulator sees bank 0. Without an .export range, the program runs up to the last byte that was written.
+	vector<unsigned char> image;
+	_programROM.GetBankImage(0, image);
 
-				if (_outMode == OutMode::Verbose)
-					printf("Adding Label %s with Value %08x\n", _controlDictionary.currLabel.c_str(), _controlDictionary.currValue);
-			}
-			else
-			{
-				int val = _controlDictionary.GetLabelValue((char*)_tokens[i]);
-				printf("         -> Val %s from dictionary: %08x\n", _tokens[i], val);
-				if (val == -1)
-				{
-					int base;
-					char* arg;
-					CalculateBase(i, &base, &arg);
+	int end = _programROM.GetEndAddress();
+	if (end <= _programROM.GetStartAddress())
+		end = (int)image.size() - 1;
 
-					val = stoi(arg, nullptr, base);
-				}
-								
-				//if (_outMode == OutMode::Verbose)
-					printf("         -> Val %s from dictionary: %08x\n", _tokens[i], val);
+	simulator.LoadProgram(image, _programROM.GetStartAddress(), end);
+	return true;
+}
 
-				switch (_lastOperation)
-				{
-				case BinaryOperation::LogicalOR:
-					if (_outMode == OutMode::Verbose)
-					{
-						printf("     ---> OR operation\n");
-						printf("     ---> Prior to op: %08x\n", _controlDictionary.currValue);
-					}
+/*================================================ Parser::RunSimulation() ==================================================================
+	DESCRIPTION:
+		  Runs the assembled program on a simulation of the architecture, one instruction at a time until it halts, reaches an
+		  unknown opcode, leaves the exported range or reaches the cycle limit of the .simulate directive. With .profile, the
+		  cycles spent on each source line are written next to the ROM file as a hot spot table (.prof) and as folded stacks
+		  for flame graph tools (.folded).
+===========================================================================================================================================*/
+void Parser::RunSimulation(const string& filename)
+{
+	Simulator simulator(_encoder);
+	int skipped = 0;
 
-					_controlDictionary.currValue = _controlDictionary.currValue | val;
-					
-					if (_outMode == OutMode::Verbose)
-						printf("     ---> After op: %08x\n", _controlDictionary.currValue);
-					break;
+	if (!BuildSimulator(simulator, &skipped))
+		return;
 
-				case BinaryOperation::LogicalAND:
-					if (_outMode == OutMode::Verbose)
-					{
-						printf("     ---> OR operation\n");
-						printf("     ---> Prior to op: %08x\n", _controlDictionary.currValue);
-					}
+	if (_profileRequested)
+		simulator.EnableProfiling();
 
-					_controlDictionary.currValue = _controlDictionary.currValue & val;
+	SimStop stop = simulator.Run(_simulationCycles, true);
 
-					if (_outMode == OutMode::Verbose)
-						printf("     ---> After op: %08x\n", _controlDictionary.currValue);
-					break;
+	printf("\n=========================\n");
+	printf("       SIMULATION\n");
+	printf("=========================\n");
+	printf("Cycles:               %lld\n", simulator.GetCycles());
 
-				case BinaryOperation::None:
-					_controlDictionary.currValue = val;
-					if (_outMode == OutMode::Verbose)
-						printf("     ---> ADDING VAL: %08X\n", _controlDictionary.currValue);
-					break;
-				}
+	int pc = simulator.GetPC();
+	int opcode = 0;
+	_programROM.GetValueAtAddress(pc, &opcode);
 
-				if (i == _numTokens - 1)
-				{
-					_controlDictionary.AddCurrentEntry();
-					if (_outMode == OutMode::Verbose)
-						printf("Adding Label %s with Value %08x\n", _controlDictionary.currLabel.c_str(), _controlDictionary.currValue);
-				}
+	switch (stop)
+	{
+	case SimStop::Halted:		printf("Stopped:              halted, next instruction at $%04X\n", pc);								break;
+	case SimStop::CycleLimit:	printf("Stopped:              cycle limit reached at $%04X\n", pc);									break;
+	case SimStop::EndOfProgram:	printf("Stopped:              left the program at $%04X\n", pc);										break;
+	default:					printf("Stopped:              unknown opcode $%02X at $%04X\n", opcode, pc);	break;
+	}
+
+	if (simulator.GetSeconds() > 0)
+		printf("Speed:                %.1f million cycles/s\n", simulator.GetCycles() / simulator.GetSeconds() / 1e6);
+	printf("Micro-programs:       %d\n", simulator.NumPrograms());
+	printf("Translated blocks:    %d (%lld interpreted steps)\n", simulator.NumBlocks(), simulator.GetFallbacks());
+	if (skipped > 0)
+		printf("Not simulated:        %d opcodes wider than 8 bits\n", skipped);
+	if (!simulator.GetOutput().empty())
+		printf("Output:               \"%s\"\n", simulator.GetOutput().c_str());
+
+	for (int r = 1; r < simulator.NumRegisters(); r++)
+		printf("%-4s = $%0*llX\n", simulator.GetRegisterName(r).c_str(), (simulator.GetRegisterBits(r) + 3) / 4, simulator.GetRegister(r));
+
+	// In verbose mode the program is run again on the interpreter alone, to check the translated blocks against it and
+	// to see how much faster they are
+	if (_outMode == OutMode::Verbose)
+	{
+		Simulator interpreter(_encoder);
+		BuildSimulator(interpreter, &skipped);
+		if (_profileRequested)
+			interpreter.EnableProfiling();
+		SimStop check = interpreter.Run(_simulationCycles, false);
+
+		bool same = check == stop && interpreter.GetCycles() == simulator.GetCycles() && interpreter.GetPC() == pc && interpreter.GetProfile() == simulator.GetProfile();
+		for (int r = 0; r < simulator.NumRegisters(); r++)
+			same = same && interpreter.GetRegister(r) == simulator.GetRegister(r);
+
+		if (interpreter.GetSeconds() > 0 && simulator.GetSeconds() > 0)
+			printf("Interpreter speed:    %.1f million cycles/s (speed-up of the translated blocks: %.1fx)\n", interpreter.GetCycles() / interpreter.GetSeconds() / 1e6, interpreter.GetSeconds() / simulator.GetSeconds());
+		if (!same)
+			printf("!!! WARNING: the interpreter ended in a different state than the translated blocks !!!\n");
+	}
+
+	if (_profileRequested)
+	{
+		Profiler profiler(_programROM);
+		profiler.Collect(simulator.GetProfile());
+
+		printf("\nHot spots:\n");
+		profiler.WriteHotSpots(stdout, PROFILE_HOT_SPOTS);
+
+		string preferredPath = "..\\Homebrew_Assembler\\ROM_Files\\";
+		string profileFile = SplitFilename(filename, preferredPath, ".prof", true);
+		string foldedFile = SplitFilename(filename, preferredPath, ".folded", true);
+		FILE* out = fopen(profileFile.c_str(), "w");
+		FILE* folded = fopen(foldedFile.c_str(), "w");
+
+		if (out != NULL && folded != NULL)
+		{
+			printf("Writing profile to %s and %s\n", profileFile.c_str(), foldedFile.c_str());
+			profiler.WriteHotSpots(out, 0);
+			profiler.WriteFolded(folded, "");
+		}
+		else
+			printf("Unable to write profile to %s\n", out == NULL ? profileFile.c_str() : foldedFile.c_str());
+
+		if (out != NULL)
+			fclose(out);
+		if (folded != NULL)
+			fclose(folded);
+	}
+
+	printf("=========================\n");
+}
+
+/*================================================= Parser::BuildChecks() ==================================================================
+	DESCRIPTION:
+		  Evaluates the expressions of the .expect/.assert lines, now that every label is known, and turns them into checks on the
+		  registers and memory of the simulator. Errors are reported at the line of the directive.
+===========================================================================================================================================*/
+bool Parser::BuildChecks(Simulator& simulator, vector<TestCheck>& checks)
+{
+	bool ok = true;
+	int savedLine = _currLine;
+	string savedFile = _currFile;
+
+	// The simulator's memory is the image of bank 0, which nothing a program does can write to
+	int first = 0;
+	int last = -1;
+	_programROM.GetBankRange(0, &first, &last);
+
+	for (const ExpectDefinition& expect : _expects)
+	{
+		_currLine = expect.line;
+		_currFile = expect.file;
+
+		TestCheck check;
+		check.text = expect.text;
+		check.file = expect.file;
+		check.line = expect.line;
+		check.reg = -1;
+		check.address = 0;
+		check.op = expect.op;
+		check.after = -1;
+		check.within = expect.within;
+
+		if (!expect.reg.empty())
+		{
+			check.reg = simulator.FindRegister(expect.reg);
+			if (check.reg < 0)
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", expect.line, expect.file.c_str());
+				printf("  -> \"%s\" is not a register! Parsing cannot continue until fixed\n", expect.reg.c_str());
+				ok = false;
+				continue;
+			}
+		}
+		else if (!EvaluateExpression(expect.address, _labelDictionary, &check.address))
+		{
+			ok = false;
+			continue;
+		}
+		else if (check.address < 0 || check.address > last)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", expect.line, expect.file.c_str());
+			printf("  -> %s address $%04X is outside of the program image ($0000-$%04X)! Parsing cannot continue until fixed\n", EXPECT_MEM_STR, check.address, max(last, 0));
+			ok = false;
+			continue;
+		}
+
+		if (!EvaluateExpression(expect.value, _labelDictionary, &check.value) || (!expect.after.empty() && !EvaluateExpression(expect.after, _labelDictionary, &check.after)))
+		{
+			ok = false;
+			continue;
+		}
+
+		checks.push_back(check);
+	}
+
+	_currLine = savedLine;
+	_currFile = savedFile;
+
+	return ok;
+}
+
+/*================================================== Parser::BuildTest() ===================================================================
+	DESCRIPTION:
+		  Hands the assembled program and its checks to the test runner, with a simulator of its own. Returns false if the program
+		  wasn't assembled (or its checks are wrong).
+===========================================================================================================================================*/
+bool Parser::BuildTest(TestCase& test)
+{
+	if (_reassembled)
+		return _reassembled->BuildTest(test);
+
+	if (!_programReady)
+		return false;
+
+	int skipped = 0;
+	test.simulator = make_unique<Simulator>(_encoder);
+	test.profiler = make_unique<Profiler>(_programROM);
+	test.maxCycles = _simulationCycles > 0 ? _simulationCycles : DEFAULT_SIMULATION_CYCLES;
+	test.checks.clear();
+
+	return BuildSimulator(*test.simulator, &skipped) && BuildChecks(*test.simulator, test.checks);
+}
+
+/*================================================= Parser::Disassemble() ==================================================================
+	DESCRIPTION:
+		  Reads an architecture file and turns a ROM image made for it back into source that assembles to the same bytes. The image
+		  starts at address base. Addresses that jumps go to get labels. Without an output file, the source is written to the
+		  assembly folder as name.dis.asm. Returns false if the architecture or the image can't be read.
+===========================================================================================================================================*/
+bool Parser::Disassemble(const char* archFile, const char* romFile, int base, const char* outFile)
+{
+	string arch = SplitFilename(archFile, "..\\Homebrew_Assembler\\Architecture_Config\\", ".arch", false);
+
+	// The architecture is read the same way as for an .arch line, just without a program around it
+	ParseMode mode = _parseMode;
+	_processingExternFile = true;
+	_parseMode = ParseMode::Architecture;
+	_programROM.SetArchitecture(archFile);
+	Parse(arch.c_str());
+	_processingExternFile = false;
+	_parseMode = mode;
+
+	if (_opcodeDictionary.NumOpcodes() == 0 || _architectureErrors > 0)
+	{
+		printf("\nUnable to disassemble: the architecture file \"%s\" has no opcodes or has errors\n", arch.c_str());
+		return false;
+	}
+
+	ResolveControlDefinitions();
+	ValidateControlPatterns();
+
+	Disassembler disassembler(_encoder);
+	for (int e = 0; e < _opcodeDictionary.NumOpcodes(); e++)
+	{
+		long long args[2] = { 0, 0 };
+		bool immediate[2] = { true, true };
+
+		for (int n = 0; n < _opcodeDictionary.GetNumArgs(e) && n < 2; n++)
+		{
+			if (_opcodeDictionary.GetArgType(e, n) == ArgType::Register)
+			{
+				args[n] = _registerIds.GetLabelValue(_opcodeDictionary.GetArgString(e, n).c_str());
+				immediate[n] = false;
+			}
+		}
+
+		int layout = _opcodeDictionary.GetLayout(e);
+		disassembler.AddOpcode(e, layout, _encoder.FixedMask(layout, immediate), _encoder.FixedBits(layout, _opcodeDictionary.GetValue(e), args, immediate), immediate, HasAction(e, MicroOpType::Jump));
+	}
+
+	disassembler.Build();
+
+	MappedFile image;
+	if (!image.Open(romFile))
+	{
+		printf("\nUnable to disassemble: \"%s\" can't be read\n", romFile);
+		return false;
+	}
+
+	disassembler.Decode(image.Data(), (int)image.Size(), base);
+
+	string sourceFile = outFile != NULL ? outFile : SplitFilename(romFile, "..\\Homebrew_Assembler\\Assembly_Code\\", ".dis.asm", true);
+	FILE* out = fopen(sourceFile.c_str(), "w");
+	if (out == NULL)
+	{
+		printf("\nUnable to disassemble: \"%s\" can't be written\n", sourceFile.c_str());
+		return false;
+	}
+
+	disassembler.Write(out, _opcodeDictionary, archFile, romFile);
+	fclose(out);
+
+	printf("\nDisassembled %d bytes: %d instructions, %d data bytes, %d labels\n", (int)image.Size(), disassembler.NumInstructions(), disassembler.NumDataBytes(), disassembler.NumLabels());
+	printf("Writing source to %s\n", sourceFile.c_str());
+	return true;
+}
+
+/*================================================== Parser::PatchLine() ===================================================================
+	DESCRIPTION:
+		  Assembles one edited line of an assembled program again, for the language server, and writes its bytes over the old
+		  ones. The line has to be an instruction whose labels are all defined, and lines is the whole edited file. When the
+		  instruction changes length, the rest of its region moves along (see ShiftRegion()). line is counted from 0. Returns
+		  false if the line has to go through a full assembly instead, after which this parser shouldn't be used any more.
+===========================================================================================================================================*/
+bool Parser::PatchLine(const string& file, int line, const vector<string>& lines)
+{
+	// A program that was assembled again is patched in the assembly that replaced it
+	if (_reassembled)
+		return _reassembled->PatchLine(file, line, lines);
+
+	if (!_programReady || line < 0 || line >= lines.size())
+		return false;
+
+	const vector<string>& files = _programROM.GetSourceFiles();
+	int fileId = find(files.begin(), files.end(), file) - files.begin();
+	if (fileId == files.size())
+		return false;
+
+	const vector<ListingRecord>& listing = _programROM.GetListing();
+
+	// Lines that define a label, or whose instruction was rewritten, change more than their bytes, so they get no record to
+	// assemble again. Neither does a symbol's line, but the dictionary works its value out again by itself.
+	if (_recordAt.empty())
+	{
+		for (int r = 0; r < listing.size(); r++)
+		{
+			long long key = SourceIndex::LineKey(listing[r].fileId, listing[r].line);
+			_recordAt[key] = _recordAt.count(key) ? -1 : r;
+		}
+
+		for (const ListingLabel& label : _programROM.GetLabels())
+			_recordAt[SourceIndex::LineKey(label.fileId, label.line)] = -1;
+
+		for (long long key : _rewrittenLines)
+			_recordAt[key] = -1;
+
+		for (auto& symbol : _symbolLines)
+			_recordAt.emplace(SourceIndex::LineKey(symbol.second.first, symbol.second.second), -2);
+	}
+
+	auto found = _recordAt.find(SourceIndex::LineKey(fileId, line));
+	if (found == _recordAt.end() || found->second < 0 || listing[found->second].instructions != 1)
+		return false;
+
+	// What an instruction jumps to decides which code .optimize leaves out
+	int r = found->second;
+	if (_optimizeRequested && listing[r].endsBlock)
+		return false;
+
+	int bank = _programROM.GetBank();
+	int address = _programROM.GetCurrentAddress();
+	_currFile = file;
+	_currFileId = fileId;
+
+	_patchedRecords.assign(1, r);
+	_patchedNames.clear();
+
+	// The line is assembled once to see how long it is now, and then with everything else that moves
+	vector<unsigned char> bytes;
+	int length = AssembleAgain(r, lines[line], bytes);
+	bool fits = length == listing[r].length || (length > 0 && ShiftRegion(r, length - listing[r].length, lines, _patchedRecords));
+
+	// The cross reference gets the uses of the lines as they are now
+	if (fits)
+	{
+		unordered_set<int> changed;
+		for (int k : _patchedRecords)
+			changed.insert(listing[k].line);
+
+		_debugInfo.RemoveUses(fileId, changed);
+	}
+
+	for (int k = 0; fits && k < _patchedRecords.size(); k++)
+	{
+		const ListingRecord& record = listing[_patchedRecords[k]];
+		fits = AssembleAgain(_patchedRecords[k], lines[record.line], bytes) == record.length;
+
+		if (fits)
+			_programROM.ReplaceRecord(_patchedRecords[k], bytes);
+	}
+
+	_programROM.SetBank(bank);
+	_programROM.SetCurrentAddress(address);
+
+	if (!fits)
+		_programReady = false;
+
+	return fits;
+}
+
+/*================================================= Parser::AssembleAgain() ================================================================
+	DESCRIPTION:
+		  Assembles the line of listing record r again from text, where the record is, for PatchLine(). An instruction's bytes are
+		  collected in bytes, while data is written into the image, and the line is left as the pending record. Returns the
+		  number of bytes it assembled to, or -1 if it isn't what the record holds (one instruction, or data) or it uses a
+		  label that isn't defined.
+===========================================================================================================================================*/
+int Parser::AssembleAgain(int r, const string& text, vector<unsigned char>& bytes)
+{
+	const ListingRecord& record = _programROM.GetListing()[r];
+
+	// The tokens point into the line, which strtok() writes over, so they get a copy of their own
+	string copy = text;
+	ResetForNewLine();
+	ParseLineIntoTokens(copy.c_str(), " ,\t");
+
+	LineType type = record.instructions > 0 ? LineType::OpCode : LineType::Directive;
+	if (_numTokens == 0 || _lineType != type || _macroDictionary.GetMacro(_tokens[0]) >= 0)
+		return -1;
+
+	size_t fixups = _fixups.size();
+	size_t farCalls = _farCalls.size();
+	size_t regions = _regions.size();
+	int encoded = _instructionsEncoded;
+
+	// At the record's address, "$" and relative jumps come out right
+	_programROM.SetBank(record.bank);
+	_programROM.SetCurrentAddress(record.address);
+	_programROM.BeginListingRecord(record.fileId, record.line, _lineColStart, _lineColEnd);
+	_currLine = record.line + 1;
+
+	bytes.clear();
+	_patchBytes = &bytes;
+
+	string nextFile;
+	int result = ProcessLine(&nextFile);
+	_patchBytes = NULL;
+
+	// A new fixup is a label that isn't defined, and a new far call may need a veneer
+	if (result != 0 || _fixups.size() != fixups || _farCalls.size() != farCalls || _regions.size() != regions || _instructionsEncoded != encoded + record.instructions)
+		return -1;
+
+	return record.instructions > 0 ? (int)bytes.size() : _programROM.GetCurrentAddress() - record.address;
+}
+
+/*================================================== Parser::ShiftRegion() =================================================================
+	DESCRIPTION:
+		  Makes room for record r growing (or shrinking) by delta bytes, for PatchLine(): the bytes, records and labels after it
+		  in its region move along, and the symbols are worked out again. again gets every record that has to be assembled again
+		  after that, in order: the ones that moved, and the ones that use a label that moved or a symbol whose value changed.
+		  Returns false if the program has to be assembled in full instead, which is when the next region doesn't start at an
+		  address of its own, the bytes would run into others or out of their bank's window, or a line that needs assembling
+		  again isn't one that can be assembled on its own (in this file).
+===========================================================================================================================================*/
+bool Parser::ShiftRegion(int r, int delta, const vector<string>& lines, vector<int>& again)
+{
+	// Rewrites, sections and veneers all depend on where everything is, and so do the jumps relaxation looked at (whether it
+	// could shorten them or not)
+	if (_reassembling || _optimizeRequested || _branchesShort + _branchesLong > 0 || !_sections.empty() || _veneers > 0)
+		return false;
+
+	const vector<ListingRecord>& listing = _programROM.GetListing();
+	const vector<ListingLabel>& labels = _programROM.GetLabels();
+	const ListingRecord& record = listing[r];
+
+	auto after = upper_bound(_regions.begin(), _regions.end(), r, [](int k, const AddressRegion& region) { return k < region.firstRecord; });
+	AddressRegion region = after == _regions.begin() ? AddressRegion{ 0, 0, 0, true } : *(after - 1);
+	AddressRegion next = after == _regions.end() ? AddressRegion{ (int)listing.size(), (int)labels.size(), _labelDictionary.NumLabels(), true } : *after;
+
+	if (!next.fixed)
+		return false;
+
+	for (int k = r + 1; k < next.firstRecord; k++)
+	{
+		auto found = _recordAt.find(SourceIndex::LineKey(listing[k].fileId, listing[k].line));
+		if (listing[k].fileId != record.fileId || found == _recordAt.end() || found->second != k || listing[k].line >= lines.size())
+			return false;
+
+		again.push_back(k);
+	}
+
+	int end = next.firstRecord > r + 1 ? listing[next.firstRecord - 1].address + listing[next.firstRecord - 1].length : record.address + record.length;
+	for (int a = end; a < end + delta; a++)
+	{
+		if (_programROM.IsWritten(ROMData::ImageAddress(record.bank, a)))
+			return false;
+	}
+
+	auto window = _banks.find(record.bank);
+	if (delta > 0 && window != _banks.end() && window->second.size > 0 && end + delta > window->second.base + window->second.size)
+		return false;
+
+	for (int l = region.firstLabel; l < next.firstLabel; l++)
+	{
+		if (labels[l].address > record.address)
+			_patchedNames.push_back(labels[l].name);
+	}
+
+	unordered_map<string, long long> values;
+	for (auto& symbol : _symbolLines)
+	{
+		long long value = 0;
+		if (_labelDictionary.Resolve(symbol.first, &value))
+			values[symbol.first] = value;
+	}
+
+	_programROM.ResizeRecord(r, next.firstRecord, region.firstLabel, next.firstLabel, delta);
+	_labelDictionary.Shift(region.firstName, next.firstName, record.address, delta);
+
+	for (auto& symbol : _symbolLines)
+	{
+		long long value = 0;
+		bool known = _labelDictionary.Resolve(symbol.first, &value);
+		auto before = values.find(symbol.first);
+
+		if (known != (before != values.end()) || (known && value != before->second))
+			_patchedNames.push_back(symbol.first);
+	}
+
+	unordered_set<int> moved;
+	for (const string& name : _patchedNames)
+	{
+		int symbol = _debugInfo.FindSymbol(name);
+		if (symbol >= 0)
+			moved.insert(symbol);
+	}
+
+	for (const SymbolUse& use : _debugInfo.GetUses())
+	{
+		if (!moved.count(use.symbol))
+			continue;
+
+		auto found = _recordAt.find(SourceIndex::LineKey(use.fileId, use.line));
+		if (found != _recordAt.end() && found->second == -2)
+			continue;
+
+		if (use.fileId != record.fileId || found == _recordAt.end() || found->second < 0 || use.line >= lines.size())
+			return false;
+
+		again.push_back(found->second);
+	}
+
+	sort(again.begin(), again.end());
+	again.erase(unique(again.begin(), again.end()), again.end());
+	return true;
+}
+
+/*================================================== Parser::BuildIndex() ==================================================================
+	DESCRIPTION:
+		  Collects the labels and symbols of the assembled program, with their values and where they were defined, and the bytes
+		  each source line assembled to, for the language server. Returns false if the program wasn't assembled.
+===========================================================================================================================================*/
+bool Parser::BuildIndex(SourceIndex& index)
+{
+	if (_reassembled)
+		return _reassembled->BuildIndex(index);
+
+	index.files = _programROM.GetSourceFiles();
+	index.symbols.clear();
+	index.lines.clear();
+
+	for (const ListingLabel& label : _programROM.GetLabels())
+		index.symbols[label.name] = { label.address, true, true, label.bank, label.fileId, label.line };
+
+	for (auto& symbol : _symbolLines)
+	{
+		long long value = 0;
+		bool known = _labelDictionary.Resolve(symbol.first, &value);
+		index.symbols[symbol.first] = { value, known, false, 0, symbol.second.first, symbol.second.second };
+	}
+
+	// A line a macro expands on gets all of the bytes it emitted
+	for (const ListingRecord& record : _programROM.GetListing())
+	{
+		auto inserted = index.lines.insert({ SourceIndex::LineKey(record.fileId, record.line), { record.address, record.bank, {} } });
+		vector<unsigned char>& bytes = inserted.first->second.bytes;
+
+		size_t start = bytes.size();
+		bytes.resize(start + record.length);
+		_programROM.ReadImage(ROMData::ImageAddress(record.bank, record.address), bytes.data() + start, record.length);
+	}
+
+	return _programReady;
+}
+
+/*================================================== Parser::UpdateIndex() =================================================================
+	DESCRIPTION:
+		  Brings the entries of an index that BuildIndex() filled up to date after PatchLine(): the bytes and addresses of the
+		  lines it assembled again, and the values of the labels and symbols it changed.
+===========================================================================================================================================*/
+void Parser::UpdateIndex(SourceIndex& index)
+{
+	if (_reassembled)
+	{
+		_reassembled->UpdateIndex(index);
+		return;
+	}
+
+	for (int r : _patchedRecords)
+	{
+		const ListingRecord& record = _programROM.GetListing()[r];
+		IndexedLine& line = index.lines[SourceIndex::LineKey(record.fileId, record.line)];
+
+		line = { record.address, record.bank, vector<unsigned char>(record.length) };
+		_programROM.ReadImage(ROMData::ImageAddress(record.bank, record.address), line.bytes.data(), record.length);
+	}
+
+	for (const string& name : _patchedNames)
+	{
+		auto symbol = index.symbols.find(name);
+		if (symbol != index.symbols.end())
+			symbol->second.known = _labelDictionary.Resolve(name, &symbol->second.value);
+	}
+}
+
+/*================================================== Parser::RunChecks() ===================================================================
+	DESCRIPTION:
+		  Runs the .expect/.assert checks of a program that was just written to ROM and prints whether they passed.
+===========================================================================================================================================*/
+void Parser::RunChecks(const string& name)
+{
+	TestCase test;
+	test.name = name;
+
+	if (!BuildTest(test))
+		return;
+
+	TestRunner runner;
+	runner.AddTest(test);
+	runner.Run(1, DEFAULT_TEST_TIMEOUT);
+	runner.PrintSummary();
+}
+
+/*================================================= Parser::PrintStats() ===================================================================
+	DESCRIPTION:
+		  Prints a short summary of what the assembler did while processing the program.
+===========================================================================================================================================*/
+void Parser::PrintStats()
+{
+	printf("\n=========================\n");
+	printf("   ASSEMBLY STATISTICS\n");
+	printf("=========================\n");
+	printf("Macros defined:       %d\n", _macroDictionary.NumNamedMacros());
+	printf("Macro expansions:     %d\n", _macroExpansions);
+	printf("Expanded lines:       %d\n", _macroLinesExpanded);
+	printf("Max expansion depth:  %d\n", _macroMaxDepth);
+	printf("Rept iterations:      %d\n", _reptIterations);
+	printf("Lines skipped by .if: %d\n", _linesSkipped);
+	printf("Expressions compiled: %d\n", _expressionsCompiled);
+	printf("Forward references:   %d\n", (int)_fixups.size());
+	printf("Symbol evaluations:   %d\n", _labelDictionary.NumEvaluations());
+	printf("Instructions encoded: %d\n", _instructionsEncoded);
+	printf("Instruction layouts:  %d\n", _encoder.NumLayouts());
+	printf("Template opcodes:     %d\n", _templateOpcodes);
+	printf("Match tree nodes:     %d\n", _opcodeMatcher.NumNodes());
+
+	if (_branchesShort + _branchesLong > 0)
+		printf("Relaxed jumps:        %d short, %d long (%lld worklist steps)\n", _branchesShort, _branchesLong, _relaxSteps);
+
+	if (_veneers > 0)
+		printf("Far calls:            %d through %d veneers (%d bytes)\n", _farCallsRouted, _veneers, _veneerBytes);
+
+	// How full each size of the opcode space is, and where the biggest gap for new opcodes is
+	for (int sz = 0; sz < _opcodeSpace.NumSizes(); sz++)
+	{
+		unsigned long long first;
+		unsigned long long length;
+
+		printf("%2d-bit opcode space:  %lld used (%.1f%%)", _opcodeSpace.GetBits(sz), _opcodeSpace.NumUsed(sz), 100.0 * _opcodeSpace.Utilization(sz));
+		if (_opcodeSpace.GetLargestFreeRun(sz, &first, &length))
+			printf(", largest free run $%02llX-$%02llX", first, first + length - 1);
+		printf("\n");
+	}
+	printf("=========================\n");
+}
+
+/*================================================ Parser::ProcessLine() ===================================================================
+	DESCRIPTION:
+		  Handles a line that has already been split into tokens. This is where macro definitions are recorded and macro invocations
+		  are expanded...everything else is passed on to ProcessTokens(). Lines produced by a macro expansion come back through here
+		  as well, which is how macros are able to use other macros.
+===========================================================================================================================================*/
+int Parser::ProcessLine(string* nextFile)
+{
+	if (_numTokens == 0 || _lineType == LineType::Comment)
+		return 0;
+
+	// While a macro or .rept block is being defined, its lines are only recorded
+	if (_macroDictionary.IsRecording())
+	{
+		if ((!_recordingRept && IsDirective(_tokens[0], ENDM_STR)) || (_recordingRept && _reptNesting == 0 && IsDirective(_tokens[0], ENDR_STR)))
+			return EndRecording();
+
+		if (!_recordingRept && IsDirective(_tokens[0], MACRO_STR))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Macro definitions cannot be nested! Parsing cannot continue until fixed\n");
+			return -1;
+		}
+
+		// Nested .rept blocks are recorded as part of the outer one and expanded when it is
+		if (_recordingRept && IsDirective(_tokens[0], REPT_STR))
+			_reptNesting++;
+		if (_recordingRept && IsDirective(_tokens[0], ENDR_STR))
+			_reptNesting--;
+
+		const ListingRecord& record = _programROM.GetPendingRecord();
+		_macroDictionary.AddLine((int)_lineType, &_tokens[0], &_tokenGroups[0], _numTokens, { record.fileId, record.line, record.colStart, record.colEnd });
+		return 0;
+	}
+
+	// Lines from a macro or .rept expansion that fall in a false conditional branch. These have already been
+	// tokenized, so only the first token needs checking.
+	if (IsSkipping())
+	{
+		if (_lineType != LineType::Directive || SkipDirective(_tokens[0] + 1, strlen(_tokens[0] + 1)))
+		{
+			_linesSkipped++;
+			return 0;
+		}
+	}
+
+	bool handled = false;
+	int condCode = ProcessConditional(&handled);
+	if (handled)
+		return condCode;
+
+	if (IsDirective(_tokens[0], MACRO_STR))
+		return BeginMacroDefinition();
+
+	if (IsDirective(_tokens[0], REPT_STR))
+		return BeginRept();
+
+	if (IsDirective(_tokens[0], ENDR_STR))
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> .%s without a matching .%s! Parsing cannot continue until fixed\n", ENDR_STR, REPT_STR);
+		return -1;
+	}
+
+	if (IsDirective(_tokens[0], ENDM_STR))
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> .%s without a matching .%s! Parsing cannot continue until fixed\n", ENDM_STR, MACRO_STR);
+		return -1;
+	}
+
+	if (_lineType == LineType::OpCode)
+	{
+		int m = _macroDictionary.GetMacro(_tokens[0]);
+		if (m != -1)
+			return ExpandMacro(m);
+	}
+
+	return ProcessTokens(nextFile);
+}
+
+/*=============================================== Parser::ProcessTokens() ==================================================================
+	DESCRIPTION:
+		  Runs ParseToken() over every token of the current line. Returns 1 if the line asks for another file to be parsed, in which
+		  case nextFile holds the name of that file.
+===========================================================================================================================================*/
+int Parser::ProcessTokens(string* nextFile)
+{
+	int retCode = 0;
+
+	// Nothing is carried over from the previous line, which may have stopped halfway through with an error
+	_currTokenType = TokenType::None;
+	_opcodeDictionary.currMnemonic.clear();
+
+	// Loop over all of them
+	for (int i = 0; i < _numTokens; i++)
+	{
+		if (_outMode == OutMode::Verbose)
+		{
+			// Echo current token to screen
+			printf("       -> Token that is being parsed: #%d \"%s\"\n", i, _tokens[i]);
+		}
+
+		// If we are not processing the last token, store the next token.
+		// This is needed for directives whose second argument is an external file.
+		// For example, if we have a directive like .arch "homewbrew.arch"...the file we want
+		// is homebrew.arch
+		string nextToken;
+		if (i + 1 < _numTokens)
+			nextToken = _tokens[i + 1];
+
+		// Parse token i
+		retCode = ParseToken(i);
+
+		// If return code is -1 something has gone wrong
+		if (retCode == -1) printf("ERROR occurred while parsing tokens\n");
+
+		if (retCode == 1)
+		{
+			// The directives that signal a new file needs to be parsed (i.e., those with return code 1)
+			// all store the filename as their second token. strtok() is used here to chop off the 
+			// quotation marks.
+			char* name = strtok((char*)nextToken.c_str(), "\"");
+			*nextFile = name != NULL ? name : "";
+			break;
+		}
+	}
+
+	return retCode;
+}
+
+/*=========================================== Parser::BeginMacroDefinition() ===============================================================
+	DESCRIPTION:
+		  Starts recording a macro. The line looks like: .macro name param1, param2=default, ...
+===========================================================================================================================================*/
+int Parser::BeginMacroDefinition()
+{
+	if (_numTokens < 2)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Macro definition is missing a name! Parsing cannot continue until fixed\n");
+		return -1;
+	}
+
+	_recordingIndex = _macroDictionary.BeginMacro(_tokens[1]);
+	_recordingRept = false;
+
+	for (int i = 2; i < _numTokens; i++)
+	{
+		// Parameters with a default value are written as name=value
+		char* eq = strchr(_tokens[i], '=');
+		if (eq != NULL)
+		{
+			*eq = 0;
+			_macroDictionary.AddParameter(_tokens[i], eq + 1, true);
+		}
+		else
+		{
+			_macroDictionary.AddParameter(_tokens[i], "", false);
+		}
+	}
+
+	if (_outMode == OutMode::Verbose)
+		printf("      -- Defining macro \"%s\" with %d parameter(s)\n", _tokens[1], _numTokens - 2);
+
+	return 0;
+}
+
+/*================================================ Parser::ExpandMacro() ===================================================================
+	DESCRIPTION:
+		  Expands macro m using the arguments on the current line. The body was tokenized and classified when the macro was defined,
+		  so each expanded line is built by copying the stored tokens (with arguments and uniquified local labels dropped into their
+		  slots) and handing them straight to ProcessLine()...the text is never tokenized again.
+===========================================================================================================================================*/
+int Parser::ExpandMacro(int m)
+{
+	// Copy the arguments out of the current line before the body starts reusing the token storage. Arguments are
+	// separated by commas, so an argument can be an expression with spaces in it.
+	vector<string> args;
+	GetOperands(1, args);
+
+	vector<string> bound;
+	string error;
+	if (!_macroDictionary.BindArguments(m, args, bound, error))
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Macro \"%s\": %s! Parsing cannot continue until fixed\n", _macroDictionary.GetName(m).c_str(), error.c_str());
+		return -1;
+	}
+
+	if (_outMode == OutMode::Verbose)
+		printf("      -- Expanding macro \"%s\"\n", _macroDictionary.GetName(m).c_str());
+
+	_macroExpansions++;
+	return ExpandBody(m, bound);
+}
+
+/*================================================= Parser::ExpandBody() ===================================================================
+	DESCRIPTION:
+		  Feeds the recorded lines of macro (or .rept block) m through ProcessLine() once, with the given arguments bound to its
+		  parameters. The body was tokenized and classified when it was recorded, so each line is built by copying the stored tokens
+		  (with arguments and uniquified local labels dropped into their slots)...the text is never tokenized again.
+===========================================================================================================================================*/
+int Parser::ExpandBody(int m, const vector<string>& bound)
+{
+	if (_macroDepth >= MAX_MACRO_DEPTH)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> \"%s\" exceeds the maximum expansion depth of %d! Parsing cannot continue until fixed\n", _macroDictionary.GetName(m).c_str(), MAX_MACRO_DEPTH);
+		return -1;
+	}
+
+	// Every expansion gets its own id so that local labels come out unique
+	int expansionId = _expansionCounter++;
+	_macroDepth++;
+	if (_macroDepth > _macroMaxDepth)
+		_macroMaxDepth = _macroDepth;
+
+	// A macro's bytes are listed under the line that called it, but each line of a .rept block gets its own bytes (and its
+	// own errors)
+	bool rept = _macroDictionary.GetName(m).empty();
+	ListingRecord caller = _programROM.GetPendingRecord();
+	int callerLine = _currLine;
+
+	int retCode = 0;
+	vector<char> buffer;
+	vector<int> offsets;
+	for (int l = 0; l < _macroDictionary.NumLines(m); l++)
+	{
+		const MacroLine& line = _macroDictionary.GetLine(m, l);
+
+		if (rept)
+		{
+			_programROM.EndListingRecord();
+			_programROM.BeginListingRecord(line.source.fileId, line.source.line, line.source.colStart, line.source.colEnd);
+			_currLine = line.source.line + 1;
+		}
+
+		buffer.clear();
+		offsets.clear();
+		for (int t = 0; t < line.numTokens; t++)
+		{
+			offsets.push_back(buffer.size());
+			_macroDictionary.AppendToken(m, line.firstToken + t, bound, expansionId, buffer);
+		}
+
+		ResetForNewLine();
+		ResetLineState();
+		for (int t = 0; t < line.numTokens; t++)
+		{
+			_tokens.push_back(&buffer[offsets[t]]);
+			_tokenGroups.push_back(_macroDictionary.GetTokenGroup(line.firstToken + t));
+		}
+		_tokens.push_back(NULL);
+		_numTokens = line.numTokens;
+		_lineType = (LineType)line.lineType;
+
+		_macroLinesExpanded++;
+
+		string nextFile;
+		retCode = ProcessLine(&nextFile);
+
+		if (retCode == 1)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Macros and .%s blocks cannot include other files! Parsing cannot continue until fixed\n", REPT_STR);
+			retCode = -1;
+		}
+
+		if (retCode == -1)
+			break;
+	}
+
+	if (rept)
+	{
+		_programROM.EndListingRecord();
+		_programROM.BeginListingRecord(caller.fileId, caller.line, caller.colStart, caller.colEnd);
+		_currLine = callerLine;
+	}
+
+	_macroDepth--;
+	return retCode;
+}
+
+/*================================================== Parser::BeginRept() ===================================================================
+	DESCRIPTION:
+		  Starts recording a .rept n block. The block is recorded like an anonymous macro with no parameters, so its lines are only
+		  tokenized once no matter how many times they are repeated.
+===========================================================================================================================================*/
+int Parser::BeginRept()
+{
+	int count = 0;
+	if (_numTokens < 2 || !EvaluateExpression(JoinTokens(1, _numTokens), _labelDictionary, &count) || count < 0)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> .%s expects a non-negative repeat count! Parsing cannot continue until fixed\n", REPT_STR);
+		return -1;
+	}
+
+	_recordingIndex = _macroDictionary.BeginMacro("");
+	_recordingRept = true;
+	_reptNesting = 0;
+	_reptCount = count;
+
+	if (_outMode == OutMode::Verbose)
+		printf("      -- Recording .%s block (%d iterations)\n", REPT_STR, count);
+
+	return 0;
+}
+
+/*================================================ Parser::EndRecording() ==================================================================
+	DESCRIPTION:
+		  Called on .endm or on the .endr that closes the outermost .rept block. A finished .rept block is expanded right away.
+===========================================================================================================================================*/
+int Parser::EndRecording()
+{
+	int m = _recordingIndex;
+	_macroDictionary.EndMacro();
+
+	if (!_recordingRept)
+	{
+		if (_outMode == OutMode::Verbose)
+			printf("      -- End of macro definition\n");
+
+		return 0;
+	}
+
+	_recordingRept = false;
+
+	// Nested .rept blocks are recorded again while this one expands, so take a copy of the count first
+	int count = _reptCount;
+
+	vector<string> noArguments;
+	int retCode = 0;
+	for (int n = 0; n < count && retCode != -1; n++)
+	{
+		_reptIterations++;
+		retCode = ExpandBody(m, noArguments);
+	}
+
+	return retCode;
+}
+
+/*============================================== Parser::ProcessConditional() ===============================================================
+	DESCRIPTION:
+		  Handles .if/.ifdef/.ifndef/.elif/.else/.endif. Sets handled to true if the current line was one of these directives.
+===========================================================================================================================================*/
+int Parser::ProcessConditional(bool* handled)
+{
+	*handled = true;
+
+	bool isIf = IsDirective(_tokens[0], IF_STR);
+	bool isIfdef = IsDirective(_tokens[0], IFDEF_STR);
+	bool isIfndef = IsDirective(_tokens[0], IFNDEF_STR);
+	bool isElif = IsDirective(_tokens[0], ELIF_STR);
+
+	if (isIf || isIfdef || isIfndef)
+	{
+		bool result = false;
+		if (isIf && !EvaluateCondition(1, &result))
+			return -1;
+
+		if (isIfdef || isIfndef)
+		{
+			if (_numTokens != 2)
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> .%s expects a single symbol! Parsing cannot continue until fixed\n", isIfdef ? IFDEF_STR : IFNDEF_STR);
+				return -1;
+			}
+
+			result = _labelDictionary.GetLabel(_tokens[1]) == isIfdef;
+		}
+
+		ConditionalFrame frame;
+		frame.active = result;
+		frame.taken = result;
+		frame.seenElse = false;
+		_condStack.push_back(frame);
+
+		return 0;
+	}
+
+	if (isElif || IsDirective(_tokens[0], ELSE_STR) || IsDirective(_tokens[0], ENDIF_STR))
+	{
+		if (_condStack.empty() || (!isElif && IsDirective(_tokens[0], ELSE_STR) && _condStack.back().seenElse) || (isElif && _condStack.back().seenElse))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> \"%s\" without a matching .%s! Parsing cannot continue until fixed\n", _tokens[0], IF_STR);
+			return -1;
+		}
+
+		ConditionalFrame& frame = _condStack.back();
+
+		if (IsDirective(_tokens[0], ENDIF_STR))
+		{
+			_condStack.pop_back();
+		}
+		else if (isElif)
+		{
+			// The condition is only evaluated if no earlier branch was taken
+			bool result = false;
+			if (!frame.taken && !EvaluateCondition(1, &result))
+				return -1;
+
+			frame.active = !frame.taken && result;
+			frame.taken = frame.taken || result;
+		}
+		else
+		{
+			frame.active = !frame.taken;
+			frame.taken = true;
+			frame.seenElse = true;
+		}
+
+		return 0;
+	}
+
+	*handled = false;
+	return 0;
+}
+
+/*============================================== Parser::EvaluateCondition() ===============================================================
+	DESCRIPTION:
+		  Evaluates the condition of an .if/.elif starting at token first. The condition is an expression that is true if non-zero.
+		  Anything it refers to has to be defined by the time the condition is reached.
+===========================================================================================================================================*/
+bool Parser::EvaluateCondition(int first, bool* result)
+{
+	int value = 0;
+
+	if (first >= _numTokens)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> \"%s\" is missing its condition! Parsing cannot continue until fixed\n", _tokens[0]);
+		return false;
+	}
+
+	if (!EvaluateExpression(JoinTokens(first, _numTokens), _labelDictionary, &value))
+		return false;
+
+	*result = value != 0;
+	return true;
+}
+
+/*================================================= Parser::GetOperands() ==================================================================
+	DESCRIPTION:
+		  Collects the operands of the current line from token first onwards. Operands are separated by commas; the tokens of an
+		  operand that was split on spaces (an expression like "X + 1") are joined back together.
+===========================================================================================================================================*/
+void Parser::GetOperands(int first, vector<string>& operands)
+{
+	for (int t = first; t < _numTokens; t++)
+	{
+		if (t == first || _tokenGroups[t] != _tokenGroups[t - 1])
+			operands.push_back(_tokens[t]);
+		else
+			operands.back() += string(" ") + _tokens[t];
+	}
+}
+
+/*================================================= Parser::JoinTokens() ===================================================================
+	DESCRIPTION:
+		  Joins tokens first up to (not including) last back into a single string, separated by spaces.
+===========================================================================================================================================*/
+string Parser::JoinTokens(int first, int last)
+{
+	string text;
+	for (int t = first; t < last; t++)
+	{
+		if (t > first)
+			text += ' ';
+
+		text += _tokens[t];
+	}
+
+	return text;
+}
+
+/*============================================== Parser::CompileExpression() ===============================================================
+	DESCRIPTION:
+		  Compiles an expression into the parser's expression pool. The same text always compiles to the same bytecode (the current
+		  address is only filled in when it is evaluated), so expressions repeated by macros and .rept blocks are compiled once.
+===========================================================================================================================================*/
+int Parser::CompileExpression(const string& text, string& error)
+{
+	auto cached = _expressionCache.find(text);
+	if (cached != _expressionCache.end())
+		return cached->second;
+
+	int expr = _expressions.Compile(text, error);
+	if (expr >= 0)
+	{
+		_expressionCache[text] = expr;
+		_expressionsCompiled++;
+	}
+
+	return expr;
+}
+
+/*============================================== Parser::EvaluateExpression() ==============================================================
+	DESCRIPTION:
+		  Evaluates an expression whose value is needed right away (directive arguments, conditions, control patterns). Symbols are
+		  looked up in the given dictionary. Prints an error and returns false if it can't be evaluated.
+===========================================================================================================================================*/
+bool Parser::EvaluateExpression(const string& text, LabelDictionary& symbols, long long* value)
+{
+	string error;
+	int expr = CompileExpression(text, error);
+
+	long long result = 0;
+	int unresolved = -1;
+	ExprResult status = ExprResult::Ok;
+
+	if (expr >= 0 && &symbols == &_labelDictionary)
+		NoteUses(expr);
+
+	if (expr >= 0)
+	{
+		status = _expressions.Evaluate(expr, _programROM.GetCurrentAddress(),
+			[&](int symbol, long long* v) { return symbols.Resolve(_expressions.GetSymbolName(symbol), v); }, &result, &unresolved);
+
+		if (status == ExprResult::Unresolved)
+		{
+			// For a name whose own definition can't be evaluated, name the undefined name at the end of the chain
+			const string& name = _expressions.GetSymbolName(unresolved);
+			vector<string> path;
+
+			if (!symbols.IsDefined(name))
+				error = "\"" + name + "\" is not defined";
+			else if (symbols.FindUnresolved(name, path) && !symbols.IsDefined(path.back()))
+			{
+				error = "\"" + path.back() + "\" is not defined (" + path[0];
+				for (int k = 1; k < path.size(); k++)
+					error += " -> " + path[k];
+				error += ")";
+			}
+			else
+				error = "\"" + name + "\" can't be evaluated here";
+		}
+		if (status == ExprResult::DivideByZero)
+			error = "division by zero";
+	}
+
+	if (expr < 0 || status != ExprResult::Ok)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Unable to evaluate \"%s\": %s! Parsing cannot continue until fixed\n", text.c_str(), error.c_str());
+		return false;
+	}
+
+	*value = result;
+	return true;
+}
+
+bool Parser::EvaluateExpression(const string& text, LabelDictionary& symbols, int* value)
+{
+	long long result;
+	if (!EvaluateExpression(text, symbols, &result))
+		return false;
+
+	*value = (int)result;
+	return true;
+}
+
+/*=============================================== Parser::EvaluateOrDefer() ================================================================
+	DESCRIPTION:
+		  Evaluates a value that ends up in the program (instruction operands and .byte values). If it refers to a label that hasn't
+		  been defined yet, the compiled expression's id is returned so that a fixup can be recorded for it, and value is set to 0.
+		  Returns -1 if the value is known now and -2 (after printing an error) if the expression is invalid.
+===========================================================================================================================================*/
+int Parser::EvaluateOrDefer(const string& text, int* value)
+{
+	string error;
+	int expr = CompileExpression(text, error);
+
+	if (expr < 0)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Invalid expression \"%s\": %s! Parsing cannot continue until fixed\n", text.c_str(), error.c_str());
+		return -2;
+	}
+
+	NoteUses(expr);
+
+	long long result = 0;
+	ExprResult status = _expressions.Evaluate(expr, _programROM.GetCurrentAddress(),
+		[this](int symbol, long long* v) { return _labelDictionary.Resolve(_expressions.GetSymbolName(symbol), v); }, &result, nullptr);
+
+	if (status == ExprResult::DivideByZero)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Division by zero in \"%s\"! Parsing cannot continue until fixed\n", text.c_str());
+		return -2;
+	}
+
+	*value = (int)result;
+	return status == ExprResult::Unresolved ? expr : -1;
+}
+
+/*================================================= Parser::NoteUses() =====================================================================
+	DESCRIPTION:
+		  Records the line that is being assembled as a use of each symbol that an expression names, for the cross reference.
+===========================================================================================================================================*/
+void Parser::NoteUses(int expr)
+{
+	if (_parseMode != ParseMode::Assembler || _emittingVeneers)
+		return;
+
+	_usedSymbols.clear();
+	_expressions.GetSymbols(expr, _usedSymbols);
+
+	const ListingRecord& record = _programROM.GetPendingRecord();
+	for (int symbol : _usedSymbols)
+		_debugInfo.AddUse(_expressions.GetSymbolName(symbol), record.fileId, record.line);
+}
+
+/*================================================= Parser::ParseOperand() =================================================================
+	DESCRIPTION:
+		  Classifies operand n of an instruction as a register, a character or a numeric expression and stores it in the opcode
+		  dictionary's current arguments.
+===========================================================================================================================================*/
+int Parser::ParseOperand(const string& text, int n)
+{
+	ArgType type = ArgType::Numeral;
+	int value = 0;
+	_operandExprs[n] = -1;
+
+	if (_registerDictionary.GetLabel(text.c_str()))
+	{
+		// Registers are encoded by their id within their register class
+		type = ArgType::Register;
+		value = _registerIds.GetLabelValue(text.c_str());
+	}
+	else if (text[0] == '"')
+	{
+		// Character operand ("/" stands for a space, like it does in .ascii)
+		type = ArgType::Ascii;
+		value = text.size() > 1 && text[1] != '"' ? (text[1] != '/' ? text[1] : ' ') : 0;
+	}
+	else
+	{
+		int expr = EvaluateOrDefer(text, &value);
+		if (expr == -2)
+			return -1;
+
+		_operandExprs[n] = expr;
+	}
+
+	if (n == 0)
+	{
+		_opcodeDictionary.currArg0type = type;
+		_opcodeDictionary.currArg0string = text;
+		_opcodeDictionary.currArg0num = value;
+	}
+	else
+	{
+		_opcodeDictionary.currArg1type = type;
+		_opcodeDictionary.currArg1string = text;
+		_opcodeDictionary.currArg1num = value;
+	}
+
+	_opcodeDictionary.currNumArgs++;
+	return 0;
+}
+
+/*================================================ Parser::ParseImmediateSpec() ===============================================================
+	DESCRIPTION:
+		  Reads an immediate operand from an opcode definition in the architecture file. "#" is an 8-bit value, "#16" a 16-bit one
+		  (little-endian unless written "#16be") and "rel8" an 8-bit offset from the address of the next instruction.
+===========================================================================================================================================*/
+bool Parser::ParseImmediateSpec(const char* token, EncodeField* spec)
+{
+	spec->source = FieldSource::Arg0;
+	spec->width = 8;
+	spec->bigEndian = false;
+	spec->relative = false;
+	spec->constant = 0;
+
+	if (token[0] == '#')
+		token++;
+	else if (!strncmp(token, RELATIVE_STR, strlen(RELATIVE_STR)))
+	{
+		token += strlen(RELATIVE_STR);
+		spec->relative = true;
+	}
+	else
+		return false;
+
+	if (isdigit((unsigned char)*token))
+	{
+		char* end;
+		spec->width = strtol(token, &end, 10);
+		token = end;
+	}
+
+	if (!strcmp(token, "be"))
+		spec->bigEndian = true;
+	else if (*token && strcmp(token, "le"))
+		return false;
+
+	return spec->width > 0 && spec->width <= 32;
+}
+
+/*================================================== Parser::BuildLayout() =================================================================
+	DESCRIPTION:
+		  Builds the layout of the opcode being defined from the fields in tokens first up to last, which follow the "encode" keyword:
+		  op:N for the opcode value, a0:N and a1:N for the operands (a register operand is encoded by its id) and value:N for constant
+		  bits, most significant field first. Fields that are a whole number of bytes can be given a byte order with a "be"/"le" suffix.
+		  Without an encode clause the layout is the opcode followed by each immediate operand, which is what the assembler has always
+		  written. Returns the layout id, or -1 if the layout is invalid.
+===========================================================================================================================================*/
+int Parser::BuildLayout(int first, int last, int cmdSize)
+{
+	vector<EncodeField> fields;
+	fields.push_back({ FieldSource::Opcode, cmdSize, true, false, 0 });
+
+	if (first >= last)
+	{
+		for (int n = 0; n < _opcodeDictionary.currNumArgs && n < 2; n++)
+		{
+			ArgType type = n == 0 ? _opcodeDictionary.currArg0type : _opcodeDictionary.currArg1type;
+			if (type == ArgType::Numeral)
+				fields.push_back(_argSpecs[n]);
+		}
+	}
+	else
+	{
+		fields.clear();
+
+		for (int t = first; t < last; t++)
+		{
+			const char* colon = strchr(_tokens[t], ':');
+			char* end = NULL;
+			int width = colon != NULL ? strtol(colon + 1, &end, 10) : 0;
+
+			if (colon == NULL || end == colon + 1 || (*end && strcmp(end, "be") && strcmp(end, "le")))
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Invalid field \"%s\" in opcode layout (expected name:width)! Parsing cannot continue until fixed\n", _tokens[t]);
+				return -1;
+			}
+
+			string name(_tokens[t], colon - _tokens[t]);
+			EncodeField field = { FieldSource::Constant, width, true, false, 0 };
+
+			if (name == "op")
+			{
+				field.source = FieldSource::Opcode;
+			}
+			else if (name == "a0" || name == "a1")
+			{
+				int n = name[1] - '0';
+				ArgType type = n == 0 ? _opcodeDictionary.currArg0type : _opcodeDictionary.currArg1type;
+
+				if (n >= _opcodeDictionary.currNumArgs)
+				{
+					printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+					printf("  -> Opcode layout refers to operand %d, which the opcode doesn't have! Parsing cannot continue until fixed\n", n);
+					return -1;
+				}
+
+				field.source = n == 0 ? FieldSource::Arg0 : FieldSource::Arg1;
+				field.bigEndian = type == ArgType::Numeral ? _argSpecs[n].bigEndian : true;
+				field.relative = type == ArgType::Numeral && _argSpecs[n].relative;
+			}
+			else
+			{
+				int constant;
+				if (!EvaluateExpression(name, _labelDictionary, &constant))
+					return -1;
+
+				field.constant = constant;
+			}
+
+			if (*end)
+				field.bigEndian = !strcmp(end, "be");
+
+			fields.push_back(field);
+		}
+	}
+
+	string error;
+	int layout = _encoder.AddLayout(fields, error);
+
+	if (layout < 0)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Invalid opcode layout: %s! Parsing cannot continue until fixed\n", error.c_str());
+	}
+
+	return layout;
+}
+
+/*=============================================== Parser::ParseTemplateArg() ================================================================
+	DESCRIPTION:
+		  Reads a template operand from an opcode definition in the architecture file. {r8:dst} stands for every 8-bit register, and
+		  dst can be used in the opcode value and control line pattern for the id of the register it stands for.
+===========================================================================================================================================*/
+bool Parser::ParseTemplateArg(const char* token, TemplateArg* arg)
+{
+	int length = strlen(token);
+	if (length < 6 || token[0] != '{' || token[length - 1] != '}' || token[1] != 'r' || !isdigit((unsigned char)token[2]))
+		return false;
+
+	char* end;
+	arg->width = strtol(token + 2, &end, 10);
+
+	if (*end != ':' || end + 1 >= token + length - 1)
+		return false;
+
+	arg->name.assign(end + 1, token + length - 1 - (end + 1));
+	return arg->width > 0;
+}
+
+/*=============================================== Parser::StripIndexCalls() ================================================================
+	DESCRIPTION:
+		  Template operands already stand for the id of their register, so idx(dst) is the same as (dst). This removes the "idx" in
+		  front of the brackets so that the expression compiler doesn't need to know about it.
+===========================================================================================================================================*/
+string Parser::StripIndexCalls(const string& text)
+{
+	string result;
+	for (size_t c = 0; c < text.size(); c++)
+	{
+		bool startOfName = c == 0 || !(isalnum((unsigned char)text[c - 1]) || text[c - 1] == '_');
+		if (startOfName && !text.compare(c, 4, "idx("))
+			c += 3;
+
+		result += text[c];
+	}
+
+	return result;
+}
+
+/*============================================= Parser::ExpandOpcodeTemplate() =============================================================
+	DESCRIPTION:
+		  Adds an opcode for every combination of registers its template operands stand for (e.g. mov {r8:dst}, {r8:src} becomes
+		  mov a, a ... mov d, d). The value and control line pattern are compiled once and evaluated for each combination, and the
+		  whole batch is checked before any of it is added to the opcode dictionary.
+===========================================================================================================================================*/
+int Parser::ExpandOpcodeTemplate(int cmdSize, int patternStart, int patternEnd, int layoutEnd)
+{
+	OpcodeDictionary& opcodes = _opcodeDictionary;
+
+	int layout = BuildLayout(patternEnd + 1, layoutEnd, cmdSize);
+	if (layout < 0)
+		return -1;
+
+	string valueText = StripIndexCalls(JoinTokens(_equalIndex + 1, patternStart));
+	string patternText = StripIndexCalls(JoinTokens(patternStart, patternEnd));
+	string error;
+
+	int valueExpr = CompileExpression(valueText, error);
+	int patternExpr = valueExpr >= 0 ? CompileExpression(patternText, error) : -1;
+
+	if (patternExpr < 0)
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Invalid expression in opcode template: %s! Parsing cannot continue until fixed\n", error.c_str());
+		return -1;
+	}
+
+	// The registers each operand goes through. Operands that aren't template operands only have one choice.
+	vector<string> fixed[2];
+	const vector<string>* choices[2];
+
+	for (int n = 0; n < 2; n++)
+	{
+		choices[n] = &fixed[n];
+
+		if (_templateArgs[n].width && n < opcodes.currNumArgs)
+		{
+			auto registerClass = _registerClasses.find(_templateArgs[n].width);
+			if (registerClass == _registerClasses.end())
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> No %d-bit registers have been defined for opcode template operand \"%s\"! Parsing cannot continue until fixed\n", _templateArgs[n].width, _templateArgs[n].name.c_str());
+				return -1;
+			}
+
+			choices[n] = &registerClass->second;
+		}
+		else if (n < opcodes.currNumArgs && (n == 0 ? opcodes.currArg0type : opcodes.currArg1type) == ArgType::Register)
+			fixed[n].push_back(n == 0 ? opcodes.currArg0string : opcodes.currArg1string);
+		else
+			fixed[n].push_back("");
+	}
+
+	// How an expanded opcode is shown in messages (e.g. "mov a, #")
+	auto describe = [&](const string& a0, const string& a1)
+	{
+		string text = opcodes.currMnemonic;
+		for (int n = 0; n < opcodes.currNumArgs; n++)
+		{
+			const string& arg = n == 0 ? a0 : a1;
+			text += (n == 0 ? " " : ", ") + (arg.empty() ? string("#") : arg);
+		}
+
+		return text;
+	};
+
+	string templateText = describe(_templateArgs[0].width ? opcodes.currArg0string : fixed[0][0], _templateArgs[1].width ? opcodes.currArg1string : fixed[1][0]);
+
+	// Template operands evaluate to the id of the register they currently stand for; anything else is looked up as usual
+	int bound[2] = { 0, 0 };
+	auto evaluate = [&](int expr, LabelDictionary& symbols, const string& text, long long* value)
+	{
+		long long result = 0;
+		int unresolved = -1;
+		ExprResult status = _expressions.Evaluate(expr, _programROM.GetCurrentAddress(), [&](int symbol, long long* v)
+		{
+			const string& name = _expressions.GetSymbolName(symbol);
+			for (int n = 0; n < 2; n++)
+			{
+				if (_templateArgs[n].width && name == _templateArgs[n].name)
+				{
+					*v = bound[n];
+					return true;
+				}
+			}
+
+			return symbols.Resolve(name, v);
+		}, &result, &unresolved);
+
+		if (status != ExprResult::Ok)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			if (status == ExprResult::Unresolved)
+				printf("  -> Unable to evaluate \"%s\": \"%s\" is not defined! Parsing cannot continue until fixed\n", text.c_str(), _expressions.GetSymbolName(unresolved).c_str());
+			else
+				printf("  -> Unable to evaluate \"%s\": division by zero! Parsing cannot continue until fixed\n", text.c_str());
+
+			return false;
+		}
+
+		*value = result;
+		return true;
+	};
+
+	// Work out every opcode of the batch first, so that a bad combination leaves the dictionary untouched
+	int count = choices[0]->size() * choices[1]->size();
+	vector<long long> values(count);
+	vector<long long> patterns(count);
+	vector<unsigned long long> slots(count);
+	unordered_map<unsigned long long, int> batchSlots;
+
+	for (int k = 0; k < count; k++)
+	{
+		bound[0] = k / choices[1]->size();
+		bound[1] = k % choices[1]->size();
+		const string& a0 = (*choices[0])[bound[0]];
+		const string& a1 = (*choices[1])[bound[1]];
+
+		if (!evaluate(valueExpr, _labelDictionary, valueText, &values[k]) || !evaluate(patternExpr, _controlDictionary, patternText, &patterns[k]))
+			return -1;
+
+		slots[k] = GetOpcodeSlot(layout, (int)values[k], cmdSize, a0, a1);
+		if (!CheckOpcodeSlot(cmdSize, slots[k], layout, patterns[k], describe(a0, a1)))
+			return -1;
+
+		// Two opcodes of the same template can only share a slot if they are aliases that do the same thing
+		auto other = batchSlots.emplace(slots[k], k);
+		if (!other.second && (!_opcodeIsAliased || patterns[other.first->second] != patterns[k]))
+		{
+			int o = other.first->second;
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Opcodes %s and %s from this template are both encoded as $%02llX! Parsing cannot continue until fixed\n", describe((*choices[0])[o / choices[1]->size()], (*choices[1])[o % choices[1]->size()]).c_str(), describe(a0, a1).c_str(), slots[k]);
+			return -1;
+		}
+
+		if (!_opcodeIsAliased && opcodes.HasPattern(opcodes.currMnemonic, opcodes.currNumArgs, opcodes.currArg0type, a0, opcodes.currArg1type, a1))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Opcode pattern %s already exists! Parsing cannot continue until fixed\n", describe(a0, a1).c_str());
+			return -1;
+		}
+	}
+
+	opcodes.Reserve(opcodes.NumOpcodes() + count);
+	opcodes.currSize = cmdSize;
+	opcodes.currLayout = layout;
+
+	for (int k = 0; k < count; k++)
+	{
+		opcodes.currArg0string = (*choices[0])[k / choices[1]->size()];
+		opcodes.currArg1string = (*choices[1])[k % choices[1]->size()];
+		opcodes.currValue = (int)values[k];
+		opcodes.currControlPattern = patterns[k];
+		_opcodeSpace.Claim(cmdSize, slots[k], opcodes.NumOpcodes());
+		RecordControlPattern(patternText, "opcode " + describe(opcodes.currArg0string, opcodes.currArg1string), patterns[k], _currFile, _currLine);
+		opcodes.AddCurrentEntry();
+
+		if (_outMode == OutMode::Verbose)
+			printf("       -> Adding %d-bit opcode%s with pattern %s = %02x using control line sequence %08llx\n", cmdSize, _opcodeIsAliased ? "-alias" : "", describe(opcodes.currArg0string, opcodes.currArg1string).c_str(), opcodes.currValue, opcodes.currControlPattern);
+	}
+
+	_templateOpcodes += count;
+	printf("       -> Adding %d %d-bit opcode%s from template %s\n", count, cmdSize, _opcodeIsAliased ? "-aliases" : "s", templateText.c_str());
+
+	return 0;
+}
+
+/*================================================ Parser::GetOpcodeSlot() =================================================================
+	DESCRIPTION:
+		  Works out which slot of the opcode space (of its size) an opcode takes up: the first cmdSize bits of the instruction, with
+		  register operands filled in and immediate operands left at zero. For opcodes without an encode clause this is simply the
+		  opcode value.
+===========================================================================================================================================*/
+unsigned long long Parser::GetOpcodeSlot(int layout, int value, int cmdSize, const string& a0, const string& a1)
+{
+	long long args[2] = { 0, 0 };
+	bool immediate[2] = { true, true };
+
+	for (int n = 0; n < _opcodeDictionary.currNumArgs && n < 2; n++)
+	{
+		if ((n == 0 ? _opcodeDictionary.currArg0type : _opcodeDictionary.currArg1type) == ArgType::Register)
+		{
+			args[n] = _registerIds.GetLabelValue((n == 0 ? a0 : a1).c_str());
+			immediate[n] = false;
+		}
+	}
+
+	unsigned long long word = _encoder.FixedBits(layout, value, args, immediate);
+	int totalBits = _encoder.Size(layout) * 8;
+
+	if (totalBits > cmdSize)
+		word >>= totalBits - cmdSize;
+
+	return cmdSize < 64 ? word & ((1ULL << cmdSize) - 1) : word;
+}
+
+/*=============================================== Parser::CheckOpcodeSlot() ================================================================
+	DESCRIPTION:
+		  Checks that an opcode that is about to be added doesn't collide with one that is already in the opcode space. Two opcodes
+		  can only share a slot if the new one is an alias that does the same as the one that owns it (same control line pattern
+		  and instruction length...the operands may be written in a different order). Prints an error naming both opcodes and
+		  returns false otherwise.
+===========================================================================================================================================*/
+bool Parser::CheckOpcodeSlot(int cmdSize, unsigned long long slot, int layout, long long controlPattern, const string& text)
+{
+	int owner = _opcodeSpace.GetOwner(cmdSize, slot);
+	if (owner < 0)
+		return true;
+
+	OpcodeDictionary& opcodes = _opcodeDictionary;
+	if (_opcodeIsAliased && _encoder.Size(opcodes.GetLayout(owner)) == _encoder.Size(layout) && opcodes.GetControlPattern(owner) == controlPattern)
+		return true;
+
+	printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+
+	if (!_opcodeIsAliased)
+		printf("  -> Opcode %s is encoded as $%02llX, which is already used by %s! Parsing cannot continue until fixed\n", text.c_str(), slot, opcodes.Describe(owner).c_str());
+	else if (opcodes.GetControlPattern(owner) != controlPattern)
+		printf("  -> Opcode alias %s shares $%02llX with %s but has a different control line pattern (%08llx instead of %08llx)! Parsing cannot continue until fixed\n", text.c_str(), slot, opcodes.Describe(owner).c_str(), controlPattern, opcodes.GetControlPattern(owner));
+	else
+		printf("  -> Opcode alias %s shares $%02llX with %s but is %d bytes long instead of %d! Parsing cannot continue until fixed\n", text.c_str(), slot, opcodes.Describe(owner).c_str(), _encoder.Size(layout), _encoder.Size(opcodes.GetLayout(owner)));
+
+	return false;
+}
+
+/*============================================= Parser::RecordControlPattern() =============================================================
+	DESCRIPTION:
+		  Keeps a control pattern (of an opcode or control alias) for ValidateControlPatterns(), together with the control lines
+		  it was built from, so that two of them driving the same control field can be told apart from one line with that value.
+===========================================================================================================================================*/
+void Parser::RecordControlPattern(const string& text, const string& name, long long value, const string& file, int line)
+{
+	string error;
+	int expr = CompileExpression(text, error);
+	if (expr < 0)
+		return;
+
+	vector<int> symbols;
+	_expressions.GetSymbols(expr, symbols);
+
+	vector<string> termNames;
+	vector<unsigned long long> termValues;
+
+	for (int symbol : symbols)
+	{
+		long long termValue;
+		if (_controlDictionary.Resolve(_expressions.GetSymbolName(symbol), &termValue))
+		{
+			termNames.push_back(_expressions.GetSymbolName(symbol));
+			termValues.push_back(termValue);
+		}
+	}
+
+	_controlFields.AddPattern(name, file, line, value, termNames, termValues);
+}
+
+/*=========================================== Parser::ResolveControlDefinitions() ==========================================================
+	DESCRIPTION:
+		  Works out the values of the control lines and aliases once the whole architecture file has been read. Each one is
+		  evaluated when it is first needed (by an opcode or by another alias) and then remembered, so the order they appear
+		  in doesn't matter and none is evaluated twice. Names that aren't defined and aliases that depend on themselves are
+		  reported with the line of the alias. Returns false if anything was reported.
+===========================================================================================================================================*/
+bool Parser::ResolveControlDefinitions()
+{
+	int errors = 0;
+
+	for (const ControlDefinition& definition : _controlDefinitions)
+	{
+		long long val;
+		if (!_controlDictionary.Resolve(definition.name, &val))
+		{
+			string reason = "it can't be evaluated";
+			vector<string> path;
+
+			if (_controlDictionary.FindUnresolved(definition.name, path))
+			{
+				string chain = path[0];
+				for (int k = 1; k < path.size(); k++)
+					chain += " -> " + path[k];
+
+				if (_controlDictionary.IsDefined(path.back()))
+					reason = "it depends on itself (" + chain + ")";
+				else
+					reason = "\"" + path.back() + "\" is not defined" + (path.size() > 2 ? " (" + chain + ")" : "");
+			}
+
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", definition.line, definition.file.c_str());
+			printf("  -> Unable to evaluate control %s\"%s\": %s! Parsing cannot continue until fixed\n", definition.alias ? "alias " : "", definition.name.c_str(), reason.c_str());
+			errors++;
+			continue;
+		}
+
+		// Control lines are the values of the control fields they lie in; aliases are checked like opcode patterns
+		if (!definition.alias)
+			_controlFields.AddControlLine(val);
+		else
+			RecordControlPattern(definition.text, "control alias " + definition.name, val, definition.file, definition.line);
+
+		if (_outMode == OutMode::Verbose)
+			printf("Adding Label %s with Value %08llx\n", definition.name.c_str(), val);
+	}
+
+	if (_outMode == OutMode::Verbose)
+		printf("      -- Resolved %d control lines and aliases with %d evaluations\n", (int)_controlDefinitions.size(), _controlDictionary.NumEvaluations());
+
+	_controlDefinitions.clear();
+	_architectureErrors += errors;
+	return errors == 0;
+}
+
+/*=========================================== Parser::ValidateControlPatterns() ============================================================
+	DESCRIPTION:
+		  Checks every control pattern of the architecture against the declared control fields in one pass, once the whole
+		  architecture file has been read. Reports fields driven by more than one control line, mutually exclusive fields driven
+		  together and values that none of a field's control lines have. Returns false if anything was reported.
+===========================================================================================================================================*/
+bool Parser::ValidateControlPatterns()
+{
+	if (_controlFields.NumFields() == 0)
+		return true;
+
+	vector<ControlConflict> conflicts;
+	_controlFields.Validate(conflicts);
+
+	for (const ControlConflict& conflict : conflicts)
+	{
+		const ControlPattern& pattern = _controlFields.GetPattern(conflict.pattern);
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", pattern.line, pattern.file.c_str());
+		printf("  -> %s! Parsing cannot continue until fixed\n", _controlFields.Describe(conflict).c_str());
+	}
+
+	if (_outMode == OutMode::Verbose)
+		printf("      -- Checked %d control patterns against %d control fields\n", _controlFields.NumPatterns(), _controlFields.NumFields());
+
+	_architectureErrors += conflicts.size();
+	return conflicts.empty();
+}
+
+/*================================================== Parser::EmitEncoded() =================================================================
+	DESCRIPTION:
+		  Encodes an instruction with the given layout at the current address. Operands with an expression id in exprs refer to
+		  labels that aren't known yet; they are written as placeholders and a fixup is recorded to encode the instruction again later.
+===========================================================================================================================================*/
+bool Parser::EmitEncoded(int layout, long long opcode, const long long* args, const int* exprs)
+{
+	bool deferred = exprs[0] >= 0 || exprs[1] >= 0;
+	int pc = _programROM.GetCurrentAddress();
+
+	unsigned char bytes[InstructionEncoder::MAX_BITS / 8];
+	string error;
+
+	// A relaxed jump that doesn't reach is written anyway and noted, so the program can be assembled again with its long form
+	bool relaxed = _currentRewrite >= 0 && _rewritePlan[_currentRewrite].relaxed;
+	if (relaxed && !deferred && !_encoder.Encode(layout, opcode, args, pc, true, bytes, error))
+	{
+		_relaxFailures.push_back(_currentRewrite);
+		deferred = true;
+		error.clear();
+	}
+
+	// Until the sections are placed, the addresses in and around them aren't final, so values are only checked when the
+	// program is assembled again
+	bool provisional = !_reassembling && !_sections.empty();
+
+	if (!_encoder.Encode(layout, opcode, args, pc, !deferred && !provisional, bytes, error))
+	{
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+		printf("  -> Unable to encode \"%s\": %s! Parsing cannot continue until fixed\n", _opcodeDictionary.currMnemonic.c_str(), error.c_str());
+		return false;
+	}
+
+	if (exprs[0] >= 0 || exprs[1] >= 0)
+		AddFixup(layout, _programROM.GetImageAddress(), pc, opcode, args, exprs);
+
+	if (_outMode == OutMode::Verbose)
+	{
+		for (int b = 0; b < _encoder.Size(layout); b++)
+			printf(b == 0 ? "      -- %02x: %02x (%s)\n" : "      -- %02x: %02x\n", pc + b, bytes[b], _opcodeDictionary.currMnemonic.c_str());
+	}
+
+	// A line the language server patches only has its bytes collected, to be written over the old ones if they fit
+	if (_patchBytes != NULL)
+		_patchBytes->insert(_patchBytes->end(), bytes, bytes + _encoder.Size(layout));
+	else
+		_programROM.WriteSpan(bytes, _encoder.Size(layout));
+
+	_instructionsEncoded++;
+
+	return true;
+}
+
+/*=================================================== Parser::AddFixup() ===================================================================
+	DESCRIPTION:
+		  Remembers that the bytes at address have to be encoded again once every label is known. pc is the address of the line the
+		  operands came from (what the current address symbol stands for).
+===========================================================================================================================================*/
+void Parser::AddFixup(int layout, long long address, int pc, long long opcode, const long long* args, const int* exprs)
+{
+	Fixup fixup;
+	fixup.address = address;
+	fixup.pc = pc;
+	fixup.layout = layout;
+	fixup.opcode = opcode;
+	fixup.args[0] = args[0];
+	fixup.args[1] = args[1];
+	fixup.exprs[0] = exprs[0];
+	fixup.exprs[1] = exprs[1];
+	fixup.file = _currFile;
+	fixup.line = _currLine;
+	fixup.rewrite = _currentRewrite;
+	_fixups.push_back(fixup);
+}
+
+/*================================================= Parser::ResolveFixups() ================================================================
+	DESCRIPTION:
+		  Patches every forward reference now that all labels have been defined. Returns false if any of them still can't be
+		  evaluated (or the value doesn't fit its field).
+===========================================================================================================================================*/
+bool Parser::ResolveFixups()
+{
+	bool ok = true;
+
+	for (int f = 0; f < _fixups.size(); f++)
+	{
+		Fixup& fixup = _fixups[f];
+		bool resolved = true;
+
+		for (int n = 0; n < 2 && resolved; n++)
+		{
+			if (fixup.exprs[n] < 0)
+				continue;
+
+			int unresolved = -1;
+			ExprResult status = _expressions.Evaluate(fixup.exprs[n], fixup.pc,
+				[this](int symbol, long long* v) { return _labelDictionary.Resolve(_expressions.GetSymbolName(symbol), v); }, &fixup.args[n], &unresolved);
+
+			if (status != ExprResult::Ok)
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", fixup.line, fixup.file.c_str());
+				if (status == ExprResult::Unresolved && _labelDictionary.IsDefined(_expressions.GetSymbolName(unresolved)))
+					printf("  -> The value of \"%s\" depends on itself or on something that is not defined! Parsing cannot continue until fixed\n", _expressions.GetSymbolName(unresolved).c_str());
+				else if (status == ExprResult::Unresolved)
+					printf("  -> \"%s\" is not defined! Parsing cannot continue until fixed\n", _expressions.GetSymbolName(unresolved).c_str());
+				else
+					printf("  -> Division by zero! Parsing cannot continue until fixed\n");
+
+				resolved = false;
+			}
+		}
+
+		unsigned char bytes[InstructionEncoder::MAX_BITS / 8];
+		string error;
+
+		if (!resolved)
+		{
+			ok = false;
+			continue;
+		}
+
+		if (!_encoder.Encode(fixup.layout, fixup.opcode, fixup.args, fixup.address, _reassembling || _sections.empty(), bytes, error))
+		{
+			if (fixup.rewrite >= 0 && _rewritePlan[fixup.rewrite].relaxed)
+			{
+				_relaxFailures.push_back(fixup.rewrite);
+				continue;
+			}
+
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", fixup.line, fixup.file.c_str());
+			printf("  -> Unable to encode operand: %s! Parsing cannot continue until fixed\n", error.c_str());
+
+			ok = false;
+			continue;
+		}
+
+		for (int b = 0; b < _encoder.Size(fixup.layout); b++)
+			_programROM.AddEntry(fixup.address + b, bytes[b]);
+	}
+
+	return ok;
+}
+
+/*=================================================== Parser::HasAction() ==================================================================
+	DESCRIPTION:
+		  Returns true if an opcode's control pattern sets off a control line whose control_action is of the given type.
+===========================================================================================================================================*/
+bool Parser::HasAction(int entry, MicroOpType type)
+{
+	unsigned long long pattern = _opcodeDictionary.GetControlPattern(entry);
+
+	for (const ControlActionDefinition& action : _controlActions)
+	{
+		long long value = 0;
+		if (action.type != type || !_controlDictionary.Resolve(action.control, &value) || value == 0)
+			continue;
+
+		if ((pattern & _controlFields.GetFieldMask(value)) == (unsigned long long)value)
+			return true;
+	}
+
+	return false;
+}
+
+/*=================================================== Parser::EndsBlock() ==================================================================
+	DESCRIPTION:
+		  Returns true if an opcode can leave straight-line code: its control pattern sets off a jump or halt action, or it takes
+		  longer when it jumps.
+===========================================================================================================================================*/
+bool Parser::EndsBlock(int entry)
+{
+	if (_opcodeDictionary.GetMinCycles(entry) != _opcodeDictionary.GetMaxCycles(entry))
+		return true;
+
+	return HasAction(entry, MicroOpType::Jump) || HasAction(entry, MicroOpType::Halt);
+}
+
+/*================================================ Parser::RewriteMayApply() ===============================================================
+	DESCRIPTION:
+		  Whether a full assembly could emit something else for an instruction than it says, for a line the language server
+		  patches: a long jump that has a short form, an opcode a peephole rule looks for, or (with .optimize stripping code
+		  that can't be reached) a jump.
+===========================================================================================================================================*/
+bool Parser::RewriteMayApply(int entry)
+{
+	if (_relaxByEntry.count(entry) > 0)
+		return true;
+
+	if (!_optimizeRequested)
+		return false;
+
+	if (EndsBlock(entry))
+		return true;
+
+	for (int r = 0; r < _peephole.NumRules(); r++)
+	{
+		for (const PeepholeInstruction& instruction : _peephole.GetRule(r).pattern)
+		{
+			if (instruction.entry == entry)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*================================================== Parser::CheckBudgets() ================================================================
+	DESCRIPTION:
+		  Checks the .budget lines: the code from each label up to the next label, taken once with every jump that costs extra
+		  taken, must fit in its number of cycles. A routine over its budget stops the ROM from being written.
+===========================================================================================================================================*/
+bool Parser::CheckBudgets()
+{
+	bool ok = true;
+
+	for (const BudgetDefinition& budget : _budgets)
+	{
+		long long address = 0;
+		int minCycles = 0;
+		int maxCycles = 0;
+
+		if (!_labelDictionary.Resolve(budget.label, &address))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", budget.line, budget.file.c_str());
+			printf("  -> \"%s\" is not a label! Parsing cannot continue until fixed\n", budget.label.c_str());
+			ok = false;
+			continue;
+		}
+
+		auto bank = _labelBanks.find(budget.label);
+		_programROM.GetRegionCycles(bank != _labelBanks.end() ? bank->second : 0, (int)address, &minCycles, &maxCycles);
+
+		if (maxCycles > budget.cycles)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", budget.line, budget.file.c_str());
+			printf("  -> [%s] takes up to %d cycles, more than its budget of %lld! Parsing cannot continue until fixed\n", budget.label.c_str(), maxCycles, budget.cycles);
+			ok = false;
+		}
+		else if (_outMode == OutMode::Verbose)
+			printf("      -- [%s]: %d of %lld cycles\n", budget.label.c_str(), maxCycles, budget.cycles);
+	}
+
+	return ok;
+}
+
+/*============================================= Parser::CompilePeepholeRules() =============================================================
+	DESCRIPTION:
+		  Turns the peephole, relax and veneer lines of the architecture file into rewrite rules once every opcode is known. Each
+		  instruction of a rule is matched to its opcode the same way a program's instructions are, and the peephole rules are
+		  then compiled into one automaton over opcodes. A peephole rule has to make the code smaller or faster without adding
+		  instructions. A relax rule pairs a jump with a shorter form whose target is stored relative to it. A veneer rule says
+		  how a call reaches a label in another bank: through code in bank 0 that selects the bank and jumps to the label.
+		  Returns false if anything was reported.
+===========================================================================================================================================*/
+bool Parser::CompilePeepholeRules()
+{
+	int errors = 0;
+
+	for (const PeepholeDefinition& definition : _peepholeDefinitions)
+	{
+		PeepholeRule rule;
+		bool arrow = false;
+		string error;
+		ParseRewriteRule(definition, rule, &arrow, error, NULL);
+
+		if (error.empty() && (!arrow || rule.pattern.empty()))
+			error = string("expected: ") + PEEPHOLE_STR + " Name instruction [; instruction ...] " + PEEPHOLE_ARROW_STR + " [instruction [; instruction ...]]";
+
+		if (error.empty() && rule.replacement.size() > rule.pattern.size())
+			error = "the replacement has more instructions than the pattern";
+
+		if (error.empty() && (rule.bytesSaved < 0 || (rule.bytesSaved == 0 && rule.cyclesSaved <= 0)))
+			error = "the replacement isn't smaller or faster than the pattern";
+
+		if (!error.empty())
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", definition.line, definition.file.c_str());
+			printf("  -> Invalid peephole rule \"%s\": %s! Parsing cannot continue until fixed\n", definition.name.c_str(), error.c_str());
+			errors++;
+			continue;
+		}
+
+		_peephole.AddRule(rule);
+	}
+
+	for (const PeepholeDefinition& definition : _relaxDefinitions)
+	{
+		PeepholeRule rule;
+		bool arrow = false;
+		string error;
+		ParseRewriteRule(definition, rule, &arrow, error, NULL);
+
+		int width = 0;
+		int target = error.empty() && rule.replacement.size() == 1 ? _encoder.GetRelativeArg(_opcodeDictionary.GetLayout(rule.replacement[0].entry), &width) : -1;
+
+		if (error.empty() && (!arrow || rule.pattern.size() != 1 || rule.replacement.size() != 1))
+			error = string("expected: ") + RELAX_STR + " Name jump " + PEEPHOLE_ARROW_STR + " short jump";
+
+		if (error.empty() && (target < 0 || rule.replacement[0].args[target].kind != PeepholeOperandKind::Capture))
+			error = "the short form needs a captured operand that is stored relative to the next instruction";
+
+		if (error.empty() && rule.bytesSaved <= 0)
+			error = "the short form isn't shorter";
+
+		if (error.empty() && _relaxByEntry.count(rule.pattern[0].entry))
+			error = "\"" + _opcodeDictionary.Describe(rule.pattern[0].entry) + "\" already has a short form";
+
+		if (!error.empty())
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", definition.line, definition.file.c_str());
+			printf("  -> Invalid relax rule \"%s\": %s! Parsing cannot continue until fixed\n", definition.name.c_str(), error.c_str());
+			errors++;
+			continue;
+		}
+
+		_relaxByEntry[rule.pattern[0].entry] = _relaxRules.size();
+		_relaxRules.push_back(rule);
+	}
+
+	for (const PeepholeDefinition& definition : _veneerDefinitions)
+	{
+		PeepholeRule rule;
+		bool arrow = false;
+		string error;
+		ParseRewriteRule(definition, rule, &arrow, error, VENEER_BANK_CAPTURE);
+
+		if (error.empty() && (!arrow || rule.pattern.size() != 1 || rule.replacement.empty()))
+			error = string("expected: ") + VENEER_STR + " Name call " + PEEPHOLE_ARROW_STR + " instruction [; instruction ...]";
+
+		// The pattern's only capture is the label it calls
+		for (int n = 0; error.empty() && n < rule.pattern[0].numArgs; n++)
+		{
+			const PeepholeOperand& operand = rule.pattern[0].args[n];
+			if (operand.kind == PeepholeOperandKind::Capture && operand.capture == 0)
+				error = string("\"") + VENEER_BANK_CAPTURE + "\" can only be used in the replacement";
+			else if (operand.kind == PeepholeOperandKind::Literal)
+				error = "the call's operands have to be registers or captures";
+		}
+
+		if (error.empty() && rule.captureSources.size() != 2)
+			error = "the call needs exactly one captured operand for the label it calls";
+
+		if (error.empty() && _veneerByEntry.count(rule.pattern[0].entry))
+			error = "\"" + _opcodeDictionary.Describe(rule.pattern[0].entry) + "\" already has a veneer";
+
+		if (!error.empty())
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", definition.line, definition.file.c_str());
+			printf("  -> Invalid veneer rule \"%s\": %s! Parsing cannot continue until fixed\n", definition.name.c_str(), error.c_str());
+			errors++;
+			continue;
+		}
+
+		_veneerByEntry[rule.pattern[0].entry] = _veneerRules.size();
+		_veneerRules.push_back(rule);
+	}
+
+	if (_peephole.NumRules() > 0)
+		_peephole.Build();
+
+	if (_outMode == OutMode::Verbose && !_peepholeDefinitions.empty())
+		printf("      -- Compiled %d peephole rules\n", _peephole.NumRules());
+
+	_peepholeDefinitions.clear();
+	_relaxDefinitions.clear();
+	_veneerDefinitions.clear();
+	_architectureErrors += errors;
+	return errors == 0;
+}
+
+/*=============================================== Parser::ParseRewriteRule() ===============================================================
+	DESCRIPTION:
+		  Reads the instructions of a peephole, relax or veneer line. They are separated by ";", with "=>" between the pattern
+		  and its replacement. Also works out how many bytes and cycles the replacement saves. bound (if not NULL) is a capture
+		  the replacement may use without the pattern binding it; it is capture 0, with no source in the pattern.
+===========================================================================================================================================*/
+void Parser::ParseRewriteRule(const PeepholeDefinition& definition, PeepholeRule& rule, bool* arrow, string& error, const char* bound)
+{
+	rule.name = definition.name;
+	rule.file = definition.file;
+	rule.line = definition.line;
+	rule.bytesSaved = 0;
+	rule.cyclesSaved = 0;
+
+	unordered_map<string, int> captures;
+	vector<string> words;
+
+	if (bound != NULL)
+	{
+		captures.emplace(bound, 0);
+		rule.captureSources.push_back({ -1, -1 });
+	}
+
+	for (int t = 0; t <= definition.tokens.size() && error.empty(); t++)
+	{
+		bool last = t == definition.tokens.size();
+		bool isArrow = !last && definition.tokens[t] == PEEPHOLE_ARROW_STR;
+
+		if (!last && !isArrow && definition.tokens[t] != PEEPHOLE_SEPARATOR_STR)
+		{
+			words.push_back(definition.tokens[t]);
+			continue;
+		}
+
+		if (!words.empty())
+			ParsePeepholeInstruction(words, *arrow, captures, rule, error);
+
+		words.clear();
+
+		if (isArrow && *arrow)
+			error = string("only one \"") + PEEPHOLE_ARROW_STR + "\" is allowed";
+
+		*arrow = *arrow || isArrow;
+	}
+
+	for (const PeepholeInstruction& instruction : rule.pattern)
+	{
+		rule.bytesSaved += _encoder.Size(_opcodeDictionary.GetLayout(instruction.entry));
+		rule.cyclesSaved += _opcodeDictionary.GetMaxCycles(instruction.entry);
+	}
+
+	for (const PeepholeInstruction& instruction : rule.replacement)
+	{
+		rule.bytesSaved -= _encoder.Size(_opcodeDictionary.GetLayout(instruction.entry));
+		rule.cyclesSaved -= _opcodeDictionary.GetMaxCycles(instruction.entry);
+	}
+}
+
+/*=========================================== Parser::ParsePeepholeInstruction() ===========================================================
+	DESCRIPTION:
+		  Reads one instruction of a peephole rule (mnemonic and operands) and adds it to the rule's pattern or replacement.
+		  Operands are registers, numbers that must match exactly, or captures (#name) that match any value as long as it is
+		  the same everywhere the capture appears. A replacement can only use captures that its pattern binds.
+===========================================================================================================================================*/
+bool Parser::ParsePeepholeInstruction(const vector<string>& words, bool replacement, unordered_map<string, int>& captures, PeepholeRule& rule, string& error)
+{
+	PeepholeInstruction instruction;
+	instruction.numArgs = words.size() - 1;
+
+	if (instruction.numArgs > 2)
+	{
+		error = "\"" + words[0] + "\" has more than two operands";
+		return false;
+	}
+
+	ArgType types[2] = { ArgType::Numeral, ArgType::Numeral };
+	string texts[2];
+	string text = words[0];
+
+	for (int n = 0; n < instruction.numArgs; n++)
+	{
+		const string& word = words[n + 1];
+		PeepholeOperand& operand = instruction.args[n];
+		operand = { PeepholeOperandKind::Literal, -1, 0, word };
+		texts[n] = word;
+		text += (n == 0 ? " " : ", ") + word;
+
+		if (_registerDictionary.GetLabel(word.c_str()))
+		{
+			operand.kind = PeepholeOperandKind::Register;
+			types[n] = ArgType::Register;
+		}
+		else if (word.size() > 1 && word[0] == PEEPHOLE_CAPTURE_KEY[0])
+		{
+			auto capture = captures.find(word);
+			if (capture == captures.end())
+			{
+				if (replacement)
+				{
+					error = "\"" + word + "\" isn't captured by the pattern";
+					return false;
+				}
+
+				if (captures.size() >= PeepholeOptimizer::MAX_CAPTURES)
+				{
+					error = "a rule can't have more than " + to_string(PeepholeOptimizer::MAX_CAPTURES) + " captures";
+					return false;
+				}
+
+				capture = captures.emplace(word, (int)captures.size()).first;
+				rule.captureSources.push_back({ (int)rule.pattern.size(), n });
+			}
+
+			operand.kind = PeepholeOperandKind::Capture;
+			operand.capture = capture->second;
+		}
+		else
+		{
+			// Literals are plain numbers, since a rule doesn't belong to any program whose labels it could use
+			string reason;
+			int expr = CompileExpression(word, reason);
+			ExprResult status = ExprResult::Unresolved;
+
+			if (expr >= 0)
+				status = _expressions.Evaluate(expr, 0, [](int, long long*) { return false; }, &operand.value, nullptr);
+
+			if (status != ExprResult::Ok)
+			{
+				error = "\"" + word + "\" is not a register, a number or a capture";
+				return false;
+			}
+		}
+	}
+
+	instruction.entry = _opcodeMatcher.Match(words[0], instruction.numArgs, types[0], texts[0], types[1], texts[1]);
+	if (instruction.entry < 0)
+	{
+		error = "no opcode matches \"" + text + "\"";
+		return false;
+	}
+
+	(replacement ? rule.replacement : rule.pattern).push_back(instruction);
+	return true;
+}
+
+/*================================================ Parser::DecodeEmitted() =================================================================
+	DESCRIPTION:
+		  Reads the instructions of the assembled program back out of the ROM image, so operands that were forward references
+		  have their final values. Jumps that are stored relative to the next instruction decode to the address they go to.
+===========================================================================================================================================*/
+void Parser::DecodeEmitted(vector<PeepholeSite>& sites)
+{
+	unordered_map<long long, int> labelled;
+	for (const ListingLabel& label : _programROM.GetLabels())
+		labelled[ROMData::ImageAddress(label.bank, label.address)]++;
+
+	sites.resize(_emitted.size());
+
+	for (int i = 0; i < _emitted.size(); i++)
+	{
+		int layout = _opcodeDictionary.GetLayout(_emitted[i].entry);
+		PeepholeSite& site = sites[i];
+
+		site.entry = _emitted[i].entry;
+		site.address = _emitted[i].address;
+		site.length = _encoder.Size(layout);
+		site.args[0] = site.args[1] = 0;
+		site.labelled = labelled.count(_emitted[i].image) > 0;
+
+		unsigned char bytes[InstructionEncoder::MAX_BITS / 8];
+		_programROM.ReadImage(_emitted[i].image, bytes, site.length);
+		_encoder.Decode(layout, bytes, site.address, site.args);
+	}
+}
+
+/*================================================= Parser::PlanPeephole() =================================================================
+	DESCRIPTION:
+		  Runs the peephole automaton over the decoded instructions and works out what the second assembly does with each one.
+		  Returns false if no rule applies.
+===========================================================================================================================================*/
+bool Parser::PlanPeephole(const vector<PeepholeSite>& sites, vector<RewriteStep>& plan, vector<int>& applications)
+{
+	vector<PeepholeMatch> matches;
+	_peephole.FindMatches(sites, matches);
+
+	// The replacement takes the place of the first instructions of the match (or the last ones, when those are the same
+	// opcodes, so the listing shows it next to the lines it came from) and the rest are left out
+	applications.assign(_peephole.NumRules(), 0);
+	for (const PeepholeMatch& match : matches)
+	{
+		const PeepholeRule& rule = _peephole.GetRule(match.rule);
+		int offset = rule.pattern.size() - rule.replacement.size();
+		applications[match.rule]++;
+
+		for (int k = 0; k < rule.replacement.size() && offset > 0; k++)
+		{
+			if (rule.replacement[k].entry != rule.pattern[offset + k].entry)
+				offset = 0;
+		}
+
+		for (int k = 0; k < rule.pattern.size(); k++)
+		{
+			plan[match.first + k].rewritten = true;
+
+			if (k >= offset && k < offset + rule.replacement.size())
+				SetReplacement(plan[match.first + k], rule, rule.replacement[k - offset], match.first);
+		}
+	}
+
+	return !matches.empty();
+}
+
+/*================================================ Parser::SetReplacement() ================================================================
+	DESCRIPTION:
+		  Makes a plan step emit an instruction of a rule's replacement. Captured operands are copied as they were written in
+		  the matched instructions (starting at first), so labels are evaluated again at their new addresses.
+===========================================================================================================================================*/
+void Parser::SetReplacement(RewriteStep& step, const PeepholeRule& rule, const PeepholeInstruction& instruction, int first)
+{
+	step.replacement = instruction.entry;
+
+	for (int n = 0; n < instruction.numArgs; n++)
+	{
+		const PeepholeOperand& operand = instruction.args[n];
+
+		if (operand.kind == PeepholeOperandKind::Capture)
+		{
+			const pair<int, int>& source = rule.captureSources[operand.capture];
+			step.operands[n] = _emitted[first + source.first].operands[source.second];
+		}
+		else
+			step.operands[n] = operand.text;
+	}
+}
+
+/*=============================================== Parser::PlanRelaxation() =================================================================
+	DESCRIPTION:
+		  Picks the form of every jump that has a relax rule. All of them start out short, and the ones whose targets are out of
+		  reach are widened one at a time from a worklist until the sizes settle (see BranchRelaxer). The instructions the
+		  peephole plan rewrites keep their new sizes, and jumps listed in keepLong (which didn't reach in an earlier try) stay
+		  long. Returns false if no jump can be made short.
+===========================================================================================================================================*/
+bool Parser::PlanRelaxation(const vector<PeepholeSite>& sites, const vector<bool>& keepLong, vector<RewriteStep>& plan)
+{
+	struct Branch
+	{
+		int site;
+		int rule;
+		int target;			// operand of the short form that holds the target
+		long long args[2];
+	};
+
+	BranchRelaxer relaxer;
+	vector<Branch> branches;
+	long long reach = 0;
+
+	for (int i = 0; i < sites.size(); i++)
+	{
+		const RewriteStep& step = plan[i];
+		int length = !step.rewritten ? sites[i].length : step.replacement >= 0 ? _encoder.Size(_opcodeDictionary.GetLayout(step.replacement)) : 0;
+		relaxer.AddSite(sites[i].address, sites[i].length, length, _emitted[i].region);
+
+		auto rule = _relaxByEntry.find(sites[i].entry);
+		if (step.rewritten || keepLong[i] || rule == _relaxByEntry.end())
+			continue;
+
+		// The short form's operands: registers are part of its opcode, captures come from the jump as it was assembled
+		const PeepholeRule& relax = _relaxRules[rule->second];
+		const PeepholeInstruction& shortForm = relax.replacement[0];
+		int layout = _opcodeDictionary.GetLayout(shortForm.entry);
+		int width = 0;
+		Branch branch = { i, rule->second, _encoder.GetRelativeArg(layout, &width), { 0, 0 } };
+
+		for (int n = 0; n < shortForm.numArgs; n++)
+		{
+			const PeepholeOperand& operand = shortForm.args[n];
+
+			if (operand.kind == PeepholeOperandKind::Capture)
+				branch.args[n] = sites[i].args[relax.captureSources[operand.capture].second];
+			else if (operand.kind == PeepholeOperandKind::Register)
+				branch.args[n] = _registerIds.GetLabelValue(_opcodeDictionary.GetArgString(shortForm.entry, n).c_str());
+			else
+				branch.args[n] = operand.value;
+		}
+
+		relaxer.AddBranch(i, _encoder.Size(layout), branch.args[branch.target]);
+		branches.push_back(branch);
+		reach = max(reach, (1LL << (width - 1)) + InstructionEncoder::MAX_BITS / 8);
+	}
+
+	if (branches.empty())
+		return false;
+
+	_relaxSteps = relaxer.Relax(reach, [&](int b, long long pc, long long target)
+	{
+		const Branch& branch = branches[b];
+		int entry = _relaxRules[branch.rule].replacement[0].entry;
+		long long args[2] = { branch.args[0], branch.args[1] };
+		args[branch.target] = target;
+
+		unsigned char bytes[InstructionEncoder::MAX_BITS / 8];
+		string error;
+		return _encoder.Encode(_opcodeDictionary.GetLayout(entry), _opcodeDictionary.GetValue(entry), args, (int)pc, true, bytes, error);
+	});
+
+	_branchesShort = 0;
+	_branchesLong = 0;
+
+	for (int b = 0; b < branches.size(); b++)
+	{
+		if (!relaxer.IsShort(b))
+		{
+			_branchesLong++;
+			continue;
+		}
+
+		const PeepholeRule& relax = _relaxRules[branches[b].rule];
+		RewriteStep& step = plan[branches[b].site];
+		step.rewritten = true;
+		step.relaxed = true;
+		SetReplacement(step, relax, relax.replacement[0], branches[b].site);
+		_branchesShort++;
+	}
+
+	return _branchesShort > 0;
+}
+
+/*=================================================== Parser::Reassemble() =================================================================
+	DESCRIPTION:
+		  Assembles the program a second time with the peephole rewrites, short jumps, pooled data and unreachable code left
+		  out applied, and with the sections placed, so that every label, forward reference and .org lands where the smaller program puts it. That assembly writes the ROM (and runs the simulation and
+		  checks) in place of this one. If one of the short jumps turns out not to reach (an .align or an address worked out
+		  from "$" can move code differently than relaxation expects), it goes back to its long form and the program is
+		  assembled again. Returns false if there was nothing to rewrite or it failed, in which case this one carries on
+		  (unless the program has sections, which only the second assembly places).
+===========================================================================================================================================*/
+bool Parser::Reassemble(const char* filename)
+{
+	vector<PeepholeSite> sites;
+	DecodeEmitted(sites);
+
+	vector<RewriteStep> plan(_emitted.size());
+	for (int i = 0; i < _emitted.size(); i++)
+	{
+		plan[i].entry = _emitted[i].entry;
+		plan[i].rewritten = false;
+		plan[i].relaxed = false;
+		plan[i].replacement = -1;
+	}
+
+	vector<int> applications;
+	bool rewritten = false;
+
+	if (_optimizeRequested && _peephole.NumRules() > 0)
+	{
+		rewritten = PlanPeephole(sites, plan, applications);
+
+		if (!rewritten && !_testMode)
+			printf("\nPeephole optimizer:   no rule applies\n");
+	}
+
+	// Banks (and sections, until they are placed) share CPU addresses, which dead code and pooling both go by, so they are
+	// left to programs without them
+	bool banked = !_bankAddresses.empty() || !_sections.empty();
+
+	// Code that can't be reached is left out after the peephole rewrites have been picked, so it doesn't split a match
+	if (_optimizeRequested && !banked && !_entries.empty() && PlanStripping(sites, plan))
+		rewritten = true;
+
+	vector<DataStep> dataPlan(_dataLines.size());
+	for (int l = 0; l < _dataLines.size(); l++)
+		dataPlan[l] = { (int)_dataLines[l].bytes.size(), false, -1 };
+
+	unordered_map<string, string> redirects;
+	bool pooled = _optimizeRequested && !banked && PlanPooling(dataPlan, redirects);
+
+	// Sections have to be placed for the program to be written at all, so if that fails this one doesn't carry on either
+	vector<int> placement;
+	if (!PlaceSections(placement))
+		return true;
+
+	vector<bool> keepLong(_emitted.size(), false);
+
+	for (int attempt = 0; attempt < MAX_RELAX_ATTEMPTS; attempt++)
+	{
+		vector<RewriteStep> steps = plan;
+		bool relaxed = !_relaxRules.empty() && PlanRelaxation(sites, keepLong, steps);
+
+		if (!rewritten && !relaxed && !pooled && _sections.empty())
+			return false;
+
+		_reassembled = make_unique<Parser>();
+		_reassembled->SetParseMode(ParseMode::Assembler);
+		_reassembled->SetOutMode(_outMode);
+		_reassembled->SetTestMode(_testMode);
+		_reassembled->_reassembling = true;
+		_reassembled->_rewritePlan = steps;
+		_reassembled->_dataPlan = dataPlan;
+		_reassembled->_labelRedirects = redirects;
+		_reassembled->_sectionPlan = placement;
+		_reassembled->_blocksPooled = _blocksPooled;
+		_reassembled->_bytesPooled = _bytesPooled;
+		_reassembled->_instructionsStripped = _instructionsStripped;
+		_reassembled->_bytesStripped = _bytesStripped;
+		_reassembled->_peepholeApplications = applications;
+		_reassembled->_branchesShort = _branchesShort;
+		_reassembled->_branchesLong = _branchesLong;
+		_reassembled->_relaxSteps = _relaxSteps;
+		_reassembled->_sources = _sources;
+		_reassembled->Parse(filename);
+
+		if (_reassembled->_programReady)
+			return true;
+
+		if (_reassembled->_relaxFailures.empty())
+			break;
+
+		for (int index : _reassembled->_relaxFailures)
+			keepLong[index] = true;
+	}
+
+	_reassembled.reset();
+
+	if (!_sections.empty())
+	{
+		printf("\nThe program couldn't be assembled with its sections placed\n");
+		return true;
+	}
+
+	printf("\nThe program couldn't be assembled with its rewrites, so it is written without them\n");
+	return false;
+}
+
+/*=============================================== Parser::PrintPeepholeReport() ============================================================
+	DESCRIPTION:
+		  Prints what each peephole rule saved in the optimized program. Cycles are counted once per rewritten sequence, with
+		  every jump that costs extra taken.
+===========================================================================================================================================*/
+void Parser::PrintPeepholeReport()
+{
+	int rewrites = 0;
+	int bytes = 0;
+	int cycles = 0;
+
+	for (int r = 0; r < _peepholeApplications.size() && r < _peephole.NumRules(); r++)
+	{
+		rewrites += _peepholeApplications[r];
+		bytes += _peepholeApplications[r] * _peephole.GetRule(r).bytesSaved;
+		cycles += _peepholeApplications[r] * _peephole.GetRule(r).cyclesSaved;
+	}
+
+	printf("\nPeephole optimizer:   %d rewrites, %d bytes and %d cycles saved\n", rewrites, bytes, cycles);
+
+	for (int r = 0; r < _peepholeApplications.size() && r < _peephole.NumRules(); r++)
+	{
+		const PeepholeRule& rule = _peephole.GetRule(r);
+		if (_peepholeApplications[r] > 0)
+			printf("  %-20s %5d x %6d bytes %8d cycles\n", rule.name.c_str(), _peepholeApplications[r], _peepholeApplications[r] * rule.bytesSaved, _peepholeApplications[r] * rule.cyclesSaved);
+	}
+}
+
+/*================================================ Parser::EmitReplacement() ===============================================================
+	DESCRIPTION:
+		  Emits the instruction a peephole rewrite puts in place of the one that was read, in the optimized assembly.
+===========================================================================================================================================*/
+int Parser::EmitReplacement(const RewriteStep& step)
+{
+	OpcodeDictionary& opcodes = _opcodeDictionary;
+	_operandExprs[0] = _operandExprs[1] = -1;
+	opcodes.currNumArgs = 0;
+
+	for (int n = 0; n < opcodes.GetNumArgs(step.replacement) && n < 2; n++)
+	{
+		if (ParseOperand(step.operands[n], n) == -1)
+			return -1;
+	}
+
+	long long args[2] = { opcodes.currArg0num, opcodes.currArg1num };
+
+	if (!EmitEncoded(opcodes.GetLayout(step.replacement), opcodes.GetValue(step.replacement), args, _operandExprs))
+		return -1;
+
+	_programROM.AddListingCycles(opcodes.GetMinCycles(step.replacement), opcodes.GetMaxCycles(step.replacement), EndsBlock(step.replacement));
+	return 0;
+}
+
+/*================================================ Parser::ResolveEntries() ================================================================
+	DESCRIPTION:
+		  Looks up the labels of the .entry lines. Returns false (after reporting them) if any of them isn't defined.
+===========================================================================================================================================*/
+bool Parser::ResolveEntries()
+{
+	bool ok = true;
+	_entryAddresses.clear();
+
+	for (const EntryDefinition& entry : _entries)
+	{
+		long long address = 0;
+
+		if (!_labelDictionary.Resolve(entry.label, &address))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", entry.line, entry.file.c_str());
+			printf("  -> \"%s\" is not a label! Parsing cannot continue until fixed\n", entry.label.c_str());
+			ok = false;
+			continue;
+		}
+
+		_entryAddresses.push_back(address);
+	}
+
+	return ok;
+}
+
+/*=================================================== Parser::PlaceData() ==================================================================
+	DESCRIPTION:
+		  Called for each .byte and .ascii line before its bytes are written. The first assembly records the line (with the
+		  labels that point at it) for PlanPooling(). The second assembly follows the data plan: it puts the label of a pooled
+		  block in front of the block, and returns true for a line whose bytes are already part of another block, which is
+		  then left out.
+===========================================================================================================================================*/
+bool Parser::PlaceData(const unsigned char* bytes, int length, const vector<string>& values, bool constant)
+{
+	int address = _programROM.GetCurrentAddress();
+
+	// A line the language server assembles again keeps its place
+	if (_patchBytes != NULL)
+		return false;
+
+	if (!_reassembling)
+	{
+		DataLine line = { address, (int)_regions.size(), (int)_emitted.size(), vector<unsigned char>(bytes, bytes + length), constant, {}, values };
+
+		for (const pair<string, int>& label : _pendingLabels)
+		{
+			if (label.second == address)
+				line.labels.push_back(label.first);
+		}
+
+		_pendingLabels.clear();
+		_dataLines.push_back(line);
+		return false;
+	}
+
+	int index = _dataIndex++;
+	if (index >= _dataPlan.size() || _dataPlan[index].length != length)
+	{
+		_rewriteMismatch = true;
+		return false;
+	}
+
+	if (_dataPlan[index].anchor >= 0)
+		_labelDictionary.Add(POOL_ANCHOR_STR + to_string(_dataPlan[index].anchor), address);
+
+	return _dataPlan[index].dropped;
+}
+
+/*================================================== Parser::PlanPooling() =================================================================
+	DESCRIPTION:
+		  Finds the data blocks whose bytes are already in the program as another block or the tail of one (see StringPool),
+		  and plans to leave them out. A block is a run of .byte and .ascii lines with nothing else between them and a label
+		  only in front of the first one. Only blocks whose bytes don't depend on labels are pooled, and only labelled blocks
+		  are left out: their labels are pointed into the block that holds their bytes. Returns false if no block is pooled.
+===========================================================================================================================================*/
+bool Parser::PlanPooling(vector<DataStep>& plan, unordered_map<string, string>& redirects)
+{
+	StringPool pool;
+	vector<int> firstLine;
+	vector<int> endLine;
+	vector<unsigned char> bytes;
+
+	for (int l = 0; l < _dataLines.size(); )
+	{
+		const DataLine& first = _dataLines[l];
+		int address = first.address + first.bytes.size();
+		bool constant = first.constant;
+		bytes = first.bytes;
+
+		int end = l + 1;
+		for (; end < _dataLines.size(); end++)
+		{
+			const DataLine& line = _dataLines[end];
+			if (!line.labels.empty() || line.region != first.region || line.instruction != first.instruction || line.address != address)
+				break;
+
+			constant = constant && line.constant;
+			address += line.bytes.size();
+			bytes.insert(bytes.end(), line.bytes.begin(), line.bytes.end());
+		}
+
+		if (constant && !bytes.empty())
+		{
+			pool.AddBlock(&bytes[0], bytes.size());
+			firstLine.push_back(l);
+			endLine.push_back(end);
+		}
+
+		l = end;
+	}
+
+	pool.Build();
+	_blocksPooled = 0;
+	_bytesPooled = 0;
+
+	for (int b = 0; b < pool.NumBlocks(); b++)
+	{
+		int offset = 0;
+		int home = pool.GetHome(b, &offset);
+		const DataLine& first = _dataLines[firstLine[b]];
+
+		if (home == b || first.labels.empty())
+			continue;
+
+		for (int l = firstLine[b]; l < endLine[b]; l++)
+		{
+			plan[l].dropped = true;
+			_bytesPooled += _dataLines[l].bytes.size();
+		}
+
+		plan[firstLine[home]].anchor = home;
+		for (const string& label : first.labels)
+			redirects[label] = POOL_ANCHOR_STR + to_string(home) + " + " + to_string(offset);
+
+		_blocksPooled++;
+	}
+
+	return _blocksPooled > 0;
+}
+
+/*================================================= Parser::PlanStripping() ================================================================
+	DESCRIPTION:
+		  Follows the program from its start address and .entry labels, and plans to leave out the instructions it never gets
+		  to. An instruction goes on to the next one unless it always jumps or halts, and every address or label its operands
+		  use (as well as those of .byte values, .expect ... after and .budget lines) may be code that is run. A jump to an
+		  address worked out at run time could go anywhere, so then nothing is left out. Returns false if every instruction
+		  can be reached.
+===========================================================================================================================================*/
+bool Parser::PlanStripping(const vector<PeepholeSite>& sites, vector<RewriteStep>& plan)
+{
+	unordered_map<int, int> siteAt;
+	for (int i = sites.size() - 1; i >= 0; i--)
+		siteAt[sites[i].address] = i;
+
+	vector<bool> reached(sites.size(), false);
+	vector<int> worklist;
+
+	auto reach = [&](long long address)
+	{
+		auto site = siteAt.find((int)address);
+		if (site != siteAt.end() && !reached[site->second])
+		{
+			reached[site->second] = true;
+			worklist.push_back(site->second);
+		}
+	};
+
+	auto reachSymbols = [&](const string& text)
+	{
+		string error;
+		int expr = text.empty() ? -1 : CompileExpression(text, error);
+		if (expr < 0)
+			return;
+
+		vector<int> symbols;
+		_expressions.GetSymbols(expr, symbols);
+
+		for (int symbol : symbols)
+		{
+			long long address = 0;
+			if (_labelDictionary.Resolve(_expressions.GetSymbolName(symbol), &address))
+				reach(address);
+		}
+	};
+
+	reach(_programROM.GetStartAddress());
+	for (long long address : _entryAddresses)
+		reach(address);
+
+	for (const DataLine& line : _dataLines)
+	{
+		for (const string& value : line.values)
+			reachSymbols(value);
+	}
+
+	for (const ExpectDefinition& expect : _expects)
+		reachSymbols(expect.after);
+	for (const BudgetDefinition& budget : _budgets)
+		reachSymbols(budget.label);
+
+	while (!worklist.empty())
+	{
+		int i = worklist.back();
+		worklist.pop_back();
+
+		int entry = sites[i].entry;
+		bool jumps = HasAction(entry, MicroOpType::Jump);
+		bool known = false;
+
+		for (int n = 0; n < _opcodeDictionary.GetNumArgs(entry) && n < 2; n++)
+		{
+			if (_opcodeDictionary.GetArgType(entry, n) == ArgType::Register)
+				continue;
+
+			reach(sites[i].args[n]);
+			reachSymbols(_emitted[i].operands[n]);
+			known = true;
+		}
+
+		if (jumps && !known)
+		{
+			if (!_testMode)
+				printf("\nDead code:            none left out, the %s at $%04X jumps to a computed address\n", _opcodeDictionary.GetMnemonic(entry).c_str(), sites[i].address);
+			return false;
+		}
+
+		bool stops = (jumps || HasAction(entry, MicroOpType::Halt)) && _opcodeDictionary.GetMinCycles(entry) == _opcodeDictionary.GetMaxCycles(entry);
+		if (!stops)
+			reach(sites[i].address + sites[i].length);
+	}
+
+	_instructionsStripped = 0;
+	_bytesStripped = 0;
+
+	for (int i = 0; i < sites.size(); i++)
+	{
+		if (reached[i] || plan[i].rewritten)
+			continue;
+
+		plan[i].rewritten = true;
+		plan[i].replacement = -1;
+		_instructionsStripped++;
+		_bytesStripped += sites[i].length;
+	}
+
+	return _instructionsStripped > 0;
+}
+
+/*=============================================== Parser::PrintLayoutReport() ==============================================================
+	DESCRIPTION:
+		  Prints the bytes .optimize recovered by pooling data and leaving out code that can't be reached.
+===========================================================================================================================================*/
+void Parser::PrintLayoutReport()
+{
+	printf("\nLayout optimizer:     %d bytes recovered\n", _bytesPooled + _bytesStripped);
+
+	if (_blocksPooled > 0)
+		printf("  %-20s %5d blocks %6d bytes\n", "pooled data", _blocksPooled, _bytesPooled);
+	if (_instructionsStripped > 0)
+		printf("  %-20s %5d instrs %6d bytes\n", "unreachable code", _instructionsStripped, _bytesStripped);
+}
+
+/*========================================================== Parser::SwitchBank() ==========================================================
+	DESCRIPTION:
+		  Selects a bank for the lines that follow. Each bank has its own location counter: the first time, it starts at the
+		  bank's base address, and after that it carries on where the code of the bank left off.
+===========================================================================================================================================*/
+void Parser::SwitchBank(int bank)
+{
+	_bankAddresses[_programROM.GetBank()] = _programROM.GetCurrentAddress();
+
+	auto saved = _bankAddresses.find(bank);
+	auto window = _banks.find(bank);
+
+	_programROM.SetBank(bank);
+	_programROM.SetCurrentAddress(saved != _bankAddresses.end() ? saved->second : window != _banks.end() ? window->second.base : 0);
+	StartAddressRegion(false);
+}
+
+/*========================================================= Parser::FillEnd() =============================================================
+	DESCRIPTION:
+		  The address a .fill at the current address can write up to (but not including): the end of the bank's window, or
+		  without one, the end of the ROM image or of the .export range for bank 0. Any other bank without a window is only as
+		  big as what is written to it, so one .fill may write as much as the ROM holds. Until it is placed, a section is
+		  assembled from address 0 of a bank of its own, and has as much room as the bank it goes in.
+===========================================================================================================================================*/
+long long Parser::FillEnd()
+{
+	int bank = _programROM.GetBank();
+	bool provisional = bank < 0 && -1 - bank < _sections.size();
+	if (provisional)
+		bank = _sections[-1 - bank].bank;
+
+	auto window = _banks.find(bank);
+	long long base = window != _banks.end() && !provisional ? window->second.base : 0;
+
+	if (window != _banks.end() && window->second.size > 0)
+		return base + window->second.size;
+
+	if (bank == 0)
+		return max(base + PROGRAM_ROM_SIZE, (long long)_programROM.GetEndAddress() + 1);
+
+	return (long long)_programROM.GetCurrentAddress() + PROGRAM_ROM_SIZE;
+}
+
+/*====================================================== Parser::CheckFillValue() ==========================================================
+	DESCRIPTION:
+		  Checks that the value a .fill or .align pads with fits in a byte, the way a .byte value is checked. Prints an error and
+		  returns false if it doesn't.
+===========================================================================================================================================*/
+bool Parser::CheckFillValue(const string& text, long long value, const char* directive)
+{
+	long long args[2] = { value, 0 };
+	unsigned char byte;
+	string error;
+
+	if (_encoder.Encode(_byteLayout, 0, args, _programROM.GetCurrentAddress(), true, &byte, error))
+		return true;
+
+	printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+	printf("  -> Invalid value \"%s\" in %s directive: %s! Parsing cannot continue until fixed\n", text.c_str(), directive, error.c_str());
+	return false;
+}
+
+/*====================================================== Parser::StartAddressRegion() ======================================================
+	DESCRIPTION:
+		  Starts a new region after a directive that moves the location counter: the lines of a region follow on from each
+		  other, so they move together. fixed is true for a region that starts at an address of its own (.org), which doesn't
+		  move when the region before it grows or shrinks.
+===========================================================================================================================================*/
+void Parser::StartAddressRegion(bool fixed)
+{
+	_regions.push_back({ (int)_programROM.GetListing().size(), (int)_programROM.GetLabels().size(), _labelDictionary.NumLabels(), fixed });
+}
+
+/*========================================================= Parser::EmitVeneers() ==========================================================
+	DESCRIPTION:
+		  Routes the calls into another bank through veneers, once every label is known. Bank 0 is always mapped, so the
+		  veneers go after its last byte: each one is the replacement of the call's veneer rule, with the label's bank for
+		  #bank. Calls to the same label share a veneer. The call is then encoded again to go to the veneer, which doesn't
+		  change its size, so nothing else moves. Returns false if a call can't reach its veneer.
+===========================================================================================================================================*/
+bool Parser::EmitVeneers()
+{
+	if (_farCalls.empty())
+		return true;
+
+	int first = 0;
+	int last = -1;
+	_programROM.GetBankRange(0, &first, &last);
+
+	int savedBank = _programROM.GetBank();
+	int savedAddress = _programROM.GetCurrentAddress();
+	_programROM.SetBank(0);
+	_programROM.SetCurrentAddress(last + 1);
+
+	int start = last + 1;
+	unordered_map<string, int> veneers;		// bank and label of each veneer, and its address
+	bool ok = true;
+
+	for (const FarCall& call : _farCalls)
+	{
+		const PeepholeRule& rule = _veneerRules[call.rule];
+		const string& target = call.operands[call.target];
+
+		// The bank of the first label in the operand
+		string error;
+		int expr = CompileExpression(target, error);
+		int bank = -1;
+
+		vector<int> symbols;
+		if (expr >= 0)
+			_expressions.GetSymbols(expr, symbols);
+
+		for (int symbol : symbols)
+		{
+			auto defined = _labelBanks.find(_expressions.GetSymbolName(symbol));
+			if (defined != _labelBanks.end())
+			{
+				bank = defined->second;
+				break;
+			}
+		}
+
+		if (bank <= 0 || bank == call.bank)
+			continue;
+
+		_currFile = call.file;
+		_currLine = call.line;
+
+		string key = to_string(bank) + ":" + target;
+		auto veneer = veneers.find(key);
+		if (veneer == veneers.end())
+		{
+			veneer = veneers.emplace(key, _programROM.GetCurrentAddress()).first;
+
+			if (_outMode == OutMode::Verbose)
+				printf("      -- %02x: veneer to %s in bank %d\n", veneer->second, target.c_str(), bank);
+
+			for (const PeepholeInstruction& instruction : rule.replacement)
+			{
+				RewriteStep step = { instruction.entry, true, false, instruction.entry, { "", "" } };
+
+				for (int n = 0; n < instruction.numArgs; n++)
+				{
+					const PeepholeOperand& operand = instruction.args[n];
+
+					if (operand.kind != PeepholeOperandKind::Capture)
+						step.operands[n] = operand.text;
+					else if (operand.capture == 0)
+						step.operands[n] = to_string(bank);
+					else
+						step.operands[n] = call.operands[rule.captureSources[operand.capture].second];
+				}
+
+				// The call already noted its use of the label, and the veneer has no line of its own to note another one on
+				_opcodeDictionary.currMnemonic = _opcodeDictionary.GetMnemonic(instruction.entry);
+				_emittingVeneers = true;
+				int result = EmitReplacement(step);
+				_emittingVeneers = false;
+
+				if (result == -1)
+					return false;
+			}
+
+			_veneers++;
+		}
+
+		// The call goes to the veneer now instead of the label
+		int layout = _opcodeDictionary.GetLayout(call.entry);
+		unsigned char bytes[InstructionEncoder::MAX_BITS / 8];
+		long long args[2] = { 0, 0 };
+
+		_programROM.ReadImage(call.image, bytes, _encoder.Size(layout));
+		_encoder.Decode(layout, bytes, call.pc, args);
+		args[call.target] = veneer->second;
+
+		if (!_encoder.Encode(layout, _opcodeDictionary.GetValue(call.entry), args, call.pc, true, bytes, error))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", call.line, call.file.c_str());
+			printf("  -> The call to \"%s\" in bank %d can't reach its veneer at $%04X: %s! Parsing cannot continue until fixed\n", target.c_str(), bank, veneer->second, error.c_str());
+			ok = false;
+			continue;
+		}
+
+		for (int b = 0; b < _encoder.Size(layout); b++)
+			_programROM.AddEntry(call.image + b, bytes[b]);
+
+		_farCallsRouted++;
+	}
+
+	_veneerBytes = _programROM.GetCurrentAddress() - start;
+	_programROM.SetBank(savedBank);
+	_programROM.SetCurrentAddress(savedAddress);
+	return ok;
+}
+
+/*========================================================== Parser::CheckBanks() ==========================================================
+	DESCRIPTION:
+		  Checks that the bytes of every bank that was given a size fit in its window. Returns false (after reporting them)
+		  if any of them don't.
+===========================================================================================================================================*/
+bool Parser::CheckBanks()
+{
+	bool ok = true;
+
+	for (const pair<const int, BankDefinition>& bank : _banks)
+	{
+		const BankDefinition& window = bank.second;
+		int first = 0;
+		int last = -1;
+
+		if (window.size <= 0 || !_programROM.GetBankRange(bank.first, &first, &last))
+			continue;
+
+		if (first < window.base || last >= window.base + window.size)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", window.line, window.file.c_str());
+			printf("  -> Bank %d holds $%04X-$%04X, which doesn't fit its window $%04X-$%04X! Parsing cannot continue until fixed\n",
+				bank.first, first, last, window.base, window.base + window.size - 1);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+/*======================================================== Parser::PlaceSections() =========================================================
+	DESCRIPTION:
+		  Works out where each section goes, once the first assembly has measured them. The free space of a bank is its
+		  window (or the first PROGRAM_ROM_SIZE bytes from its base) less the bytes the rest of the program wrote there. The
+		  biggest sections are placed first, each in the smallest free range that it fits in. Returns false (after reporting
+		  them) if any of them doesn't fit.
+===========================================================================================================================================*/
+bool Parser::PlaceSections(vector<int>& plan)
+{
+	plan.assign(_sections.size(), 0);
+	if (_sections.empty())
+		return true;
+
+	unordered_map<int, FreeSpace> free;
+	unordered_map<int, int> bases;
+
+	for (const SectionDefinition& section : _sections)
+	{
+		if (free.count(section.bank))
+			continue;
+
+		auto window = _banks.find(section.bank);
+		long long start = window != _banks.end() ? window->second.base : 0;
+		long long end = start + (window != _banks.end() && window->second.size > 0 ? window->second.size : PROGRAM_ROM_SIZE);
+		bases[section.bank] = (int)start;
+
+		vector<pair<int, int>> used;
+		_programROM.GetUsedRanges(section.bank, used);
+
+		FreeSpace& space = free[section.bank];
+		for (const pair<int, int>& range : used)
+		{
+			space.Add(start, min(end, (long long)range.first));
+			start = max(start, (long long)range.second);
+		}
+
+		space.Add(start, end);
+	}
+
+	vector<int> order(_sections.size());
+	for (int s = 0; s < order.size(); s++)
+		order[s] = s;
+
+	stable_sort(order.begin(), order.end(), [this](int a, int b)
+	{
+		const SectionDefinition& x = _sections[a];
+		const SectionDefinition& y = _sections[b];
+		return x.size != y.size ? x.size > y.size : x.alignment > y.alignment;
+	});
+
+	bool ok = true;
+
+	for (int s : order)
+	{
+		const SectionDefinition& section = _sections[s];
+		long long address = bases[section.bank];
+
+		if (section.size == 0 || free[section.bank].Allocate(section.size, section.alignment, section.page, &address))
+		{
+			plan[s] = (int)address;
+
+			if (_outMode == OutMode::Verbose)
+				printf("      -- Section %s: %d bytes at %02x\n", section.name.c_str(), section.size, plan[s]);
+
+			continue;
+		}
+
+		printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", section.line, section.file.c_str());
+		if (section.page > 0)
+			printf("  -> Section \"%s\" (%d bytes) doesn't fit in the free space of bank %d without running over a page of %d bytes! Parsing cannot continue until fixed\n", section.name.c_str(), section.size, section.bank, section.page);
+		else
+			printf("  -> Section \"%s\" (%d bytes) doesn't fit in the free space of bank %d! Parsing cannot continue until fixed\n", section.name.c_str(), section.size, section.bank);
+		ok = false;
+	}
+
+	return ok;
+}
+
+/*======================================================== Parser::CheckOverlaps() =========================================================
+	DESCRIPTION:
+		  Checks that no two lines wrote to the same bytes, which would otherwise leave whatever was written last. The lines
+		  are sorted by address, so a line can only overlap the one before it that reaches furthest. Returns false (after
+		  reporting them) if any do.
+===========================================================================================================================================*/
+bool Parser::CheckOverlaps()
+{
+	vector<ListingRecord> records;
+	for (const ListingRecord& record : _programROM.GetListing())
+	{
+		if (record.length > 0)
+			records.push_back(record);
+	}
+
+	sort(records.begin(), records.end(), [](const ListingRecord& a, const ListingRecord& b)
+	{
+		return a.bank != b.bank ? a.bank < b.bank : a.address < b.address;
+	});
+
+	const vector<string>& files = _programROM.GetSourceFiles();
+	bool ok = true;
+	int furthest = -1;
+
+	for (int r = 0; r < records.size(); r++)
+	{
+		const ListingRecord& record = records[r];
+
+		if (furthest >= 0 && records[furthest].bank == record.bank && record.address < records[furthest].address + records[furthest].length)
+		{
+			const ListingRecord& other = records[furthest];
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", record.line + 1, files[record.fileId].c_str());
+			printf("  -> Its bytes $%04X-$%04X overlap those of line #%d of \"%s\" ($%04X-$%04X)! Parsing cannot continue until fixed\n",
+				record.address, record.address + record.length - 1, other.line + 1, files[other.fileId].c_str(), other.address, other.address + other.length - 1);
+			ok = false;
+		}
+
+		if (furthest < 0 || records[furthest].bank != record.bank || record.address + record.length > records[furthest].address + records[furthest].length)
+			furthest = r;
+	}
+
+	return ok;
+}
+
+/*====================================================== Parser::PrintSectionReport() ======================================================
+	DESCRIPTION:
+		  Prints where each section was placed.
+===========================================================================================================================================*/
+void Parser::PrintSectionReport()
+{
+	int bytes = 0;
+	for (const SectionDefinition& section : _sections)
+		bytes += section.size;
+
+	printf("\nSections placed:      %d, %d bytes\n", (int)_sections.size(), bytes);
+
+	for (int s = 0; s < _sections.size() && s < _sectionPlan.size(); s++)
+	{
+		const SectionDefinition& section = _sections[s];
+		if (section.size > 0)
+			printf("  %-20s bank %-3d $%04X-$%04X\n", section.name.c_str(), section.bank, _sectionPlan[s], _sectionPlan[s] + section.size - 1);
+		else
+			printf("  %-20s bank %-3d (empty)\n", section.name.c_str(), section.bank);
+	}
+}
+
+/*================================================= Parser::SkipRawLine() ==================================================================
+	DESCRIPTION:
+		  Used while inside a false conditional branch. Looks at the raw text of a line without tokenizing it and returns true if the
+		  line can be dropped. Returns false for the .elif/.else/.endif that belongs to the current block, which then has to be parsed.
+===========================================================================================================================================*/
+bool Parser::SkipRawLine(const char* line)
+{
+	while (*line == ' ' || *line == '\t')
+		line++;
+
+	if (*line == 0 || !strchr(DIRECTIVE_KEYS, *line))
+		return true;
+
+	const char* word = line + 1;
+	int length = 0;
+	while (word[length] != 0 && word[length] != ' ' && word[length] != '\t' && word[length] != ',' && word[length] != '\r')
+		length++;
+
+	return SkipDirective(word, length);
+}
+
+/*================================================ Parser::SkipDirective() =================================================================
+	DESCRIPTION:
+		  Tracks conditional nesting inside a skipped region. Returns false if the directive closes or continues the current block.
+===========================================================================================================================================*/
+bool Parser::SkipDirective(const char* word, int length)
+{
+	if ((length == strlen(IF_STR) && !strncmp(word, IF_STR, length)) ||
+		(length == strlen(IFDEF_STR) && !strncmp(word, IFDEF_STR, length)) ||
+		(length == strlen(IFNDEF_STR) && !strncmp(word, IFNDEF_STR, length)))
+	{
+		_skipDepth++;
+		return true;
+	}
+
+	if (length == strlen(ENDIF_STR) && !strncmp(word, ENDIF_STR, length))
+	{
+		if (_skipDepth == 0)
+			return false;
+
+		_skipDepth--;
+		return true;
+	}
+
+	if ((length == strlen(ELIF_STR) && !strncmp(word, ELIF_STR, length)) || (length == strlen(ELSE_STR) && !strncmp(word, ELSE_STR, length)))
+		return _skipDepth > 0;
+
+	return true;
+}
+
+/*================================================= Parser::IsDirective() ==================================================================
+	DESCRIPTION:
+		  Helper that checks whether a token is the given directive (i.e., one of the DIRECTIVE_KEYS followed by the name).
+===========================================================================================================================================*/
+bool Parser::IsDirective(const char* token, const char* name)
+{
+	return token != NULL && *token != 0 && strchr(DIRECTIVE_KEYS, *token) && !strcmp(token + 1, name);
+}
+
+/*============================================ Parser::ParseLineIntoTokens()================================================================
+	DESCRIPTION:
+		  This function just prints a few versions of the interpreted program to the screen and writes the ROM data to a binary file.
+===========================================================================================================================================*/
+void Parser::ParseLineIntoTokens(const char* line, const char* delimiters)
+{
+	// strtok() overwrites the delimiter that ends each token, which may be the comma separating two operands. Keep a copy of
+	// lines that have commas in them so the operand each token belongs to can still be worked out.
+	bool hasCommas = strchr(line, ',') != NULL;
+	if (hasCommas)
+		_rawLine = line;
+
+	// Parse line into tokens by splitting on spaces, tabs, and commas
+	// This command actually only performs one split...hence the while loop below
+	char* tokens = strtok((char*)line, delimiters);
+	_tokens.push_back(tokens);
+	_tokenGroups.push_back(0);
+
+	ResetLineState();
+
+	// Column span of the line's tokens (used by the listing to point back into the source)
+	_lineColStart = 0;
+	_lineColEnd = 0;
+	if (tokens != NULL)
+	{
+		_lineColStart = tokens - line;
+		_lineColEnd = _lineColStart + strlen(tokens);
+	}
+
+	// Skip blank lines and comments. Else, determine the line type.
+	_lineType = ClassifyLine(tokens);
+
+	if (_lineType != LineType::Blank && _lineType != LineType::Comment)
+	{
+		// Continue splitting on the specified delimiters until none remain (i.e., NULL is returned)
+		int group = 0;
+		while (tokens != NULL)
+		{
+			_numTokens++;
+			_lineColEnd = (tokens - line) + strlen(tokens);
+			tokens = strtok(NULL, delimiters);
+			_tokens.push_back(tokens);
+
+			// A comma between the previous token and this one starts a new operand
+			if (tokens != NULL && hasCommas && _rawLine.find(',', _lineColEnd) < (size_t)(tokens - line))
+				group++;
+
+			_tokenGroups.push_back(group);
+		}
+	}
+}
+
+/*================================================= Parser::ClassifyLine() =================================================================
+	DESCRIPTION:
+		  Determines the type of a line from its first token.
+===========================================================================================================================================*/
+LineType Parser::ClassifyLine(const char* firstToken)
+{
+	if (firstToken == NULL)
+		return LineType::Blank;
+
+	switch (firstToken[0])
+	{
+		case ';':
+			return LineType::Comment;
+
+		case DIRECTIVE_KEYS[0]:
+			return LineType::Directive;
+
+		case SYMBOL_KEYS[0]:
+			return LineType::Symbol;
+
+		case LABEL_KEYS[0]:
+			return LineType::Label;
+
+		// Only thing left is an opcode!
+		default:
+			return LineType::OpCode;
+	}
+}
+
+int Parser::ParseToken(int i)
+{
+	if (i >= _numTokens) return -1;
+
+	if (i == 0)
+	{
+		// Only the first token is split on the directive/symbol/label keys. strtok() writes into the token, so doing
+		// this for every token would chop up operands such as file names ("font.bin").
+		char* directive_parse = strtok(_tokens[i], DIRECTIVE_KEYS);
+		char* symbol_parse = strtok(_tokens[i], SYMBOL_KEYS);
+		char* label_parse = strtok(_tokens[i], LABEL_KEYS);
+
+		if (!strcmp(directive_parse, ARCH_STR))
+		{
+			_currTokenType = TokenType::Architecture;
+			return 1;
+		}
+
+		if (!strcmp(directive_parse, INCLUDE_STR) || !strcmp(directive_parse, INSERT_STR))
+		{
+			_currTokenType = TokenType::Include;
+			return 1;
+		}
+
+		if (!strcmp(directive_parse, ORIGIN_STR))
+		{
+			_currTokenType = TokenType::Origin;
+		}
+
+		if (!strcmp(directive_parse, EXPORT_STR))
+		{
+			_currTokenType = TokenType::Export;
+		}
+
+		if (!strcmp(directive_parse, BYTE_STR))
+		{
+			_currTokenType = TokenType::Byte;
+		}
+
+		if (!strcmp(directive_parse, ASCII_STR))
+		{
+			_currTokenType = TokenType::Ascii;
+		}
+
+		if (!strcmp(directive_parse, LIST_STR))
+		{
+			_listingRequested = true;
+		}
+
+		if (!strcmp(directive_parse, SYMBOLS_STR))
+		{
+			_symbolsRequested = true;
+		}
+
+		if (!strcmp(directive_parse, OPTIMIZE_STR))
+		{
+			_optimizeRequested = true;
+		}
+
+		if (!strcmp(directive_parse, FILL_STR))
+		{
+			_currTokenType = TokenType::Fill;
+		}
+
+		if (!strcmp(directive_parse, ALIGN_STR))
+		{
+			_currTokenType = TokenType::Align;
+		}
+
+		if (!strcmp(directive_parse, INCBIN_STR))
+		{
+			_currTokenType = TokenType::Incbin;
+		}
+
+		if (!strcmp(directive_parse, SIMULATE_STR))
+		{
+			_currTokenType = TokenType::Simulate;
+		}
+
+		if (!strcmp(directive_parse, EXPECT_STR) || !strcmp(directive_parse, ASSERT_STR))
+		{
+			_currTokenType = TokenType::Expect;
+		}
+
+		if (!strcmp(directive_parse, PROFILE_STR))
+		{
+			_currTokenType = TokenType::Profile;
+		}
+
+		if (!strcmp(directive_parse, BUDGET_STR))
+		{
+			_currTokenType = TokenType::Budget;
+		}
+
+		if (!strcmp(directive_parse, ENTRY_STR))
+		{
+			_currTokenType = TokenType::Entry;
+		}
+
+		if (!strcmp(directive_parse, BANK_STR))
+		{
+			_currTokenType = TokenType::Bank;
+		}
+
+		if (!strcmp(directive_parse, SEGMENT_STR))
+		{
+			_currTokenType = TokenType::Segment;
+		}
+
+		if (!strcmp(directive_parse, SECTION_STR))
+		{
+			_currTokenType = TokenType::Section;
+		}
+
+		if (!strcmp(directive_parse, ENDS_STR))
+		{
+			_currTokenType = TokenType::Ends;
+		}
+
+		if (!strcmp(_tokens[0], REGISTER_STR))
+		{
+			_lineType = LineType::ArchRegister;
+		}
+
+		if (!strcmp(_tokens[0], CONTROL_STR))
+		{
+			_lineType = LineType::ArchControl;
+		}
+
+		if (!strcmp(_tokens[0], CONTROL_ALIAS_STR))
+		{
+			_lineType = LineType::ArchControlAlias;
+		}
+
+		if (!strcmp(_tokens[0], CONTROL_FIELD_STR))
+		{
+			_lineType = LineType::ArchControlField;
+		}
+
+		if (!strcmp(_tokens[0], CONTROL_GROUP_STR))
+		{
+			_lineType = LineType::ArchControlGroup;
+		}
+
+		if (!strcmp(_tokens[0], CONTROL_ACTION_STR))
+		{
+			_lineType = LineType::ArchControlAction;
+		}
+
+		if (!strcmp(_tokens[0], PEEPHOLE_STR))
+		{
+			_lineType = LineType::ArchPeephole;
+		}
+
+		if (!strcmp(_tokens[0], RELAX_STR))
+		{
+			_lineType = LineType::ArchRelax;
+		}
+
+		if (!strcmp(_tokens[0], VENEER_STR))
+		{
+			_lineType = LineType::ArchVeneer;
+		}
+
+		if (!strcmp(_tokens[0], OPCODE_STR))
+		{
+			_lineType = LineType::ArchOpcode;			
+		}
+
+		if (!strcmp(_tokens[0], OPCODE_ALIAS_STR))
+		{
+			_lineType = LineType::ArchOpcode;			
+			_opcodeIsAliased = true;
+		}
+
+		if (!strcmp(_tokens[0], CONTROL_ROM_STR))
+		{
+			_lineType = LineType::ControlROM;
+			_controlROMindex++;
+			_controlROMs.push_back(ROMData());
+		}
+
+		if (!strcmp(_tokens[0], CONTROL_ROM_LAYOUT_STR))
+			_lineType = LineType::ControlROMLayout;
+
+		if (strcmp(symbol_parse, _tokens[0]))
+		{
+			_currTokenType = TokenType::Symbol;
+			_labelDictionary.currLabel = symbol_parse;
+		}
+
+		if (strcmp(label_parse, _tokens[0]))
+		{
+			_currTokenType = TokenType::Label;
+			_labelDictionary.currLabel = label_parse;
+		}
+
+		if (_lineType == LineType::OpCode)
+		{
+			// Opcodes added after the architecture file (or without one) still have to be matched
+			if (_opcodeMatcher.NumEntries() != _opcodeDictionary.NumOpcodes())
+				_opcodeMatcher.Build(_opcodeDictionary);
+
+			// In a program, a word that is nothing else is taken as a mnemonic even if the architecture has no such opcode,
+			// so that it is reported along with its operands instead of the line being dropped
+			if ((_currTokenType == TokenType::None && _parseMode == ParseMode::Assembler) || _opcodeMatcher.IsAMnemonic(_tokens[0]))
+			{
+				_currTokenType = TokenType::OpCode;
+
+				_opcodeDictionary.currMnemonic = _tokens[0];
+				_opcodeDictionary.currNumArgs = 0;
+			}
+		}
+	}
+
+	if (_currTokenType == TokenType::Origin && i > 0 && i == _numTokens - 1)
+	{
+		int address;
+		if (!EvaluateExpression(JoinTokens(1, _numTokens), _labelDictionary, &address))
+			return -1;
+
+		if (_outMode == OutMode::Verbose)
+			printf("      -- Address set to: %02x\n", address);
+
+		_programROM.SetCurrentAddress(address);
+		StartAddressRegion(true);
+
+		_currTokenType = TokenType::None;
+	}
+
+	if (_currTokenType == TokenType::Export && i > 0 && i == _numTokens - 1)
+	{
+		// The start and end address can be separated by a comma or just by a space
+		vector<string> operands;
+		GetOperands(1, operands);
+		if (operands.size() == 1 && _numTokens == 3)
+		{
+			operands[0] = _tokens[1];
+			operands.push_back(_tokens[2]);
+		}
+
+		if (operands.size() != 2)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> EXPORT directive expects: .%s start end! Parsing cannot continue until fixed\n", EXPORT_STR);
+			return -1;
+		}
+
+		int startAddress;
+		int endAddress;
+		if (!EvaluateExpression(operands[0], _labelDictionary, &startAddress) || !EvaluateExpression(operands[1], _labelDictionary, &endAddress))
+			return -1;
+
+		if (_outMode == OutMode::Verbose)
+		{
+			printf("      -- Start Address set to: %02x\n", startAddress);
+			printf("      -- End Address set to: %02x\n", endAddress);
+		}
+
+		_programROM.SetStartAddress(startAddress);
+		_programROM.SetEndAddress(endAddress);
+
+		_currTokenType = TokenType::None;
+	}
+
+	if (_lineType == LineType::ArchRegister && i > 1)
+	{
+		int cmdSize = stoi(_tokens[1], nullptr, 10);
+
+		// If arch file was correctly typed, anything token at this point should be the label of a new register.
+		// So, let's add it to the register dictionary. Throw an error if register has already been added. Skip
+		// parsing equal sign.
+		if (strcmp(_tokens[i], "="))
+		{
+			if (!IsNumeric(_tokens[i]) && _registerDictionary.GetLabel((char*)_tokens[i]))
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Register \"%s\" already defined! Parsing cannot continue until fixed\n", _tokens[i]);
+				return -1;
+			}
+			else
+			{
+				// Add this register to the register dictionary
+				_registerDictionary.Add(_tokens[i], cmdSize);
+
+				// Its id (used when a register is encoded into an instruction) is its position among the registers of the same size
+				vector<string>& registerClass = _registerClasses[cmdSize];
+				_registerIds.Add(_tokens[i], registerClass.size());
+				registerClass.push_back(_tokens[i]);
+
+				if (_outMode == OutMode::Verbose)
+					printf("       -> Adding %d-bit register: \"%s\"\n", _registerDictionary.currValue, _registerDictionary.currLabel.c_str());
+			}
+		}
+	}
+
+	// Control lines and aliases both look like: control Name = value. The value is an expression, so an alias can combine
+	// other control lines with any of the operators (e.g. { Ctrl_A | Ctrl_B }). It is only evaluated once the whole
+	// architecture file has been read (or when an opcode needs it), so aliases can use names that are defined later.
+	if ((_lineType == LineType::ArchControl || _lineType == LineType::ArchControlAlias) && i > 1 && i == _numTokens - 1)
+	{
+		int first = strcmp(_tokens[2], "=") ? 2 : 3;
+
+		if (first >= _numTokens)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Control line \"%s\" is missing its value! Parsing cannot continue until fixed\n", _tokens[1]);
+			return -1;
+		}
+
+		string text = JoinTokens(first, _numTokens);
+		string error;
+
+		if (!_controlDictionary.AddExpression(_tokens[1], text, 0, error))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Unable to evaluate \"%s\": %s! Parsing cannot continue until fixed\n", text.c_str(), error.c_str());
+			return -1;
+		}
+
+		_controlDefinitions.push_back({ _tokens[1], text, _currFile, _currLine, _lineType == LineType::ArchControlAlias });
+	}
+
+	// control_field Name high:low (or just the bit number for a one bit field)
+	if (_lineType == LineType::ArchControlField && i > 0 && i == _numTokens - 1)
+	{
+		char* end = NULL;
+		int high = _numTokens == 3 ? strtol(_tokens[2], &end, 10) : -1;
+		int low = high;
+
+		if (end != NULL && *end == ':')
+			low = strtol(end + 1, &end, 10);
+
+		string error = "expected: control_field name high:low";
+		if (end == NULL || *end || !_controlFields.AddField(_tokens[1], high, low, error))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Invalid control field \"%s\": %s! Parsing cannot continue until fixed\n", _tokens[1], error.c_str());
+			return -1;
+		}
+
+		if (_outMode == OutMode::Verbose)
+			printf("       -> Adding control field %s (bits %d to %d)\n", _tokens[1], high, low);
+	}
+
+	// control_group Name Field1, Field2, ... (fields that can't be driven by the same pattern)
+	if (_lineType == LineType::ArchControlGroup && i > 0 && i == _numTokens - 1)
+	{
+		vector<string> fields;
+		for (int t = 2; t < _numTokens; t++)
+			fields.push_back(_tokens[t]);
+
+		string error = "a group needs at least two fields";
+		if (fields.size() < 2 || !_controlFields.AddGroup(fields, error))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Invalid control group \"%s\": %s! Parsing cannot continue until fixed\n", _tokens[1], error.c_str());
+			return -1;
+		}
+	}
+
+	// control_action Name action [register] tells the simulator what a control line (or alias) does. The control line and
+	// register are looked up when the simulation starts.
+	if (_lineType == LineType::ArchControlAction && i > 0 && i == _numTokens - 1)
+	{
+		const char* actions[] = { ACTION_ASSERT_STR, ACTION_LOAD_STR, ACTION_FETCH_STR, ACTION_JUMP_STR, ACTION_OUT_STR, ACTION_HALT_STR };
+		const MicroOpType types[] = { MicroOpType::Assert, MicroOpType::Load, MicroOpType::Fetch, MicroOpType::Jump, MicroOpType::Out, MicroOpType::Halt };
+
+		int a = 0;
+		while (a < 6 && (_numTokens < 3 || strcmp(_tokens[2], actions[a])))
+			a++;
+
+		bool needsRegister = a < 2;
+		if (a == 6 || _numTokens != (needsRegister ? 4 : 3))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Control action expects: %s Name %s|%s register, or %s Name %s|%s|%s|%s! Parsing cannot continue until fixed\n", CONTROL_ACTION_STR,
+				ACTION_ASSERT_STR, ACTION_LOAD_STR, CONTROL_ACTION_STR, ACTION_FETCH_STR, ACTION_JUMP_STR, ACTION_OUT_STR, ACTION_HALT_STR);
+			return -1;
+		}
+
+		_controlActions.push_back({ _tokens[1], types[a], needsRegister ? _tokens[3] : "", _currFile, _currLine });
+	}
+
+	// peephole Name pattern => replacement (or relax Name jump => short jump, or veneer Name call => bank switch and jump).
+	// A ";" that ends an instruction may also be written at the end of its last operand.
+	if ((_lineType == LineType::ArchPeephole || _lineType == LineType::ArchRelax || _lineType == LineType::ArchVeneer) && i > 0 && i == _numTokens - 1)
+	{
+		vector<string> tokens;
+		for (int t = 2; t < _numTokens; t++)
+		{
+			string token = _tokens[t];
+			bool separator = token.size() > 1 && token.back() == PEEPHOLE_SEPARATOR_STR[0];
+
+			tokens.push_back(separator ? token.substr(0, token.size() - 1) : token);
+			if (separator)
+				tokens.push_back(PEEPHOLE_SEPARATOR_STR);
+		}
+
+		vector<PeepholeDefinition>& definitions = _lineType == LineType::ArchPeephole ? _peepholeDefinitions : _lineType == LineType::ArchRelax ? _relaxDefinitions : _veneerDefinitions;
+		definitions.push_back({ _tokens[1], tokens, _currFile, _currLine });
+	}
+
+	if (_lineType == LineType::ArchOpcode && i > 0)
+	{
+		if (!isdigit((unsigned char)_tokens[1][0]))
+		{
+			if (i == 1)
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Opcode \"%s\" is missing its size (e.g. opcode 8 %s)! Parsing cannot continue until fixed\n", _tokens[1], _tokens[1]);
+			}
+
+			return -1;
+		}
+
+		int cmdSize = stoi(_tokens[1], nullptr, 10);
+
+		_opcodeDictionary.currMnemonic = _tokens[2];
+
+		if (i == 1)
+			_opcodeDictionary.currNumArgs = 0;
+
+		EncodeField spec;
+		TemplateArg templateArg;
+
+		if (!strcmp(_tokens[i], "=") && !_equalProcessed)
+		{
+			_equalProcessed = true;
+			_equalIndex = i;
+		}
+
+		// If we haven't yet read an equal sign, then the tokens correspond to the opcode definition.
+		// If we have read the equal sign, then the token is the opcode value or control line specification.
+		if (!_equalProcessed && i > 2 && strcmp(_tokens[i], "="))
+		{
+			// See if the argument is a register
+			if (_registerDictionary.GetLabel(_tokens[i]))
+			{
+				if (_opcodeDictionary.currNumArgs == 0)
+				{
+					_opcodeDictionary.currArg0type = ArgType::Register;
+					_opcodeDictionary.currArg0string = _tokens[i];
+					_opcodeDictionary.currNumArgs++;
+				}
+				else
+				{
+					_opcodeDictionary.currArg1type = ArgType::Register;
+					_opcodeDictionary.currArg1string = _tokens[i];
+					_opcodeDictionary.currNumArgs++;
+				}
+			}
+			else if (ParseTemplateArg(_tokens[i], &templateArg))
+			{
+				// Stands for each register of its class in turn (the opcode is expanded once the whole line has been read)
+				if (_opcodeDictionary.currNumArgs == 0)
+				{
+					_opcodeDictionary.currArg0type = ArgType::Register;
+					_opcodeDictionary.currArg0string = _tokens[i];
+					_templateArgs[0] = templateArg;
+					_opcodeDictionary.currNumArgs++;
+				}
+				else
+				{
+					_opcodeDictionary.currArg1type = ArgType::Register;
+					_opcodeDictionary.currArg1string = _tokens[i];
+					_templateArgs[1] = templateArg;
+					_opcodeDictionary.currNumArgs++;
+				}
+			}
+			else if (ParseImmediateSpec(_tokens[i], &spec))
+			{
+				if (_opcodeDictionary.currNumArgs == 0)
+				{
+					_opcodeDictionary.currArg0type = ArgType::Numeral;
+					_argSpecs[0] = spec;
+					_opcodeDictionary.currNumArgs++;
+				}
+				else
+				{
+					_opcodeDictionary.currArg1type = ArgType::Numeral;
+					spec.source = FieldSource::Arg1;
+					_argSpecs[1] = spec;
+					_opcodeDictionary.currNumArgs++;
+				}
+			}
+			else
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Unknown opcode argument \"%s\"! Parsing cannot continue until fixed\n", _tokens[i]);
+				return -1;
+			}
+		}
+		else if (_equalProcessed && i == _numTokens - 1)
+		{
+			// Everything after the equal sign is the opcode value followed by the control line pattern, which is
+			// enclosed in braces (or parentheses). Both are expressions. The layout of the instruction can follow
+			// after the "encode" keyword, and the line can end with the number of cycles the opcode takes ("cycles n",
+			// or "cycles n m" for one that takes m cycles when it jumps).
+			int patternStart = _equalIndex + 2;
+			while (patternStart < _numTokens && strcmp(_tokens[patternStart], "{") && strcmp(_tokens[patternStart], "("))
+				patternStart++;
+
+			int cyclesStart = patternStart;
+			while (cyclesStart < _numTokens && strcmp(_tokens[cyclesStart], OPCODE_CYCLES_STR))
+				cyclesStart++;
+
+			int patternEnd = patternStart;
+			while (patternEnd < cyclesStart && strcmp(_tokens[patternEnd], ENCODE_STR))
+				patternEnd++;
+
+			if (patternStart >= _numTokens)
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Opcode is missing its control line pattern! Parsing cannot continue until fixed\n");
+				return -1;
+			}
+
+			// Opcodes without a cycle count take one cycle (the listing only shows cycles once an opcode has a count)
+			int numCycleTokens = _numTokens - cyclesStart - 1;
+			if (cyclesStart < _numTokens)
+				_programROM.SetShowCycles(true);
+
+			_opcodeDictionary.currMinCycles = 1;
+			_opcodeDictionary.currMaxCycles = 1;
+
+			if (cyclesStart < _numTokens && (numCycleTokens < 1 || numCycleTokens > 2 ||
+				!EvaluateExpression(_tokens[cyclesStart + 1], _labelDictionary, &_opcodeDictionary.currMinCycles) ||
+				!EvaluateExpression(_tokens[cyclesStart + numCycleTokens], _labelDictionary, &_opcodeDictionary.currMaxCycles) ||
+				_opcodeDictionary.currMinCycles < 1 || _opcodeDictionary.currMaxCycles < _opcodeDictionary.currMinCycles))
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Opcode cycle count expects: %s n [m] with 0 < n <= m! Parsing cannot continue until fixed\n", OPCODE_CYCLES_STR);
+				return -1;
+			}
+
+			if (_templateArgs[0].width || _templateArgs[1].width)
+				return ExpandOpcodeTemplate(cmdSize, patternStart, patternEnd, cyclesStart);
+
+			int ocval;
+			if (!EvaluateExpression(JoinTokens(_equalIndex + 1, patternStart), _labelDictionary, &ocval))
+				return -1;
+
+			_opcodeDictionary.currValue = ocval;
+			_opcodeDictionary.currSize = cmdSize;
+
+			if (!EvaluateExpression(JoinTokens(patternStart, patternEnd), _controlDictionary, &_opcodeDictionary.currControlPattern))
+				return -1;
+
+			_opcodeDictionary.currLayout = BuildLayout(patternEnd + 1, cyclesStart, cmdSize);
+			if (_opcodeDictionary.currLayout < 0)
+				return -1;
+
+			// The slot is the opcode value together with any register operands the layout puts next to it, so opcodes
+			// with their own layout can share a value as long as their registers tell them apart
+			unsigned long long slot = GetOpcodeSlot(_opcodeDictionary.currLayout, ocval, cmdSize, _opcodeDictionary.currArg0string, _opcodeDictionary.currArg1string);
+			if (!CheckOpcodeSlot(cmdSize, slot, _opcodeDictionary.currLayout, _opcodeDictionary.currControlPattern, _opcodeDictionary.DescribeCurrent()))
+				return -1;
+
+			_opcodeSpace.Claim(cmdSize, slot, _opcodeDictionary.NumOpcodes());
+			RecordControlPattern(JoinTokens(patternStart, patternEnd), "opcode " + _opcodeDictionary.DescribeCurrent(), _opcodeDictionary.currControlPattern, _currFile, _currLine);
+
+			if (_outMode == OutMode::Verbose)
+				printf("     ---> Control Pattern: %08llX\n", _opcodeDictionary.currControlPattern);
+
+			int v;
+			int s;
+			long long cp;
+			if (_opcodeDictionary.currNumArgs == 0)
+			{
+				if (_opcodeIsAliased || !_opcodeDictionary.Get0ArgOpcode(_opcodeDictionary.currMnemonic, &s, &v, &cp))
+				{
+					// Here's where the opcode is actually added to the dictionary
+					_opcodeDictionary.AddCurrentEntry();
+					printf("       -> Adding %d-bit opcode%s with pattern %s = %02x using control line sequence %08llx\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
+				}
+				else
+				{
+					printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+					printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
+					return -1;
+				}
+			}
+
+			if (_opcodeDictionary.currNumArgs == 1)
+			{
+				if (_opcodeDictionary.currArg0type == ArgType::Register)
+				{
+					if (_opcodeIsAliased || !_opcodeDictionary.Get1ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, &s, &v, &cp))
+					{
+						// Here's where the opcode is actually added to the dictionary
+						_opcodeDictionary.AddCurrentEntry();
+						printf("       -> Adding %d-bit opcode%s with pattern %s %s = %02x using control line sequence %08llx\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg0string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
+					}
+					else
+					{
+						printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+						printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
+						return -1;
+					}
+				}
+
+				if (_opcodeDictionary.currArg0type == ArgType::Numeral)
+				{
+					if (_opcodeIsAliased || !_opcodeDictionary.Get1ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0num, &s, &v, &cp))
+					{
+						// Here's where the opcode is actually added to the dictionary
+						_opcodeDictionary.AddCurrentEntry();
+						printf("       -> Adding %d-bit opcode%s with pattern %s # = %02x using control line sequence %08llx\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
+					}
+					else
+					{
+						printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+						printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
+						return -1;
+					}
+				}
+			}
+
+			if (_opcodeDictionary.currNumArgs == 2)
+			{
+				if (_opcodeDictionary.currArg0type == ArgType::Register && _opcodeDictionary.currArg1type == ArgType::Register)
+				{
+					if (_opcodeIsAliased || !_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, _opcodeDictionary.currArg1string, &s, &v, &cp))
+					{
+						// Here's where the opcode is actually added to the dictionary
+						_opcodeDictionary.AddCurrentEntry();
+						printf("       -> Adding %d-bit opcode%s with pattern %s %s, %s = %02x using control line sequence %08llx\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg0string.c_str(), _opcodeDictionary.currArg1string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
+					}
+					else
+					{
+						printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+						printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
+						return -1;
+					}
+				}
+
+				if (_opcodeDictionary.currArg0type == ArgType::Register && _opcodeDictionary.currArg1type == ArgType::Numeral)
+				{
+					if (_opcodeIsAliased || !_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, _opcodeDictionary.currArg1num, &s, &v, &cp))
+					{
+						// Here's where the opcode is actually added to the dictionary
+						_opcodeDictionary.AddCurrentEntry();
+						printf("       -> Adding %d-bit opcode%s with pattern %s %s, # = %02x using control line sequence %08llx\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg0string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
+					}
+					else
+					{
+						printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+						printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
+						return -1;
+					}
+				}
+
+				if (_opcodeDictionary.currArg0type == ArgType::Numeral && _opcodeDictionary.currArg1type == ArgType::Register)
+				{
+					if (_opcodeIsAliased || !_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0num, _opcodeDictionary.currArg1string, &s, &v, &cp))
+					{
+						// Here's where the opcode is actually added to the dictionary
+						_opcodeDictionary.AddCurrentEntry();
+						printf("       -> Adding %d-bit opcode%s with pattern %s #, %s = %02x using control line sequence %08llx\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg1string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
+					}
+					else
+					{
+						printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+						printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
+						return -1;
+					}
+				}
+			}
+		}
+	}
+
+	if (_lineType == LineType::ControlROM && i > 0)
+	{
+		if (i == 1)
+		{
+			int val = stoi(_tokens[i]);
+			_controlROMs[_controlROMindex].SetBitWidth(val);
+		}
+
+		if (i == 2)
+		{
+			int val = stoi(_tokens[i]);
+			_controlROMs[_controlROMindex].SetROMsize(val);
+		}
+
+		if (i == 3)
+		{
+			_controlROMs[_controlROMindex].SetROMname(string(_tokens[i],strlen(_tokens[i])));
+		}
+	}
+
+	// controlROM_layout direct|packed|indexed asks for a report of the control ROM layouts, and picks the one that is written
+	if (_lineType == LineType::ControlROMLayout && i == _numTokens - 1)
+	{
+		if (_numTokens != 2 || (strcmp(_tokens[1], LAYOUT_DIRECT_STR) && strcmp(_tokens[1], LAYOUT_PACKED_STR) && strcmp(_tokens[1], LAYOUT_INDEXED_STR)))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> %s must be followed by %s, %s or %s! Parsing cannot continue until fixed\n", CONTROL_ROM_LAYOUT_STR, LAYOUT_DIRECT_STR, LAYOUT_PACKED_STR, LAYOUT_INDEXED_STR);
+			return -1;
+		}
+
+		_controlLayoutReport = true;
+		_controlLayout = !strcmp(_tokens[1], LAYOUT_PACKED_STR) ? MicrocodeLayoutType::Packed :
+			!strcmp(_tokens[1], LAYOUT_INDEXED_STR) ? MicrocodeLayoutType::Indexed : MicrocodeLayoutType::Direct;
+	}
+
+	// Data directives are handled once the last token of the line has been reached. That way all of the values on the
+	// line can be collected and written to the ROM as a single span instead of one byte at a time.
+	if (_currTokenType == TokenType::Byte && i > 0 && i == _numTokens - 1)
+	{
+		vector<string> operands;
+		GetOperands(1, operands);
+
+		vector<unsigned char> bytes(operands.size());
+		int pc = _programROM.GetCurrentAddress();
+		bool constant = true;
+
+		for (int t = 0; t < operands.size(); t++)
+		{
+			// Values that refer to labels further down are written as 0 for now and patched later
+			int byteVal;
+			int exprs[2] = { EvaluateOrDefer(operands[t], &byteVal), -1 };
+			if (exprs[0] == -2)
+				return -1;
+
+			long long args[2] = { byteVal, 0 };
+			string error;
+			if (!_encoder.Encode(_byteLayout, 0, args, pc + t, exprs[0] < 0 && (_reassembling || _sections.empty()), &bytes[t], error))
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Invalid value \"%s\" in BYTE directive: %s! Parsing cannot continue until fixed\n", operands[t].c_str(), error.c_str());
+				return -1;
+			}
+
+			if (exprs[0] >= 0)
+				AddFixup(_byteLayout, _programROM.GetImageAddress() + t, pc, 0, args, exprs);
+
+			// Only bytes that stay the same wherever the line ends up can be pooled
+			constant = constant && exprs[0] < 0 && _expressions.IsConstant(CompileExpression(operands[t], error));
+
+			if (_outMode == OutMode::Verbose)
+				printf("      -- %02x: %02x\n", pc + t, bytes[t]);
+		}
+
+		if (!PlaceData(&bytes[0], bytes.size(), operands, constant))
+			_programROM.WriteSpan(&bytes[0], bytes.size());
+
+		_currTokenType = TokenType::None;
+	}
+
+	if (_currTokenType == TokenType::Ascii && i > 0 && i == _numTokens - 1)
+	{
+		vector<unsigned char> chars;
+
+		for (int t = 1; t < _numTokens; t++)
+		{
+			char* a = strtok(_tokens[t], "\"");
+
+			for (; a != NULL && *a; a++)
+			{
+				char currChar = *a != '/' ? *a : ' ';
+
+				if (_outMode == OutMode::Verbose)
+					printf("      -- %02x: %c (%02x)\n", _programROM.GetCurrentAddress() + (int)chars.size(), currChar, currChar);
+
+				chars.push_back((unsigned char)currChar);
+			}
+		}
+
+		if (!chars.empty() && !PlaceData(&chars[0], chars.size(), {}, true))
+			_programROM.WriteSpan(&chars[0], chars.size());
+
+		_currTokenType = TokenType::None;
+	}
+
+	if (_currTokenType == TokenType::Fill && i == _numTokens - 1)
+	{
+		vector<string> operands;
+		GetOperands(1, operands);
+
+		int count = 0;
+		long long value = 0;
+		if (operands.size() < 1 || operands.size() > 2 || !EvaluateExpression(operands[0], _labelDictionary, &count) || count < 0 ||
+			(operands.size() == 2 && !EvaluateExpression(operands[1], _labelDictionary, &value)))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> FILL directive expects: .%s count[, value]! Parsing cannot continue until fixed\n", FILL_STR);
+			return -1;
+		}
+
+		// The bytes are only allocated for as much space as the bank has
+		long long end = FillEnd();
+		if (_programROM.GetCurrentAddress() + (long long)count > end)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> FILL of %d bytes at $%04X runs past the end of bank %d ($%04llX)! Parsing cannot continue until fixed\n", count, _programROM.GetCurrentAddress(), _programROM.GetBank(), end - 1);
+			return -1;
+		}
+
+		if (!CheckFillValue(operands.size() == 2 ? operands[1] : "0", value, "FILL"))
+			return -1;
+
+		if (_outMode == OutMode::Verbose)
+			printf("      -- %02x: %d bytes of %02x\n", _programROM.GetCurrentAddress(), count, (int)(value & 0xFF));
+
+		_programROM.FillSpan((unsigned char)value, count);
+		_currTokenType = TokenType::None;
+	}
+
+	if (_currTokenType == TokenType::Simulate && i == _numTokens - 1)
+	{
+		long long cycles = DEFAULT_SIMULATION_CYCLES;
+		if (_numTokens > 1 && (!EvaluateExpression(JoinTokens(1, _numTokens), _labelDictionary, &cycles) || cycles <= 0))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> SIMULATE directive expects: .%s [cycles] with cycles > 0! Parsing cannot continue until fixed\n", SIMULATE_STR);
+			return -1;
+		}
+
+		_simulationCycles = cycles;
+		_currTokenType = TokenType::None;
+	}
+
+	// .profile runs the program (for the default number of cycles, unless .simulate says otherwise) and reports where it spent them
+	if (_currTokenType == TokenType::Profile && i == _numTokens - 1)
+	{
+		if (_numTokens > 1)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> PROFILE directive expects: .%s! Parsing cannot continue until fixed\n", PROFILE_STR);
+			return -1;
+		}
+
+		_profileRequested = true;
+		if (_simulationCycles == 0)
+			_simulationCycles = DEFAULT_SIMULATION_CYCLES;
+
+		_currTokenType = TokenType::None;
+	}
+
+	// .budget label, cycles: the code from the label up to the next label mustn't take more cycles than that
+	if (_currTokenType == TokenType::Budget && i == _numTokens - 1)
+	{
+		vector<string> operands;
+		GetOperands(1, operands);
+
+		BudgetDefinition budget;
+		if (operands.size() != 2 || !EvaluateExpression(operands[1], _labelDictionary, &budget.cycles) || budget.cycles < 0)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> BUDGET directive expects: .%s label, cycles! Parsing cannot continue until fixed\n", BUDGET_STR);
+			return -1;
+		}
+
+		// The label may be written the way it is defined ([start] or start:)
+		budget.label = operands[0];
+		budget.label.erase(remove_if(budget.label.begin(), budget.label.end(), [](char c) { return strchr(LABEL_KEYS, c) != NULL; }), budget.label.end());
+		budget.file = _currFile;
+		budget.line = _currLine;
+		_budgets.push_back(budget);
+
+		_currTokenType = TokenType::None;
+	}
+
+	// .entry label[, label ...]: places execution can start at besides the start address (e.g. interrupt handlers), which
+	// .optimize follows to find the code that is never run
+	if (_currTokenType == TokenType::Entry && i == _numTokens - 1)
+	{
+		vector<string> operands;
+		GetOperands(1, operands);
+
+		if (operands.empty())
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> ENTRY directive expects: .%s label[, label ...]! Parsing cannot continue until fixed\n", ENTRY_STR);
+			return -1;
+		}
+
+		for (string label : operands)
+		{
+			label.erase(remove_if(label.begin(), label.end(), [](char c) { return strchr(LABEL_KEYS, c) != NULL; }), label.end());
+			_entries.push_back({ label, _currFile, _currLine });
+		}
+
+		_currTokenType = TokenType::None;
+	}
+
+	// .bank n[, base[, size]]: the lines that follow go to bank n. The base and size are the bank's window in the CPU's address
+	// space: its code starts at the base, and its file starts there and is padded to the size.
+	if (_currTokenType == TokenType::Bank && i == _numTokens - 1)
+	{
+		vector<string> operands;
+		GetOperands(1, operands);
+
+		int values[3] = { 0, 0, 0 };
+		bool valid = operands.size() >= 1 && operands.size() <= 3;
+		for (int n = 0; valid && n < operands.size(); n++)
+			valid = EvaluateExpression(operands[n], _labelDictionary, &values[n]);
+
+		if (!valid || values[0] < 0 || values[2] < 0)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> BANK directive expects: .%s n[, base[, size]] with n >= 0! Parsing cannot continue until fixed\n", BANK_STR);
+			return -1;
+		}
+
+		if (operands.size() > 1)
+		{
+			auto defined = _banks.find(values[0]);
+			if (defined != _banks.end() && (defined->second.base != values[1] || defined->second.size != values[2]))
+			{
+				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+				printf("  -> Bank %d already has a different window (line #%d of \"%s\")! Parsing cannot continue until fixed\n", values[0], defined->second.line, defined->second.file.c_str());
+				return -1;
 			}
+
+			_banks[values[0]] = { values[1], values[2], _currFile, _currLine };
+			_programROM.SetBankWindow(values[0], values[1], values[2]);
 		}
+
+		SwitchBank(values[0]);
+
+		if (_outMode == OutMode::Verbose)
+			printf("      -- Bank %d at %02x\n", values[0], _programROM.GetCurrentAddress());
+
+		_currTokenType = TokenType::None;
 	}
 
-	if (_lineType == LineType::ArchOpcode && i > 0)
+	// .segment name[, address]: switches to a named location counter, which carries on where the last .segment line with the
+	// same name left off (in the same bank). The first time, the address says where it starts in the current bank.
+	if (_currTokenType == TokenType::Segment && i == _numTokens - 1)
 	{
-		int cmdSize = stoi(_tokens[1], nullptr, 10);
+		vector<string> operands;
+		GetOperands(1, operands);
 
-		_opcodeDictionary.currMnemonic = _tokens[2];
+		int address = 0;
+		bool known = !operands.empty() && _segments.count(operands[0]) > 0;
 
-		if (i == 1)
-			_opcodeDictionary.currNumArgs = 0;
+		if (operands.empty() || operands.size() > 2 || (operands.size() == 1 && !known) ||
+			(operands.size() == 2 && !EvaluateExpression(operands[1], _labelDictionary, &address)))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> SEGMENT directive expects: .%s name[, address] (with the address the first time)! Parsing cannot continue until fixed\n", SEGMENT_STR);
+			return -1;
+		}
+
+		_segments[_currSegment] = { _programROM.GetBank(), _programROM.GetCurrentAddress() };
+
+		SegmentState next = known ? _segments[operands[0]] : SegmentState{ _programROM.GetBank(), address };
+		if (operands.size() == 2)
+			next.address = address;
+
+		_currSegment = operands[0];
+		_programROM.SetBank(next.bank);
+		_programROM.SetCurrentAddress(next.address);
+		StartAddressRegion(false);
+
+		if (_outMode == OutMode::Verbose)
+			printf("      -- Segment %s in bank %d at %02x\n", _currSegment.c_str(), next.bank, next.address);
+
+		_currTokenType = TokenType::None;
+	}
+
+	// .section name[, alignment[, page]] ... .ends: code and data without an address of their own. Once the program has been
+	// assembled, each section is placed in the free space of the bank it is in, at a multiple of the alignment and (with a
+	// page size) without running over the end of a page, and the program is assembled again with the sections there.
+	if (_currTokenType == TokenType::Section && i == _numTokens - 1)
+	{
+		vector<string> operands;
+		GetOperands(1, operands);
 
-		if (!strcmp(_tokens[i], "="))
+		int values[2] = { 1, 0 };
+		bool valid = operands.size() >= 1 && operands.size() <= 3;
+		for (int n = 1; valid && n < operands.size(); n++)
+			valid = EvaluateExpression(operands[n], _labelDictionary, &values[n - 1]);
+
+		if (!valid || values[0] <= 0 || values[1] < 0)
 		{
-			_equalProcessed = true;
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> SECTION directive expects: .%s name[, alignment[, page]] with alignment > 0! Parsing cannot continue until fixed\n", SECTION_STR);
+			return -1;
 		}
 
-		// If we haven't yet read an equal sign, then the tokens correspond to the opcode definition.
-		// If we have read the equal sign, then the token is the opcode value or control line specification.
-		if (!_equalProcessed && i > 2 && strcmp(_tokens[i], "="))
+		if (_currSection >= 0)
 		{
-			// See if the argument is a register
-			if (_registerDictionary.GetLabel(_tokens[i]))
-			{
-				if (_opcodeDictionary.currNumArgs == 0)
-				{
-					_opcodeDictionary.currArg0type = ArgType::Register;
-					_opcodeDictionary.currArg0string = _tokens[i];
-					_opcodeDictionary.currNumArgs++;
-				}
-				else
-				{
-					_opcodeDictionary.currArg1type = ArgType::Register;
-					_opcodeDictionary.currArg1string = _tokens[i];
-					_opcodeDictionary.currNumArgs++;
-				}
-			}
-			else if (!strcmp(_tokens[i], "#"))
-			{
-				if (_opcodeDictionary.currNumArgs == 0)
-				{
-					_opcodeDictionary.currArg0type = ArgType::Numeral;
-					_opcodeDictionary.currNumArgs++;
-				}
-				else
-				{
-					_opcodeDictionary.currArg1type = ArgType::Numeral;
-					_opcodeDictionary.currNumArgs++;
-				}
-			}
-			else
-			{
-				printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-				printf("  -> Unknown opcode argument \"%s\"! Parsing cannot continue until fixed\n", _tokens[i]);
-				return -1;
-			}
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Section \"%s\" is still open: sections can't be nested! Parsing cannot continue until fixed\n", _sections[_currSection].name.c_str());
+			return -1;
 		}
-		else if (_equalProcessed && strcmp(_tokens[i], "="))
+
+		_currSection = _sections.size();
+		_sections.push_back({ operands[0], _programROM.GetBank(), values[0], values[1], 0, _currFile, _currLine });
+		_sectionReturn = { _programROM.GetBank(), _programROM.GetCurrentAddress() };
+
+		// Until it is placed, each section is assembled on its own at address 0 of a bank of its own (below bank 0, so it
+		// can't be mistaken for one of the program's banks)
+		if (!_reassembling)
 		{
-			if (!_ocValProcessed)
-			{
-				int base;
-				char* arg;
-				CalculateBase(i, &base, &arg);
+			_programROM.SetBank(-1 - _currSection);
+			_programROM.SetCurrentAddress(0);
+		}
+		else if (_currSection < _sectionPlan.size())
+			_programROM.SetCurrentAddress(_sectionPlan[_currSection]);
+		else
+			_rewriteMismatch = true;
 
-				int ocval = stoi(arg, nullptr, base);
+		StartAddressRegion(false);
 
-				if (_opcodeDictionary.GetOpcodeValue(ocval) && !_opcodeIsAliased)
-				{
-					printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-					printf("  -> Value of \"%d\" assigned to opcode already exists! Parsing cannot continue until fixed\n", ocval);
-					return -1;
-				}
+		if (_outMode == OutMode::Verbose)
+			printf("      -- Section %s at %02x\n", operands[0].c_str(), _programROM.GetCurrentAddress());
 
-				_opcodeDictionary.currValue = ocval;
-				_opcodeDictionary.currSize = cmdSize;
+		_currTokenType = TokenType::None;
+	}
 
-				_ocValProcessed = true;
-			}
-			else
-			{
-				// TODO: Make sure the process control line pattern is correct here
-				if (!strcmp(_tokens[i], "{") || !strcmp(_tokens[i], "("))
-				{
-					_opcodeDictionary.currControlPattern = 0;
-					_lastOperation = BinaryOperation::None;
+	if (_currTokenType == TokenType::Ends && i == _numTokens - 1)
+	{
+		if (_currSection < 0)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> ENDS directive without a SECTION! Parsing cannot continue until fixed\n");
+			return -1;
+		}
 
-					if (_outMode == OutMode::Verbose)
-						printf("     ---> Initializing Control Pattern: %08X\n", _opcodeDictionary.currControlPattern);
-				}
-				else if (!strcmp(_tokens[i], "|"))
-				{
-					_lastOperation = BinaryOperation::LogicalOR;
-				}
-				else if (!strcmp(_tokens[i], "&"))
-				{
-					_lastOperation = BinaryOperation::LogicalAND;
-				}
-				else if (!strcmp(_tokens[i], "}") || !strcmp(_tokens[i], ")"))
-				{
-					int v;
-					int s;
-					int cp;
-					if (_opcodeDictionary.currNumArgs == 0)
-					{
-						if (_opcodeIsAliased || !_opcodeDictionary.Get0ArgOpcode(_opcodeDictionary.currMnemonic, &s, &v, &cp))
-						{
-							// Here's where the opcode is actually added to the dictionary
-							_opcodeDictionary.AddCurrentEntry();
-							printf("       -> Adding %d-bit opcode%s with pattern %s = %02x using control line sequence %08x\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
-						}
-						else
-						{
-							printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-							printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
-							return -1;
-						}
-					}
+		SectionDefinition& section = _sections[_currSection];
+		int start = _reassembling && _currSection < _sectionPlan.size() ? _sectionPlan[_currSection] : 0;
+		section.size = max(_programROM.GetCurrentAddress() - start, 0);
 
-					if (_opcodeDictionary.currNumArgs == 1)
-					{
-						if (_opcodeDictionary.currArg0type == ArgType::Register)
-						{
-							if (_opcodeIsAliased || !_opcodeDictionary.Get1ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, &s, &v, &cp))
-							{
-								// Here's where the opcode is actually added to the dictionary
-								_opcodeDictionary.AddCurrentEntry();
-								printf("       -> Adding %d-bit opcode%s with pattern %s %s = %02x using control line sequence %08x\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg0string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
-							}
-							else
-							{
-								printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-								printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
-								return -1;
-							}
-						}
-
-						if (_opcodeDictionary.currArg0type == ArgType::Numeral)
-						{
-							if (_opcodeIsAliased || !_opcodeDictionary.Get1ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0num, &s, &v, &cp))
-							{
-								// Here's where the opcode is actually added to the dictionary
-								_opcodeDictionary.AddCurrentEntry();
-								printf("       -> Adding %d-bit opcode%s with pattern %s # = %02x using control line sequence %08x\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
-							}
-							else
-							{
-								printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-								printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
-								return -1;
-							}
-						}
-					}
+		_programROM.SetBank(_sectionReturn.bank);
+		_programROM.SetCurrentAddress(_sectionReturn.address);
+		_currSection = -1;
+		StartAddressRegion(false);
 
-					if (_opcodeDictionary.currNumArgs == 2)
-					{
-						if (_opcodeDictionary.currArg0type == ArgType::Register && _opcodeDictionary.currArg1type == ArgType::Register)
-						{
-							if (_opcodeIsAliased || !_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, _opcodeDictionary.currArg1string, &s, &v, &cp))
-							{
-								// Here's where the opcode is actually added to the dictionary
-								_opcodeDictionary.AddCurrentEntry();
-								printf("       -> Adding %d-bit opcode%s with pattern %s %s, %s = %02x using control line sequence %08x\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg0string.c_str(), _opcodeDictionary.currArg1string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
-							}
-							else
-							{
-								printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-								printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
-								return -1;
-							}
-						}
-
-						if (_opcodeDictionary.currArg0type == ArgType::Register && _opcodeDictionary.currArg1type == ArgType::Numeral)
-						{
-							if (_opcodeIsAliased || !_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, _opcodeDictionary.currArg1num, &s, &v, &cp))
-							{
-								// Here's where the opcode is actually added to the dictionary
-								_opcodeDictionary.AddCurrentEntry();
-								printf("       -> Adding %d-bit opcode%s with pattern %s %s, # = %02x using control line sequence %08x\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg0string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
-							}
-							else
-							{
-								printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-								printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
-								return -1;
-							}
-						}
-
-						if (_opcodeDictionary.currArg0type == ArgType::Numeral && _opcodeDictionary.currArg1type == ArgType::Register)
-						{
-							if (_opcodeIsAliased || !_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0num, _opcodeDictionary.currArg1string, &s, &v, &cp))
-							{
-								// Here's where the opcode is actually added to the dictionary
-								_opcodeDictionary.AddCurrentEntry();
-								printf("       -> Adding %d-bit opcode%s with pattern %s #, %s = %02x using control line sequence %08x\n", cmdSize, _opcodeIsAliased ? "-alias" : "", _opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg1string.c_str(), _opcodeDictionary.currValue, _opcodeDictionary.currControlPattern);
-							}
-							else
-							{
-								printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _linePtr + 1, _currFile.c_str());
-								printf("  -> Opcode pattern already exists! Parsing cannot continue until fixed\n");
-								return -1;
-							}
-						}
-					}
-				}
-				else
-				{
-					// Pull value from the control dictionary
-					int val = _controlDictionary.GetLabelValue(_tokens[i]);				
+		_currTokenType = TokenType::None;
+	}
 
-					// If not found in the control dictionary, it might be a numeric value
-					if (val == -1 && IsNumeric(_tokens[i]))
-					{
-						int base;
-						char* arg;
-						CalculateBase(i, &base, &arg);
+	// .expect reg name op value [after label] [within n [cycles]], or .expect mem address op value [...]. The operator splits
+	// the address from the value, which both may be expressions with spaces in them.
+	if (_currTokenType == TokenType::Expect && i == _numTokens - 1)
+	{
+		static const char* ops[] = { "==", "!=", "<", ">", "<=", ">=" };
+		int op = -1;
+		int after = -1;
+		int within = -1;
 
-						val = stoi(arg, nullptr, base);
-					}
+		ExpectDefinition expect;
+		expect.within = 0;
 
-					//if (_outMode == OutMode::Verbose)
-						printf("         -> Val %s from dictionary: %08x\n", _tokens[i], val);
+		// A two-character operator is always the comparison. Without one, a bare < or > is, as long as it follows an
+		// operand: at the start of an expression or after another operator it selects the low or high byte.
+		auto endsOperand = [](const char* token)
+		{
+			char last = token[strlen(token) - 1];
+			return isalnum((unsigned char)last) || last == '_' || last == '$' || last == ')' || last == '\'' || last == '"';
+		};
 
-					switch (_lastOperation)
-					{
-					case BinaryOperation::LogicalOR:
-						if (_outMode == OutMode::Verbose)
-						{
-							printf("     ---> OR operation\n");
-							printf("     ---> Prior to op: %08x\n", _opcodeDictionary.currControlPattern);
-						}
-
-						_opcodeDictionary.currControlPattern = _opcodeDictionary.currControlPattern | val;
-						if (_outMode == OutMode::Verbose)
-							printf("     ---> After op: %08x\n", _opcodeDictionary.currControlPattern);
-						break;
-
-					case BinaryOperation::LogicalAND:
-						if (_outMode == OutMode::Verbose)
-						{
-							printf("     ---> OR operation\n");
-							printf("     ---> Prior to op: %08x\n", _opcodeDictionary.currControlPattern);
-						}
-						_opcodeDictionary.currControlPattern = _opcodeDictionary.currControlPattern & val;
-						if (_outMode == OutMode::Verbose)
-						{
-							printf("     ---> After op: %08x\n", _opcodeDictionary.currControlPattern);
-						}
-
-						break;
-
-					case BinaryOperation::None:
-						_opcodeDictionary.currControlPattern = val;
-
-						if (_outMode == OutMode::Verbose)
-							printf("     ---> ADDING VAL: %08X\n", _opcodeDictionary.currControlPattern);
-						break;
-					}
-				}				
+		for (int t = 2; t < _numTokens && op < 0; t++)
+		{
+			for (int o = 0; o < 6 && op < 0; o++)
+			{
+				if (strlen(ops[o]) == 2 && !strcmp(_tokens[t], ops[o]))
+				{
+					op = t;
+					expect.op = (CheckOp)o;
+				}
 			}
 		}
-	}
 
-	if (_lineType == LineType::ControlROM && i > 0)
-	{
-		if (i == 1)
+		for (int t = 3; t < _numTokens && op < 0; t++)
 		{
-			int val = stoi(_tokens[i]);
-			_controlROMs[_controlROMindex].SetBitWidth(val);
+			for (int o = 2; o < 4 && op < 0; o++)
+			{
+				if (!strcmp(_tokens[t], ops[o]) && endsOperand(_tokens[t - 1]))
+				{
+					op = t;
+					expect.op = (CheckOp)o;
+				}
+			}
 		}
 
-		if (i == 2)
+		for (int t = op + 1; op >= 0 && t < _numTokens; t++)
 		{
-			int val = stoi(_tokens[i]);
-			_controlROMs[_controlROMindex].SetROMsize(val);
+			if (after < 0 && within < 0 && !strcmp(_tokens[t], EXPECT_AFTER_STR))
+				after = t;
+			if (within < 0 && !strcmp(_tokens[t], EXPECT_WITHIN_STR))
+				within = t;
 		}
 
-		if (i == 3)
+		int valueEnd = after >= 0 ? after : (within >= 0 ? within : _numTokens);
+		bool isReg = _numTokens > 1 && !strcmp(_tokens[1], EXPECT_REG_STR);
+		bool isMem = _numTokens > 1 && !strcmp(_tokens[1], EXPECT_MEM_STR);
+		bool ok = (isReg && op == 3) || (isMem && op > 2);
+
+		ok = ok && valueEnd > op + 1;
+		ok = ok && (after < 0 || (within >= 0 ? within : _numTokens) == after + 2);
+		ok = ok && (within < 0 || _numTokens == within + 2 || (_numTokens == within + 3 && !strcmp(_tokens[within + 2], EXPECT_CYCLES_STR)));
+		ok = ok && (within < 0 || (EvaluateExpression(_tokens[within + 1], _labelDictionary, &expect.within) && expect.within > 0));
+
+		if (!ok)
 		{
-			_controlROMs[_controlROMindex].SetROMname(string(_tokens[i],strlen(_tokens[i])));
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> EXPECT directive expects: .%s %s name|%s address op value [%s label] [%s cycles]! Parsing cannot continue until fixed\n",
+				EXPECT_STR, EXPECT_REG_STR, EXPECT_MEM_STR, EXPECT_AFTER_STR, EXPECT_WITHIN_STR);
+			return -1;
 		}
+
+		// The label may be written the way it is defined ([start] or start:)
+		if (after >= 0)
+		{
+			expect.after = _tokens[after + 1];
+			expect.after.erase(remove_if(expect.after.begin(), expect.after.end(), [](char c) { return strchr(LABEL_KEYS, c) != NULL; }), expect.after.end());
+		}
+
+		if (isReg)
+			expect.reg = _tokens[2];
+		else
+			expect.address = JoinTokens(2, op);
+
+		expect.value = JoinTokens(op + 1, valueEnd);
+		expect.text = JoinTokens(1, _numTokens);
+		expect.file = _currFile;
+		expect.line = _currLine;
+		_expects.push_back(expect);
+
+		if (_outMode == OutMode::Verbose)
+			printf("      -- check: %s\n", expect.text.c_str());
+
+		_currTokenType = TokenType::None;
 	}
 
-	if (_currTokenType == TokenType::Byte && i > 0)
+	if (_currTokenType == TokenType::Align && i == _numTokens - 1)
 	{
-		CalculateBase(i, &base, &arg);
+		vector<string> operands;
+		GetOperands(1, operands);
+
+		int alignment = 0;
+		long long value = 0;
+		if (operands.size() < 1 || operands.size() > 2 || !EvaluateExpression(operands[0], _labelDictionary, &alignment) || alignment <= 0 ||
+			(operands.size() == 2 && !EvaluateExpression(operands[1], _labelDictionary, &value)))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> ALIGN directive expects: .%s n[, value] with n > 0! Parsing cannot continue until fixed\n", ALIGN_STR);
+			return -1;
+		}
+
+		if (!CheckFillValue(operands.size() == 2 ? operands[1] : "0", value, "ALIGN"))
+			return -1;
 
-		int byteVal = stoi(arg, nullptr, base);
+		int padding = (alignment - _programROM.GetCurrentAddress() % alignment) % alignment;
 
 		if (_outMode == OutMode::Verbose)
-			printf("      -- %02x: %02x\n", _programROM.GetCurrentAddress(), byteVal);
+			printf("      -- %02x: aligning to %d with %d bytes of %02x\n", _programROM.GetCurrentAddress(), alignment, padding, (int)(value & 0xFF));
 
-		_programROM.AddEntryToCurrentAddress(byteVal);
-		_programROM.SetPattern("byte def");
-		_programROM.IncrementCurrentAddress(1);
+		_programROM.FillSpan((unsigned char)value, padding);
+		StartAddressRegion(false);
+		_currTokenType = TokenType::None;
 	}
 
-	if (_currTokenType == TokenType::Ascii && i > 0)
+	if (_currTokenType == TokenType::Incbin && i == _numTokens - 1)
 	{
-		char* a = strtok(_tokens[i], "\"");
+		vector<string> operands;
+		GetOperands(1, operands);
 
-		for (; *a; a++)
+		int offset = 0;
+		int length = -1;
+		if ((operands.size() != 1 && operands.size() != 3) ||
+			(operands.size() == 3 && (!EvaluateExpression(operands[1], _labelDictionary, &offset) || !EvaluateExpression(operands[2], _labelDictionary, &length))))
 		{
-			char currChar = *a != '/' ? *a : ' ';
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> INCBIN directive expects: .%s \"file\"[, offset, length]! Parsing cannot continue until fixed\n", INCBIN_STR);
+			return -1;
+		}
 
-			if (_outMode == OutMode::Verbose)
-				printf("      -- %02x: %c (%02x)\n", _programROM.GetCurrentAddress(), currChar, currChar);
+		char* name = strtok(_tokens[1], "\"");
+		string fullFile = SplitFilename(name != NULL ? name : "", "..\\Homebrew_Assembler\\Assembly_Code\\", "", false);
+
+		// The asset is mapped rather than read so that it can be copied straight into the ROM image
+		MappedFile asset;
+		if (!asset.Open(fullFile.c_str()))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Unable to open binary file \"%s\"! Parsing cannot continue until fixed\n", fullFile.c_str());
+			return -1;
+		}
 
-			string charStr(1, currChar);
+		if (length == -1)
+			length = (int)asset.Size() - offset;
 
-			_programROM.AddEntryToCurrentAddress((int)currChar);
-			_programROM.SetPattern("ascii def: " + charStr);
-			_programROM.IncrementCurrentAddress(1);
+		if (offset < 0 || length < 0 || (size_t)offset + length > asset.Size())
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Range %d..%d is outside of \"%s\" (%d bytes)! Parsing cannot continue until fixed\n", offset, offset + length, fullFile.c_str(), (int)asset.Size());
+			return -1;
 		}
+
+		if (_outMode == OutMode::Verbose)
+			printf("      -- %02x: %d bytes from %s\n", _programROM.GetCurrentAddress(), length, fullFile.c_str());
+
+		_programROM.WriteSpan(asset.Data() + offset, length);
+		_currTokenType = TokenType::None;
 	}
 
-	if (_currTokenType == TokenType::Symbol && i == 1)
+	if (_currTokenType == TokenType::Symbol && i > 0 && i == _numTokens - 1)
 	{
-		CalculateBase(1, &base, &arg);
+		// @NAME value or @NAME = value. The value is only evaluated when the symbol is first used, so it may refer to labels
+		// that are defined further down.
+		int first = strcmp(_tokens[1], "=") ? 1 : 2;
+		string error;
 
-		if (base != -1)
-		{		
-			_labelDictionary.currValue = stoi(arg, nullptr, base);
-			_labelDictionary.AddCurrentEntry();
+		if (first >= _numTokens || !_labelDictionary.AddExpression(_labelDictionary.currLabel, JoinTokens(first, _numTokens), _programROM.GetCurrentAddress(), error))
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			printf("  -> Invalid value for symbol \"%s\"%s%s! Parsing cannot continue until fixed\n", _labelDictionary.currLabel.c_str(), error.empty() ? "" : ": ", error.c_str());
+			return -1;
+		}
 
-			if (_outMode == OutMode::Verbose)
-				printf("      -- Symbol: %s = %02x\n", _labelDictionary.currLabel.c_str(), _labelDictionary.currValue);
+		_symbolLines[_labelDictionary.currLabel] = { _programROM.GetPendingRecord().fileId, _programROM.GetPendingRecord().line };
 
-			_currTokenType = TokenType::None;
-		}
+		if (_outMode == OutMode::Verbose)
+			printf("      -- Symbol: %s = %s\n", _labelDictionary.currLabel.c_str(), JoinTokens(first, _numTokens).c_str());
+
+		_currTokenType = TokenType::None;
 	}
 
 	if (_currTokenType == TokenType::Label)
 	{
+		// The label of a data block whose bytes were pooled points into the block that holds them (see PlanPooling())
+		auto redirect = _labelRedirects.find(_labelDictionary.currLabel);
+		if (redirect != _labelRedirects.end())
+		{
+			string error;
+			_labelDictionary.AddExpression(_labelDictionary.currLabel, redirect->second, _programROM.GetCurrentAddress(), error);
+			_labelBanks[_labelDictionary.currLabel] = _programROM.GetBank();
+
+			if (_outMode == OutMode::Verbose)
+				printf("      -- Label: %s = %s\n", _labelDictionary.currLabel.c_str(), redirect->second.c_str());
+		}
+		else
+		{
 			_labelDictionary.currValue = _programROM.GetCurrentAddress();
 			_labelDictionary.AddCurrentEntry();
+			_programROM.AddLabel(_labelDictionary.currLabel, _labelDictionary.currValue);
+			_labelBanks[_labelDictionary.currLabel] = _programROM.GetBank();
+
+			if (!_reassembling)
+				_pendingLabels.push_back({ _labelDictionary.currLabel, _labelDictionary.currValue });
 
 			if (_outMode == OutMode::Verbose)
 				printf("      -- Label: %s = %02x\n", _labelDictionary.currLabel.c_str(), _labelDictionary.currValue);
-						
-			_currTokenType = TokenType::None;
+		}
+
+		_currTokenType = TokenType::None;
 	}
 
-	if (_currTokenType == TokenType::OpCode)
+	// Instructions are looked up once all of their operands have been read
+	if (_currTokenType == TokenType::OpCode && i == _numTokens - 1)
 	{
-		if (i > 0)
-		{
-			if (i == 1)
-			{
-				CalculateBase(1, &base, &arg);
+		vector<string> operands;
+		GetOperands(1, operands);
 
-				if (IsNumeric(arg))
-				{
-					if (base != -1)
-					{
-						int arg0 = stoi(arg, nullptr, base);
-
-						if (_opcodeDictionary.currNumArgs == 0)
-						{
-							_opcodeDictionary.currArg0type = ArgType::Numeral;
-							_opcodeDictionary.currArg0num = arg0;
-							_opcodeDictionary.currNumArgs++;
-						}
-					}
-				}
-				else
-				{
-					if (_registerDictionary.GetLabel(arg))
-					{
-						if (_opcodeDictionary.currNumArgs == 0)
-						{
-							_opcodeDictionary.currArg0type = ArgType::Register;
-							_opcodeDictionary.currArg0string = arg;
-							_opcodeDictionary.currNumArgs++;
-						}
-					}
-					else if (_labelDictionary.GetLabel(arg))
-					{
-						if (_opcodeDictionary.currNumArgs == 0)
-						{
-							_opcodeDictionary.currArg0type = ArgType::Numeral;
-							_opcodeDictionary.currArg0num = _labelDictionary.currValue;
-							_opcodeDictionary.currNumArgs++;
-						}						
-					}
-					else
-					{
-						if ((unsigned char)_tokens[i] <= 127)
-						{
-							char* a = strtok(_tokens[i], "\"");
-
-							for (; *a; a++)
-							{
-								char currChar = *a != '/' ? *a : ' ';
-
-							
-									printf("      -- %02x: %c (%02x)\n", _programROM.GetCurrentAddress(), currChar, currChar);
-							}
-
-							_opcodeDictionary.currArg0type = ArgType::Ascii;
-							_opcodeDictionary.currArg0num = (int)_tokens[i];
-							_opcodeDictionary.currNumArgs++;
-						}
-					}
-				}
-			}
+		_operandExprs[0] = _operandExprs[1] = -1;
 
-			if (i == 2)
-			{
-				CalculateBase(2, &base, &arg);
+		for (int n = 0; n < operands.size() && n < 2; n++)
+		{
+			if (ParseOperand(operands[n], n) == -1)
+				return -1;
+		}
 
-				if (IsNumeric(arg))
-				{
-					if (base != -1)
-					{
-						int arg1 = stoi(arg, nullptr, base);
-
-						if (_opcodeDictionary.currNumArgs > 0)
-						{
-							_opcodeDictionary.currArg1type = ArgType::Numeral;
-							_opcodeDictionary.currArg1num = arg1;
-							_opcodeDictionary.currNumArgs++;
-						}
-					}
-				}
-				else
-				{
-					if (_registerDictionary.GetLabel(arg))
-					{
-						if (_opcodeDictionary.currNumArgs > 0)
-						{
-							_opcodeDictionary.currArg1type = ArgType::Register;
-							_opcodeDictionary.currArg1string = arg;
-							_opcodeDictionary.currNumArgs++;
-						}
-					}
-					else if (_labelDictionary.GetLabel(arg))
-					{
-						if (_opcodeDictionary.currNumArgs > 0)
-						{
-							_opcodeDictionary.currArg1type = ArgType::Numeral;
-							_opcodeDictionary.currArg1num = _labelDictionary.currValue;
-							_opcodeDictionary.currNumArgs++;
-						}		
-					}
-					else
-					{
-						char* a = strtok(_tokens[i], "\"");
+		if (operands.size() > 2)
+			_opcodeDictionary.currNumArgs = operands.size();
+
+		_currTokenType = TokenType::None;
 
-						char currChar;
-						for (; *a; a++)
-						{
-							currChar = *a != '/' ? *a : ' ';
+		// One walk down the decision tree: mnemonic, then the class of each operand (a register, or any number)
+		OpcodeDictionary& opcodes = _opcodeDictionary;
+		int entry = _opcodeMatcher.Match(opcodes.currMnemonic, opcodes.currNumArgs, opcodes.currArg0type, opcodes.currArg0string, opcodes.currArg1type, opcodes.currArg1string);
 
+		if (entry < 0)
+		{
+			printf("\n\n!!! CRITICAL ERROR in Line #%d of \"%s\" !!!\n", _currLine, _currFile.c_str());
+			string text = opcodes.currMnemonic;
+			for (int n = 0; n < operands.size(); n++)
+				text += (n == 0 ? " " : ", ") + operands[n];
 
-							printf("      -- %02x: %c (%02x)\n", _programROM.GetCurrentAddress(), currChar, currChar);
-						}
+			printf("  -> No opcode matches \"%s\"! Parsing cannot continue until fixed\n", text.c_str());
 
-							_opcodeDictionary.currArg1type = ArgType::Ascii;
-							_opcodeDictionary.currArg1num = (int)currChar;
-							_opcodeDictionary.currNumArgs++;
+			vector<int> candidates;
+			_opcodeMatcher.GetCandidates(opcodes.currMnemonic, opcodes.currNumArgs, opcodes.currArg0type, opcodes.currArg0string, opcodes.currArg1type, opcodes.currArg1string, MAX_MATCH_CANDIDATES, candidates);
 
-					}
+			for (int c = 0; c < candidates.size(); c++)
+				printf("     %s %s\n", c == 0 ? "Closest opcodes:" : "                ", opcodes.Describe(candidates[c]).c_str());
 
-					_currTokenType = TokenType::None;
-				}
-			}
+			return -1;
 		}
 
-		// TODO: Addresses are currently hard-coded to increase by 8...need to increment by actual size later!
-		// --> opcodes are corrected!
-
-		int oc_value = -1;
-		int oc_size = -1;
-		int oc_ctrlPattern = -1;
-		if (_opcodeDictionary.currNumArgs == 0)
+		// The second assembly emits what the rewrite plan says in place of the instructions it rewrites (checking that it
+		// reads the same instructions as the first assembly). The first assembly records what it emits for the peephole
+		// optimizer, branch relaxation and .optimize. A line the language server patches is emitted as it is written, which
+		// is only what a full assembly would do if no rewrite can apply to it.
+		if (_patchBytes != NULL)
 		{
-			if (_opcodeDictionary.Get0ArgOpcode(_opcodeDictionary.currMnemonic, &oc_size, &oc_value, &oc_ctrlPattern))
-			{
-				if (_outMode == OutMode::Verbose)
-					printf("      -- %02x: %02x (%s)\n", _programROM.GetCurrentAddress(), oc_value, _opcodeDictionary.currMnemonic.c_str());
-				_programROM.AddEntryToCurrentAddress(oc_value);
-				_programROM.SetPattern(_opcodeDictionary.currMnemonic);
-				_programROM.IncrementCurrentAddress(oc_size/8);
-			}
+			if (RewriteMayApply(entry))
+				return -1;
 		}
-
-		if (_opcodeDictionary.currNumArgs == 1)
+		else if (_reassembling)
 		{
-			if ((_opcodeDictionary.currArg0type == ArgType::Numeral || _opcodeDictionary.currArg0type == ArgType::Ascii) && _opcodeDictionary.Get1ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0num, &oc_size, &oc_value, &oc_ctrlPattern))
-			{
-				if (_outMode == OutMode::Verbose)
-					printf("      -- %02x: %02x (%s)\n", _programROM.GetCurrentAddress(), oc_value, _opcodeDictionary.currMnemonic.c_str());
-				_programROM.AddEntryToCurrentAddress(oc_value);
-				_programROM.SetPattern(_opcodeDictionary.currMnemonic + " #");
-				_programROM.IncrementCurrentAddress(oc_size/8);
-				if (_outMode == OutMode::Verbose)
-				{
-					if (_opcodeDictionary.currArg0type == ArgType::Numeral)
-						printf("      -- %02x: %02x\n", _programROM.GetCurrentAddress(), _opcodeDictionary.currArg0num);
-					else
-						printf("      -- %02x: %c\n", _programROM.GetCurrentAddress(), _opcodeDictionary.currArg0num);
-				}
-				_programROM.AddEntryToCurrentAddress(_opcodeDictionary.currArg0num);				
-				
-				char c = static_cast<char>(_opcodeDictionary.currArg0num);
-				printf("Char is %c\n", c);
-				string s(1, c);
+			int index = _instructionIndex++;
 
-				if (_opcodeDictionary.currArg0type == ArgType::Numeral)
-					_programROM.SetPattern("#");
-				else
-					_programROM.SetPattern(s);
-				_programROM.IncrementCurrentAddress(1);
-			}
-
-			if (_opcodeDictionary.currArg0type == ArgType::Register && _opcodeDictionary.Get1ArgOpcode(_opcodeDictionary.currMnemonic.c_str(), _opcodeDictionary.currArg0string, &oc_size, &oc_value, &oc_ctrlPattern))
+			if (index >= _rewritePlan.size() || _rewritePlan[index].entry != entry)
+				_rewriteMismatch = true;
+			else if (_rewritePlan[index].rewritten)
 			{
-				if (_outMode == OutMode::Verbose)
-					printf("      -- %02x: %02x (%s)\n", _programROM.GetCurrentAddress(), oc_value, _opcodeDictionary.currMnemonic.c_str());
-				_programROM.AddEntryToCurrentAddress(oc_value);
-				_programROM.SetPattern(_opcodeDictionary.currMnemonic + " " + _opcodeDictionary.currArg0string);
-				_programROM.IncrementCurrentAddress(oc_size/8);
+				const ListingRecord& record = _programROM.GetPendingRecord();
+				_rewrittenLines.insert(SourceIndex::LineKey(record.fileId, record.line));
+
+				_currentRewrite = index;
+				int result = _rewritePlan[index].replacement >= 0 ? EmitReplacement(_rewritePlan[index]) : 0;
+				_currentRewrite = -1;
+				return result;
 			}
 		}
+		else
+		{
+			_emitted.push_back({ entry, _programROM.GetCurrentAddress(), _programROM.GetImageAddress(), (int)_regions.size(), { operands.size() > 0 ? operands[0] : "", operands.size() > 1 ? operands[1] : "" } });
+			_pendingLabels.clear();
+		}
 
-		if (_opcodeDictionary.currNumArgs == 2)
+		// Calls that a veneer rule covers are kept until every label is known, to see which of them call into another bank
+		auto veneer = _veneerByEntry.find(entry);
+		if (veneer != _veneerByEntry.end())
 		{
-			if (_opcodeDictionary.currArg0type == ArgType::Register && _opcodeDictionary.currArg1type == ArgType::Register &&
-				_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, _opcodeDictionary.currArg1string, &oc_size, &oc_value, &oc_ctrlPattern))
-			{
-				if (_outMode == OutMode::Verbose)
-					printf("      -- %02x: %02x (%s)\n", _programROM.GetCurrentAddress(), oc_value, _opcodeDictionary.currMnemonic.c_str());
-				_programROM.AddEntryToCurrentAddress(oc_value);
-				_programROM.SetPattern(_opcodeDictionary.currMnemonic + " " + _opcodeDictionary.currArg0string + ", " + _opcodeDictionary.currArg1string);
-				_programROM.IncrementCurrentAddress(oc_size/8);
-			}
+			const PeepholeRule& rule = _veneerRules[veneer->second];
+			FarCall call = { veneer->second, entry, _programROM.GetImageAddress(), _programROM.GetCurrentAddress(), _programROM.GetBank(), rule.captureSources[1].second,
+				{ operands.size() > 0 ? operands[0] : "", operands.size() > 1 ? operands[1] : "" }, _currFile, _currLine };
+			_farCalls.push_back(call);
+		}
 
-			if (_opcodeDictionary.currArg0type == ArgType::Register && (_opcodeDictionary.currArg1type == ArgType::Numeral || _opcodeDictionary.currArg1type == ArgType::Ascii) &&
-				_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0string, _opcodeDictionary.currArg1num, &oc_size, &oc_value, &oc_ctrlPattern))
-			{
-				if (_outMode == OutMode::Verbose)
-					printf("      -- %02x: %02x (%s)\n", _programROM.GetCurrentAddress(), oc_value, _opcodeDictionary.currMnemonic.c_str());
-				_programROM.AddEntryToCurrentAddress(oc_value);
-				_programROM.SetPattern(_opcodeDictionary.currMnemonic + " " + _opcodeDictionary.currArg0string + ", #");
-				_programROM.IncrementCurrentAddress(oc_size/8);
-				if (_outMode == OutMode::Verbose)
-				{
-					if (_opcodeDictionary.currArg1type == ArgType::Numeral)
-						printf("      -- %02x: %02x\n", _programROM.GetCurrentAddress(), _opcodeDictionary.currArg1num);
-					else
-						printf("      -- %02x: %c\n", _programROM.GetCurrentAddress(), _opcodeDictionary.currArg1num);
-				}
-				_programROM.AddEntryToCurrentAddress(_opcodeDictionary.currArg1num);
-				char c = static_cast<char>(_opcodeDictionary.currArg1num);
-				printf("Char is %c\n", c);
-				string s(1, c);
+		// The opcode's layout says where the opcode value and each operand go in the instruction
+		long long args[2] = { opcodes.currArg0num, opcodes.currArg1num };
 
-				if (_opcodeDictionary.currArg1type == ArgType::Numeral)
-					_programROM.SetPattern("#");
-				else
-					_programROM.SetPattern(s);
-				_programROM.IncrementCurrentAddress(1);
-			}
+		if (!EmitEncoded(opcodes.GetLayout(entry), opcodes.GetValue(entry), args, _operandExprs))
+			return -1;
 
-			if (_opcodeDictionary.currArg0type == ArgType::Numeral && _opcodeDictionary.currArg1type == ArgType::Register &&
-				_opcodeDictionary.Get2ArgOpcode(_opcodeDictionary.currMnemonic, _opcodeDictionary.currArg0num, _opcodeDictionary.currArg1string, &oc_size, &oc_value, &oc_ctrlPattern))
-			{
-				if (_outMode == OutMode::Verbose)
-					printf("      -- %02x: %02x (%s)\n", _programROM.GetCurrentAddress(), oc_value, _opcodeDictionary.currMnemonic.c_str());
-				_programROM.AddEntryToCurrentAddress(oc_value);
-				_programROM.SetPattern(_opcodeDictionary.currMnemonic + " #, " + _opcodeDictionary.currArg1string);
-				_programROM.IncrementCurrentAddress(oc_size/8);
-				if (_outMode == OutMode::Verbose)
-					printf("      -- %02x: %02x\n", _programROM.GetCurrentAddress(), _opcodeDictionary.currArg0num);
-				_programROM.AddEntryToCurrentAddress(_opcodeDictionary.currArg0num);
-				_programROM.SetPattern("#");
-				_programROM.IncrementCurrentAddress(1);
-			}
-		}
+		_programROM.AddListingCycles(opcodes.GetMinCycles(entry), opcodes.GetMaxCycles(entry), EndsBlock(entry));
 	}
 
 	return 0;
 }
 
-void Parser::CalculateBase(int i, int* base, char** arg)
-{
-	*base = -1;
-	*arg = _tokens[i];
-
-	switch (_tokens[i][0])
-	{
-		case BIN_KEY[0]:
-			*base = 2;
-			if (BIN_KEY != "") *arg = strtok(*arg, BIN_KEY);
-			break;
-
-		case HEX_KEY[0]:
-			*base = 16;
-			if (HEX_KEY != "") *arg = strtok(*arg, HEX_KEY);
-			break;
-
-		case DEC_KEY[0]:
-			*base = 10;
-			if (DEC_KEY != "") *arg = strtok(*arg, DEC_KEY);
-			break;
-
-		default:
-			if (BIN_KEY == "") *base = 2;
-			if (HEX_KEY == "") *base = 16;
-			if (DEC_KEY == "") *base = 10;
-			break;
-	}
-}
-
 /*================================================== Parser::IsNumeric()================================================================
 	DESCRIPTION:
 		  This is a helper function which determines if the provided character matches 0-9 or any numeric prefixes.
@@ -1,44 +1,372 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
 #include "Config.h"
+#include "ControlFields.h"
+#include "DebugInfo.h"
+#include "Disassembler.h"
+#include "FreeSpace.h"
+#include "Expression.h"
+#include "InstructionEncoder.h"
 #include "LabelDictionary.h"
 #include "OpcodeDictionary.h"
+#include "OpcodeMatcher.h"
+#include "OpcodeSpace.h"
+#include "BranchRelaxer.h"
+#include "MacroDictionary.h"
+#include "MicrocodeLayout.h"
+#include "PeepholeOptimizer.h"
 #include "ROMData.h"
+#include "Simulator.h"
+#include "StringPool.h"
+#include "TestRunner.h"
 
 using namespace std;
 
 enum class ParseMode { None, Architecture, Assembler };
-enum class LineType { None, Blank, Comment, File, ArchRegister, ArchOpcode, ArchControl, ArchControlAlias, ControlROM, Directive, Symbol, Label, OpCode };
-enum class TokenType { None, Architecture, Include, Origin, Export, Byte, Ascii, Symbol, Label, OpCode };
+enum class LineType { None, Blank, Comment, File, ArchRegister, ArchOpcode, ArchControl, ArchControlAlias, ArchControlField, ArchControlGroup, ArchControlAction, ArchPeephole, ArchRelax, ArchVeneer, ControlROM, ControlROMLayout, Directive, Symbol, Label, OpCode };
+enum class TokenType { None, Architecture, Include, Origin, Export, Byte, Ascii, List, Fill, Align, Incbin, Simulate, Expect, Profile, Budget, Entry, Bank, Segment, Section, Ends, Symbol, Label, OpCode };
 enum class OutMode { None, Brief, Verbose };
-enum class BinaryOperation { None, LogicalOR, LogicalAND, BitShiftLeft, BitShiftRight };
+
+// An instruction (or .byte value) with an operand whose value wasn't known yet when its bytes were written (i.e., a
+// forward reference). These are encoded again once the whole program has been read.
+struct Fixup
+{
+	long long address;	// image address (see ROMData)
+	int pc;
+	int layout;
+	long long opcode;
+	long long args[2];
+	int exprs[2];		// -1 for arguments that were already known
+	string file;
+	int line;
+	int rewrite;		// step of the rewrite plan that emitted it, or -1
+};
+
+// An operand of an opcode template that stands for every register of one size (written {r8:name} in the architecture file)
+struct TemplateArg
+{
+	int width;			// 0 if the operand isn't a template operand
+	string name;
+};
+
+// A control line or alias of the architecture file. Its value is only worked out once the whole file has been read, so
+// aliases can refer to names defined further down.
+struct ControlDefinition
+{
+	string name;
+	string text;
+	string file;
+	int line;
+	bool alias;
+};
+
+// A control_action line, resolved when the simulation starts
+struct ControlActionDefinition
+{
+	string control;
+	MicroOpType type;
+	string reg;
+	string file;
+	int line;
+};
+
+// A .expect/.assert line. Its expressions are evaluated once every label is known.
+struct ExpectDefinition
+{
+	string text;
+	string reg;			// empty for a memory check
+	string address;
+	CheckOp op;
+	string value;
+	string after;		// empty to check when the program stops
+	long long within;
+	string file;
+	int line;
+};
+
+// A .budget line, checked once the program has been assembled
+struct BudgetDefinition
+{
+	string label;
+	long long cycles;
+	string file;
+	int line;
+};
+
+// A .entry line: a place execution can start at, besides the start address
+struct EntryDefinition
+{
+	string label;
+	string file;
+	int line;
+};
+
+// A .bank line that gave the bank its window. Banks are checked against it once the program is assembled.
+struct BankDefinition
+{
+	int base;
+	int size;			// 0 if it isn't fixed
+	string file;
+	int line;
+};
+
+// Where a .segment left off, so the next .segment line with its name carries on from there
+struct SegmentState
+{
+	int bank;
+	int address;
+};
+
+// A relocatable section: the lines between .section and .ends, which are placed in the free space of their bank once the
+// program has been assembled and its size is known
+struct SectionDefinition
+{
+	string name;
+	int bank;
+	int alignment;
+	int page;			// size of the pages it must not run over the end of, or 0
+	int size;
+	string file;
+	int line;
+};
+
+// A call that a veneer rule can route through bank 0, recorded with the call's bank so calls into another bank can be
+// found once every label is known
+struct FarCall
+{
+	int rule;
+	int entry;
+	long long image;
+	int pc;
+	int bank;
+	int target;			// operand that holds the label it calls
+	string operands[2];
+	string file;
+	int line;
+};
+
+// A peephole or relax line of the architecture file. Its instructions are matched to opcodes once the whole file has been
+// read.
+struct PeepholeDefinition
+{
+	string name;
+	vector<string> tokens;
+	string file;
+	int line;
+};
+
+// An instruction the program emitted, recorded so the peephole optimizer and branch relaxation can look for rewrites
+// once it is assembled
+struct EmittedInstruction
+{
+	int entry;
+	int address;
+	long long image;
+	int region;			// code between two .org or .align lines moves together
+	string operands[2];
+};
+
+// What the second assembly does with one instruction of the first assembly
+struct RewriteStep
+{
+	int entry;			// the opcode the first assembly matched, to check that both assemblies read the same program
+	bool rewritten;
+	bool relaxed;		// the replacement is the short form of a jump, which may still turn out to be out of reach
+	int replacement;	// opcode to emit instead, or -1 to leave the instruction out
+	string operands[2];
+};
+
+// A .byte or .ascii line, recorded so .optimize can find the data blocks that can share their bytes
+struct DataLine
+{
+	int address;
+	int region;
+	int instruction;			// instructions emitted before it
+	vector<unsigned char> bytes;
+	bool constant;				// its bytes don't depend on any label or address
+	vector<string> labels;		// labels that point at its first byte
+	vector<string> values;		// the .byte values as they were written
+};
+
+// Where a run of lines whose addresses follow on from each other starts in the listing, the labels and the label dictionary,
+// so the language server knows what an edited line that changes length pushes along
+struct AddressRegion
+{
+	int firstRecord;
+	int firstLabel;
+	int firstName;
+	bool fixed;			// it starts at an address of its own (.org), so it stays put when the region before it changes length
+};
+
+// What the second assembly does with one data line of the first assembly
+struct DataStep
+{
+	int length;			// to check that both assemblies read the same data
+	bool dropped;		// its bytes are part of another block
+	int anchor;			// pooled block that starts here, or -1
+};
+
+// What the language server shows for a label or symbol
+struct IndexedSymbol
+{
+	long long value;
+	bool known;			// false if its value couldn't be worked out
+	bool label;
+	int bank;
+	int fileId;			// line it was defined on, or -1 if it wasn't defined in the program
+	int line;
+};
+
+// The bytes a source line assembled to
+struct IndexedLine
+{
+	int address;
+	int bank;
+	vector<unsigned char> bytes;
+};
+
+// Everything the language server answers queries from, looked up by name or by line rather than searched for
+struct SourceIndex
+{
+	vector<string> files;
+	unordered_map<string, IndexedSymbol> symbols;
+	unordered_map<long long, IndexedLine> lines;		// by file id in the high half and line (from 0) in the low half
+
+	static long long LineKey(int fileId, int line) { return ((long long)fileId << 32) | (unsigned int)line; }
+};
+
+// One entry per open .if block
+struct ConditionalFrame
+{
+	bool active;		// lines in the current branch are being assembled
+	bool taken;			// one of the branches of this block has already been assembled
+	bool seenElse;
+};
 
 class Parser
 {
 public:
 	Parser() :
-		_processingExternFile(false), _linePtr(-1), _currFile(""), _outMode(OutMode::None), _parseMode(ParseMode::None), _lineType(LineType::None), _numTokens(0),
-		_currTokenType(TokenType::None), _labelDictionary(LabelDictionary()), _registerDictionary(LabelDictionary()), _opcodeDictionary(OpcodeDictionary()), _controlDictionary(LabelDictionary()), _programROM(ROMData()), _equalProcessed(false), _lastOperation(BinaryOperation::None), _ocValProcessed(false), _opcodeIsAliased(false), _controlROMindex(-1)
-	{	_tokens.clear(); _controlROMs.clear();	}
+		_processingExternFile(false), _linePtr(-1), _currLine(0), _currFile(""), _outMode(OutMode::None), _parseMode(ParseMode::None), _lineType(LineType::None), _numTokens(0),
+		_currTokenType(TokenType::None), _labelDictionary(LabelDictionary()), _registerDictionary(LabelDictionary()), _opcodeDictionary(OpcodeDictionary()), _controlDictionary(LabelDictionary()), _programROM(ROMData()), _equalProcessed(false), _equalIndex(-1), _opcodeIsAliased(false), _controlROMindex(-1),
+		_currFileId(-1), _lineColStart(0), _lineColEnd(0), _listingRequested(false), _symbolsRequested(false),
+		_macroDictionary(MacroDictionary()), _macroExpansions(0), _macroLinesExpanded(0), _macroDepth(0), _macroMaxDepth(0),
+		_skipDepth(0), _linesSkipped(0), _recordingRept(false), _reptNesting(0), _reptCount(0), _reptIterations(0), _expansionCounter(0), _recordingIndex(-1),
+		_expressions(ExpressionPool()), _expressionsCompiled(0), _encoder(InstructionEncoder()), _registerIds(LabelDictionary()), _opcodeMatcher(OpcodeMatcher()), _opcodeSpace(OpcodeSpace()), _controlFields(ControlFields()), _architectureErrors(0), _controlLayout(MicrocodeLayoutType::Direct), _controlLayoutReport(false), _simulationCycles(0), _profileRequested(false), _testMode(false), _programReady(false), _templateOpcodes(0), _instructionsEncoded(0),
+		_optimizeRequested(false), _instructionIndex(0), _rewriteMismatch(false), _currentRewrite(-1), _branchesShort(0), _branchesLong(0), _relaxSteps(0),
+		_reassembling(false), _dataIndex(0), _blocksPooled(0), _bytesPooled(0), _instructionsStripped(0), _bytesStripped(0),
+		_veneers(0), _veneerBytes(0), _farCallsRouted(0), _emittingVeneers(false),
+		_currSection(-1), _sectionReturn({ 0, 0 }), _sources(NULL), _patchBytes(NULL)
+	{
+		_tokens.clear(); _tokenGroups.clear(); _controlROMs.clear(); _fixups.clear(); _registerClasses.clear();
+		_operandExprs[0] = _operandExprs[1] = -1;
+
+		// .byte values go through the encoder as a one field layout
+		string error;
+		_byteLayout = _encoder.AddLayout({ { FieldSource::Arg0, 8, false, false, 0 } }, error);
+	}
 
 	void SetParseMode(ParseMode m) { _parseMode = m; }
 	void ResetParser() { _linePtr = -1; _processingExternFile = false; _currFile = ""; _numTokens = 0; _tokens.clear(); _lineType = LineType::None; _outMode = OutMode::None; _currTokenType = TokenType::None; };
-	void ResetForNewLine() { _numTokens = 0; _tokens.clear(); }
+	void ResetForNewLine() { _numTokens = 0; _tokens.clear(); _tokenGroups.clear(); }
+	void ResetLineState() { _equalProcessed = false; _equalIndex = -1; _opcodeIsAliased = false; _templateArgs[0].width = _templateArgs[1].width = 0; }
 	void Parse(const char* filename);
 	void SetOutMode(OutMode m) { _outMode = m; }
+	void SetTestMode(bool testMode) { _testMode = testMode; }
+	bool BuildTest(TestCase& test);
+	bool Disassemble(const char* archFile, const char* romFile, int base, const char* outFile);
+	void SetSources(const unordered_map<string, string>* sources) { _sources = sources; }
+	bool PatchLine(const string& file, int line, const vector<string>& lines);
+	bool BuildIndex(SourceIndex& index);
+	void UpdateIndex(SourceIndex& index);
 
 protected:
 	void ParseLineIntoTokens(const char* line, const char* delimiters);
+	LineType ClassifyLine(const char* firstToken);
+	int ProcessLine(string* nextFile);
+	int ProcessTokens(string* nextFile);
+	int BeginMacroDefinition();
+	int ExpandMacro(int m);
+	int ExpandBody(int m, const vector<string>& bound);
+	int BeginRept();
+	int EndRecording();
+	int ProcessConditional(bool* handled);
+	bool EvaluateCondition(int first, bool* result);
+	void GetOperands(int first, vector<string>& operands);
+	string JoinTokens(int first, int last);
+	int CompileExpression(const string& text, string& error);
+	bool EvaluateExpression(const string& text, LabelDictionary& symbols, long long* value);
+	bool EvaluateExpression(const string& text, LabelDictionary& symbols, int* value);
+	int EvaluateOrDefer(const string& text, int* value);
+	void NoteUses(int expr);
+	int ParseOperand(const string& text, int n);
+	bool ParseImmediateSpec(const char* token, EncodeField* spec);
+	int BuildLayout(int first, int last, int cmdSize);
+	bool ParseTemplateArg(const char* token, TemplateArg* arg);
+	string StripIndexCalls(const string& text);
+	int ExpandOpcodeTemplate(int cmdSize, int patternStart, int patternEnd, int layoutEnd);
+	unsigned long long GetOpcodeSlot(int layout, int value, int cmdSize, const string& a0, const string& a1);
+	bool CheckOpcodeSlot(int cmdSize, unsigned long long slot, int layout, long long controlPattern, const string& text);
+	void RecordControlPattern(const string& text, const string& name, long long value, const string& file, int line);
+	bool ResolveControlDefinitions();
+	bool ValidateControlPatterns();
+	bool EmitEncoded(int layout, long long opcode, const long long* args, const int* exprs);
+	void AddFixup(int layout, long long address, int pc, long long opcode, const long long* args, const int* exprs);
+	bool ResolveFixups();
+	bool HasAction(int entry, MicroOpType type);
+	bool EndsBlock(int entry);
+	bool CheckBudgets();
+	bool CompilePeepholeRules();
+	void ParseRewriteRule(const PeepholeDefinition& definition, PeepholeRule& rule, bool* arrow, string& error, const char* bound);
+	bool ParsePeepholeInstruction(const vector<string>& words, bool replacement, unordered_map<string, int>& captures, PeepholeRule& rule, string& error);
+	void DecodeEmitted(vector<PeepholeSite>& sites);
+	bool PlanPeephole(const vector<PeepholeSite>& sites, vector<RewriteStep>& plan, vector<int>& applications);
+	void SetReplacement(RewriteStep& step, const PeepholeRule& rule, const PeepholeInstruction& instruction, int first);
+	bool PlanRelaxation(const vector<PeepholeSite>& sites, const vector<bool>& keepLong, vector<RewriteStep>& plan);
+	bool Reassemble(const char* filename);
+	void PrintPeepholeReport();
+	int EmitReplacement(const RewriteStep& step);
+	bool ResolveEntries();
+	bool PlaceData(const unsigned char* bytes, int length, const vector<string>& values, bool constant);
+	bool PlanPooling(vector<DataStep>& plan, unordered_map<string, string>& redirects);
+	bool PlanStripping(const vector<PeepholeSite>& sites, vector<RewriteStep>& plan);
+	void PrintLayoutReport();
+	void SwitchBank(int bank);
+	void StartAddressRegion(bool fixed);
+	long long FillEnd();
+	bool CheckFillValue(const string& text, long long value, const char* directive);
+	bool EmitVeneers();
+	bool CheckBanks();
+	bool PlaceSections(vector<int>& plan);
+	bool CheckOverlaps();
+	void PrintSectionReport();
+	int AssembleAgain(int r, const string& text, vector<unsigned char>& bytes);
+	bool ShiftRegion(int r, int delta, const vector<string>& lines, vector<int>& again);
+	bool RewriteMayApply(int entry);
+	bool IsSkipping() { return !_condStack.empty() && !_condStack.back().active; }
+	bool SkipRawLine(const char* line);
+	bool SkipDirective(const char* word, int length);
+	bool IsDirective(const char* token, const char* name);
 	int ParseToken(int i);
-	void CalculateBase(int i, int* base, char** arg);
 	bool IsNumeric(const char* c);
 	const string SplitFilename(const string& s, const string& preferredPath, const string& preferredExtension, bool forcePreferred);
 	void WriteProgramToROM(const char* filename);
+	void PrintStats();
+	void RunSimulation(const string& filename);
+	bool BuildSimulator(Simulator& simulator, int* skipped);
+	bool BuildChecks(Simulator& simulator, vector<TestCheck>& checks);
+	void RunChecks(const string& name);
+	bool BuildControlROMs(const string& reportFile);
+	void WriteMicrocodeReport(FILE* out, MicrocodeLayout& layout, const vector<int>& addresses, const vector<unsigned long long>& words, const vector<vector<int>>& entries);
 
 private:
 	bool _processingExternFile;
 	int _linePtr = -1;
+	int _currLine = 0;
 	string _currFile;
 	OutMode _outMode;
 	ParseMode _parseMode;
@@ -46,15 +374,118 @@ private:
 	int     _numTokens;
 	TokenType _currTokenType;
 	vector<char*>   _tokens;
+	vector<int>     _tokenGroups;	// operand (comma separated group) each token belongs to
+	string _rawLine;
 	LabelDictionary _labelDictionary;
 	LabelDictionary _registerDictionary;
 	LabelDictionary _controlDictionary;
 	OpcodeDictionary _opcodeDictionary;
 	ROMData _programROM;
 	vector<ROMData> _controlROMs;
-	BinaryOperation _lastOperation;
 	bool _equalProcessed = false;
-	bool _ocValProcessed = false;
+	int _equalIndex;
 	bool _opcodeIsAliased = false;
 	int _controlROMindex = -1;
+	int _currFileId;
+	int _lineColStart;
+	int _lineColEnd;
+	bool _listingRequested;
+	bool _symbolsRequested;
+	DebugInfo _debugInfo;					// uses of each symbol, for the cross reference
+	vector<int> _usedSymbols;
+	MacroDictionary _macroDictionary;
+	int _macroExpansions;
+	int _macroLinesExpanded;
+	int _macroDepth;
+	int _macroMaxDepth;
+	vector<ConditionalFrame> _condStack;
+	int _skipDepth;
+	int _linesSkipped;
+	bool _recordingRept;
+	int _reptNesting;
+	int _reptCount;
+	int _reptIterations;
+	int _expansionCounter;
+	int _recordingIndex;
+	ExpressionPool _expressions;
+	unordered_map<string, int> _expressionCache;
+	int _expressionsCompiled;
+	vector<Fixup> _fixups;
+	int _operandExprs[2];
+	InstructionEncoder _encoder;
+	int _byteLayout;
+	EncodeField _argSpecs[2];
+	LabelDictionary _registerIds;
+	unordered_map<int, vector<string>> _registerClasses;	// registers of each size, in id order
+	TemplateArg _templateArgs[2];
+	OpcodeMatcher _opcodeMatcher;
+	OpcodeSpace _opcodeSpace;
+	ControlFields _controlFields;
+	vector<ControlDefinition> _controlDefinitions;
+	int _architectureErrors;
+	MicrocodeLayoutType _controlLayout;
+	bool _controlLayoutReport;
+	vector<ControlActionDefinition> _controlActions;
+	long long _simulationCycles;		// 0 unless .simulate was used
+	bool _profileRequested;
+	vector<ExpectDefinition> _expects;
+	vector<BudgetDefinition> _budgets;
+	bool _testMode;						// only assemble into memory, for the test runner
+	bool _programReady;					// the program was assembled without errors
+	int _templateOpcodes;
+	int _instructionsEncoded;
+	PeepholeOptimizer _peephole;
+	vector<PeepholeDefinition> _peepholeDefinitions;
+	bool _optimizeRequested;
+	vector<EmittedInstruction> _emitted;
+	vector<RewriteStep> _rewritePlan;		// only set for the second assembly
+	vector<int> _peepholeApplications;		// rewrites made by each rule
+	int _instructionIndex;
+	bool _rewriteMismatch;
+	unique_ptr<Parser> _reassembled;		// the second assembly, once it has replaced this one
+	vector<PeepholeDefinition> _relaxDefinitions;
+	vector<PeepholeRule> _relaxRules;
+	unordered_map<int, int> _relaxByEntry;	// relax rule of each long form opcode
+	vector<AddressRegion> _regions;			// every region but the first, which starts at the top of the program
+	int _currentRewrite;					// plan step being emitted, or -1
+	vector<int> _relaxFailures;				// short forms that turned out to be out of reach
+	int _branchesShort;
+	int _branchesLong;
+	long long _relaxSteps;
+	bool _reassembling;						// this is the second assembly
+	vector<EntryDefinition> _entries;
+	vector<long long> _entryAddresses;
+	vector<DataLine> _dataLines;
+	vector<pair<string, int>> _pendingLabels;	// labels since the last instruction or data line, and their addresses
+	vector<DataStep> _dataPlan;				// only set for the second assembly
+	int _dataIndex;
+	unordered_map<string, string> _labelRedirects;	// labels of pooled blocks, and where they point now
+	int _blocksPooled;
+	int _bytesPooled;
+	int _instructionsStripped;
+	int _bytesStripped;
+	unordered_map<int, BankDefinition> _banks;
+	unordered_map<int, int> _bankAddresses;		// where each bank's code left off when another bank was selected
+	unordered_map<string, SegmentState> _segments;
+	string _currSegment;						// "" until the first .segment
+	unordered_map<string, int> _labelBanks;		// bank each label was defined in
+	vector<PeepholeDefinition> _veneerDefinitions;
+	vector<PeepholeRule> _veneerRules;
+	unordered_map<int, int> _veneerByEntry;		// veneer rule of each call opcode
+	vector<FarCall> _farCalls;
+	int _veneers;
+	int _veneerBytes;
+	int _farCallsRouted;
+	bool _emittingVeneers;
+	vector<SectionDefinition> _sections;
+	vector<int> _sectionPlan;					// address of each section, only set for the second assembly
+	int _currSection;							// section being assembled, or -1
+	SegmentState _sectionReturn;				// where the code around the current section left off
+	const unordered_map<string, string>* _sources;	// text to read in place of these files, or NULL
+	vector<unsigned char>* _patchBytes;			// where the line being patched puts its bytes, or NULL
+	unordered_map<string, pair<int, int>> _symbolLines;	// file id and line each symbol was defined on
+	unordered_map<long long, int> _recordAt;		// listing record of each line (-1 if it can't be assembled on its own, -2 for a symbol), for PatchLine
+	unordered_set<long long> _rewrittenLines;		// lines whose instruction the second assembly rewrote
+	vector<int> _patchedRecords;				// records the last PatchLine() assembled again
+	vector<string> _patchedNames;				// labels it moved and symbols whose value that changed
 };
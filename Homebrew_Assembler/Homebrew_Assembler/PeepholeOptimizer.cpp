@@ -0,0 +1,145 @@
+#include "PeepholeOptimizer.h"
+#include <algorithm>
+
+PeepholeOptimizer::PeepholeOptimizer()
+{
+	_rules.clear();
+	_states.clear();
+	_built = false;
+}
+
+// Builds the trie of patterns, then the failure links breadth first (each state falls back to the longest suffix of its
+// path that is also a path from the root) and merges the rules of the states each one falls back to
+void PeepholeOptimizer::Build()
+{
+	_states.assign(1, { {}, 0, {} });
+
+	for (int r = 0; r < _rules.size(); r++)
+	{
+		int state = 0;
+		for (const PeepholeInstruction& instruction : _rules[r].pattern)
+		{
+			auto next = _states[state].next.find(instruction.entry);
+			if (next != _states[state].next.end())
+			{
+				state = next->second;
+				continue;
+			}
+
+			_states[state].next[instruction.entry] = _states.size();
+			state = _states.size();
+			_states.push_back({ {}, 0, {} });
+		}
+
+		_states[state].rules.push_back(r);
+	}
+
+	vector<int> queue;
+	for (auto& child : _states[0].next)
+		queue.push_back(child.second);
+
+	for (int q = 0; q < queue.size(); q++)
+	{
+		int state = queue[q];
+		const PeepholeState& fallback = _states[_states[state].fail];
+		_states[state].rules.insert(_states[state].rules.end(), fallback.rules.begin(), fallback.rules.end());
+
+		for (auto& child : _states[state].next)
+		{
+			int fail = _states[state].fail;
+			while (fail && !_states[fail].next.count(child.first))
+				fail = _states[fail].fail;
+
+			auto target = _states[fail].next.find(child.first);
+			_states[child.second].fail = target != _states[fail].next.end() && target->second != child.second ? target->second : 0;
+			queue.push_back(child.second);
+		}
+	}
+
+	// Longer patterns are tried first, so "mov a, #x ; mov a, #x" wins over a rule for its last instruction alone
+	for (PeepholeState& state : _states)
+	{
+		stable_sort(state.rules.begin(), state.rules.end(), [this](int x, int y) { return _rules[x].pattern.size() > _rules[y].pattern.size(); });
+	}
+
+	_built = true;
+}
+
+int PeepholeOptimizer::Step(int state, int entry)
+{
+	while (true)
+	{
+		auto next = _states[state].next.find(entry);
+		if (next != _states[state].next.end())
+			return next->second;
+
+		if (state == 0)
+			return 0;
+
+		state = _states[state].fail;
+	}
+}
+
+// A pattern only applies to straight-line code: the instructions have to follow each other in memory, no label may point
+// inside them, and the operands have to agree with the pattern's literals and captures
+bool PeepholeOptimizer::Fits(const PeepholeRule& rule, const vector<PeepholeSite>& sites, int first)
+{
+	long long captures[MAX_CAPTURES];
+	bool bound[MAX_CAPTURES] = { false };
+
+	for (int k = 0; k < rule.pattern.size(); k++)
+	{
+		const PeepholeSite& site = sites[first + k];
+
+		if (k > 0 && (site.labelled || site.address != sites[first + k - 1].address + sites[first + k - 1].length))
+			return false;
+
+		const PeepholeInstruction& instruction = rule.pattern[k];
+		for (int n = 0; n < instruction.numArgs && n < 2; n++)
+		{
+			const PeepholeOperand& operand = instruction.args[n];
+
+			if (operand.kind == PeepholeOperandKind::Literal && site.args[n] != operand.value)
+				return false;
+
+			if (operand.kind == PeepholeOperandKind::Capture)
+			{
+				if (bound[operand.capture] && captures[operand.capture] != site.args[n])
+					return false;
+
+				bound[operand.capture] = true;
+				captures[operand.capture] = site.args[n];
+			}
+		}
+	}
+
+	return true;
+}
+
+// Finds where the rules apply, from the start of the program to the end. A rewrite is taken as soon as its pattern ends
+// and the instructions it covers aren't looked at again, so the matches never overlap.
+void PeepholeOptimizer::FindMatches(const vector<PeepholeSite>& sites, vector<PeepholeMatch>& matches)
+{
+	if (!_built)
+		Build();
+
+	int state = 0;
+	int covered = 0;		// first site that isn't part of a rewrite yet
+
+	for (int i = 0; i < sites.size(); i++)
+	{
+		state = Step(state, sites[i].entry);
+
+		for (int r : _states[state].rules)
+		{
+			int first = i + 1 - (int)_rules[r].pattern.size();
+
+			if (first >= covered && Fits(_rules[r], sites, first))
+			{
+				matches.push_back({ r, first });
+				covered = i + 1;
+				break;
+			}
+		}
+	}
+}
\ No newline at end of file
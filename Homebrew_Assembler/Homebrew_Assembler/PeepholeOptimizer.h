@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+enum class PeepholeOperandKind { None, Register, Capture, Literal };
+
+// An operand of a rewrite rule instruction. Registers are part of the opcode entry, so only captures (#name, any value
+// that is the same everywhere the name is used) and literal numbers are checked.
+struct PeepholeOperand
+{
+	PeepholeOperandKind kind;
+	int capture;
+	long long value;
+	string text;		// the literal as written, for replacements
+};
+
+// One instruction of a rule's pattern or replacement
+struct PeepholeInstruction
+{
+	int entry;
+	int numArgs;
+	PeepholeOperand args[2];
+};
+
+// peephole NAME pattern => replacement, with the instructions of each side separated by ";"
+struct PeepholeRule
+{
+	string name;
+	string file;
+	int line;
+	vector<PeepholeInstruction> pattern;
+	vector<PeepholeInstruction> replacement;
+	vector<pair<int, int>> captureSources;	// pattern instruction and operand each capture is first bound at
+	int bytesSaved;							// per rewrite
+	int cyclesSaved;
+};
+
+// An instruction of the assembled program as the optimizer sees it
+struct PeepholeSite
+{
+	int entry;
+	int address;
+	int length;
+	long long args[2];
+	bool labelled;		// a label points at it, so a rewrite can't start after it
+};
+
+// A rule applied to the instructions starting at site first
+struct PeepholeMatch
+{
+	int rule;
+	int first;
+};
+
+// The rules compiled into an Aho-Corasick automaton over opcode entries, so the program is searched for every pattern at
+// once in a single pass
+struct PeepholeState
+{
+	unordered_map<int, int> next;
+	int fail;
+	vector<int> rules;		// patterns that end here, longest first
+};
+
+class PeepholeOptimizer
+{
+public:
+	PeepholeOptimizer();
+
+	void AddRule(const PeepholeRule& rule) { _rules.push_back(rule); _built = false; }
+	int NumRules() { return _rules.size(); }
+	const PeepholeRule& GetRule(int r) { return _rules[r]; }
+	void Build();
+	void FindMatches(const vector<PeepholeSite>& sites, vector<PeepholeMatch>& matches);
+
+	static constexpr int MAX_CAPTURES = 16;
+
+private:
+	int Step(int state, int entry);
+	bool Fits(const PeepholeRule& rule, const vector<PeepholeSite>& sites, int first);
+
+	vector<PeepholeRule> _rules;
+	vector<PeepholeState> _states;
+	bool _built;
+};
\ No newline at end of file
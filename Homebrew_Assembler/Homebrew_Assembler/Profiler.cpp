@@ -0,0 +1,143 @@
+#include "Profiler.h"
+#include "Simulator.h"
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+Profiler::Profiler(ROMData& rom)
+{
+	_lines.clear();
+	_lineAt.clear();
+	_totalCycles = 0;
+
+	// The simulator runs the code of bank 0
+	for (const ListingLabel& label : rom.GetLabels())
+	{
+		if (label.bank == 0)
+			_labels.push_back(label);
+	}
+
+	stable_sort(_labels.begin(), _labels.end(), [](const ListingLabel& a, const ListingLabel& b) { return a.address < b.address; });
+
+	vector<ListingRecord> records = rom.GetListing();
+	stable_sort(records.begin(), records.end(), [](const ListingRecord& a, const ListingRecord& b) { return a.address < b.address; });
+
+	// Only the file name is shown, not the whole path
+	vector<string> files;
+	for (const string& path : rom.GetSourceFiles())
+	{
+		size_t slash = path.find_last_of("/\\");
+		files.push_back(slash == string::npos ? path : path.substr(slash + 1));
+	}
+
+	// Records of the same line under the same label (e.g. a line that is part of a .rept block) share a row
+	map<tuple<int, int, string>, int> seen;
+
+	for (const ListingRecord& record : records)
+	{
+		if (record.length <= 0 || record.bank != 0)
+			continue;
+
+		string label = FindLabel(record.address);
+		auto key = make_tuple(record.fileId, record.line, label);
+		auto found = seen.find(key);
+		int l = found != seen.end() ? found->second : (int)_lines.size();
+
+		if (found == seen.end())
+		{
+			_lines.push_back({ files[record.fileId], record.line + 1, label, record.address, 0, 0, 0 });
+			seen[key] = l;
+		}
+
+		if (_lineAt.size() < record.address + record.length)
+			_lineAt.resize(record.address + record.length, -1);
+
+		for (int a = record.address; a < record.address + record.length; a++)
+			_lineAt[a] = l;
+	}
+
+	_unknownLine = _lines.size();
+	_lines.push_back({ "(no source)", 0, "", -1, 0, 0, 0 });
+}
+
+// The label an address is under: the last one defined at or before it
+string Profiler::FindLabel(int address)
+{
+	auto after = upper_bound(_labels.begin(), _labels.end(), address, [](int a, const ListingLabel& label) { return a < label.address; });
+	return after == _labels.begin() ? "" : (after - 1)->name;
+}
+
+// Adds the counters of a run (as returned by Simulator::GetProfile()) to the lines they belong to
+void Profiler::Collect(const vector<unsigned long long>& counters)
+{
+	int numAddresses = counters.size() / Simulator::PROFILE_COUNTERS;
+
+	for (int a = 0; a < numAddresses; a++)
+	{
+		const unsigned long long* c = &counters[a * Simulator::PROFILE_COUNTERS];
+		if (c[Simulator::PROFILE_EXECUTIONS] == 0)
+			continue;
+
+		ProfileLine& line = _lines[a < _lineAt.size() && _lineAt[a] >= 0 ? _lineAt[a] : _unknownLine];
+		line.executions += c[Simulator::PROFILE_EXECUTIONS];
+		line.cycles += c[Simulator::PROFILE_CYCLES];
+		line.taken += c[Simulator::PROFILE_TAKEN];
+		_totalCycles += c[Simulator::PROFILE_CYCLES];
+	}
+}
+
+// The lines that took the most cycles, most first (all of them if maxRows is 0)
+void Profiler::WriteHotSpots(FILE* out, int maxRows)
+{
+	vector<int> order;
+	for (int l = 0; l < _lines.size(); l++)
+	{
+		if (_lines[l].cycles > 0)
+			order.push_back(l);
+	}
+
+	stable_sort(order.begin(), order.end(), [this](int a, int b) { return _lines[a].cycles > _lines[b].cycles; });
+	if (maxRows > 0 && order.size() > maxRows)
+		order.resize(maxRows);
+
+	fprintf(out, "%14s  %6s  %12s  %12s  %-7s  %-20s  %s\n", "Cycles", "%", "Executions", "Taken", "Address", "Line", "Label");
+
+	for (int l : order)
+	{
+		const ProfileLine& line = _lines[l];
+
+		// Addresses without a listing record are all counted in the last line
+		char address[16] = "-";
+		char location[64];
+		snprintf(location, sizeof(location), "%s", line.file.c_str());
+
+		if (line.address >= 0)
+		{
+			snprintf(address, sizeof(address), "$%04X", line.address);
+			snprintf(location, sizeof(location), "%s:%d", line.file.c_str(), line.line);
+		}
+
+		fprintf(out, "%14llu  %5.1f%%  %12llu  %12llu  %-7s  %-20s  %s\n", line.cycles, 100.0 * line.cycles / max(_totalCycles, 1ULL), line.executions,
+			line.taken, address, location, line.label.c_str());
+	}
+}
+
+// One line per source line in the folded stack format of flame graph tools: "root;file;label;file:line cycles". The label
+// stands in for the function, since the programs don't have calls to build real stacks from.
+void Profiler::WriteFolded(FILE* out, const string& root)
+{
+	for (const ProfileLine& line : _lines)
+	{
+		if (line.cycles == 0)
+			continue;
+
+		string stack = root.empty() ? "" : root + ";";
+		stack += line.file + ";" + (line.label.empty() ? "(no label)" : line.label);
+		if (line.address >= 0)
+			stack += ";" + line.file + ":" + to_string(line.line);
+
+		// Stack frames are separated by semicolons and the count by the last space
+		replace(stack.begin(), stack.end(), ' ', '_');
+		fprintf(out, "%s %llu\n", stack.c_str(), line.cycles);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "ROMData.h"
+
+using namespace std;
+
+// The counts of one source line (every listing record of the same line and label is added together)
+struct ProfileLine
+{
+	string file;
+	int line;
+	string label;
+	int address;
+	unsigned long long executions;
+	unsigned long long cycles;
+	unsigned long long taken;
+};
+
+// Maps the simulator's per-address counters back to source lines and labels, using the listing records and labels of the
+// assembled program. It keeps its own copy of them, so it can outlive the parser.
+class Profiler
+{
+public:
+	Profiler(ROMData& rom);
+
+	void Collect(const vector<unsigned long long>& counters);
+	unsigned long long GetTotalCycles() { return _totalCycles; }
+	void WriteHotSpots(FILE* out, int maxRows);
+	void WriteFolded(FILE* out, const string& root);
+
+private:
+	string FindLabel(int address);
+
+	vector<ProfileLine> _lines;		// in address order, with the addresses without a listing record last
+	vector<int> _lineAt;			// line of each address (-1 if none)
+	vector<ListingLabel> _labels;	// sorted by address
+	int _unknownLine;
+	unsigned long long _totalCycles;
+};
\ No newline at end of file
@@ -1,25 +1,248 @@
 #include "ROMData.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <climits>
 
 ROMData::ROMData()
 {
+	_bitWidth = 8;
+	_romSize = 32768;
 	_currAddress = 0;
 	_startAddress = 0;
 	_endAddress = 0;
-	_addresses.clear();
-	_values.clear();
-	_patterns.clear();
+	_bank = 0;
+	_pages.clear();
+	_pageAt.clear();
+	_lastKey = 0;
+	_lastPage = -1;
+	_windows.clear();
+	_bytesWritten = 0;
+	_sourceFiles.clear();
+	_listing.clear();
+	_labels.clear();
+	_pendingRecord = ListingRecord();
+	_recordPending = false;
+	_showCycles = false;
 }
 
-void ROMData::AddEntry(int address, int value)
+void ROMData::AddEntry(long long address, int value)
 {
-	_addresses.push_back(address);
-	_values.push_back(value);
+	ROMPage& page = GetPage(address);
+	int offset = (int)(address & (ROM_PAGE_SIZE - 1));
+
+	_bytesWritten += !page.written[offset];
+	page.bytes[offset] = (unsigned char)value;
+	page.written[offset] = 1;
 }
 
 void ROMData::AddEntryToCurrentAddress(int value)
 {
-	_addresses.push_back(_currAddress);
-	_values.push_back(value);
+	MarkListingStart();
+	AddEntry(GetImageAddress(), value);
+}
+
+void ROMData::WriteSpan(const unsigned char* data, int length)
+{
+	if (length <= 0)
+		return;
+
+	MarkListingStart();
+	Store(data, 0, length);
+}
+
+void ROMData::FillSpan(unsigned char value, int length)
+{
+	if (length <= 0)
+		return;
+
+	MarkListingStart();
+	Store(NULL, value, length);
+}
+
+// Copies data (or fills with value when data is NULL) to the current address, one page at a time
+void ROMData::Store(const unsigned char* data, unsigned char value, int length)
+{
+	long long address = GetImageAddress();
+	_currAddress += length;
+
+	while (length > 0)
+	{
+		ROMPage& page = GetPage(address);
+		int offset = (int)(address & (ROM_PAGE_SIZE - 1));
+		int chunk = min(length, ROM_PAGE_SIZE - offset);
+
+		for (int i = 0; i < chunk; i++)
+			_bytesWritten += !page.written[offset + i];
+
+		if (data != NULL)
+		{
+			memcpy(page.bytes + offset, data, chunk);
+			data += chunk;
+		}
+		else
+			memset(page.bytes + offset, value, chunk);
+
+		memset(page.written + offset, 1, chunk);
+		address += chunk;
+		length -= chunk;
+	}
+}
+
+// The page that holds a block of image addresses, or -1 if nothing was written to it yet
+int ROMData::FindPage(long long key)
+{
+	if (_lastPage >= 0 && key == _lastKey)
+		return _lastPage;
+
+	auto found = _pageAt.find(key);
+	if (found == _pageAt.end())
+		return -1;
+
+	_lastKey = key;
+	_lastPage = found->second;
+	return _lastPage;
+}
+
+// The page that holds an image address, allocated (cleared) the first time. The reference is only good until the next
+// page is allocated.
+ROMPage& ROMData::GetPage(long long address)
+{
+	long long key = address >> ROM_PAGE_BITS;
+	int page = FindPage(key);
+
+	if (page < 0)
+	{
+		page = _pages.size();
+		_pages.emplace_back();
+		memset(&_pages[page], 0, sizeof(ROMPage));
+		_pageAt[key] = page;
+		_lastKey = key;
+		_lastPage = page;
+	}
+
+	return _pages[page];
+}
+
+// Copies bytes out of the image...the ones that were never written read as 0
+void ROMData::ReadImage(long long address, unsigned char* data, int length)
+{
+	while (length > 0)
+	{
+		int page = FindPage(address >> ROM_PAGE_BITS);
+		int offset = (int)(address & (ROM_PAGE_SIZE - 1));
+		int chunk = min(length, ROM_PAGE_SIZE - offset);
+
+		if (page >= 0)
+			memcpy(data, _pages[page].bytes + offset, chunk);
+		else
+			memset(data, 0, chunk);
+
+		data += chunk;
+		address += chunk;
+		length -= chunk;
+	}
+}
+
+bool ROMData::IsWritten(long long address)
+{
+	int page = FindPage(address >> ROM_PAGE_BITS);
+	return page >= 0 && _pages[page].written[address & (ROM_PAGE_SIZE - 1)];
+}
+
+// The lowest and highest CPU address written in a bank. Returns false if nothing was.
+bool ROMData::GetBankRange(int bank, int* first, int* last)
+{
+	long long low = LLONG_MAX;
+	long long high = LLONG_MIN;
+
+	for (const pair<const long long, int>& page : _pageAt)
+	{
+		long long start = page.first << ROM_PAGE_BITS;
+		if (BankOf(start) != bank)
+			continue;
+
+		const ROMPage& p = _pages[page.second];
+		for (int i = 0; i < ROM_PAGE_SIZE; i++)
+		{
+			if (p.written[i])
+			{
+				low = min(low, start + i);
+				high = max(high, start + i);
+			}
+		}
+	}
+
+	if (low > high)
+		return false;
+
+	*first = (int)(low - ImageAddress(bank, 0));
+	*last = (int)(high - ImageAddress(bank, 0));
+	return true;
+}
+
+// The runs of written bytes in a bank, in order, as CPU addresses of their first byte and one past their last
+void ROMData::GetUsedRanges(int bank, vector<pair<int, int>>& ranges)
+{
+	vector<long long> keys;
+	for (const pair<const long long, int>& page : _pageAt)
+	{
+		if (BankOf(page.first << ROM_PAGE_BITS) == bank)
+			keys.push_back(page.first);
+	}
+
+	sort(keys.begin(), keys.end());
+	ranges.clear();
+
+	for (long long key : keys)
+	{
+		const ROMPage& page = _pages[_pageAt[key]];
+		int start = (int)((key << ROM_PAGE_BITS) - ImageAddress(bank, 0));
+
+		for (int i = 0; i < ROM_PAGE_SIZE; i++)
+		{
+			if (!page.written[i])
+				continue;
+
+			if (!ranges.empty() && ranges.back().second == start + i)
+				ranges.back().second++;
+			else
+				ranges.push_back({ start + i, start + i + 1 });
+		}
+	}
+}
+
+// Every bank something was written to, in order
+void ROMData::GetBanks(vector<int>& banks)
+{
+	banks.clear();
+	for (const pair<const long long, int>& page : _pageAt)
+		banks.push_back(BankOf(page.first << ROM_PAGE_BITS));
+
+	sort(banks.begin(), banks.end());
+	banks.erase(unique(banks.begin(), banks.end()), banks.end());
+}
+
+// A bank as the CPU sees it, from address 0 up to the last byte written to it
+void ROMData::GetBankImage(int bank, vector<unsigned char>& image)
+{
+	int first = 0;
+	int last = -1;
+
+	image.clear();
+	if (!GetBankRange(bank, &first, &last) || last < 0)
+		return;
+
+	image.resize(last + 1);
+	ReadImage(ImageAddress(bank, 0), &image[0], last + 1);
+}
+
+void ROMData::MarkListingStart()
+{
+	if (_recordPending && _pendingRecord.address == -1)
+	{
+		_pendingRecord.address = _currAddress;
+		_pendingRecord.bank = _bank;
+	}
 }
 
 void ROMData::SetArchitecture(const string& arch)
@@ -42,9 +265,192 @@ void ROMData::SetEndAddress(int a)
 	_endAddress = a;
 }
 
-void ROMData::SetPattern(const string& p)
+int ROMData::AddSourceFile(const string& filename)
+{
+	for (int i = 0; i < _sourceFiles.size(); i++)
+	{
+		if (_sourceFiles[i] == filename)
+			return i;
+	}
+
+	_sourceFiles.push_back(filename);
+	return _sourceFiles.size() - 1;
+}
+
+void ROMData::BeginListingRecord(int fileId, int line, int colStart, int colEnd)
+{
+	// The address is filled in later...lines that never emit a byte (labels, symbols, directives) don't get a record
+	_pendingRecord.address = -1;
+	_pendingRecord.bank = 0;
+	_pendingRecord.length = 0;
+	_pendingRecord.fileId = fileId;
+	_pendingRecord.line = line;
+	_pendingRecord.colStart = colStart;
+	_pendingRecord.colEnd = colEnd;
+	_pendingRecord.instructions = 0;
+	_pendingRecord.minCycles = 0;
+	_pendingRecord.maxCycles = 0;
+	_pendingRecord.endsBlock = false;
+	_recordPending = true;
+}
+
+// Adds an instruction's timing to the current line (a macro call can emit several instructions on one line)
+void ROMData::AddListingCycles(int minCycles, int maxCycles, bool endsBlock)
+{
+	if (!_recordPending)
+		return;
+
+	_pendingRecord.instructions++;
+	_pendingRecord.minCycles += minCycles;
+	_pendingRecord.maxCycles += maxCycles;
+	_pendingRecord.endsBlock = endsBlock;
+}
+
+// The first label address after the given one (INT_MAX if there isn't one). Labels must be sorted by address.
+int ROMData::NextLabelAddress(const vector<ListingLabel>& sorted, int address)
+{
+	auto next = upper_bound(sorted.begin(), sorted.end(), address, [](int a, const ListingLabel& label) { return a < label.address; });
+	return next == sorted.end() ? INT_MAX : next->address;
+}
+
+// The labels of one bank, sorted by address
+void ROMData::GetBankLabels(int bank, vector<ListingLabel>& sorted)
+{
+	sorted.clear();
+	for (const ListingLabel& label : _labels)
+	{
+		if (label.bank == bank)
+			sorted.push_back(label);
+	}
+
+	stable_sort(sorted.begin(), sorted.end(), [](const ListingLabel& a, const ListingLabel& b) { return a.address < b.address; });
+}
+
+// Cycles of one pass through the code from an address up to the next label (the label's region). Returns false if no
+// instruction lies in it.
+bool ROMData::GetRegionCycles(int bank, int address, int* minCycles, int* maxCycles)
+{
+	vector<ListingLabel> sorted;
+	GetBankLabels(bank, sorted);
+	int end = NextLabelAddress(sorted, address);
+
+	int instructions = 0;
+	*minCycles = 0;
+	*maxCycles = 0;
+
+	for (const ListingRecord& record : _listing)
+	{
+		if (record.bank == bank && record.address >= address && record.address < end)
+		{
+			instructions += record.instructions;
+			*minCycles += record.minCycles;
+			*maxCycles += record.maxCycles;
+		}
+	}
+
+	return instructions > 0;
+}
+
+// For the language server: record r grows (or shrinks) by delta bytes, so whatever follows it up to record end moves along,
+// bytes and all, as do the labels from firstLabel up to endLabel that point past it. They must all be in the record's bank.
+// The bytes the record no longer holds are no longer written; the ones it gets are written by ReplaceRecord().
+void ROMData::ResizeRecord(int r, int end, int firstLabel, int endLabel, int delta)
+{
+	ListingRecord& record = _listing[r];
+	int from = record.address + record.length;
+	int to = end > r + 1 ? _listing[end - 1].address + _listing[end - 1].length : from;
+
+	vector<unsigned char> bytes(to - from);
+	vector<unsigned char> written(to - from);
+
+	for (int i = 0; i < bytes.size(); i++)
+	{
+		long long address = ImageAddress(record.bank, from + i);
+		int page = FindPage(address >> ROM_PAGE_BITS);
+		int offset = (int)(address & (ROM_PAGE_SIZE - 1));
+
+		if (page >= 0 && _pages[page].written[offset])
+		{
+			bytes[i] = _pages[page].bytes[offset];
+			written[i] = 1;
+			_pages[page].written[offset] = 0;
+			_bytesWritten--;
+		}
+	}
+
+	for (int a = from + delta; a < from; a++)
+	{
+		long long address = ImageAddress(record.bank, a);
+		int page = FindPage(address >> ROM_PAGE_BITS);
+		int offset = (int)(address & (ROM_PAGE_SIZE - 1));
+
+		if (page >= 0 && _pages[page].written[offset])
+		{
+			_pages[page].written[offset] = 0;
+			_bytesWritten--;
+		}
+	}
+
+	for (int i = 0; i < bytes.size(); i++)
+	{
+		if (!written[i])
+			continue;
+
+		ROMPage& page = GetPage(ImageAddress(record.bank, from + delta + i));
+		int offset = (from + delta + i) & (ROM_PAGE_SIZE - 1);
+
+		page.bytes[offset] = bytes[i];
+		_bytesWritten += !page.written[offset];
+		page.written[offset] = 1;
+	}
+
+	record.length += delta;
+	for (int k = r + 1; k < end; k++)
+		_listing[k].address += delta;
+
+	for (int l = firstLabel; l < endLabel; l++)
+	{
+		if (_labels[l].bank == record.bank && _labels[l].address > record.address)
+			_labels[l].address += delta;
+	}
+}
+
+// For the language server: the pending record is the line of record r assembled again, so it takes over the record's columns
+// and timing, and bytes (an instruction's, which haven't been written yet) go where the record is
+void ROMData::ReplaceRecord(int r, const vector<unsigned char>& bytes)
 {
-	_patterns.push_back(p);
+	ListingRecord& record = _listing[r];
+	record.colStart = _pendingRecord.colStart;
+	record.colEnd = _pendingRecord.colEnd;
+	record.instructions = _pendingRecord.instructions;
+	record.minCycles = _pendingRecord.minCycles;
+	record.maxCycles = _pendingRecord.maxCycles;
+	record.endsBlock = _pendingRecord.endsBlock;
+	_recordPending = false;
+
+	if (!bytes.empty())
+	{
+		int bank = _bank;
+		int address = _currAddress;
+
+		_bank = record.bank;
+		_currAddress = record.address;
+		Store(bytes.data(), 0, bytes.size());
+
+		_bank = bank;
+		_currAddress = address;
+	}
+}
+
+void ROMData::EndListingRecord()
+{
+	if (_recordPending && _pendingRecord.address != -1)
+	{
+		_pendingRecord.length = _currAddress - _pendingRecord.address;
+		_listing.push_back(_pendingRecord);
+	}
+
+	_recordPending = false;
 }
 
 void ROMData::PrintTable()
@@ -73,7 +479,7 @@ void ROMData::PrintTable()
 		}
 
 		int v = -1;
-		if (i < _addresses.size() && i < _values.size() && GetValueAtAddress(i, &v))
+		if (GetValueAtAddress(i, &v))
 		{
 			printf(" %02x", v);
 			lastVal = v;	
@@ -105,86 +511,309 @@ void ROMData::PrintTable()
 
 void ROMData::PrintList() 
 {
-	printf("\nArchitecture: %s\n\n", _architecture.c_str());
+	WriteList(stdout);
+}
 
-	printf("Start Address: %04X\n", _startAddress);
-	printf("End Address:   %04X\n", _endAddress);
+void ROMData::WriteListing(const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+	{
+		printf("!!! CRITICAL ERROR: Cannot open file %s for writing the listing !!!\n", filename);
+		return;
+	}
 
-	printf("\n=========================\n");
-	printf("     PROGRAM LISTING\n");
-	printf("=========================\n");
+	WriteList(file);
+	fclose(file);
+}
 
-	int lastVal = -1;
-	int ellipsisPrinted = false;
-	for (int i = _startAddress; i <= _endAddress; i++)
+// A cycle count as shown in the listing: "n", or "min-max" when it depends on jumps
+static string CycleText(int minCycles, int maxCycles)
+{
+	return minCycles == maxCycles ? to_string(minCycles) : to_string(minCycles) + "-" + to_string(maxCycles);
+}
+
+void ROMData::WriteList(FILE* out)
+{
+	fprintf(out, "\nArchitecture: %s\n\n", _architecture.c_str());
+
+	fprintf(out, "Start Address: %04X\n", _startAddress);
+	fprintf(out, "End Address:   %04X\n", _endAddress);
+
+	fprintf(out, "\n=========================\n");
+	fprintf(out, "     PROGRAM LISTING\n");
+	fprintf(out, "=========================\n");
+
+	// Records are stored in the order they were emitted, but .org can move the address backwards, so sort them
+	vector<int> order(_listing.size());
+	for (int i = 0; i < order.size(); i++)
+		order[i] = i;
+	stable_sort(order.begin(), order.end(), [this](int a, int b)
+	{
+		const ListingRecord& x = _listing[a];
+		const ListingRecord& y = _listing[b];
+		return x.bank != y.bank ? x.bank < y.bank : x.address < y.address;
+	});
+
+	// Source files are only mapped (and their line offsets only computed) the first time a record needs them
+	MappedFile* sources = new MappedFile[_sourceFiles.size()];
+	vector<vector<int>> lineStarts(_sourceFiles.size());
+
+	// With cycle counts, each line shows its own cycles and the total since the last label. Straight-line blocks (which end
+	// at a jump or a label) and label regions get a summary line when they end.
+	vector<ListingLabel> labels;
+	GetBankLabels(0, labels);
+
+	string regionName;
+	int regionEnd = INT_MIN;
+	int regionInstructions = 0;
+	int regionMin = 0;
+	int regionMax = 0;
+	int blockStart = -1;
+	int blockEnd = 0;
+	int blockMin = 0;
+	int blockMax = 0;
+
+	auto endBlock = [&]()
 	{
-		int addressCalc = i;
+		if (blockStart >= 0)
+			fprintf(out, "      ; block $%04X-$%04X: %s cycles\n", blockStart, blockEnd - 1, CycleText(blockMin, blockMax).c_str());
+		blockStart = -1;
+	};
 
-		int v = -1;
-		if (i < _addresses.size() && i < _values.size() && GetValueAtAddress(addressCalc, &v))
+	auto endRegion = [&]()
+	{
+		endBlock();
+		if (regionInstructions > 0 && !regionName.empty())
+			fprintf(out, "      ; [%s]: %s cycles\n", regionName.c_str(), CycleText(regionMin, regionMax).c_str());
+		regionInstructions = regionMin = regionMax = 0;
+	};
+
+	int lastEnd = -1;
+	int lastBank = 0;
+	for (int n = 0; n < order.size(); n++)
+	{
+		const ListingRecord& r = _listing[order[n]];
+
+		// Each bank after the first starts over at its own base address, with its own labels
+		if (r.bank != lastBank)
+		{
+			if (_showCycles)
+				endRegion();
+
+			fprintf(out, "  --- bank %d ---\n", r.bank);
+			GetBankLabels(r.bank, labels);
+			lastBank = r.bank;
+			lastEnd = -1;
+			regionEnd = INT_MIN;
+		}
+
+		if (_showCycles && r.address >= regionEnd)
+		{
+			endRegion();
+
+			auto label = upper_bound(labels.begin(), labels.end(), r.address, [](int a, const ListingLabel& l) { return a < l.address; });
+			regionName = label == labels.begin() ? "" : (label - 1)->name;
+			regionEnd = NextLabelAddress(labels, r.address);
+		}
+
+		if (lastEnd != -1 && r.address > lastEnd)
+			fprintf(out, "  ...\n");
+		lastEnd = r.address + r.length;
+
+		// At most four bytes are shown per line...data directives can be much longer than that
+		char bytes[16] = "";
+		int shown = r.length < 4 ? r.length : 4;
+		for (int b = 0; b < shown; b++)
+		{
+			int v = 0;
+			GetValueAtAddress(ImageAddress(r.bank, r.address + b), &v);
+			sprintf(bytes + b * 3, "%02x ", v & 0xFF);
+		}
+
+		const char* text = "";
+		int textLen = 0;
+		MappedFile& src = sources[r.fileId];
+		if (!src.IsOpen() && lineStarts[r.fileId].empty())
+		{
+			src.Open(_sourceFiles[r.fileId].c_str());
+			lineStarts[r.fileId].push_back(0);
+			for (size_t c = 0; c < src.Size(); c++)
+			{
+				if (src.Data()[c] == '\n')
+					lineStarts[r.fileId].push_back(c + 1);
+			}
+		}
+
+		if (src.Data() != NULL && r.line < lineStarts[r.fileId].size())
 		{
-			printf("%04x: %02x   (%s)\n", addressCalc, v, _patterns[i].c_str());
-			lastVal = v;
+			size_t offset = lineStarts[r.fileId][r.line] + r.colStart;
+			if (offset + (r.colEnd - r.colStart) <= src.Size())
+			{
+				text = (const char*)src.Data() + offset;
+				textLen = r.colEnd - r.colStart;
+			}
 		}
+
+		// Only the file name is printed, not the whole path
+		const string& path = _sourceFiles[r.fileId];
+		size_t slash = path.find_last_of("/\\");
+		const char* name = path.c_str() + (slash == string::npos ? 0 : slash + 1);
+
+		char location[64];
+		snprintf(location, sizeof(location), "%s:%d", name, r.line + 1);
+
+		if (!_showCycles)
+		{
+			fprintf(out, "%04x: %-12s%s %-20s %.*s\n", r.address, bytes, r.length > 4 ? "..." : "   ", location, textLen, text);
+			continue;
+		}
+
+		string cycles;
+		string total;
+
+		if (r.instructions == 0)
+			endBlock();
 		else
 		{
-			if (lastVal != 0)
-				printf("%04x: %02x   (empty)\n", addressCalc, 0);
-			else if (lastVal == 0 && i == _endAddress)
-				printf("%04x: %02x   (empty)\n", addressCalc, 0);
-			else if (!ellipsisPrinted)
+			regionInstructions += r.instructions;
+			regionMin += r.minCycles;
+			regionMax += r.maxCycles;
+
+			if (blockStart < 0)
 			{
-				printf("  ...\n");
-				ellipsisPrinted = true;
-			}				
+				blockStart = r.address;
+				blockMin = blockMax = 0;
+			}
 
-			lastVal = 0;
+			blockEnd = r.address + r.length;
+			blockMin += r.minCycles;
+			blockMax += r.maxCycles;
+
+			cycles = CycleText(r.minCycles, r.maxCycles);
+			total = CycleText(regionMin, regionMax);
 		}
+
+		fprintf(out, "%04x: %-12s%s %-7s %-9s %-20s %.*s\n", r.address, bytes, r.length > 4 ? "..." : "   ", cycles.c_str(), total.c_str(), location, textLen, text);
+
+		if (r.endsBlock)
+			endBlock();
 	}
 
-	printf("=========================\n");
-	printf("\n");
+	if (_showCycles)
+		endRegion();
+
+	delete[] sources;
+
+	fprintf(out, "=========================\n");
+	fprintf(out, "\n");
 }
 
-bool ROMData::GetValueAtAddress(int a, int* v)
+bool ROMData::GetValueAtAddress(long long a, int* v)
 {
-	for (int i = 0; i < _addresses.size(); i++)
-	{
-		if (a == _addresses[i])
-		{
-			*v = _values[i];
-			return true;
-		}
-	}
+	int page = FindPage(a >> ROM_PAGE_BITS);
+	int offset = (int)(a & (ROM_PAGE_SIZE - 1));
 
-	return false;
+	if (page < 0 || !_pages[page].written[offset])
+		return false;
+
+	*v = _pages[page].bytes[offset];
+	return true;
 }
 
+// Bank 0 goes to the file itself, padded to size, and every other bank to a file of its own next to it (name.bank1.bin,
+// ...) that starts at the bank's base address. The pages are visited once in address order, so each file is written
+// straight from the pages without putting the bank together in memory first.
 void ROMData::WriteProgram(const char* filename, const unsigned int size)
 {
-	// Create the binary file
-	FILE *file = fopen(filename, "wb");
-	if (!file)
+	vector<long long> keys;
+	for (const pair<const long long, int>& page : _pageAt)
+		keys.push_back(page.first);
+	sort(keys.begin(), keys.end());
+
+	vector<int> banks;
+	GetBanks(banks);
+	if (banks.empty() || banks[0] != 0)
+		banks.insert(banks.begin(), 0);
+
+	string name = filename;
+	size_t dot = name.find_last_of('.');
+	size_t slash = name.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = name.size();
+
+	for (int bank : banks)
 	{
-		printf("!!! CRITICAL ERROR: Cannot open file %s for writing to ROM !!!\n", filename);
-		return;
+		BankWindow window = { 0, bank == 0 ? (int)size : 0 };
+		auto found = _windows.find(bank);
+		if (found != _windows.end())
+			window = { found->second.base, bank == 0 ? max((int)size, found->second.size) : found->second.size };
+
+		string bankFile = bank == 0 ? name : name.substr(0, dot) + ".bank" + to_string(bank) + name.substr(dot);
+		if (bank != 0)
+			printf("Writing bank %d to %s\n", bank, bankFile.c_str());
+
+		// Create the binary file
+		FILE* file = fopen(bankFile.c_str(), "wb");
+		if (!file)
+		{
+			printf("!!! CRITICAL ERROR: Cannot open file %s for writing to ROM !!!\n", bankFile.c_str());
+			return;
+		}
+
+		// Write data to binary file (will be written to ROM via TL86II Plus Programmer)
+		WriteBank(file, bank, window.base, window.size, keys);
+		fclose(file);
 	}
+}
 
-	// unsigned char bc its size is 1 byte = 8 bits
-	unsigned char* romData = new unsigned char[size];  // 32768 = 32 KBytes = 256 KBits
-	memset(romData, 0x00, size);  // Set 32768 bytes to 0x00
+// Writes the pages of one bank from its base address on, with zeros in the gaps between them, then pads the file to size
+void ROMData::WriteBank(FILE* file, int bank, int base, long long size, const vector<long long>& keys)
+{
+	static const unsigned char zeros[ROM_PAGE_SIZE] = { 0 };
+
+	int first = 0;
+	int last = -1;
+	GetBankRange(bank, &first, &last);
 
-	// copy from _values to romData
-	for (int i = 0; i < _values.size(); i++)
+	long long end = max(size, (long long)last + 1 - base);
+	long long written = 0;
+
+	auto pad = [&](long long to)
+	{
+		while (written < to)
+		{
+			long long chunk = min((long long)ROM_PAGE_SIZE, to - written);
+			fwrite(zeros, 1, (size_t)chunk, file);
+			written += chunk;
+		}
+	};
+
+	auto page = lower_bound(keys.begin(), keys.end(), ImageAddress(bank, base) >> ROM_PAGE_BITS);
+	for (; page != keys.end() && BankOf(*page << ROM_PAGE_BITS) == bank; page++)
 	{
-		romData[i] = (unsigned char)_values[i];
+		// Offset in the file of the first byte of the page, which can lie before the base when the base isn't page aligned
+		long long offset = (*page << ROM_PAGE_BITS) - ImageAddress(bank, base);
+		long long from = max(offset, written);
+		long long to = min(offset + ROM_PAGE_SIZE, end);
+		if (from >= to)
+			continue;
+
+		pad(from);
+		fwrite(_pages[_pageAt[*page]].bytes + (from - offset), 1, (size_t)(to - from), file);
+		written = to;
 	}
 
-	// Write data to binary file (will be written to ROM via TL86II Plus Programmer)
-	fwrite(romData, 1, 32768, file);
-	fclose(file);
+	pad(end);
+}
 
-	delete [] romData;
+// Writes one word of a control ROM, least significant byte first when the ROM is wider than 8 bits
+void ROMData::AddWord(int address, unsigned long long value)
+{
+	int bytes = (_bitWidth + 7) / 8;
+
+	for (int b = 0; b < bytes; b++)
+		AddEntry(address * bytes + b, (int)((value >> (8 * b)) & 0xFF));
 }
 
 void ROMData::SetBitWidth(int bw)
@@ -214,22 +843,22 @@ void ROMData::WriteControlROM()
 	FILE* file = fopen(fullFile.c_str(), "wb");
 	if (!file)
 	{
-		printf("!!! CRITICAL ERROR: Cannot open file %s for writing to Control ROM !!!\n", fullFile);
+		printf("!!! CRITICAL ERROR: Cannot open file %s for writing to Control ROM !!!\n", fullFile.c_str());
 		return;
 	}
 
+	// ROMs wider than 8 bits take several bytes per address
+	size_t size = (size_t)_romSize * ((_bitWidth + 7) / 8);
+
 	// unsigned char bc its size is 1 byte = 8 bits
-	unsigned char* romData = new unsigned char[_romSize];  // 32768 = 32 KBytes = 256 KBits
-	memset(romData, 0x00, _romSize);  // Set 32768 bytes to 0x00
+	unsigned char* romData = new unsigned char[size];  // 32768 = 32 KBytes = 256 KBits
+	memset(romData, 0x00, size);  // Set 32768 bytes to 0x00
 	
-	// copy from _values to romData
-	for (int i = 0; i < _values.size(); i++)
-	{
-		romData[i] = (unsigned char)_values[i];
-	}
+	// copy from the image to romData
+	ReadImage(0, romData, (int)size);
 
 	// Write data to binary file (will be written to ROM via TL86II Plus Programmer)
-	fwrite(romData, 1, 32768, file);
+	fwrite(romData, 1, size, file);
 	fclose(file);
 
 	delete[] romData;
@@ -1,40 +1,143 @@
+#pragma once
+#include <cstdio>
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 using namespace std;
 
+// One listing record per source line that emitted bytes. The source text itself is not copied...the record just
+// points back into the original file so the listing can be rebuilt on demand.
+struct ListingRecord
+{
+	int address;
+	int bank;
+	int length;
+	int fileId;
+	int line;
+	int colStart;
+	int colEnd;
+	int instructions;
+	int minCycles;
+	int maxCycles;
+	bool endsBlock;		// the last instruction can jump (or halt), so the straight-line code stops here
+};
+
+// A label and the address it was defined at, kept with the listing so addresses can be named in reports
+struct ListingLabel
+{
+	string name;
+	int address;
+	int bank;
+	int fileId;		// line it was defined on
+	int line;
+};
+
+// A bank's window in the CPU's address space: where its file starts, and how big it is (0 if it isn't fixed)
+struct BankWindow
+{
+	int base;
+	int size;
+};
+
+// The image is kept in pages that are only allocated once something is written to them, so a program can put bytes far
+// apart (or in many banks) without paying for the memory in between
+constexpr int ROM_PAGE_BITS = 12;
+constexpr int ROM_PAGE_SIZE = 1 << ROM_PAGE_BITS;
+
+struct ROMPage
+{
+	unsigned char bytes[ROM_PAGE_SIZE];
+	unsigned char written[ROM_PAGE_SIZE];
+};
+
+// Addresses of the image have the bank number above the CPU address, so bank 0's image addresses are its CPU addresses
+// and a program that doesn't use banks never sees the difference
 class ROMData
 {
 public:
 	ROMData();
 
-	void AddEntry(int address, int value);
+	static long long ImageAddress(int bank, int address) { return (long long)bank * (1LL << 32) + (unsigned int)address; }
+	static int BankOf(long long address) { return (int)(address >> 32); }
+
+	void AddEntry(long long address, int value);
 	void AddEntryToCurrentAddress(int value);
+	void WriteSpan(const unsigned char* data, int length);
+	void FillSpan(unsigned char value, int length);
 	void SetArchitecture(const string& arch);
 	void SetStartAddress(int a);
 	void SetCurrentAddress(int a);
 	void IncrementCurrentAddress(int n) { _currAddress += n; }
 	void SetEndAddress(int a);
 	int GetCurrentAddress() { return _currAddress; }
-	bool GetValueAtAddress(int a, int *v);
-	void SetPattern(const string& p);
+	int GetStartAddress() { return _startAddress; }
+	int GetEndAddress() { return _endAddress; }
+	void SetBank(int bank) { _bank = bank; }
+	int GetBank() { return _bank; }
+	long long GetImageAddress() { return ImageAddress(_bank, _currAddress); }
+	void SetBankWindow(int bank, int base, int size) { _windows[bank] = { base, size }; }
+	bool GetBankRange(int bank, int* first, int* last);
+	void GetUsedRanges(int bank, vector<pair<int, int>>& ranges);
+	void GetBanks(vector<int>& banks);
+	void GetBankImage(int bank, vector<unsigned char>& image);
+	void ReadImage(long long address, unsigned char* data, int length);
+	bool IsWritten(long long address);
+	bool GetValueAtAddress(long long a, int *v);
+	int AddSourceFile(const string& filename);
+	void BeginListingRecord(int fileId, int line, int colStart, int colEnd);
+	void EndListingRecord();
+	void AddLabel(const string& name, int address) { _labels.push_back({ name, address, _bank, _pendingRecord.fileId, _pendingRecord.line }); }
+	void AddListingCycles(int minCycles, int maxCycles, bool endsBlock);
+	void ResizeRecord(int r, int end, int firstLabel, int endLabel, int delta);
+	void ReplaceRecord(int r, const vector<unsigned char>& bytes);
+	void SetShowCycles(bool show) { _showCycles = show; }
+	bool GetRegionCycles(int bank, int address, int* minCycles, int* maxCycles);
+	const ListingRecord& GetPendingRecord() { return _pendingRecord; }
+	const vector<ListingRecord>& GetListing() { return _listing; }
+	const vector<ListingLabel>& GetLabels() { return _labels; }
+	const vector<string>& GetSourceFiles() { return _sourceFiles; }
 	void PrintList();
+	void WriteListing(const char* filename);
 	void PrintTable();
 	void WriteProgram(const char* filename, const unsigned int size);
 	void WriteControlROM();
 	void SetBitWidth(int bw);
 	void SetROMsize(int s);
 	void SetROMname(string n);
+	int GetBitWidth() { return _bitWidth; }
+	int GetROMsize() { return _romSize; }
+	const string& GetROMname() { return _romName; }
+	void AddWord(int address, unsigned long long value);
 
 private:
+	void WriteList(FILE* out);
+	int FindPage(long long key);
+	ROMPage& GetPage(long long address);
+	void Store(const unsigned char* data, unsigned char value, int length);
+	void WriteBank(FILE* file, int bank, int base, long long size, const vector<long long>& keys);
+	void MarkListingStart();
+	int NextLabelAddress(const vector<ListingLabel>& sorted, int address);
+	void GetBankLabels(int bank, vector<ListingLabel>& sorted);
+
 	int _bitWidth;
 	int _romSize;
 	int _currAddress;
 	int _startAddress;
 	int _endAddress;
-	vector<int> _addresses;
-	vector<int> _values;
-	vector<string> _patterns;
+	int _bank;
+	vector<ROMPage> _pages;
+	unordered_map<long long, int> _pageAt;		// page of each page sized block of image addresses
+	long long _lastKey;							// the page found last, since writes mostly go to the same one
+	int _lastPage;
+	unordered_map<int, BankWindow> _windows;
+	int _bytesWritten;
+	vector<string> _sourceFiles;
+	vector<ListingRecord> _listing;
+	vector<ListingLabel> _labels;
+	ListingRecord _pendingRecord;
+	bool _recordPending;
+	bool _showCycles;
 	string _architecture;
 	string _romName;
-};
+};
\ No newline at end of file
@@ -0,0 +1,410 @@
+#include "Simulator.h"
+#include <algorithm>
+#include <chrono>
+
+Simulator::Simulator(const InstructionEncoder& encoder)
+{
+	_encoder = encoder;
+	_breakpoints.clear();
+	_hasBreakpoints = false;
+	_profile.clear();
+	_profiling = false;
+	_names.clear();
+	_bits.clear();
+	_masks.clear();
+	_regs.clear();
+	_actions.clear();
+	_programs.clear();
+	_moves.clear();
+	_compiled.clear();
+	_memory.clear();
+	_start = 0;
+	_end = -1;
+	_pc = 0;
+	_cycles = 0;
+	_seconds = 0;
+	_output = "";
+	_blocks.clear();
+	_steps.clear();
+	_blockAt.clear();
+	_fallbacks = 0;
+
+	for (int b = 0; b < 256; b++)
+		_table[b] = { -1, -1, 0, -1, 1, 1 };
+
+	AddRegister("const", 32);
+}
+
+int Simulator::AddRegister(const string& name, int bits)
+{
+	_names.push_back(name);
+	_bits.push_back(bits);
+	_masks.push_back(bits >= 64 ? ~0ULL : (1ULL << bits) - 1);
+	_regs.push_back(0);
+
+	return _names.size() - 1;
+}
+
+int Simulator::FindRegister(const string& name)
+{
+	for (int r = 0; r < _names.size(); r++)
+	{
+		if (_names[r] == name)
+			return r;
+	}
+
+	return -1;
+}
+
+void Simulator::AddAction(const ControlAction& action)
+{
+	_actions.push_back(action);
+}
+
+// Puts an opcode in the dispatch table. Opcodes that share a control word share its micro-program.
+void Simulator::AddInstruction(int firstByte, unsigned long long controlWord, int layout, int immediate, int cycles, int takenCycles)
+{
+	_table[firstByte & 0xFF] = { Compile(controlWord), layout, _encoder.Size(layout), immediate, cycles, takenCycles };
+}
+
+// Works out which actions a control word sets off
+int Simulator::Compile(unsigned long long controlWord)
+{
+	auto found = _compiled.find(controlWord);
+	if (found != _compiled.end())
+		return found->second;
+
+	MicroProgram program = { (int)_moves.size(), 0, 0, false, false, false, false };
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (const ControlAction& action : _actions)
+		{
+			if ((controlWord & action.mask) != action.value)
+				continue;
+
+			if (pass == 0 && action.type == MicroOpType::Assert)
+			{
+				_moves.push_back(action.reg);
+				program.numSources++;
+			}
+
+			if (pass == 1 && action.type == MicroOpType::Load)
+			{
+				_moves.push_back(action.reg);
+				program.numLoads++;
+			}
+
+			if (pass == 0)
+			{
+				program.fetch |= action.type == MicroOpType::Fetch;
+				program.jump |= action.type == MicroOpType::Jump;
+				program.out |= action.type == MicroOpType::Out;
+				program.halt |= action.type == MicroOpType::Halt;
+			}
+		}
+	}
+
+	_programs.push_back(program);
+	_compiled[controlWord] = _programs.size() - 1;
+
+	return _programs.size() - 1;
+}
+
+// Copies the program ROM and starts execution at its first address. The memory is padded so that decoding an
+// instruction at the very end never reads past it.
+void Simulator::LoadProgram(const vector<unsigned char>& image, int start, int end)
+{
+	_memory = image;
+	_memory.resize(max((int)_memory.size(), end + 1) + 8, 0);
+	_start = start;
+	_end = end;
+	_pc = start;
+	_cycles = 0;
+	_output = "";
+	_fallbacks = 0;
+
+	for (unsigned long long& reg : _regs)
+		reg = 0;
+
+	_blocks.clear();
+	_steps.clear();
+	_blockAt.assign(_memory.size(), -1);
+	_breakpoints.assign(_memory.size(), 0);
+	_hasBreakpoints = false;
+
+	if (_profiling)
+		_profile.assign(_memory.size() * PROFILE_COUNTERS, 0);
+}
+
+// Counts the executions, cycles and taken jumps of every address from now on
+void Simulator::EnableProfiling()
+{
+	_profiling = true;
+	_profile.assign(_memory.size() * PROFILE_COUNTERS, 0);
+}
+
+const vector<unsigned long long>& Simulator::GetProfile()
+{
+	FlushProfile();
+	return _profile;
+}
+
+// Adds the runs of each translated block to the counters of its instructions. Every instruction of a block runs each
+// time the block does, and only the last one can jump.
+void Simulator::FlushProfile()
+{
+	for (TranslatedBlock& block : _blocks)
+	{
+		if (!_profiling || block.count == 0)
+		{
+			block.count = 0;
+			continue;
+		}
+
+		for (int s = block.firstStep; s < block.firstStep + block.numSteps; s++)
+		{
+			unsigned long long* counters = &_profile[_steps[s].address * PROFILE_COUNTERS];
+			counters[PROFILE_EXECUTIONS] += block.count;
+			counters[PROFILE_CYCLES] += block.count * _steps[s].cycles;
+		}
+
+		const TranslatedStep& last = _steps[block.firstStep + block.numSteps - 1];
+		if (_programs[last.program].jump)
+			_profile[last.address * PROFILE_COUNTERS + PROFILE_TAKEN] += block.count;
+
+		block.count = 0;
+	}
+}
+
+// Makes Run() stop when execution gets to an address (before the instruction there runs). Blocks are translated again
+// afterwards, since a breakpoint has to be at the start of one.
+void Simulator::SetBreakpoint(int address)
+{
+	if (address < 0 || address >= _breakpoints.size())
+		return;
+
+	_breakpoints[address] = 1;
+	_hasBreakpoints = true;
+
+	FlushProfile();
+	_blocks.clear();
+	_steps.clear();
+	_blockAt.assign(_memory.size(), -1);
+}
+
+// Translates the block starting at pc. Returns its id, or -2 if the first instruction can't be translated (it is
+// unknown or outside of the program), in which case the interpreter deals with it.
+int Simulator::Translate(int pc)
+{
+	TranslatedBlock block = { pc, pc, (int)_steps.size(), 0, 0, 0 };
+
+	while (block.numSteps < MAX_BLOCK_STEPS && block.end >= _start && block.end <= _end)
+	{
+		const SimInstruction& instruction = _table[_memory[block.end]];
+		if (instruction.program < 0 || (block.numSteps > 0 && _breakpoints[block.end]))
+			break;
+
+		const MicroProgram& program = _programs[instruction.program];
+		TranslatedStep step = { block.end, instruction.program, program.fetch && instruction.immediate >= 0, program.jump ? instruction.takenCycles : instruction.cycles, 0 };
+
+		if (step.fetch)
+		{
+			long long args[2] = { 0, 0 };
+			_encoder.Decode(instruction.layout, &_memory[block.end], block.end, args);
+			step.constant = (unsigned long long)args[instruction.immediate] & _masks[CONST_REGISTER];
+		}
+
+		_steps.push_back(step);
+		block.numSteps++;
+		block.cycles += step.cycles;
+		block.end += instruction.length;
+
+		if (program.jump || program.halt)
+			break;
+	}
+
+	if (block.numSteps == 0)
+	{
+		_blockAt[pc] = -2;
+		return -2;
+	}
+
+	_blocks.push_back(block);
+	_blockAt[pc] = _blocks.size() - 1;
+
+	return _blocks.size() - 1;
+}
+
+// Runs until a halt action, an unknown opcode, the end of the program or the cycle limit. An instruction does all of its
+// work at once, and then counts the cycles its opcode is declared to take (more when it jumps). With translate set, whole blocks are run at a time and
+// the interpreter only steps through what can't be translated (and the last few cycles before the limit).
+SimStop Simulator::Run(long long maxCycles, bool translate)
+{
+	auto startTime = chrono::steady_clock::now();
+	SimStop stop = SimStop::CycleLimit;
+
+	while (translate && _cycles < maxCycles)
+	{
+		if (_pc < _start || _pc > _end)
+		{
+			stop = SimStop::EndOfProgram;
+			break;
+		}
+
+		int b = _blockAt[_pc];
+		if (b == -1)
+			b = Translate(_pc);
+
+		if (b < 0 || _cycles + _blocks[b].cycles > maxCycles)
+		{
+			_fallbacks++;
+			stop = Interpret(_cycles + 1);
+			if (stop != SimStop::CycleLimit)
+				break;
+
+			continue;
+		}
+
+		TranslatedBlock& block = _blocks[b];
+		block.count++;
+
+		const TranslatedStep* step = &_steps[block.firstStep];
+		const TranslatedStep* last = step + block.numSteps;
+		const MicroProgram* programs = _programs.data();
+		const int* moves = _moves.data();
+		unsigned long long* regs = _regs.data();
+		const unsigned long long* masks = _masks.data();
+		unsigned long long bus = 0;
+
+		for (; step < last; step++)
+		{
+			const MicroProgram& program = programs[step->program];
+
+			if (step->fetch)
+				regs[CONST_REGISTER] = step->constant;
+
+			const int* move = moves + program.firstMove;
+			bus = 0;
+
+			for (int s = 0; s < program.numSources; s++)
+				bus |= regs[*move++];
+
+			for (int l = 0; l < program.numLoads; l++, move++)
+				regs[*move] = bus & masks[*move];
+
+			if (program.out)
+				_output += (char)bus;
+		}
+
+		// Only the last instruction of a block can jump or halt
+		const MicroProgram& final = programs[(last - 1)->program];
+		_cycles += block.cycles;
+		_pc = final.jump ? (int)bus : block.end;
+
+		if (final.halt)
+		{
+			stop = SimStop::Halted;
+			break;
+		}
+
+		if (_hasBreakpoints && _pc >= 0 && _pc < _breakpoints.size() && _breakpoints[_pc])
+		{
+			stop = SimStop::Breakpoint;
+			break;
+		}
+	}
+
+	if (!translate)
+		stop = Interpret(maxCycles);
+
+	_seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+	return stop;
+}
+
+// Runs one instruction at a time, straight from the dispatch table
+SimStop Simulator::Interpret(long long maxCycles)
+{
+	const SimInstruction* table = _table;
+	const MicroProgram* programs = _programs.data();
+	const int* moves = _moves.data();
+	unsigned long long* regs = _regs.data();
+	const unsigned long long* masks = _masks.data();
+	const unsigned char* memory = _memory.data();
+	unsigned long long* profile = _profiling ? _profile.data() : nullptr;
+
+	SimStop stop = SimStop::CycleLimit;
+	long long cycles = _cycles;
+	int pc = _pc;
+
+	while (cycles < maxCycles)
+	{
+		if (pc < _start || pc > _end)
+		{
+			stop = SimStop::EndOfProgram;
+			break;
+		}
+
+		const SimInstruction& instruction = table[memory[pc]];
+		if (instruction.program < 0)
+		{
+			stop = SimStop::UnknownOpcode;
+			break;
+		}
+
+		const MicroProgram& program = programs[instruction.program];
+		int next = pc + instruction.length;
+
+		if (program.fetch && instruction.immediate >= 0)
+		{
+			long long args[2] = { 0, 0 };
+			_encoder.Decode(instruction.layout, memory + pc, pc, args);
+			regs[CONST_REGISTER] = (unsigned long long)args[instruction.immediate] & masks[CONST_REGISTER];
+		}
+
+		const int* move = moves + program.firstMove;
+		unsigned long long bus = 0;
+
+		for (int s = 0; s < program.numSources; s++)
+			bus |= regs[*move++];
+
+		for (int l = 0; l < program.numLoads; l++, move++)
+			regs[*move] = bus & masks[*move];
+
+		if (program.out)
+			_output += (char)bus;
+
+		if (program.jump)
+			next = (int)bus;
+
+		int cost = program.jump ? instruction.takenCycles : instruction.cycles;
+
+		if (profile)
+		{
+			unsigned long long* counters = profile + pc * PROFILE_COUNTERS;
+			counters[PROFILE_EXECUTIONS]++;
+			counters[PROFILE_CYCLES] += cost;
+			counters[PROFILE_TAKEN] += program.jump;
+		}
+
+		pc = next;
+		cycles += cost;
+
+		if (program.halt)
+		{
+			stop = SimStop::Halted;
+			break;
+		}
+
+		if (_hasBreakpoints && pc >= 0 && pc < _breakpoints.size() && _breakpoints[pc])
+		{
+			stop = SimStop::Breakpoint;
+			break;
+		}
+	}
+
+	_pc = pc;
+	_cycles = cycles;
+
+	return stop;
+}
\ No newline at end of file
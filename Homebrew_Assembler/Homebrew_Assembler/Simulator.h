@@ -0,0 +1,145 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "InstructionEncoder.h"
+
+using namespace std;
+
+enum class MicroOpType { Assert, Load, Fetch, Jump, Out, Halt };
+
+// What a control line does while it is active. A line is active when the bits of its field (mask) in the control word
+// equal its value.
+struct ControlAction
+{
+	unsigned long long value;
+	unsigned long long mask;
+	MicroOpType type;
+	int reg;			// register driven onto or loaded from the bus (Assert and Load only)
+};
+
+// Everything one control word does, worked out once so that a cycle is a table lookup and a few register moves. The
+// registers it moves are a run of _moves: the ones driving the bus first, then the ones loading from it.
+struct MicroProgram
+{
+	int firstMove;
+	int numSources;
+	int numLoads;
+	bool fetch;
+	bool jump;
+	bool out;
+	bool halt;
+};
+
+// One entry of the dispatch table, indexed by the first byte of an instruction
+struct SimInstruction
+{
+	int program;		// -1 if no opcode starts with this byte
+	int layout;
+	int length;
+	int immediate;		// operand that holds the constant (-1 if none)
+	int cycles;
+	int takenCycles;	// cycles when the instruction jumps
+};
+
+// One instruction of a translated block. The constant it fetches is read out of the program when the block is translated.
+struct TranslatedStep
+{
+	int address;
+	int program;
+	bool fetch;
+	int cycles;
+	unsigned long long constant;
+};
+
+// A run of instructions that ends with a jump or halt (or just before an instruction that can't be translated), executed
+// without looking at the dispatch table or decoding operands again
+struct TranslatedBlock
+{
+	int start;
+	int end;			// address after the last instruction
+	int firstStep;
+	int numSteps;
+	long long cycles;
+	unsigned long long count;	// runs not yet added to the profile
+};
+
+enum class SimStop { Halted, CycleLimit, EndOfProgram, UnknownOpcode, Breakpoint };
+
+class Simulator
+{
+public:
+	Simulator(const InstructionEncoder& encoder);
+
+	int AddRegister(const string& name, int bits);
+	int FindRegister(const string& name);
+	void AddAction(const ControlAction& action);
+	void AddInstruction(int firstByte, unsigned long long controlWord, int layout, int immediate, int cycles, int takenCycles);
+	void LoadProgram(const vector<unsigned char>& image, int start, int end);
+	SimStop Run(long long maxCycles, bool translate);
+	unsigned char ReadMemory(int address) { return address >= 0 && address < _memory.size() ? _memory[address] : 0; }
+	void SetBreakpoint(int address);
+	void EnableProfiling();
+	const vector<unsigned long long>& GetProfile();
+
+	long long GetCycles() { return _cycles; }
+	double GetSeconds() { return _seconds; }
+	int GetPC() { return _pc; }
+	int NumRegisters() { return _names.size(); }
+	const string& GetRegisterName(int r) { return _names[r]; }
+	int GetRegisterBits(int r) { return _bits[r]; }
+	unsigned long long GetRegister(int r) { return _regs[r]; }
+	const string& GetOutput() { return _output; }
+	int NumPrograms() { return _programs.size(); }
+	int NumBlocks() { return _blocks.size(); }
+	long long GetFallbacks() { return _fallbacks; }
+
+	// The constant register holds the operand of the current instruction once a fetch action has run
+	static constexpr int CONST_REGISTER = 0;
+	static constexpr int MAX_BLOCK_STEPS = 64;
+
+	// Profile counters of each address, PROFILE_COUNTERS of them in a row
+	static constexpr int PROFILE_EXECUTIONS = 0;
+	static constexpr int PROFILE_CYCLES = 1;
+	static constexpr int PROFILE_TAKEN = 2;		// jumps taken
+	static constexpr int PROFILE_COUNTERS = 3;
+
+private:
+	int Compile(unsigned long long controlWord);
+	SimStop Interpret(long long maxCycles);
+	int Translate(int pc);
+	void FlushProfile();
+
+	InstructionEncoder _encoder;		// a copy, so that simulators can run on separate threads
+	vector<string> _names;
+	vector<int> _bits;
+	vector<unsigned long long> _masks;
+	vector<unsigned long long> _regs;
+	vector<ControlAction> _actions;
+	vector<MicroProgram> _programs;
+	vector<int> _moves;
+	unordered_map<unsigned long long, int> _compiled;
+	SimInstruction _table[256];
+	vector<unsigned char> _memory;
+	int _start;
+	int _end;
+	int _pc;
+	long long _cycles;
+	double _seconds;
+	string _output;
+
+	// Translated blocks, looked up by the address they start at (-1 if there isn't one yet, -2 if one can't be made)
+	vector<TranslatedBlock> _blocks;
+	vector<TranslatedStep> _steps;
+	vector<int> _blockAt;
+
+	// Addresses that stop the run when execution reaches them
+	vector<char> _breakpoints;
+	bool _hasBreakpoints;
+
+	// Translated blocks only count how often they run; their counts are spread over their instructions when the profile
+	// is read (or the blocks are thrown away)
+	vector<unsigned long long> _profile;
+	bool _profiling;
+	long long _fallbacks;
+};
\ No newline at end of file
@@ -0,0 +1,163 @@
+#include "StringPool.h"
+#include <algorithm>
+
+StringPool::StringPool()
+{
+	_text.clear();
+	_starts.clear();
+	_lengths.clear();
+	_blockAt.clear();
+	_homes.clear();
+	_offsets.clear();
+}
+
+int StringPool::AddBlock(const unsigned char* data, int length)
+{
+	int block = _starts.size();
+	_starts.push_back(_text.size());
+	_lengths.push_back(length);
+
+	for (int i = 0; i < length; i++)
+		_text.push_back(data[i] + 1);
+
+	_text.push_back(0);
+	_blockAt.resize(_text.size(), block);
+
+	return block;
+}
+
+// Prefix doubling: the suffixes are sorted by their first k symbols, then by their first 2k using the ranks of the two
+// halves, until every rank is different
+void StringPool::BuildSuffixArray()
+{
+	int n = _text.size();
+	vector<int> next(n);
+
+	_suffixes.resize(n);
+	_rank = _text;
+
+	for (int i = 0; i < n; i++)
+		_suffixes[i] = i;
+
+	for (int k = 1; ; k <<= 1)
+	{
+		auto before = [&](int x, int y)
+		{
+			if (_rank[x] != _rank[y])
+				return _rank[x] < _rank[y];
+
+			int rx = x + k < n ? _rank[x + k] : -1;
+			int ry = y + k < n ? _rank[y + k] : -1;
+			return rx < ry;
+		};
+
+		sort(_suffixes.begin(), _suffixes.end(), before);
+
+		next[_suffixes[0]] = 0;
+		for (int i = 1; i < n; i++)
+			next[_suffixes[i]] = next[_suffixes[i - 1]] + before(_suffixes[i - 1], _suffixes[i]);
+
+		_rank.swap(next);
+		if (_rank[_suffixes[n - 1]] == n - 1)
+			break;
+	}
+
+	// Kasai: the common prefix of a suffix and the one before it in sorted order is at most one shorter than the one of
+	// the suffix that starts a position earlier
+	_lcp.assign(n, 0);
+	for (int i = 0, h = 0; i < n; i++)
+	{
+		if (_rank[i] == 0)
+		{
+			h = 0;
+			continue;
+		}
+
+		int j = _suffixes[_rank[i] - 1];
+		while (i + h < n && j + h < n && _text[i + h] == _text[j + h])
+			h++;
+
+		_lcp[_rank[i]] = h;
+		if (h > 0)
+			h--;
+	}
+}
+
+// Of two positions in the sorted suffixes, the one whose block is longer (or comes first)
+int StringPool::Longer(int x, int y)
+{
+	int bx = _blockAt[_suffixes[x]];
+	int by = _blockAt[_suffixes[y]];
+
+	if (_lengths[bx] != _lengths[by])
+		return _lengths[bx] > _lengths[by] ? x : y;
+
+	return bx <= by ? x : y;
+}
+
+void StringPool::BuildTables()
+{
+	int n = _suffixes.size();
+
+	_minLcp.assign(1, _lcp);
+	_longest.assign(1, vector<int>(n));
+	for (int i = 0; i < n; i++)
+		_longest[0][i] = i;
+
+	for (int j = 1; (1 << j) <= n; j++)
+	{
+		int half = 1 << (j - 1);
+		_minLcp.push_back(vector<int>(n - (1 << j) + 1));
+		_longest.push_back(vector<int>(n - (1 << j) + 1));
+
+		for (int i = 0; i + (1 << j) <= n; i++)
+		{
+			_minLcp[j][i] = min(_minLcp[j - 1][i], _minLcp[j - 1][i + half]);
+			_longest[j][i] = Longer(_longest[j - 1][i], _longest[j - 1][i + half]);
+		}
+	}
+}
+
+// Every block's home is the longest block that ends with its bytes. That one can't be the tail of a longer block itself,
+// so homes never have homes of their own.
+void StringPool::Build()
+{
+	int blocks = _starts.size();
+	_homes.resize(blocks);
+	_offsets.resize(blocks);
+
+	if (_text.empty())
+		return;
+
+	BuildSuffixArray();
+	BuildTables();
+
+	int n = _suffixes.size();
+	int levels = _minLcp.size();
+
+	for (int b = 0; b < blocks; b++)
+	{
+		// The run of suffixes that start with this block and its separator
+		int length = _lengths[b] + 1;
+		int first = _rank[_starts[b]];
+		int last = first;
+
+		for (int j = levels - 1; j >= 0; j--)
+		{
+			if (first - (1 << j) >= 0 && _minLcp[j][first - (1 << j) + 1] >= length)
+				first -= 1 << j;
+			if (last + (1 << j) < n && _minLcp[j][last + 1] >= length)
+				last += 1 << j;
+		}
+
+		int j = 0;
+		while ((2 << j) <= last - first + 1)
+			j++;
+
+		int longest = Longer(_longest[j][first], _longest[j][last - (1 << j) + 1]);
+		int home = _blockAt[_suffixes[longest]];
+
+		_homes[b] = home;
+		_offsets[b] = _suffixes[longest] - _starts[home];
+	}
+}
\ No newline at end of file
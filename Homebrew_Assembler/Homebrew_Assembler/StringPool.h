@@ -0,0 +1,35 @@
+#pragma once
+#include <vector>
+
+using namespace std;
+
+// Finds the data blocks whose bytes are the same as another block, or the tail of one, so that they can share its bytes.
+// All of the blocks go into one suffix array with a separator after each of them. The suffixes that start with a whole
+// block and its separator then sit next to each other in the array, and each of them is the tail of some block.
+class StringPool
+{
+public:
+	StringPool();
+
+	int AddBlock(const unsigned char* data, int length);
+	int NumBlocks() { return _starts.size(); }
+	void Build();
+	int GetHome(int block, int* offset) { *offset = _offsets[block]; return _homes[block]; }
+
+private:
+	void BuildSuffixArray();
+	void BuildTables();
+	int Longer(int x, int y);
+
+	vector<int> _text;			// each byte + 1, with a 0 after every block
+	vector<int> _starts;
+	vector<int> _lengths;
+	vector<int> _blockAt;		// block each position of the text belongs to
+	vector<int> _suffixes;		// start of each suffix, in sorted order
+	vector<int> _rank;			// where each suffix is in _suffixes
+	vector<int> _lcp;			// length of the common prefix of each suffix and the one before it
+	vector<vector<int>> _minLcp;		// sparse tables over the sorted suffixes: smallest lcp, and the suffix whose
+	vector<vector<int>> _longest;		// block is longest (the first block when they are as long) of each power of two run
+	vector<int> _homes;			// block that holds each block's bytes (itself if none does)
+	vector<int> _offsets;		// where in its home a block starts
+};
\ No newline at end of file
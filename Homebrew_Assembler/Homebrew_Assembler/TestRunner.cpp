@@ -0,0 +1,341 @@
+#include "TestRunner.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+static const char* CHECK_OP_TEXT[] = { "==", "!=", "<", ">", "<=", ">=" };
+
+TestRunner::TestRunner()
+{
+	_tests.clear();
+	_results.clear();
+	_seconds = 0;
+	_profiling = false;
+}
+
+void TestRunner::AddTest(TestCase& test)
+{
+	_tests.push_back(move(test));
+}
+
+// A program that couldn't be assembled still shows up in the report, as an error
+void TestRunner::AddBrokenTest(const string& name, const string& error)
+{
+	TestCase test;
+	test.name = name;
+	test.maxCycles = 0;
+	_tests.push_back(move(test));
+
+	_results.resize(_tests.size());
+	_results.back().error = error;
+}
+
+// Runs every test, spreading them over the given number of threads. Each test has its own simulator, so the threads
+// share nothing but the index of the next test to run.
+void TestRunner::Run(int jobs, double timeoutSeconds)
+{
+	auto startTime = chrono::steady_clock::now();
+	_results.resize(_tests.size());
+
+	atomic<int> next(0);
+	auto worker = [&]()
+	{
+		for (int t = next++; t < _tests.size(); t = next++)
+		{
+			if (_tests[t].simulator)
+				RunTest(t, timeoutSeconds);
+		}
+	};
+
+	jobs = max(1, min(jobs, (int)_tests.size()));
+	vector<thread> threads;
+	for (int j = 1; j < jobs; j++)
+		threads.emplace_back(worker);
+
+	worker();
+	for (thread& t : threads)
+		t.join();
+
+	_seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+}
+
+// Checks with an address get a breakpoint there and are looked at the first time execution reaches it; the others once
+// the program stops. The simulation runs in slices, so a program that never stops is given up on after the timeout.
+void TestRunner::RunTest(int t, double timeoutSeconds)
+{
+	TestCase& test = _tests[t];
+	TestResult& result = _results[t];
+	Simulator& simulator = *test.simulator;
+	int numChecks = test.checks.size();
+
+	result.failures.assign(numChecks, "");
+	result.errors.assign(numChecks, 0);
+	vector<char> done(numChecks, 0);
+
+	auto reached = [&](int pc)
+	{
+		for (int c = 0; c < numChecks; c++)
+		{
+			const TestCheck& check = test.checks[c];
+			if (done[c] || check.after != pc)
+				continue;
+
+			done[c] = 1;
+			if (check.within > 0 && simulator.GetCycles() > check.within)
+			{
+				char text[64];
+				snprintf(text, sizeof(text), "$%04X reached after %lld cycles", pc, simulator.GetCycles());
+				result.failures[c] = text;
+			}
+			else
+				Evaluate(simulator, check, result.failures[c]);
+		}
+	};
+
+	for (const TestCheck& check : test.checks)
+	{
+		if (check.after >= 0)
+			simulator.SetBreakpoint(check.after);
+	}
+
+	if (_profiling && test.profiler)
+		simulator.EnableProfiling();
+
+	auto startTime = chrono::steady_clock::now();
+	reached(simulator.GetPC());
+
+	SimStop stop;
+	while (true)
+	{
+		stop = simulator.Run(min(simulator.GetCycles() + SLICE_CYCLES, test.maxCycles), true);
+
+		if (stop == SimStop::Breakpoint)
+			reached(simulator.GetPC());
+		else if (stop != SimStop::CycleLimit || simulator.GetCycles() >= test.maxCycles)
+			break;
+
+		if (chrono::duration<double>(chrono::steady_clock::now() - startTime).count() > timeoutSeconds)
+		{
+			char text[64];
+			snprintf(text, sizeof(text), "timed out after %lld cycles", simulator.GetCycles());
+			result.error = text;
+			break;
+		}
+	}
+
+	result.cycles = simulator.GetCycles();
+	result.seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+
+	if (_profiling && test.profiler)
+		test.profiler->Collect(simulator.GetProfile());
+
+	if (result.error.empty() && stop == SimStop::UnknownOpcode)
+	{
+		char text[64];
+		snprintf(text, sizeof(text), "unknown opcode $%02X at $%04X", simulator.ReadMemory(simulator.GetPC()), simulator.GetPC());
+		result.error = text;
+	}
+
+	for (int c = 0; c < numChecks; c++)
+	{
+		const TestCheck& check = test.checks[c];
+		if (done[c])
+			continue;
+
+		char text[64];
+		if (!result.error.empty())
+		{
+			result.failures[c] = result.error;
+			result.errors[c] = 1;
+		}
+		else if (check.after >= 0)
+		{
+			snprintf(text, sizeof(text), "$%04X was never reached", check.after);
+			result.failures[c] = text;
+		}
+		else if (stop == SimStop::CycleLimit)
+		{
+			snprintf(text, sizeof(text), "program didn't stop within %lld cycles", test.maxCycles);
+			result.failures[c] = text;
+		}
+		else if (check.within > 0 && result.cycles > check.within)
+		{
+			snprintf(text, sizeof(text), "program stopped after %lld cycles", result.cycles);
+			result.failures[c] = text;
+		}
+		else
+			Evaluate(simulator, check, result.failures[c]);
+	}
+}
+
+bool TestRunner::Evaluate(Simulator& simulator, const TestCheck& check, string& failure)
+{
+	long long actual = check.reg >= 0 ? (long long)simulator.GetRegister(check.reg) : simulator.ReadMemory(check.address);
+	bool pass = false;
+
+	switch (check.op)
+	{
+	case CheckOp::Equal:		pass = actual == check.value;	break;
+	case CheckOp::NotEqual:		pass = actual != check.value;	break;
+	case CheckOp::Less:			pass = actual < check.value;	break;
+	case CheckOp::Greater:		pass = actual > check.value;	break;
+	case CheckOp::LessEqual:	pass = actual <= check.value;	break;
+	case CheckOp::GreaterEqual:	pass = actual >= check.value;	break;
+	}
+
+	if (!pass)
+	{
+		char text[96];
+		snprintf(text, sizeof(text), "got $%llX, expected %s $%llX", actual, CHECK_OP_TEXT[(int)check.op], check.value);
+		failure = text;
+	}
+
+	return pass;
+}
+
+// Prints a line per test (and per failed check) and returns the number of tests that failed
+int TestRunner::PrintSummary()
+{
+	int failed = 0;
+	int numChecks = 0;
+
+	printf("\n=========================\n");
+	printf("       TEST RESULTS\n");
+	printf("=========================\n");
+
+	for (int t = 0; t < _tests.size(); t++)
+	{
+		const TestCase& test = _tests[t];
+		const TestResult& result = _results[t];
+		bool pass = result.error.empty();
+
+		for (const string& failure : result.failures)
+			pass = pass && failure.empty();
+		numChecks += test.checks.size();
+
+		if (test.simulator)
+			printf("%s  %s (%d checks, %lld cycles)\n", pass ? "PASS" : "FAIL", test.name.c_str(), (int)test.checks.size(), result.cycles);
+		else
+			printf("FAIL  %s\n", test.name.c_str());
+
+		if (!result.error.empty())
+			printf("        %s\n", result.error.c_str());
+
+		for (int c = 0; c < test.checks.size(); c++)
+		{
+			if (!result.failures[c].empty() && !result.errors[c])
+				printf("        Line #%d of \"%s\": %s: %s\n", test.checks[c].line, test.checks[c].file.c_str(), test.checks[c].text.c_str(), result.failures[c].c_str());
+		}
+
+		failed += !pass;
+	}
+
+	printf("=========================\n");
+	printf("Tests:                %d (%d failed)\n", (int)_tests.size(), failed);
+	printf("Checks:               %d\n", numChecks);
+	printf("Time:                 %.2f s\n", _seconds);
+	printf("=========================\n");
+
+	return failed;
+}
+
+static string EscapeXML(const string& text)
+{
+	string escaped;
+	for (char c : text)
+	{
+		switch (c)
+		{
+		case '&':	escaped += "&amp;";		break;
+		case '<':	escaped += "&lt;";		break;
+		case '>':	escaped += "&gt;";		break;
+		case '"':	escaped += "&quot;";	break;
+		case '\'':	escaped += "&apos;";	break;
+		default:	escaped += c;			break;
+		}
+	}
+
+	return escaped;
+}
+
+// JUnit XML: a test suite per program and a test case per check. A program that couldn't be assembled is a suite with a
+// single errored case.
+void TestRunner::WriteJUnit(FILE* out)
+{
+	int numCases = 0;
+	int numFailures = 0;
+	int numErrors = 0;
+
+	for (int t = 0; t < _tests.size(); t++)
+	{
+		numCases += max(1, (int)_tests[t].checks.size());
+		for (int c = 0; c < _tests[t].checks.size(); c++)
+		{
+			numFailures += !_results[t].failures[c].empty() && !_results[t].errors[c];
+			numErrors += _results[t].errors[c];
+		}
+
+		numErrors += !_tests[t].simulator;
+	}
+
+	fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(out, "<testsuites tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.3f\">\n", numCases, numFailures, numErrors, _seconds);
+
+	for (int t = 0; t < _tests.size(); t++)
+	{
+		const TestCase& test = _tests[t];
+		const TestResult& result = _results[t];
+		string name = EscapeXML(test.name);
+
+		if (!test.simulator)
+		{
+			fprintf(out, "  <testsuite name=\"%s\" tests=\"1\" failures=\"0\" errors=\"1\" time=\"0\">\n", name.c_str());
+			fprintf(out, "    <testcase classname=\"%s\" name=\"assemble\">\n", name.c_str());
+			fprintf(out, "      <error message=\"%s\"/>\n", EscapeXML(result.error).c_str());
+			fprintf(out, "    </testcase>\n");
+			fprintf(out, "  </testsuite>\n");
+			continue;
+		}
+
+		int failures = 0;
+		int errors = 0;
+		for (int c = 0; c < test.checks.size(); c++)
+		{
+			failures += !result.failures[c].empty() && !result.errors[c];
+			errors += result.errors[c];
+		}
+
+		fprintf(out, "  <testsuite name=\"%s\" tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.3f\">\n", name.c_str(), (int)test.checks.size(), failures, errors, result.seconds);
+
+		for (int c = 0; c < test.checks.size(); c++)
+		{
+			const TestCheck& check = test.checks[c];
+			string caseName = EscapeXML("line " + to_string(check.line) + ": " + check.text);
+
+			if (result.failures[c].empty())
+			{
+				fprintf(out, "    <testcase classname=\"%s\" name=\"%s\"/>\n", name.c_str(), caseName.c_str());
+				continue;
+			}
+
+			fprintf(out, "    <testcase classname=\"%s\" name=\"%s\">\n", name.c_str(), caseName.c_str());
+			fprintf(out, "      <%s message=\"%s\"/>\n", result.errors[c] ? "error" : "failure", EscapeXML(result.failures[c]).c_str());
+			fprintf(out, "    </testcase>\n");
+		}
+
+		fprintf(out, "  </testsuite>\n");
+	}
+
+	fprintf(out, "</testsuites>\n");
+}
+
+// Folded stacks of every test that was profiled, each under the name of its program
+void TestRunner::WriteProfile(FILE* out)
+{
+	for (const TestCase& test : _tests)
+	{
+		if (test.profiler)
+			test.profiler->WriteFolded(out, test.name);
+	}
+}
\ No newline at end of file
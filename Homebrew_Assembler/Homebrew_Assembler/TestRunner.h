@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include "Profiler.h"
+#include "Simulator.h"
+
+using namespace std;
+
+enum class CheckOp { Equal, NotEqual, Less, Greater, LessEqual, GreaterEqual };
+
+// One .expect (or .assert) line: a register or memory byte compared against a value, either when execution first gets to
+// an address or when the program stops
+struct TestCheck
+{
+	string text;
+	string file;
+	int line;
+	int reg;			// -1 for a memory check
+	int address;
+	CheckOp op;
+	long long value;
+	int after;			// -1 to check when the program stops
+	long long within;	// cycles the check has to be reached in (0 for no limit besides the test's)
+};
+
+// An assembled program with its checks, ready to run
+struct TestCase
+{
+	string name;
+	unique_ptr<Simulator> simulator;
+	unique_ptr<Profiler> profiler;
+	long long maxCycles;
+	vector<TestCheck> checks;
+};
+
+struct TestResult
+{
+	vector<string> failures;	// one per check, empty if it passed
+	vector<char> errors;		// checks that were never decided because the program couldn't be run
+	string error;				// set if the program couldn't be run to the end (timeout, unknown opcode)
+	long long cycles = 0;
+	double seconds = 0;
+};
+
+class TestRunner
+{
+public:
+	TestRunner();
+
+	void AddTest(TestCase& test);
+	void AddBrokenTest(const string& name, const string& error);
+	int NumTests() { return _tests.size(); }
+	void EnableProfiling() { _profiling = true; }
+	void Run(int jobs, double timeoutSeconds);
+	int PrintSummary();
+	void WriteJUnit(FILE* out);
+	void WriteProfile(FILE* out);
+
+	// Simulations are run a slice at a time so that the timeout can be checked in between
+	static constexpr long long SLICE_CYCLES = 1000000;
+
+private:
+	void RunTest(int t, double timeoutSeconds);
+	bool Evaluate(Simulator& simulator, const TestCheck& check, string& failure);
+
+	vector<TestCase> _tests;
+	vector<TestResult> _results;
+	double _seconds;
+	bool _profiling;
+};
\ No newline at end of file